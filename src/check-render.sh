@@ -0,0 +1,20 @@
+#!/bin/sh
+
+# Render the canned screen once and compare it with the golden image.  Widgets
+# still need a display to be created on, even though nothing is drawn through
+# it, so use Xvfb when there is no display; the render program itself skips
+# (exit status 77) if it still can't get one.
+
+test -z "$srcdir" && srcdir=.
+golden="$srcdir/render-golden.png"
+
+if test ! -f "$golden"; then
+	echo "No $golden to compare with; skipping test"
+	echo "Write one with \"make render-golden\""
+	exit 77
+fi
+
+if test -z "$DISPLAY" && xvfb-run --help >/dev/null 2>&1; then
+	exec xvfb-run -a ./render -n 0 -c "$golden"
+fi
+exec ./render -n 0 -c "$golden"
@@ -67,6 +67,86 @@ console_console_set_mouse_autohide(Console *self, gboolean setting)
 	vte_terminal_set_mouse_autohide(VTE_TERMINAL(self), setting);
 }
 
+void
+console_console_set_scrollback_lines(Console *self, glong lines)
+{
+	vte_terminal_set_scrollback_lines(VTE_TERMINAL(self), lines);
+}
+
+gboolean
+console_console_get_text_range_stream(Console *self,
+				      glong start_row, glong start_col,
+				      glong end_row, glong end_col,
+				      VteTextRangeMode mode,
+				      gboolean attributes,
+				      VteTextSink sink, gpointer data)
+{
+	return vte_terminal_get_text_range_stream(VTE_TERMINAL(self),
+						  start_row, start_col,
+						  end_row, end_col,
+						  mode, attributes,
+						  sink, data);
+}
+
+gboolean
+console_console_write_contents(Console *self, gint fd,
+			       VteTerminalWriteFlags flags,
+			       VteTerminalWriteCallback callback,
+			       gpointer data, GError **error)
+{
+	return vte_terminal_write_contents(VTE_TERMINAL(self), fd, flags,
+					   callback, data, error);
+}
+
+GdkPixbuf *
+console_console_render_pixbuf(Console *self)
+{
+	return vte_terminal_render_pixbuf(VTE_TERMINAL(self));
+}
+
+VteSnapshot *
+console_console_get_snapshot(Console *self, glong start_row, glong end_row)
+{
+	return vte_terminal_get_snapshot(VTE_TERMINAL(self), start_row, end_row);
+}
+
+VteSnapshot *
+console_console_snapshot_ref(VteSnapshot *snapshot)
+{
+	return vte_snapshot_ref(snapshot);
+}
+
+void
+console_console_snapshot_unref(VteSnapshot *snapshot)
+{
+	vte_snapshot_unref(snapshot);
+}
+
+char *
+console_console_snapshot_get_text_range(VteSnapshot *snapshot,
+					glong start_row, glong start_col,
+					glong end_row, glong end_col)
+{
+	return vte_snapshot_get_text_range(snapshot, start_row, start_col,
+					   end_row, end_col);
+}
+
+guint
+console_console_search_gregex(Console *self, GRegex *regex,
+			      GRegexMatchFlags flags, glong start_row,
+			      VteSearchCallback callback, gpointer data,
+			      GDestroyNotify destroy)
+{
+	return vte_terminal_search_gregex(VTE_TERMINAL(self), regex, flags,
+					  start_row, callback, data, destroy);
+}
+
+void
+console_console_search_cancel(Console *self, guint search_id)
+{
+	vte_terminal_search_cancel(VTE_TERMINAL(self), search_id);
+}
+
 static void
 console_console_dispose (GObject *gobject)
 {
@@ -74,5 +74,29 @@ void console_console_feed(Console *self, const char *data, glong length);
 /* Functions inherited from VteTerminal that we need to reexport */
 void console_console_set_font_from_string(Console *self, const char *name);
 void console_console_set_mouse_autohide(Console *self, gboolean setting);
+void console_console_set_scrollback_lines(Console *self, glong lines);
+gboolean console_console_get_text_range_stream(Console *self,
+					       glong start_row, glong start_col,
+					       glong end_row, glong end_col,
+					       VteTextRangeMode mode,
+					       gboolean attributes,
+					       VteTextSink sink, gpointer data);
+gboolean console_console_write_contents(Console *self, gint fd,
+					VteTerminalWriteFlags flags,
+					VteTerminalWriteCallback callback,
+					gpointer data, GError **error);
+GdkPixbuf *console_console_render_pixbuf(Console *self);
+VteSnapshot *console_console_get_snapshot(Console *self,
+					  glong start_row, glong end_row);
+VteSnapshot *console_console_snapshot_ref(VteSnapshot *snapshot);
+void console_console_snapshot_unref(VteSnapshot *snapshot);
+char *console_console_snapshot_get_text_range(VteSnapshot *snapshot,
+					      glong start_row, glong start_col,
+					      glong end_row, glong end_col);
+guint console_console_search_gregex(Console *self, GRegex *regex,
+				    GRegexMatchFlags flags, glong start_row,
+				    VteSearchCallback callback, gpointer data,
+				    GDestroyNotify destroy);
+void console_console_search_cancel(Console *self, guint search_id);
 
 #endif
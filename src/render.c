@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2009 Thiago Arrais
+ *
+ * This is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Library General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <gtk/gtk.h>
+#include "console.h"
+
+/* Paint a canned screen without ever showing the widget, to time frames and
+ * to catch rendering changes by comparing against a golden image.  GTK+ still
+ * wants a display to create widgets with, so run it under Xvfb on a headless
+ * box; nothing is drawn through the X server. */
+
+#define DEFAULT_FONT "Monospace 10"
+#define DEFAULT_FRAMES 100
+
+static const char *screen[] = {
+	"\033[H\033[2J",
+	"plain \033[1mbold\033[0m \033[4munderline\033[0m "
+	"\033[7mreverse\033[0m \033[1;4;7mall three\033[0m\r\n",
+	"\033[30;47m black \033[31;40m red \033[32m green \033[33m yellow "
+	"\033[34m blue \033[35m magenta \033[36m cyan \033[37m white \033[0m\r\n",
+	"\033[1;31;44m bright \033[1;32m text \033[1;33m on \033[1;35m blue "
+	"\033[0m\r\n",
+	"\033(0lqqqqqwqqqqqk\033(B  \342\224\214\342\224\200\342\224\254"
+	"\342\224\200\342\224\220  \342\226\200\342\226\204\342\226\210"
+	"\342\226\214\342\226\220\342\226\221\342\226\222\342\226\223\r\n",
+	"\033(0x     x     x\033(B  \342\224\234\342\224\200\342\224\274"
+	"\342\224\200\342\224\244  \342\225\224\342\225\220\342\225\246"
+	"\342\225\220\342\225\227\r\n",
+	"\033(0mqqqqqvqqqqqj\033(B  \342\224\224\342\224\200\342\224\264"
+	"\342\224\200\342\224\230  \342\225\232\342\225\220\342\225\251"
+	"\342\225\220\342\225\235\r\n",
+	"wide: \346\227\245\346\234\254\350\252\236 \355\225\234\352\265\255"
+	"\354\226\264  combining: e\314\201 a\314\210 n\314\203\r\n",
+	NULL,
+};
+
+static void
+feed_screen(Console *console, glong rows)
+{
+	const char *filler = "The quick brown fox jumps over the lazy dog. "
+			     "0123456789 !\"#$%&'()*+,-./:;<=>?@[\\]^_`{|}~";
+	char *line;
+	glong i;
+
+	for (i = 0; screen[i] != NULL; i++) {
+		console_console_feed(console, screen[i], -1);
+	}
+	for (i = i - 1; i < rows - 1; i++) {
+		line = g_strdup_printf("\033[%ldm%3ld %s\033[0m\r\n",
+				       30 + i % 8, i, filler);
+		console_console_feed(console, line, -1);
+		g_free(line);
+	}
+}
+
+/* Whether every pixel is the same color as the top-left one, which is
+ * always padding and so background. */
+static gboolean
+pixbuf_is_uniform(GdkPixbuf *pixbuf)
+{
+	const guchar *row, *first;
+	gint width, height, channels, x, y;
+
+	width = gdk_pixbuf_get_width(pixbuf);
+	height = gdk_pixbuf_get_height(pixbuf);
+	channels = gdk_pixbuf_get_n_channels(pixbuf);
+	first = gdk_pixbuf_get_pixels(pixbuf);
+	for (y = 0; y < height; y++) {
+		row = first + y * gdk_pixbuf_get_rowstride(pixbuf);
+		for (x = 0; x < width * channels; x += channels) {
+			if (memcmp(row + x, first, 3) != 0) {
+				return FALSE;
+			}
+		}
+	}
+	return TRUE;
+}
+
+/* Count the pixels which differ, or -1 if the sizes don't match. */
+static glong
+compare_pixbufs(GdkPixbuf *a, GdkPixbuf *b)
+{
+	const guchar *pa, *pb;
+	gint width, height, x, y;
+	glong differ = 0;
+
+	width = gdk_pixbuf_get_width(a);
+	height = gdk_pixbuf_get_height(a);
+	if (gdk_pixbuf_get_width(b) != width ||
+	    gdk_pixbuf_get_height(b) != height ||
+	    gdk_pixbuf_get_n_channels(b) != 3) {
+		return -1;
+	}
+	for (y = 0; y < height; y++) {
+		pa = gdk_pixbuf_get_pixels(a) + y * gdk_pixbuf_get_rowstride(a);
+		pb = gdk_pixbuf_get_pixels(b) + y * gdk_pixbuf_get_rowstride(b);
+		for (x = 0; x < width * 3; x += 3) {
+			if (memcmp(pa + x, pb + x, 3) != 0) {
+				differ++;
+			}
+		}
+	}
+	return differ;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *font = DEFAULT_FONT, *output = NULL, *compare = NULL;
+	long frames = DEFAULT_FRAMES, i;
+	GtkWidget *widget;
+	GdkPixbuf *pixbuf, *golden;
+	GTimer *timer;
+	GError *error = NULL;
+	gdouble elapsed, best = G_MAXDOUBLE, total = 0;
+	glong differ;
+	int c;
+
+	if (!gtk_init_check(&argc, &argv)) {
+		g_printerr("No display to create widgets on, skipping.\n");
+		return 77;
+	}
+
+	while ((c = getopt(argc, argv, "c:f:n:w:")) != -1) {
+		switch (c) {
+		case 'c':
+			compare = optarg;
+			break;
+		case 'f':
+			font = optarg;
+			break;
+		case 'n':
+			frames = atol(optarg);
+			break;
+		case 'w':
+			output = optarg;
+			break;
+		default:
+			g_print("Usage: render [-f font] [-n frames] "
+				"[-w golden.png | -c golden.png]\n");
+			return 1;
+			break;
+		}
+	}
+
+	widget = console_console_new();
+	g_object_ref_sink(widget);
+	console_console_set_font_from_string(CONSOLE_CONSOLE(widget), font);
+	feed_screen(CONSOLE_CONSOLE(widget),
+		    CONSOLE_CONSOLE(widget)->parent.row_count);
+
+	/* The first frame loads the font and fills the glyph cache. */
+	pixbuf = console_console_render_pixbuf(CONSOLE_CONSOLE(widget));
+	if (pixbuf_is_uniform(pixbuf)) {
+		g_printerr("Nothing but background was drawn.\n");
+		g_object_unref(pixbuf);
+		g_object_unref(widget);
+		return 1;
+	}
+
+	timer = g_timer_new();
+	for (i = 0; i < frames; i++) {
+		g_object_unref(pixbuf);
+		g_timer_start(timer);
+		pixbuf = console_console_render_pixbuf(CONSOLE_CONSOLE(widget));
+		elapsed = g_timer_elapsed(timer, NULL);
+		best = MIN(best, elapsed);
+		total += elapsed;
+	}
+	g_timer_destroy(timer);
+	if (frames > 0) {
+		g_print("%dx%d pixels, %ld frames: %.3f ms best, %.3f ms mean\n",
+			gdk_pixbuf_get_width(pixbuf),
+			gdk_pixbuf_get_height(pixbuf),
+			frames, best * 1000, total * 1000 / frames);
+	}
+
+	if (output != NULL &&
+	    !gdk_pixbuf_save(pixbuf, output, "png", &error, NULL)) {
+		g_printerr("Error writing %s: %s\n", output, error->message);
+		return 1;
+	}
+
+	differ = 0;
+	if (compare != NULL) {
+		golden = gdk_pixbuf_new_from_file(compare, &error);
+		if (golden == NULL) {
+			g_printerr("Error reading %s: %s\n",
+				   compare, error->message);
+			return 1;
+		}
+		differ = compare_pixbufs(pixbuf, golden);
+		if (differ < 0) {
+			g_printerr("Frame size differs from %s.\n", compare);
+		} else if (differ > 0) {
+			g_printerr("%ld pixels differ from %s.\n",
+				   differ, compare);
+		}
+		g_object_unref(golden);
+	}
+
+	g_object_unref(pixbuf);
+	g_object_unref(widget);
+
+	return differ == 0 ? 0 : 1;
+}
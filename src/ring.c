@@ -17,11 +17,19 @@
  */
 
 #include <config.h>
+#include <sys/types.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include "debug.h"
 #include "ring.h"
+#include "vtelz.h"
 
 #ifdef VTE_DEBUG
 static void
@@ -30,16 +38,454 @@ _vte_ring_validate(VteRing * ring)
 	long i, max;
 	g_assert(ring != NULL);
 	g_assert(ring->length <= ring->max);
+	g_assert(ring->length - (ring->frozen - ring->delta) <= ring->size);
+	g_assert(ring->frozen >= ring->delta);
 	max = ring->delta + ring->length;
-	for (i = ring->delta; i < max; i++) {
+	for (i = ring->frozen; i < max; i++) {
 		g_assert(_vte_ring_contains(ring, i));
-		g_assert(ring->array[i % ring->max] != NULL);
+		g_assert(ring->array[i & ring->mask] != NULL);
 	}
 }
 #else
 #define _vte_ring_validate(ring) G_STMT_START {} G_STMT_END
 #endif
 
+/* The array always has a power of two slots, so that positions map to slots
+ * with a mask instead of a division. */
+static glong
+_vte_ring_round_size(glong count)
+{
+	glong size = 2;
+	while (size < count) {
+		size <<= 1;
+	}
+	return size;
+}
+
+/* Move the unfrozen items into a fresh array of (at least) @size slots. */
+static void
+_vte_ring_set_size(VteRing *ring, glong size)
+{
+	gpointer *array;
+	glong i, mask;
+
+	size = _vte_ring_round_size(size);
+	mask = size - 1;
+	array = g_malloc0(sizeof(gpointer) * size);
+	for (i = ring->frozen; i < _vte_ring_next(ring); i++) {
+		array[i & mask] = ring->array[i & ring->mask];
+	}
+	g_free(ring->array);
+	ring->array = array;
+	ring->size = size;
+	ring->mask = mask;
+}
+
+/* Make room in the array for @count unfrozen items.  Only items which
+ * aren't frozen occupy slots, so the array only needs to span the hot part of
+ * a ring which freezes its history. */
+static void
+_vte_ring_ensure_slots(VteRing *ring, glong count)
+{
+	if (count <= ring->size) {
+		return;
+	}
+	_vte_ring_set_size(ring, MIN(ring->max, MAX(count, ring->size * 2)));
+}
+
+/* Drop cached lookups of positions in [@start, @end). */
+static void
+_vte_ring_uncache(VteRing *ring, glong start, glong end)
+{
+	guint i;
+
+	if (end - start == 1) {
+		i = start & (VTE_RING_CACHE_SIZE - 1);
+		if (ring->cache[i].position == start) {
+			ring->cache[i].position = -1;
+		}
+		return;
+	}
+	for (i = 0; i < G_N_ELEMENTS(ring->cache); i++) {
+		if (ring->cache[i].position >= start &&
+		    ring->cache[i].position < end) {
+			ring->cache[i].position = -1;
+		}
+	}
+}
+
+/* Make room in the block table for blocks up to @block. */
+static void
+_vte_ring_ensure_blocks(VteRing *ring, glong block)
+{
+	VteRingBlock **blocks;
+	glong i, first, n_blocks;
+
+	first = ring->delta / VTE_RING_BLOCK_SIZE;
+	if (block - first < ring->n_blocks) {
+		return;
+	}
+	n_blocks = MAX(block - first + 1, ring->n_blocks * 2);
+	blocks = g_new0(VteRingBlock *, n_blocks);
+	for (i = first; i * VTE_RING_BLOCK_SIZE < ring->frozen; i++) {
+		blocks[i % n_blocks] = ring->blocks[i % ring->n_blocks];
+	}
+	g_free(ring->blocks);
+	ring->blocks = blocks;
+	ring->n_blocks = n_blocks;
+}
+
+static void
+_vte_ring_file_unref(VteRingFile *file)
+{
+	if (g_atomic_int_dec_and_test(&file->ref_count)) {
+		close(file->fd);
+		g_slice_free(VteRingFile, file);
+	}
+}
+
+/* Let go of the spill file; blocks held elsewhere keep it open. */
+static void
+_vte_ring_close_spill(VteRing *ring)
+{
+	if (ring->file != NULL) {
+		_vte_ring_file_unref(ring->file);
+		ring->file = NULL;
+		ring->file_length = 0;
+	}
+}
+
+/* Create an anonymous spill file, unless we have one already. */
+static gboolean
+_vte_ring_open_spill(VteRing *ring)
+{
+	GError *error = NULL;
+	gchar *name = NULL;
+	gint fd;
+
+	if (ring->file != NULL) {
+		return TRUE;
+	}
+	fd = g_file_open_tmp("vte-scrollback-XXXXXX", &name, &error);
+	if (fd == -1) {
+		g_warning("Error creating scrollback file: %s",
+			  error->message);
+		g_error_free(error);
+		return FALSE;
+	}
+	/* Nobody else needs to see it, and it goes away with us. */
+	g_unlink(name);
+	g_free(name);
+
+	ring->file = g_slice_new(VteRingFile);
+	ring->file->ref_count = 1;
+	ring->file->fd = fd;
+	ring->file_length = 0;
+	return TRUE;
+}
+
+/* Move a block's compressed data to the end of the spill file. */
+static gboolean
+_vte_ring_spill_block(VteRing *ring, VteRingBlock *block)
+{
+	gsize done = 0;
+	gssize n;
+
+	if (!_vte_ring_open_spill(ring)) {
+		/* Keep history in memory from now on. */
+		ring->spill = FALSE;
+		return FALSE;
+	}
+	while (done < block->length) {
+		n = pwrite(ring->file->fd, block->data + done,
+			   block->length - done, ring->file_length + done);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			g_warning("Error writing scrollback to disk: %s",
+				  g_strerror(errno));
+			return FALSE;
+		}
+		done += n;
+	}
+
+	block->file = ring->file;
+	g_atomic_int_inc(&block->file->ref_count);
+	block->offset = ring->file_length;
+	ring->file_length += block->length;
+	ring->file_blocks++;
+	g_free(block->data);
+	block->data = NULL;
+	return TRUE;
+}
+
+/* Read a spilled block back; the pages are only faulted in for the duration
+ * of the decompression, so they don't count against our resident size. */
+static gssize
+_vte_ring_read_spilled(VteRingBlock *block, guchar *raw)
+{
+	gssize ret;
+#ifdef HAVE_SYS_MMAN_H
+	gint64 page;
+	gsize length;
+	gpointer map;
+
+	page = block->offset & ~((gint64) sysconf(_SC_PAGESIZE) - 1);
+	length = block->offset - page + block->length;
+	map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, block->file->fd,
+		   page);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+	ret = _vte_lz_decompress((guchar *) map + (block->offset - page),
+				 block->length, raw, block->raw_length);
+	munmap(map, length);
+#else
+	guchar *data;
+	gsize done = 0;
+	gssize n;
+
+	data = g_malloc(block->length);
+	while (done < block->length) {
+		n = pread(block->file->fd, data + done, block->length - done,
+			  block->offset + done);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			g_free(data);
+			return -1;
+		}
+		done += n;
+	}
+	ret = _vte_lz_decompress(data, block->length, raw, block->raw_length);
+	g_free(data);
+#endif
+	return ret;
+}
+
+/* Forget the expanded copy of a frozen block, if we have one. */
+static void
+_vte_ring_forget_thawed(VteRing *ring, glong block)
+{
+	VteRingThawed *thawed;
+	guint i, j;
+
+	for (i = 0; i < G_N_ELEMENTS(ring->thawed); i++) {
+		thawed = &ring->thawed[i];
+		if (thawed->block != block) {
+			continue;
+		}
+		for (j = 0; j < G_N_ELEMENTS(thawed->items); j++) {
+			if (thawed->items[j] != NULL && ring->free) {
+				ring->free(thawed->items[j], ring->user_data);
+			}
+			thawed->items[j] = NULL;
+		}
+		thawed->block = -1;
+		thawed->stamp = 0;
+		_vte_ring_uncache(ring, block * VTE_RING_BLOCK_SIZE,
+				  (block + 1) * VTE_RING_BLOCK_SIZE);
+	}
+}
+
+static void
+_vte_ring_free_block(VteRing *ring, glong block)
+{
+	VteRingBlock **slot;
+	gboolean spilled;
+
+	_vte_ring_forget_thawed(ring, block);
+	slot = &ring->blocks[block % ring->n_blocks];
+	if (*slot == NULL) {
+		return;
+	}
+	spilled = (*slot)->data == NULL;
+	_vte_ring_block_unref(*slot);
+	*slot = NULL;
+
+	/* Reclaim the disk space once nothing refers to the file.  If a
+	 * reader still holds some of its blocks, leave it to them and start
+	 * another file the next time round. */
+	if (spilled && --ring->file_blocks == 0) {
+		if (ring->spill &&
+		    g_atomic_int_get(&ring->file->ref_count) == 1) {
+			if (ftruncate(ring->file->fd, 0) == 0) {
+				ring->file_length = 0;
+			}
+		} else {
+			_vte_ring_close_spill(ring);
+		}
+	}
+}
+
+/* Expand a frozen block into the thawed LRU, evicting the least recently
+ * used expanded block if necessary. */
+static VteRingThawed *
+_vte_ring_thaw_block(VteRing *ring, glong block)
+{
+	VteRingThawed *thawed, *victim = NULL;
+	VteRingBlock *frozen;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(ring->thawed); i++) {
+		thawed = &ring->thawed[i];
+		if (thawed->block == block) {
+			thawed->stamp = ++ring->thaw_stamp;
+			return thawed;
+		}
+		if (victim == NULL || thawed->stamp < victim->stamp) {
+			victim = thawed;
+		}
+	}
+
+	frozen = ring->blocks[block % ring->n_blocks];
+	g_assert(frozen != NULL);
+
+	_vte_debug_print(VTE_DEBUG_RING,
+			"Thawing block %ld (%u items, %u->%u bytes).\n",
+			block, frozen->count, frozen->length,
+			frozen->raw_length);
+
+	if (victim->block != -1) {
+		_vte_ring_forget_thawed(ring, victim->block);
+	}
+
+	if (!_vte_ring_block_thaw(frozen, ring->thaw, ring->user_data,
+				  victim->items +
+				  frozen->start % VTE_RING_BLOCK_SIZE)) {
+		g_critical("Corrupt scrollback block %ld.\n", block);
+		return NULL;
+	}
+
+	victim->block = block;
+	victim->stamp = ++ring->thaw_stamp;
+	return victim;
+}
+
+/* Serialize, compress and free the oldest block of unfrozen items. */
+static void
+_vte_ring_freeze_block(VteRing *ring)
+{
+	VteRingBlock *block;
+	GByteArray *raw;
+	guchar *data;
+	glong start, end, i;
+
+	start = ring->frozen;
+	end = (start / VTE_RING_BLOCK_SIZE + 1) * VTE_RING_BLOCK_SIZE;
+	_vte_ring_ensure_blocks(ring, start / VTE_RING_BLOCK_SIZE);
+
+	raw = g_byte_array_new();
+	for (i = start; i < end; i++) {
+		gpointer item = ring->array[i & ring->mask];
+		ring->freeze(item, raw, ring->user_data);
+		if (ring->free) {
+			ring->free(item, ring->user_data);
+		}
+		ring->array[i & ring->mask] = NULL;
+	}
+
+	block = g_slice_new(VteRingBlock);
+	block->ref_count = 1;
+	block->start = start;
+	block->count = end - start;
+	block->raw_length = raw->len;
+	data = g_malloc(_vte_lz_compress_bound(raw->len));
+	block->length = _vte_lz_compress(raw->data, raw->len, data);
+	block->data = g_realloc(data, block->length);
+	block->file = NULL;
+	block->offset = 0;
+	g_byte_array_free(raw, TRUE);
+	if (ring->spill && !_vte_ring_spill_block(ring, block)) {
+		/* Keep it in memory; we'll retry with the next block. */
+		_vte_debug_print(VTE_DEBUG_RING, "Spilling failed.\n");
+	}
+
+	_vte_debug_print(VTE_DEBUG_RING,
+			"Froze block %ld (%u items, %u->%u bytes).\n",
+			start / VTE_RING_BLOCK_SIZE, block->count,
+			block->raw_length, block->length);
+
+	ring->blocks[(start / VTE_RING_BLOCK_SIZE) % ring->n_blocks] = block;
+	ring->frozen = end;
+	_vte_ring_uncache(ring, start, end);
+}
+
+static void
+_vte_ring_maybe_freeze(VteRing *ring)
+{
+	if (ring->freeze == NULL) {
+		return;
+	}
+	while ((ring->frozen / VTE_RING_BLOCK_SIZE + 1) * VTE_RING_BLOCK_SIZE <=
+	       _vte_ring_next(ring) - ring->hot) {
+		_vte_ring_freeze_block(ring);
+	}
+}
+
+/* Turn the newest frozen block back into ordinary items. */
+static void
+_vte_ring_unfreeze_block(VteRing *ring, glong block)
+{
+	VteRingThawed *thawed;
+	glong position;
+	guint i;
+
+	_vte_ring_ensure_slots(ring, _vte_ring_next(ring) -
+			       MAX(block * VTE_RING_BLOCK_SIZE, ring->delta));
+	thawed = _vte_ring_thaw_block(ring, block);
+	if (thawed != NULL) {
+		for (i = 0; i < G_N_ELEMENTS(thawed->items); i++) {
+			if (thawed->items[i] == NULL) {
+				continue;
+			}
+			position = block * VTE_RING_BLOCK_SIZE + i;
+			if (position >= ring->delta) {
+				ring->array[position & ring->mask] =
+					thawed->items[i];
+			} else if (ring->free) {
+				ring->free(thawed->items[i], ring->user_data);
+			}
+			thawed->items[i] = NULL;
+		}
+		thawed->block = -1;
+		thawed->stamp = 0;
+	}
+	_vte_ring_uncache(ring, block * VTE_RING_BLOCK_SIZE,
+			  (block + 1) * VTE_RING_BLOCK_SIZE);
+	_vte_ring_free_block(ring, block);
+	ring->frozen = MAX(block * VTE_RING_BLOCK_SIZE, ring->delta);
+}
+
+static void
+_vte_ring_unfreeze_from(VteRing *ring, glong position)
+{
+	position = MAX(position, ring->delta);
+	while (ring->frozen > position) {
+		_vte_ring_unfreeze_block(ring,
+				(ring->frozen - 1) / VTE_RING_BLOCK_SIZE);
+	}
+}
+
+/* Scroll the oldest item off the top, releasing its block if it was the
+ * last item of a frozen one. */
+static void
+_vte_ring_advance_delta(VteRing *ring)
+{
+	glong position = ring->delta++;
+	if (position < ring->frozen) {
+		if (ring->delta % VTE_RING_BLOCK_SIZE == 0) {
+			_vte_ring_free_block(ring,
+					position / VTE_RING_BLOCK_SIZE);
+		}
+	} else {
+		ring->frozen = ring->delta;
+	}
+	_vte_ring_uncache(ring, position, position + 1);
+}
+
 /**
  * _vte_ring_new:
  * @max_elements: the maximum size the new ring will be allowed to reach
@@ -56,11 +502,20 @@ VteRing *
 _vte_ring_new(glong max_elements, VteRingFreeFunc free_func, gpointer data)
 {
 	VteRing *ret = g_slice_new0(VteRing);
+	guint i;
 	ret->user_data = data;
-	ret->cached_item = -1;
+	for (i = 0; i < G_N_ELEMENTS(ret->cache); i++) {
+		ret->cache[i].position = -1;
+	}
 	ret->max = MAX(max_elements, 2);
-	ret->array = g_malloc0(sizeof(gpointer) * ret->max);
+	ret->size = _vte_ring_round_size(MIN(ret->max, VTE_RING_BLOCK_SIZE));
+	ret->mask = ret->size - 1;
+	ret->array = g_malloc0(sizeof(gpointer) * ret->size);
 	ret->free = free_func;
+	ret->hot = G_MAXLONG;
+	for (i = 0; i < G_N_ELEMENTS(ret->thawed); i++) {
+		ret->thawed[i].block = -1;
+	}
 	return ret;
 }
 
@@ -71,9 +526,219 @@ _vte_ring_new_with_delta(glong max_elements, glong delta,
 	VteRing *ret;
 	ret = _vte_ring_new(max_elements, free_func, data);
 	ret->delta = delta;
+	ret->frozen = delta;
 	return ret;
 }
 
+/**
+ * _vte_ring_set_freezer:
+ * @ring: a #VteRing
+ * @freeze_func: a #VteRingFreezeFunc
+ * @thaw_func: a #VteRingThawFunc
+ *
+ * Allows @ring to keep items older than its hot length (see
+ * _vte_ring_set_hot_length()) in compressed form.  @freeze_func appends a
+ * serialized copy of an item to a byte array, and @thaw_func rebuilds an item
+ * from that data, advancing the input pointer past it.  Both are passed the
+ * ring's user data.
+ *
+ */
+void
+_vte_ring_set_freezer(VteRing *ring, VteRingFreezeFunc freeze_func,
+		      VteRingThawFunc thaw_func)
+{
+	g_return_if_fail(ring != NULL);
+	g_return_if_fail(ring->freeze == NULL);
+
+	ring->freeze = freeze_func;
+	ring->thaw = thaw_func;
+	ring->n_blocks = MIN(ring->max / VTE_RING_BLOCK_SIZE + 2, 16);
+	ring->blocks = g_new0(VteRingBlock *, ring->n_blocks);
+	_vte_ring_maybe_freeze(ring);
+}
+
+/**
+ * _vte_ring_set_hot_length:
+ * @ring: a #VteRing
+ * @hot: a number of items
+ *
+ * Sets the number of most recent items which are guaranteed to stay expanded
+ * and writable.  Anything older is frozen once a whole block of it has
+ * accumulated.  Growing the hot length thaws any frozen items it now covers.
+ *
+ */
+void
+_vte_ring_set_hot_length(VteRing *ring, glong hot)
+{
+	g_return_if_fail(ring != NULL);
+
+	ring->hot = MAX(hot, 0);
+	if (ring->freeze == NULL) {
+		return;
+	}
+	_vte_ring_unfreeze_from(ring, _vte_ring_next(ring) - ring->hot);
+	_vte_ring_maybe_freeze(ring);
+}
+
+/**
+ * _vte_ring_set_spill:
+ * @ring: a #VteRing
+ * @spill: whether to keep frozen blocks on disk
+ *
+ * Makes @ring write the blocks it freezes from now on to an anonymous
+ * temporary file instead of keeping them in memory.  When turned off, blocks
+ * already on disk stay there until they scroll off.
+ *
+ * Returns: %FALSE if the spill file couldn't be created.
+ */
+gboolean
+_vte_ring_set_spill(VteRing *ring, gboolean spill)
+{
+	g_return_val_if_fail(ring != NULL, FALSE);
+
+	ring->spill = FALSE;
+	if (!spill) {
+		if (ring->file_blocks == 0) {
+			_vte_ring_close_spill(ring);
+		}
+		return TRUE;
+	}
+
+	if (!_vte_ring_open_spill(ring)) {
+		return FALSE;
+	}
+	ring->spill = TRUE;
+	return TRUE;
+}
+
+/**
+ * _vte_ring_at_frozen:
+ * @ring: a #VteRing
+ * @position: an index
+ *
+ * Looks up an item which isn't stored expanded in @ring's array, thawing its
+ * block if needed.  This is the slow path of _vte_ring_at().
+ *
+ * Returns: the item, which stays owned by @ring.
+ */
+gpointer
+_vte_ring_at_frozen(VteRing *ring, glong position)
+{
+	VteRingThawed *thawed;
+	gpointer item;
+
+	if (position >= ring->delta && position < ring->frozen) {
+		if (_vte_ring_is_cached(ring, position)) {
+			return _vte_ring_get_cached_data(ring, position);
+		}
+		thawed = _vte_ring_thaw_block(ring,
+				position / VTE_RING_BLOCK_SIZE);
+		if (thawed != NULL) {
+			item = thawed->items[position % VTE_RING_BLOCK_SIZE];
+			_vte_ring_set_cache(ring, position, item);
+			return item;
+		}
+	}
+#ifdef VTE_DEBUG
+	g_critical("NULL at %ld(->%ld) delta %ld, length %ld, max %ld next %ld\n",
+		   position, position & ring->mask,
+		   ring->delta, ring->length, ring->max,
+		   ring->delta + ring->length);
+#endif
+	return NULL;
+}
+
+/**
+ * _vte_ring_ref_block:
+ * @ring: a #VteRing
+ * @position: an index
+ *
+ * Takes a reference to the frozen block holding the @position'th item, so
+ * that its items can be read later with _vte_ring_block_thaw() even if
+ * @ring lets go of them.  This doesn't thaw anything.
+ *
+ * Returns: the block, to be released with _vte_ring_block_unref(), or %NULL
+ * if the item isn't frozen.
+ */
+VteRingBlock *
+_vte_ring_ref_block(VteRing *ring, glong position)
+{
+	VteRingBlock *block;
+
+	g_return_val_if_fail(ring != NULL, NULL);
+
+	if (position < ring->delta || position >= ring->frozen) {
+		return NULL;
+	}
+	block = ring->blocks[(position / VTE_RING_BLOCK_SIZE) % ring->n_blocks];
+	g_atomic_int_inc(&block->ref_count);
+	return block;
+}
+
+/**
+ * _vte_ring_block_unref:
+ * @block: a #VteRingBlock
+ *
+ * Drops a reference to @block, freeing it when the last one goes.  This may
+ * be called from any thread.
+ *
+ */
+void
+_vte_ring_block_unref(VteRingBlock *block)
+{
+	if (!g_atomic_int_dec_and_test(&block->ref_count)) {
+		return;
+	}
+	if (block->file != NULL) {
+		_vte_ring_file_unref(block->file);
+	}
+	g_free(block->data);
+	g_slice_free(VteRingBlock, block);
+}
+
+/**
+ * _vte_ring_block_thaw:
+ * @block: a #VteRingBlock
+ * @thaw_func: a #VteRingThawFunc
+ * @data: user data for @thaw_func
+ * @items: room for the block's items
+ *
+ * Expands a frozen block, storing new copies of its items, oldest first, at
+ * the start of @items.  The first is the one at @block's start position.
+ * This may be called from any thread, as long as a reference to @block is
+ * held.
+ *
+ * Returns: %FALSE if the block couldn't be read back, leaving @items alone.
+ */
+gboolean
+_vte_ring_block_thaw(VteRingBlock *block, VteRingThawFunc thaw_func,
+		     gpointer data, gpointer *items)
+{
+	const guchar *p, *end;
+	guchar *raw;
+	gssize length;
+	guint i;
+
+	raw = g_malloc(block->raw_length);
+	if (block->data != NULL) {
+		length = _vte_lz_decompress(block->data, block->length,
+					    raw, block->raw_length);
+	} else {
+		length = _vte_ring_read_spilled(block, raw);
+	}
+	if (length != (gssize) block->raw_length) {
+		g_free(raw);
+		return FALSE;
+	}
+	p = raw;
+	end = raw + block->raw_length;
+	for (i = 0; i < block->count; i++) {
+		items[i] = thaw_func(&p, end, data);
+	}
+	g_free(raw);
+	return TRUE;
+}
+
 /**
  * _vte_ring_insert:
  * @ring: a #VteRing
@@ -104,22 +769,27 @@ _vte_ring_insert(VteRing * ring, long position, gpointer data)
 
 	/* Initial insertion, or append. */
 	if (position == ring->length + ring->delta) {
-		i = position % ring->max;
-		old_data = ring->array[i];
-		/* Set the new item, and if the buffer wasn't "full", increase
-		 * our idea of how big it is, otherwise increase the delta so
-		 * that this becomes the "last" item and the previous item
-		 * scrolls off the *top*. */
-		ring->array[i] = data;
+		_vte_ring_ensure_slots(ring, MIN(position + 1 - ring->frozen,
+						 ring->max));
+		/* If the buffer wasn't "full", increase our idea of how big
+		 * it is, otherwise increase the delta so that this becomes
+		 * the "last" item and the first item scrolls off the *top*.
+		 * The array may be larger than the maximum, so the first
+		 * item's slot isn't necessarily the one we're about to use. */
 		if (ring->length == ring->max) {
-			ring->delta++;
-			if (ring->delta > ring->cached_item) {
-				_vte_ring_set_cache (ring, -1, NULL);
+			if (ring->delta >= ring->frozen) {
+				i = ring->delta & ring->mask;
+				old_data = ring->array[i];
+				ring->array[i] = NULL;
 			}
-
+			_vte_ring_advance_delta(ring);
 		} else {
+			old_data = ring->array[position & ring->mask];
 			ring->length++;
 		}
+		ring->array[position & ring->mask] = data;
+		_vte_ring_uncache(ring, position, position + 1);
+		_vte_ring_maybe_freeze(ring);
 		_vte_debug_print(VTE_DEBUG_RING,
 				" Delta = %ld, Length = %ld, "
 				"Max = %ld.\n",
@@ -128,36 +798,38 @@ _vte_ring_insert(VteRing * ring, long position, gpointer data)
 		return old_data;
 	}
 
-	if (position <= ring->cached_item) {
-		_vte_ring_set_cache (ring, -1, NULL);
+	if (position < ring->frozen) {
+		_vte_ring_unfreeze_from(ring, position);
 	}
+	_vte_ring_uncache(ring, position, G_MAXLONG);
 
 	/* All other cases.  Calculate the location where the last "item" in the
 	 * buffer is going to end up in the array. */
 	point = ring->delta + ring->length - 1;
 	while (point < 0) {
-		point += ring->max;
+		point += ring->size;
 	}
 
 	if (ring->length == ring->max) {
 		/* If the buffer's full, then the last item will have to be
 		 * "lost" to make room for the new item so that the buffer
 		 * doesn't grow (here we scroll off the *bottom*). */
-		old_data = ring->array[point % ring->max];
+		old_data = ring->array[point & ring->mask];
 	} else {
 		/* We don't want to discard the last item. */
+		_vte_ring_ensure_slots(ring, point + 2 - ring->frozen);
 		point++;
 	}
 
 	/* We need to bubble the remaining valid elements down.  This isn't as
 	 * slow as you probably think it is due to the pattern of usage. */
 	for (i = point; i > position; i--) {
-		ring->array[i % ring->max] = ring->array[(i - 1) % ring->max];
+		ring->array[i & ring->mask] = ring->array[(i - 1) & ring->mask];
 	}
 
 	/* Store the new item and bump up the length, unless we've hit the
 	 * maximum length already. */
-	ring->array[position % ring->max] = data;
+	ring->array[position & ring->mask] = data;
 	ring->length = CLAMP(ring->length + 1, 0, ring->max);
 	_vte_debug_print(VTE_DEBUG_RING,
 			" Delta = %ld, Length = %ld, Max = %ld.\n",
@@ -194,9 +866,10 @@ _vte_ring_insert_preserve(VteRing * ring, long position, gpointer data)
 			position, ring->delta, ring->length, ring->max);
 	_vte_ring_validate(ring);
 
-	if (position <= ring->cached_item) {
-		_vte_ring_set_cache (ring, -1, NULL);
+	if (position < ring->frozen) {
+		_vte_ring_unfreeze_from(ring, position);
 	}
+	_vte_ring_uncache(ring, position, G_MAXLONG);
 
 	/* Allocate space to save existing elements. */
 	point = _vte_ring_next(ring);
@@ -254,11 +927,12 @@ _vte_ring_remove(VteRing * ring, long position, gboolean free_element)
 			position, ring->delta, ring->length, ring->max);
 	_vte_ring_validate(ring);
 
-	if (position <= ring->cached_item) {
-		_vte_ring_set_cache (ring, -1, NULL);
+	if (position < ring->frozen) {
+		_vte_ring_unfreeze_from(ring, position);
 	}
+	_vte_ring_uncache(ring, position, G_MAXLONG);
 
-	i = position % ring->max;
+	i = position & ring->mask;
 	/* Remove the data at this position. */
 	old_data = ring->array[i];
 	if (free_element && old_data && ring->free) {
@@ -272,12 +946,12 @@ _vte_ring_remove(VteRing * ring, long position, gboolean free_element)
 	/* Bubble the rest of the buffer up one notch.  This is also less
 	 * of a problem than it might appear, again due to usage patterns. */
 	for (i = position; i < ring->delta + ring->length - 1; i++) {
-		ring->array[i % ring->max] = ring->array[(i + 1) % ring->max];
+		ring->array[i & ring->mask] = ring->array[(i + 1) & ring->mask];
 	}
 
 	/* Store a NULL in the position at the end of the buffer and decrement
 	 * its length (got room for one more now). */
-	ring->array[(ring->delta + ring->length - 1) % ring->max] = NULL;
+	ring->array[(ring->delta + ring->length - 1) & ring->mask] = NULL;
 	if (ring->length > 0) {
 		ring->length--;
 	}
@@ -289,6 +963,89 @@ _vte_ring_remove(VteRing * ring, long position, gboolean free_element)
 	return old_data;
 }
 
+/**
+ * _vte_ring_rotate:
+ * @ring: a #VteRing
+ * @from: the index of the item to move
+ * @to: its new index
+ *
+ * Moves the @from'th item of @ring to the @to'th offset, shifting the items
+ * in between by one towards @from.  Only that part of the ring is touched,
+ * so this is much cheaper than a removal followed by an insertion when there
+ * are many items after the affected range.
+ *
+ * Returns: the moved item.
+ */
+gpointer
+_vte_ring_rotate(VteRing *ring, glong from, glong to)
+{
+	gpointer data;
+	glong i;
+
+	g_return_val_if_fail(_vte_ring_contains(ring, from), NULL);
+	g_return_val_if_fail(_vte_ring_contains(ring, to), NULL);
+
+	_vte_debug_print(VTE_DEBUG_RING,
+			"Rotating item at position %ld to %ld.\n"
+			" Delta = %ld, Length = %ld, Max = %ld.\n",
+			from, to, ring->delta, ring->length, ring->max);
+	_vte_ring_validate(ring);
+
+	if (MIN(from, to) < ring->frozen) {
+		_vte_ring_unfreeze_from(ring, MIN(from, to));
+	}
+	_vte_ring_uncache(ring, MIN(from, to), MAX(from, to) + 1);
+
+	data = ring->array[from & ring->mask];
+	if (from < to) {
+		for (i = from; i < to; i++) {
+			ring->array[i & ring->mask] =
+				ring->array[(i + 1) & ring->mask];
+		}
+	} else {
+		for (i = from; i > to; i--) {
+			ring->array[i & ring->mask] =
+				ring->array[(i - 1) & ring->mask];
+		}
+	}
+	ring->array[to & ring->mask] = data;
+	_vte_ring_validate(ring);
+
+	return data;
+}
+
+/**
+ * _vte_ring_replace:
+ * @ring: a #VteRing
+ * @position: an index
+ * @data: the new item
+ *
+ * Puts @data in place of the @position'th item of @ring, thawing it first if
+ * need be, without moving anything else.
+ *
+ * Returns: the replaced item, which the caller now owns.
+ */
+gpointer
+_vte_ring_replace(VteRing *ring, glong position, gpointer data)
+{
+	gpointer old;
+
+	g_return_val_if_fail(_vte_ring_contains(ring, position), NULL);
+	g_assert(data != NULL);
+
+	_vte_debug_print(VTE_DEBUG_RING,
+			"Replacing item at position %ld.\n", position);
+
+	if (position < ring->frozen) {
+		_vte_ring_unfreeze_from(ring, position);
+	}
+	_vte_ring_uncache(ring, position, position + 1);
+	old = ring->array[position & ring->mask];
+	ring->array[position & ring->mask] = data;
+
+	return old;
+}
+
 /**
  * _vte_ring_append:
  * @ring: a #VteRing
@@ -318,17 +1075,79 @@ _vte_ring_free(VteRing * ring, gboolean free_elements)
 {
 	long i;
 	if (free_elements && ring->free) {
-		for (i = 0; i < ring->max; i++) {
+		for (i = 0; i < ring->size; i++) {
 			/* Remove this item. */
 			if (ring->array[i] != NULL) {
 				ring->free(ring->array[i], ring->user_data);
 			}
 		}
 	}
+	/* Frozen items are always ours. */
+	if (ring->blocks != NULL) {
+		for (i = 0; i < ring->n_blocks; i++) {
+			if (ring->blocks[i] != NULL) {
+				_vte_ring_free_block(ring,
+					ring->blocks[i]->start /
+					VTE_RING_BLOCK_SIZE);
+			}
+		}
+		g_free(ring->blocks);
+	}
+	_vte_ring_close_spill(ring);
 	g_free(ring->array);
 	g_slice_free(VteRing, ring);
 }
 
+/**
+ * _vte_ring_resize:
+ * @ring: a #VteRing
+ * @max_elements: the new maximum size
+ *
+ * Changes the number of items @ring can hold, keeping the newest ones.  Items
+ * which no longer fit are freed, as are their frozen blocks.
+ *
+ */
+void
+_vte_ring_resize(VteRing *ring, glong max_elements)
+{
+	glong max, position;
+
+	g_return_if_fail(ring != NULL);
+
+	max = MAX(max_elements, 2);
+	if (max == ring->max) {
+		return;
+	}
+
+	_vte_debug_print(VTE_DEBUG_RING,
+			"Resizing from %ld to %ld.\n"
+			" Delta = %ld, Length = %ld, Frozen = %ld.\n",
+			ring->max, max,
+			ring->delta, ring->length, ring->frozen);
+
+	/* Scroll off whatever doesn't fit any more. */
+	while (ring->length > max) {
+		position = ring->delta;
+		if (position >= ring->frozen) {
+			if (ring->free) {
+				ring->free(ring->array[position & ring->mask],
+					   ring->user_data);
+			}
+			ring->array[position & ring->mask] = NULL;
+		}
+		_vte_ring_advance_delta(ring);
+		ring->length--;
+	}
+
+	_vte_ring_set_size(ring, MIN(max, MAX(_vte_ring_next(ring) - ring->frozen,
+					      VTE_RING_BLOCK_SIZE)));
+	ring->max = max;
+
+	_vte_ring_uncache(ring, 0, G_MAXLONG);
+	_vte_ring_maybe_freeze(ring);
+	_vte_ring_validate(ring);
+}
+
 #ifdef RING_MAIN
 static void
 scrolled_off(gpointer freed, gpointer data)
@@ -338,6 +1157,192 @@ scrolled_off(gpointer freed, gpointer data)
 	g_printerr(fmt, *l);
 }
 
+static void
+freeze_long(gpointer item, GByteArray *out, gpointer data)
+{
+	g_byte_array_append(out, item, sizeof(long));
+}
+
+static gpointer
+thaw_long(const guchar **in, const guchar *end, gpointer data)
+{
+	long *l = g_new(long, 1);
+	g_assert(end - *in >= (gssize) sizeof(long));
+	memcpy(l, *in, sizeof(long));
+	*in += sizeof(long);
+	return l;
+}
+
+static void
+free_long(gpointer freeing, gpointer data)
+{
+	g_free(freeing);
+}
+
+static void
+check_values(VteRing *ring)
+{
+	long i;
+	for (i = _vte_ring_delta(ring); i < _vte_ring_next(ring); i++) {
+		g_assert(*_vte_ring_index(ring, long *, i) == i);
+	}
+}
+
+static void
+test_freezing(void)
+{
+	VteRing *ring;
+	long i, *l;
+
+	ring = _vte_ring_new(2000, free_long, NULL);
+	_vte_ring_set_freezer(ring, freeze_long, thaw_long);
+	_vte_ring_set_hot_length(ring, 24);
+	for (i = 0; i < 5000; i++) {
+		l = g_new(long, 1);
+		*l = i;
+		l = _vte_ring_append(ring, l);
+		g_free(l);
+	}
+	g_assert(_vte_ring_delta(ring) == 3000);
+	g_assert(ring->frozen > ring->delta);
+	g_assert(ring->frozen <= _vte_ring_next(ring) - 24);
+	check_values(ring);
+
+	/* Shrinking drops frozen blocks from the top. */
+	_vte_ring_resize(ring, 700);
+	g_assert(_vte_ring_delta(ring) == 4300);
+	check_values(ring);
+
+	/* Editing inside the frozen area thaws it first. */
+	l = _vte_ring_remove(ring, 4400, FALSE);
+	g_assert(*l == 4400);
+	g_assert(ring->frozen <= 4400);
+	_vte_ring_insert(ring, 4400, l);
+	check_values(ring);
+
+	/* Growing the hot area thaws the newest blocks for good. */
+	_vte_ring_set_hot_length(ring, 500);
+	g_assert(ring->frozen <= _vte_ring_next(ring) - 500);
+	check_values(ring);
+
+	_vte_ring_free(ring, TRUE);
+	g_printerr("Freezing OK.\n");
+}
+
+static void
+test_spilling(void)
+{
+	VteRing *ring;
+	VteRingBlock *block;
+	gpointer items[VTE_RING_BLOCK_SIZE];
+	long i, *l;
+
+	ring = _vte_ring_new(VTE_RING_UNLIMITED, free_long, NULL);
+	_vte_ring_set_freezer(ring, freeze_long, thaw_long);
+	_vte_ring_set_hot_length(ring, 24);
+	g_assert(_vte_ring_set_spill(ring, TRUE));
+	for (i = 0; i < 100000; i++) {
+		l = g_new(long, 1);
+		*l = i;
+		l = _vte_ring_append(ring, l);
+		g_assert(l == NULL);
+	}
+	g_assert(_vte_ring_delta(ring) == 0);
+	g_assert(ring->size < 24 + 2 * VTE_RING_BLOCK_SIZE);
+	g_assert(ring->file_blocks == ring->frozen / VTE_RING_BLOCK_SIZE);
+	check_values(ring);
+	block = _vte_ring_ref_block(ring, 0);
+	g_assert(block != NULL && block->data == NULL);
+
+	/* Going back to a bounded size keeps new blocks in memory; the
+	 * file goes away once the last spilled block scrolls off. */
+	g_assert(_vte_ring_set_spill(ring, FALSE));
+	_vte_ring_resize(ring, 1000);
+	check_values(ring);
+	g_assert(ring->file_blocks <= 1000 / VTE_RING_BLOCK_SIZE + 1);
+	for (i = 100000; i < 102000; i++) {
+		l = g_new(long, 1);
+		*l = i;
+		l = _vte_ring_append(ring, l);
+		g_free(l);
+	}
+	check_values(ring);
+	g_assert(ring->file_blocks == 0);
+	g_assert(ring->file == NULL);
+
+	/* A block held onto is still readable after scrolling off. */
+	g_assert(_vte_ring_block_thaw(block, thaw_long, NULL, items));
+	for (i = 0; i < VTE_RING_BLOCK_SIZE; i++) {
+		g_assert(*(long *) items[i] == i);
+		g_free(items[i]);
+	}
+	_vte_ring_block_unref(block);
+
+	_vte_ring_free(ring, TRUE);
+	g_printerr("Spilling OK.\n");
+}
+
+static void
+test_iterating(void)
+{
+	VteRing *ring;
+	VteRingIter iter;
+	long i, *l;
+
+	/* A maximum which isn't a power of two still drops exactly the
+	 * oldest item. */
+	ring = _vte_ring_new(1000, free_long, NULL);
+	for (i = 0; i < 3000; i++) {
+		l = g_new(long, 1);
+		*l = i;
+		l = _vte_ring_append(ring, l);
+		g_assert(i < 1000 ? l == NULL : *l == i - 1000);
+		g_free(l);
+	}
+	g_assert((ring->size & ring->mask) == 0);
+	g_assert(_vte_ring_delta(ring) == 2000);
+	check_values(ring);
+
+	_vte_ring_set_hot_length(ring, 100);
+	_vte_ring_set_freezer(ring, freeze_long, thaw_long);
+	g_assert(ring->frozen > _vte_ring_delta(ring));
+
+	_vte_ring_iter_init(&iter, ring, _vte_ring_delta(ring) - 5);
+	for (i = _vte_ring_delta(ring) - 5; i < _vte_ring_next(ring) + 5; i++) {
+		g_assert(_vte_ring_iter_position(&iter) == i);
+		l = _vte_ring_iter_next(&iter);
+		g_assert(_vte_ring_contains(ring, i) ? *l == i : l == NULL);
+		/* Frozen lookups are cached. */
+		g_assert(i >= ring->frozen || !_vte_ring_contains(ring, i) ||
+			 _vte_ring_is_cached(ring, i));
+	}
+
+	/* Rotating a region leaves everything outside it alone, and can be
+	 * undone, even across the frozen boundary. */
+	i = _vte_ring_next(ring) - 1;
+	l = _vte_ring_rotate(ring, i, i - 10);
+	g_assert(*l == i);
+	g_assert(*_vte_ring_index(ring, long *, i) == i - 1);
+	g_assert(*_vte_ring_index(ring, long *, i - 9) == i - 10);
+	_vte_ring_rotate(ring, i - 10, i);
+	i = _vte_ring_delta(ring);
+	_vte_ring_rotate(ring, i + 1, i + 3);
+	g_assert(*_vte_ring_index(ring, long *, i + 3) == i + 1);
+	_vte_ring_rotate(ring, i + 3, i + 1);
+	check_values(ring);
+
+	/* Replacing a frozen item hands back the thawed one. */
+	l = g_new(long, 1);
+	*l = i;
+	l = _vte_ring_replace(ring, i, l);
+	g_assert(*l == i && i >= ring->frozen);
+	g_free(l);
+	check_values(ring);
+
+	_vte_ring_free(ring, TRUE);
+	g_printerr("Iterating OK.\n");
+}
+
 int
 main(int argc, char **argv)
 {
@@ -407,6 +1412,10 @@ main(int argc, char **argv)
 
 	_vte_ring_free(ring, TRUE);
 
+	test_freezing();
+	test_iterating();
+	test_spilling();
+
 	return 0;
 }
 #endif
@@ -27,16 +27,84 @@
 G_BEGIN_DECLS
 
 typedef struct _VteRing VteRing;
+typedef struct _VteRingBlock VteRingBlock;
+typedef struct _VteRingFile VteRingFile;
+typedef struct _VteRingThawed VteRingThawed;
+typedef struct _VteRingIter VteRingIter;
 typedef void (*VteRingFreeFunc)(gpointer freeing, gpointer data);
+typedef void (*VteRingFreezeFunc)(gpointer item, GByteArray *out,
+				  gpointer data);
+typedef gpointer (*VteRingThawFunc)(const guchar **in, const guchar *end,
+				    gpointer data);
+
+/* Items older than the newest @hot ones are frozen a block at a time: the
+ * block is serialized with the freeze callback, compressed, and the items
+ * freed.  Looking up a frozen item thaws its whole block into a small LRU of
+ * expanded blocks; such items are owned by the ring and must be treated as
+ * read-only, since they're discarded when their block is evicted.
+ *
+ * A ring may also spill its frozen blocks to an unlinked temporary file,
+ * keeping only an offset for each in memory; with an effectively unlimited
+ * maximum, history is then bounded by disk space only.
+ *
+ * Frozen blocks are reference counted, so that a reader can hold on to some
+ * and thaw them later, on any thread, whatever the ring does meanwhile. */
+#define VTE_RING_BLOCK_SIZE	128
+#define VTE_RING_THAWED_BLOCKS	8
+/* Recent lookups are remembered in a small direct-mapped cache. */
+#define VTE_RING_CACHE_SIZE	32
+
+struct _VteRingFile {
+	gint ref_count;		/* the ring's, and one per block in it */
+	gint fd;
+};
+
+struct _VteRingBlock {
+	gint ref_count;
+	glong start;		/* first position stored in this block */
+	guint count;		/* number of items stored */
+	guint raw_length;	/* serialized size */
+	guint length;		/* compressed size */
+	guchar *data;		/* or NULL if it lives in the spill file */
+	VteRingFile *file;	/* the spill file, if so */
+	gint64 offset;		/* in the spill file */
+};
+
+struct _VteRingThawed {
+	glong block;		/* block number, or -1 if unused */
+	guint stamp;		/* for LRU eviction */
+	gpointer items[VTE_RING_BLOCK_SIZE];
+};
 
 struct _VteRing {
 	glong delta, length, max;
-	glong cached_item;
-	gpointer cached_data;
+	struct {
+		glong position;	/* or -1 if unused */
+		gpointer data;
+	} cache[VTE_RING_CACHE_SIZE];
 	gpointer *array;
+	glong size;		/* slots in array, a power of two grown as
+				   needed until it covers max */
+	glong mask;		/* size - 1 */
 
 	VteRingFreeFunc free;
 	gpointer user_data;
+
+	/* Cold storage. */
+	VteRingFreezeFunc freeze;
+	VteRingThawFunc thaw;
+	glong hot;		/* number of newest items never frozen */
+	glong frozen;		/* items before this position are frozen */
+	VteRingBlock **blocks;	/* indexed by block number % n_blocks */
+	glong n_blocks;
+	VteRingThawed thawed[VTE_RING_THAWED_BLOCKS];
+	guint thaw_stamp;
+
+	/* Spill file. */
+	gboolean spill;
+	VteRingFile *file;	/* or NULL */
+	gint64 file_length;
+	glong file_blocks;	/* of ours in it */
 };
 
 #define _vte_ring_contains(__ring, __position) \
@@ -46,26 +114,50 @@ struct _VteRing {
 #define _vte_ring_length(__ring) ((__ring)->length)
 #define _vte_ring_next(__ring) ((__ring)->delta + (__ring)->length)
 #define _vte_ring_max(__ring) ((__ring)->max)
-#define _vte_ring_is_cached(__ring, __v) ((__ring)->cached_item == (__v))
-#define _vte_ring_get_cached_data(__ring) ((__ring)->cached_data)
-#define _vte_ring_set_cache(__ring, __v, __data) ((__ring)->cached_item = (__v), (__ring)->cached_data = (__data))
+#define _vte_ring_frozen(__ring) ((__ring)->frozen)
+#define _vte_ring_cache_entry(__ring, __v) \
+	((__ring)->cache[(__v) & (VTE_RING_CACHE_SIZE - 1)])
+#define _vte_ring_is_cached(__ring, __v) \
+	(_vte_ring_cache_entry(__ring, __v).position == (__v))
+#define _vte_ring_get_cached_data(__ring, __v) \
+	(_vte_ring_cache_entry(__ring, __v).data)
+#define _vte_ring_set_cache(__ring, __v, __data) \
+	(_vte_ring_cache_entry(__ring, __v).position = (__v), \
+	 _vte_ring_cache_entry(__ring, __v).data = (__data))
+#define VTE_RING_UNLIMITED G_MAXLONG
+/* Frozen positions may share a slot with a live item, so check the frozen
+ * boundary before looking at the array. */
 #ifdef VTE_DEBUG
 #define _vte_ring_at(__ring, __position) \
-	((__ring)->array[(__position) % (__ring)->max] ? \
-	 (__ring)->array[(__position) % (__ring)->max] : \
-	 (g_critical("NULL at %ld(->%ld) delta %ld, length %ld, max %ld next %ld" \
-		  " at %d\n", \
-		  (__position), (__position) % (__ring)->max, \
-		  (__ring)->delta, (__ring)->length, (__ring)->max, \
-		  (__ring)->delta + (__ring)->length, \
-		  __LINE__), (gpointer) NULL))
+	(((__position) >= (__ring)->frozen && \
+	  (__ring)->array[(__position) & (__ring)->mask]) ? \
+	 (__ring)->array[(__position) & (__ring)->mask] : \
+	 _vte_ring_at_frozen((__ring), (__position)))
 #else
 #define _vte_ring_at(__ring, __position) \
-	((__ring)->array[(__position) % (__ring)->max])
+	((__position) >= (__ring)->frozen ? \
+	 (__ring)->array[(__position) & (__ring)->mask] : \
+	 _vte_ring_at_frozen((__ring), (__position)))
 #endif
 #define _vte_ring_index(__ring, __cast, __position) \
 	(__cast) _vte_ring_at(__ring, __position)
 
+/* Walks a range of positions, yielding NULL for those outside the ring, with
+ * the bounds worked out once up front.  The ring mustn't be modified while an
+ * iterator is in use. */
+struct _VteRingIter {
+	VteRing *ring;
+	glong position;		/* next position to be returned */
+	glong start, end;	/* the part of the range within the ring */
+};
+
+#define _vte_ring_iter_init(__iter, __ring, __position) \
+	((__iter)->ring = (__ring), \
+	 (__iter)->position = (__position), \
+	 (__iter)->start = (__ring)->delta, \
+	 (__iter)->end = _vte_ring_next(__ring))
+#define _vte_ring_iter_position(__iter) ((__iter)->position)
+
 VteRing *_vte_ring_new(glong max_elements,
 		      VteRingFreeFunc free_func,
 		      gpointer data);
@@ -74,8 +166,30 @@ VteRing *_vte_ring_new_with_delta(glong max_elements, glong delta,
 gpointer _vte_ring_insert(VteRing *ring, glong position, gpointer data);
 gpointer _vte_ring_insert_preserve(VteRing *ring, glong position, gpointer data);
 gpointer _vte_ring_remove(VteRing *ring, glong position, gboolean free_element);
+gpointer _vte_ring_rotate(VteRing *ring, glong from, glong to);
+gpointer _vte_ring_replace(VteRing *ring, glong position, gpointer data);
 gpointer _vte_ring_append(VteRing *ring, gpointer data);
 void _vte_ring_free(VteRing *ring, gboolean free_elements);
+void _vte_ring_resize(VteRing *ring, glong max_elements);
+void _vte_ring_set_freezer(VteRing *ring, VteRingFreezeFunc freeze_func,
+			   VteRingThawFunc thaw_func);
+void _vte_ring_set_hot_length(VteRing *ring, glong hot);
+gboolean _vte_ring_set_spill(VteRing *ring, gboolean spill);
+gpointer _vte_ring_at_frozen(VteRing *ring, glong position);
+VteRingBlock *_vte_ring_ref_block(VteRing *ring, glong position);
+void _vte_ring_block_unref(VteRingBlock *block);
+gboolean _vte_ring_block_thaw(VteRingBlock *block, VteRingThawFunc thaw_func,
+			      gpointer data, gpointer *items);
+
+static inline gpointer
+_vte_ring_iter_next(VteRingIter *iter)
+{
+	glong position = iter->position++;
+	if (position < iter->start || position >= iter->end) {
+		return NULL;
+	}
+	return _vte_ring_at(iter->ring, position);
+}
 
 G_END_DECLS
 
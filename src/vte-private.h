@@ -45,6 +45,7 @@
 #include "vteconv.h"
 #include "vtedraw.h"
 #include "ring.h"
+#include "vtesearch.h"
 #include "caps.h"
 
 #include "controller.h"
@@ -69,6 +70,15 @@ G_BEGIN_DECLS
 
 #define VTE_SATURATION_MAX		10000
 #define VTE_SCROLLBACK_INIT		100
+#define VTE_SCROLLBACK_HOT_MARGIN	256
+#define VTE_REFLOW_DELAY		100
+#define VTE_REFLOW_CHUNK		1024
+#define VTE_SEARCH_BATCH		64
+#define VTE_SEARCH_SLICE_ROWS		4096
+#define VTE_TEXT_CHUNK_SIZE		16384
+#define VTE_WRITE_CHUNK_SIZE		65536
+#define VTE_WRITE_SLICE_ROWS		1024
+#define VTE_GRAPHIC_CACHE_SIZE		256
 #define VTE_DEFAULT_CURSOR		GDK_XTERM
 #define VTE_MOUSING_CURSOR		GDK_LEFT_PTR
 #define VTE_TAB_MAX			999
@@ -88,6 +98,11 @@ G_BEGIN_DECLS
 #define VTE_UPDATE_REPEAT_TIMEOUT	30
 #define VTE_MAX_PROCESS_TIME		100
 #define VTE_CELL_BBOX_SLACK		1
+#define VTE_FRONT_SELECTED		(1 << 0)
+#define VTE_FRONT_HILITE		(1 << 1)
+#define VTE_FRONT_CURSOR		(1 << 2)
+#define VTE_FRONT_FOCUS			(1 << 3)
+#define VTE_FRONT_SHAPE_SHIFT		4
 
 #define VTE_UTF8_BPC                    (6) /* Maximum number of bytes used per UTF-8 character */
 
@@ -166,6 +181,8 @@ struct vte_match_regex {
                char *cursor_name;
                GdkCursorType cursor_type;
         } cursor;
+	char *pattern;		/* VTE_REGEX_VTE's source, for its literal */
+	gboolean prefiltered;	/* only run on lines with its literal */
 };
 
 /* The terminal's keypad/cursor state.  A terminal can either be using the
@@ -181,11 +198,35 @@ typedef struct _VteWordCharRange {
 	gunichar start, end;
 } VteWordCharRange;
 
+/* Rows in the compressed part of the scrollback (older than the visible
+ * area plus VTE_SCROLLBACK_HOT_MARGIN) are thawed on demand and must not be
+ * modified; see ring.h.  Rows above the insertion area may also be shared
+ * with snapshots, which is why they're reference counted; a shared row is
+ * replaced rather than modified if it ever comes back into the writable
+ * area. */
 typedef struct _VteRowData {
 	GArray *cells;
 	guchar soft_wrapped: 1;
+	gint ref_count;
 } VteRowData;
 
+/* A copy of a range of rows which can be read from any thread.  Rows from
+ * above the insertion area are shared with the ring, the rest copied.  Rows
+ * which the ring had frozen are held as its compressed blocks, and only
+ * thawed when read. */
+struct _VteSnapshot {
+	gint ref_count;
+	glong start_row;		/* absolute row of rows[0] */
+	glong n_rows;
+	glong column_count;
+	VteRowData **rows;		/* NULL where the ring had nothing, or
+					   where the block is still frozen */
+	VteRingBlock **blocks;		/* by block number from first_block,
+					   NULL once thawed */
+	glong first_block, n_blocks;
+	GStaticMutex thaw_lock;
+};
+
 /* Terminal private data. */
 struct _VteTerminalPrivate {
 	/* Emulation setup data. */
@@ -222,7 +263,23 @@ struct _VteTerminalPrivate {
 			- 2 * sizeof(void *)];
 	} *incoming;			/* pending bytestream */
 	GArray *pending;		/* pending characters */
-	GSList *update_regions;
+	struct _vte_damage {		/* pending repaints, kept while active */
+		struct vte_damage_span {
+			glong start, end;	/* dirty columns */
+		} *rows;		/* one per visible row */
+		glong n_rows;
+		glong scrolled;		/* rows the view moved down by */
+		GdkRegion *region;	/* exposures off the cell grid */
+		gboolean pending;
+	} damage;
+	struct _vte_front {		/* what was last painted, by cell */
+		struct vte_front_cell {
+			gunichar c;
+			struct vte_charcell_attr attr;	/* colors resolved */
+			guint32 state;	/* VTE_FRONT_* flags */
+		} *cells;		/* rows * columns, or NULL */
+		glong rows, columns;
+	} front;
 	gboolean invalidated_all;	/* pending refresh of entire terminal */
 	GList *active;                  /* is the terminal processing data */
 	glong input_bytes;
@@ -276,6 +333,31 @@ struct _VteTerminalPrivate {
 	} normal_screen, alternate_screen, *screen;
 	VteRowData *free_row;
 
+	/* Rewrapping of the normal screen's history after a width change. */
+	VteRing *reflow_ring;		/* rewrapped copy being built */
+	glong reflow_next, reflow_end;	/* old rows still to be copied */
+	guint reflow_tag;
+
+	/* Scrollback search. */
+	VteSearchIndex *search_index;	/* created by the first search */
+	struct vte_search_job *search_index_job;	/* building it, or NULL */
+	GList *search_jobs;
+	guint search_last_id;
+
+	/* Rows whose text changed since the accessibility peer last asked. */
+	glong text_damage_start, text_damage_end;
+	gboolean text_damage_all;
+
+	/* Line-drawing characters we've already rasterized, and the mask
+	 * being drawn into while we rasterize another. */
+	GHashTable *graphics;
+	struct _vte_draw_mask *graphic_mask;
+
+	/* Runs of cells with the same colors in the rows being drawn, and
+	 * where each row's runs start. */
+	GArray *draw_runs;
+	GArray *draw_row_runs;
+
 	/* Selection information. */
 	GArray *word_chars;
 	gboolean has_selection;
@@ -329,6 +411,8 @@ struct _VteTerminalPrivate {
         gboolean cursor_blinks;           /* whether the cursor is actually blinking */
 	gint64 cursor_blink_time;         /* how long the cursor has been blinking yet */
 	gboolean cursor_visible;
+	glong cursor_painted_row;	/* visible row it was last drawn on,
+					   or -1 */
 
 	/* Input device options. */
 	time_t last_keypress_time;
@@ -343,11 +427,15 @@ struct _VteTerminalPrivate {
 	/* State variables for handling match checks. */
 	char *match_contents;
 	GArray *match_attributes;
+	GPtrArray *match_lines;		/* matches per logical line */
+	VteSearchLiterals *match_literals;	/* what each expression needs */
+	glong match_lines_delta;	/* scroll_delta they were found at */
+	gboolean match_lines_checked;	/* against the current contents */
         VteRegexMode match_regex_mode;
 	GArray *match_regexes;
 	char *match;
 	int match_tag;
-	struct {
+	struct vte_match_coords {
 		long row, column;
 	} match_start, match_end;
 	gboolean show_match;
@@ -362,6 +450,9 @@ struct _VteTerminalPrivate {
 	 * and data, which should be dropped when unrealizing and (re)created
 	 * when realizing. */
 	struct _vte_draw *draw;
+	/* Paints into memory for vte_terminal_render_pixbuf(); it survives
+	 * unrealizing, since it uses no server resources. */
+	struct _vte_draw *offscreen_draw;
 
 	gboolean palette_initialized;
 	gboolean highlight_color_set;
@@ -425,6 +516,8 @@ struct _VteTerminalPrivate {
 VteRowData *_vte_terminal_ensure_row(VteTerminal *terminal);
 void _vte_terminal_set_pointer_visible(VteTerminal *terminal, gboolean visible);
 void _vte_invalidate_all(VteTerminal *terminal);
+void _vte_terminal_render(VteTerminal *terminal,
+			  struct _vte_rgb_buffer *buffer);
 void _vte_invalidate_cells(VteTerminal *terminal,
 			   glong column_start, gint column_count,
 			   glong row_start, gint row_count);
@@ -433,6 +526,7 @@ void _vte_invalidate_cursor_once(VteTerminal *terminal, gboolean periodic);
 VteRowData * _vte_new_row_data(VteTerminal *terminal);
 VteRowData * _vte_new_row_data_sized(VteTerminal *terminal, gboolean fill);
 VteRowData * _vte_reset_row_data (VteTerminal *terminal, VteRowData *row, gboolean fill);
+void _vte_terminal_rotate_line(VteTerminal *terminal, glong from, glong to);
 void _vte_free_row_data(VteRowData *row);
 void _vte_terminal_adjust_adjustments(VteTerminal *terminal);
 void _vte_terminal_queue_contents_changed(VteTerminal *terminal);
@@ -81,9 +81,12 @@ static void vte_terminal_match_hilite_hide(VteTerminal *terminal);
 static void vte_terminal_match_hilite_show(VteTerminal *terminal, long x, long y);
 static void vte_terminal_match_hilite_update(VteTerminal *terminal, long x, long y);
 static void vte_terminal_match_contents_clear(VteTerminal *terminal);
+static void vte_terminal_match_lines_clear(VteTerminal *terminal);
+static void vte_terminal_match_literals_build(VteTerminal *terminal);
 static gboolean vte_terminal_background_update(VteTerminal *data);
 static void vte_terminal_queue_background_update(VteTerminal *terminal);
 static void vte_terminal_process_incoming(VteTerminal *terminal);
+static inline gboolean need_processing(VteTerminal *terminal);
 static void vte_terminal_emit_pending_signals(VteTerminal *terminal);
 static gboolean vte_cell_is_selected(VteTerminal *terminal,
 				     glong col, glong row, gpointer data);
@@ -126,6 +129,9 @@ static void vte_terminal_set_selection_block_mode (VteTerminal *terminal,
 
 static gboolean process_timeout (gpointer data);
 static gboolean update_timeout (gpointer data);
+static void vte_terminal_search_index_update(VteTerminal *terminal);
+static void vte_terminal_search_index_invalidate(VteTerminal *terminal,
+						 glong row);
 
 enum {
     COPY_CLIPBOARD,
@@ -283,14 +289,126 @@ G_DEFINE_TYPE(VteTerminal, vte_terminal, GTK_TYPE_WIDGET)
  * Only the first %VTE_LEGACY_COLOR_SET_SIZE colors have dim versions.  */
 static const guchar corresponding_dim_index[] = {16,88,28,100,18,90,30,102};
 
-/* Free a no-longer-used row data array. */
+/* Drop a reference to a row data array, freeing it once it's unused. */
 void
 _vte_free_row_data(VteRowData *row)
 {
+	if (!g_atomic_int_dec_and_test(&row->ref_count)) {
+		return;
+	}
 	g_array_free(row->cells, TRUE);
 	g_slice_free(VteRowData, row);
 }
 
+static void
+vte_put_varint(GByteArray *out, guint32 v)
+{
+	guint8 buf[5];
+	guint n = 0;
+	while (v >= 0x80) {
+		buf[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	buf[n++] = v;
+	g_byte_array_append(out, buf, n);
+}
+
+static guint32
+vte_get_varint(const guchar **in, const guchar *end)
+{
+	guint32 v = 0;
+	guint shift = 0;
+	while (*in < end && shift < 32) {
+		guchar b = *(*in)++;
+		v |= (guint32) (b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			break;
+		}
+		shift += 7;
+	}
+	return v;
+}
+
+/* Serialize a row for the compressed part of the scrollback: the soft wrap
+ * flag and cell count, then runs of cells which share their attributes, each
+ * stored once, with the characters as varints.  Plain text costs about a
+ * byte per cell before compression. */
+static void
+_vte_freeze_row_data(gpointer item, GByteArray *out, gpointer data)
+{
+	VteRowData *row = item;
+	struct vte_charcell *cells;
+	guint8 flags;
+	guint i, j, run, len;
+
+	flags = row->soft_wrapped;
+	g_byte_array_append(out, &flags, 1);
+	len = row->cells->len;
+	vte_put_varint(out, len);
+	cells = (struct vte_charcell *) row->cells->data;
+	for (i = 0; i < len; i += run) {
+		for (run = 1; i + run < len; run++) {
+			if (memcmp(&cells[i + run].attr, &cells[i].attr,
+				   sizeof(cells[i].attr)) != 0) {
+				break;
+			}
+		}
+		vte_put_varint(out, run);
+		g_byte_array_append(out, (const guint8 *) &cells[i].attr,
+				    sizeof(cells[i].attr));
+		for (j = i; j < i + run; j++) {
+			vte_put_varint(out, cells[j].c);
+		}
+	}
+}
+
+static gpointer
+_vte_thaw_row_data(const guchar **in, const guchar *end, gpointer data)
+{
+	VteRowData *row;
+	struct vte_charcell cell;
+	guint i, run, len;
+
+	row = g_slice_new(VteRowData);
+	row->soft_wrapped = 0;
+	row->ref_count = 1;
+	if (*in < end) {
+		row->soft_wrapped = *(*in)++ & 1;
+	}
+	len = vte_get_varint(in, end);
+	row->cells = g_array_sized_new(FALSE, TRUE,
+				       sizeof(struct vte_charcell), len);
+	while (row->cells->len < len) {
+		run = vte_get_varint(in, end);
+		if (run == 0 || end - *in < (gssize) sizeof(cell.attr)) {
+			break;
+		}
+		memcpy(&cell.attr, *in, sizeof(cell.attr));
+		*in += sizeof(cell.attr);
+		for (i = 0; i < run; i++) {
+			cell.c = vte_get_varint(in, end);
+			g_array_append_val(row->cells, cell);
+		}
+	}
+	return row;
+}
+
+/* Create a row ring which keeps its cold history compressed, with its first
+ * row at @delta.  VTE_RING_UNLIMITED lines asks for unlimited history,
+ * spilled to disk. */
+static VteRing *
+vte_row_ring_new(glong lines, glong delta)
+{
+	VteRing *ring;
+	ring = _vte_ring_new_with_delta(lines, delta,
+					(GFunc) _vte_free_row_data, NULL);
+	_vte_ring_set_freezer(ring, _vte_freeze_row_data, _vte_thaw_row_data);
+	if (lines == VTE_RING_UNLIMITED) {
+		_vte_ring_set_spill(ring, TRUE);
+	}
+	return ring;
+}
+
 /* Append a single item to a GArray a given number of times. Centralizing all
  * of the places we do this may let me do something more clever later. */
 static void
@@ -314,6 +432,7 @@ _vte_new_row_data(VteTerminal *terminal)
 	row = g_slice_new(VteRowData);
 	row->cells = g_array_new(FALSE, TRUE, sizeof(struct vte_charcell));
 	row->soft_wrapped = 0;
+	row->ref_count = 1;
 	return row;
 }
 
@@ -327,6 +446,7 @@ _vte_new_row_data_sized(VteTerminal *terminal, gboolean fill)
 				       sizeof(struct vte_charcell),
 				       terminal->column_count);
 	row->soft_wrapped = 0;
+	row->ref_count = 1;
 	if (fill) {
 		vte_g_array_fill(row->cells,
 				 &terminal->pvt->screen->fill_defaults,
@@ -338,6 +458,11 @@ _vte_new_row_data_sized(VteTerminal *terminal, gboolean fill)
 VteRowData *
 _vte_reset_row_data (VteTerminal *terminal, VteRowData *row, gboolean fill)
 {
+	if (g_atomic_int_get (&row->ref_count) > 1) {
+		/* A snapshot still has it; leave it be. */
+		_vte_free_row_data (row);
+		return _vte_new_row_data_sized (terminal, fill);
+	}
 	g_array_set_size (row->cells, 0);
 	row->soft_wrapped = 0;
 	if (fill) {
@@ -348,6 +473,21 @@ _vte_reset_row_data (VteTerminal *terminal, VteRowData *row, gboolean fill)
 	return row;
 }
 
+/* Make a private copy of a row. */
+static VteRowData *
+vte_row_data_copy(const VteRowData *row)
+{
+	VteRowData *copy;
+	copy = g_slice_new(VteRowData);
+	copy->cells = g_array_sized_new(FALSE, TRUE,
+					sizeof(struct vte_charcell),
+					row->cells->len);
+	g_array_append_vals(copy->cells, row->cells->data, row->cells->len);
+	copy->soft_wrapped = row->soft_wrapped;
+	copy->ref_count = 1;
+	return copy;
+}
+
 /* Insert a blank line at an arbitrary position. */
 static void
 vte_insert_line_internal(VteTerminal *terminal, glong position)
@@ -393,6 +533,33 @@ vte_remove_line_internal(VteTerminal *terminal, glong position)
 	}
 }
 
+/**
+ * _vte_terminal_rotate_line:
+ * @terminal: a #VteTerminal
+ * @from: the row which scrolls out
+ * @to: the row where a blank line scrolls in
+ *
+ * Scrolls the rows between @from and @to by one towards @from, which is the
+ * same as removing the line at @from and inserting a blank one at @to.  When
+ * all of the rows exist, only those in between are moved, and the line which
+ * scrolls out is cleared and reused.
+ */
+void
+_vte_terminal_rotate_line(VteTerminal *terminal, glong from, glong to)
+{
+	VteRing *ring = terminal->pvt->screen->row_data;
+	VteRowData *row;
+
+	if (_vte_ring_contains(ring, from) && _vte_ring_contains(ring, to)) {
+		/* A row a snapshot shares is swapped for a fresh one. */
+		row = _vte_ring_rotate(ring, from, to);
+		_vte_ring_replace(ring, to,
+				  _vte_reset_row_data(terminal, row, TRUE));
+	} else {
+		vte_remove_line_internal(terminal, from);
+		vte_insert_line_internal(terminal, to);
+	}
+}
 
 /* Reset defaults for character insertion. */
 void
@@ -423,6 +590,73 @@ _vte_terminal_set_default_attributes(VteTerminal *terminal)
 	screen->fill_defaults = screen->defaults;
 }
 
+/* Convert a block of visible cells to the pixels which need repainting.
+ * Always include the extra pixel border and overlap pixel. */
+static void
+vte_terminal_cells_to_rect(VteTerminal *terminal,
+			   glong column_start, glong column_count,
+			   glong row_start, glong row_count,
+			   GdkRectangle *rect)
+{
+	rect->x = column_start * terminal->char_width - 1;
+	if (column_start != 0) {
+		rect->x += VTE_PAD_WIDTH;
+	}
+	rect->width = (column_start + column_count) * terminal->char_width + 3 + VTE_PAD_WIDTH;
+	if (column_start + column_count == terminal->column_count) {
+		rect->width += VTE_PAD_WIDTH;
+	}
+	rect->width -= rect->x;
+
+	rect->y = row_start * terminal->char_height - 1;
+	if (row_start != 0) {
+		rect->y += VTE_PAD_WIDTH;
+	}
+	rect->height = (row_start + row_count) * terminal->char_height + 2 + VTE_PAD_WIDTH;
+	if (row_start + row_count == terminal->row_count) {
+		rect->height += VTE_PAD_WIDTH;
+	}
+	rect->height -= rect->y;
+}
+
+/* Make sure there's a damage span for every visible row. */
+static void
+vte_terminal_damage_ensure_rows(VteTerminal *terminal)
+{
+	struct _vte_damage *damage = &terminal->pvt->damage;
+	glong i;
+
+	if (damage->n_rows >= terminal->row_count) {
+		return;
+	}
+	damage->rows = g_renew(struct vte_damage_span, damage->rows,
+			       terminal->row_count);
+	for (i = damage->n_rows; i < terminal->row_count; i++) {
+		damage->rows[i].start = damage->rows[i].end = 0;
+	}
+	damage->n_rows = terminal->row_count;
+}
+
+/* Note that the text of rows [start, end) may have changed, for the benefit
+ * of the accessibility peer, which patches its copy of the view instead of
+ * re-reading all of it.  This happens whether or not we're drawable. */
+static inline void
+vte_terminal_note_text_damage(VteTerminal *terminal, glong start, glong end)
+{
+	VteTerminalPrivate *pvt = terminal->pvt;
+
+	if (pvt->text_damage_all || start >= end) {
+		return;
+	}
+	if (pvt->text_damage_start >= pvt->text_damage_end) {
+		pvt->text_damage_start = start;
+		pvt->text_damage_end = end;
+	} else {
+		pvt->text_damage_start = MIN(pvt->text_damage_start, start);
+		pvt->text_damage_end = MAX(pvt->text_damage_end, end);
+	}
+}
+
 /* Cause certain cells to be repainted. */
 void
 _vte_invalidate_cells(VteTerminal *terminal,
@@ -430,12 +664,16 @@ _vte_invalidate_cells(VteTerminal *terminal,
 		      glong row_start, gint row_count)
 {
 	GdkRectangle rect;
+	struct vte_damage_span *span;
 	glong i;
 
 	if (!column_count || !row_count) {
 		return;
 	}
 
+	vte_terminal_note_text_damage(terminal,
+				      row_start, row_start + row_count);
+
 	if (G_UNLIKELY (!GTK_WIDGET_DRAWABLE(terminal) ||
 				terminal->pvt->invalidated_all)) {
 		return;
@@ -462,7 +700,7 @@ _vte_invalidate_cells(VteTerminal *terminal,
 	/* Clamp the start values to reasonable numbers. */
 	i = row_start + row_count;
 	row_start = MAX (0, row_start);
-	row_count = CLAMP (i - row_start, 0, terminal->row_count);
+	row_count = CLAMP (i - row_start, 0, terminal->row_count - row_start);
 
 	i = column_start + column_count;
 	column_start = MAX (0, column_start);
@@ -471,48 +709,43 @@ _vte_invalidate_cells(VteTerminal *terminal,
 	if (!column_count || !row_count) {
 		return;
 	}
+	/* While active, keep even a whole screen as spans so that it can be
+	 * narrowed against the front buffer. */
 	if (column_count == terminal->column_count &&
-			row_count == terminal->row_count) {
+			row_count == terminal->row_count &&
+			terminal->pvt->active == NULL) {
 		_vte_invalidate_all (terminal);
 		return;
 	}
 
-	/* Convert the column and row start and end to pixel values
-	 * by multiplying by the size of a character cell.
-	 * Always include the extra pixel border and overlap pixel.
-	 */
-	rect.x = column_start * terminal->char_width - 1;
-	if (column_start != 0) {
-		rect.x += VTE_PAD_WIDTH;
-	}
-	rect.width = (column_start + column_count) * terminal->char_width + 3 + VTE_PAD_WIDTH;
-	if (column_start + column_count == terminal->column_count) {
-		rect.width += VTE_PAD_WIDTH;
-	}
-	rect.width -= rect.x;
-
-	rect.y = row_start * terminal->char_height - 1;
-	if (row_start != 0) {
-		rect.y += VTE_PAD_WIDTH;
-	}
-	rect.height = (row_start + row_count) * terminal->char_height + 2 + VTE_PAD_WIDTH;
-	if (row_start + row_count == terminal->row_count) {
-		rect.height += VTE_PAD_WIDTH;
-	}
-	rect.height -= rect.y;
-
-	_vte_debug_print (VTE_DEBUG_UPDATES,
-			"Invalidating pixels at (%d,%d)x(%d,%d).\n",
-			rect.x, rect.y, rect.width, rect.height);
-
 	if (terminal->pvt->active != NULL) {
-		terminal->pvt->update_regions = g_slist_prepend (
-				terminal->pvt->update_regions,
-				gdk_region_rectangle (&rect));
+		/* Just widen the dirty span of each row; the pixels are
+		 * worked out once per update. */
+		vte_terminal_damage_ensure_rows(terminal);
+		span = terminal->pvt->damage.rows + row_start;
+		for (i = 0; i < row_count; i++, span++) {
+			if (span->start >= span->end) {
+				span->start = column_start;
+				span->end = column_start + column_count;
+			} else {
+				span->start = MIN(span->start, column_start);
+				span->end = MAX(span->end,
+						column_start + column_count);
+			}
+		}
+		terminal->pvt->damage.pending = TRUE;
 		/* Wait a bit before doing any invalidation, just in
 		 * case updates are coming in really soon. */
 		add_update_timeout (terminal);
 	} else {
+		/* Convert the column and row start and end to pixel values
+		 * by multiplying by the size of a character cell. */
+		vte_terminal_cells_to_rect(terminal,
+					   column_start, column_count,
+					   row_start, row_count, &rect);
+		_vte_debug_print (VTE_DEBUG_UPDATES,
+				"Invalidating pixels at (%d,%d)x(%d,%d).\n",
+				rect.x, rect.y, rect.width, rect.height);
 		gdk_window_invalidate_rect (terminal->widget.window,
 				&rect, FALSE);
 	}
@@ -553,6 +786,8 @@ _vte_invalidate_all(VteTerminal *terminal)
 
 	g_assert(VTE_IS_TERMINAL(terminal));
 
+	terminal->pvt->text_damage_all = TRUE;
+
 	if (!GTK_WIDGET_DRAWABLE(terminal)) {
 		return;
 	}
@@ -563,7 +798,7 @@ _vte_invalidate_all(VteTerminal *terminal)
 	_vte_debug_print (VTE_DEBUG_WORK, "*");
 	_vte_debug_print (VTE_DEBUG_UPDATES, "Invalidating all.\n");
 
-	/* replace invalid regions with one covering the whole terminal */
+	/* replace any damage with the whole terminal */
 	reset_update_regions (terminal);
 	rect.x = rect.y = 0;
 	rect.width = terminal->widget.allocation.width;
@@ -571,8 +806,7 @@ _vte_invalidate_all(VteTerminal *terminal)
 	terminal->pvt->invalidated_all = TRUE;
 
 	if (terminal->pvt->active != NULL) {
-		terminal->pvt->update_regions = g_slist_prepend (NULL,
-				gdk_region_rectangle (&rect));
+		terminal->pvt->damage.pending = TRUE;
 		/* Wait a bit before doing any invalidation, just in
 		 * case updates are coming in really soon. */
 		add_update_timeout (terminal);
@@ -583,6 +817,150 @@ _vte_invalidate_all(VteTerminal *terminal)
 }
 
 
+/* Move the front buffer along with blitted pixels; the rows uncovered are
+ * unknown until they're painted. */
+static void
+vte_terminal_front_scroll(VteTerminal *terminal, glong delta)
+{
+	struct _vte_front *front = &terminal->pvt->front;
+	glong rows, stride;
+
+	if (front->cells == NULL) {
+		return;
+	}
+	rows = front->rows;
+	stride = front->columns;
+	if (ABS (delta) >= rows) {
+		memset(front->cells, 0xff,
+		       rows * stride * sizeof(*front->cells));
+	} else if (delta > 0) {
+		memmove(front->cells + delta * stride, front->cells,
+			(rows - delta) * stride * sizeof(*front->cells));
+		memset(front->cells, 0xff,
+		       delta * stride * sizeof(*front->cells));
+	} else if (delta < 0) {
+		memmove(front->cells, front->cells - delta * stride,
+			(rows + delta) * stride * sizeof(*front->cells));
+		memset(front->cells + (rows + delta) * stride, 0xff,
+		       -delta * stride * sizeof(*front->cells));
+	}
+}
+
+/* Copy the pixels of the visible rows @delta rows down (up if negative)
+ * instead of repainting them.  The window invalidates the strip which is
+ * uncovered; we add the edge rows, whose overdraw into the border isn't
+ * moved, and the rows holding the old and the new cursor.  Returns FALSE
+ * if the background doesn't move along with the text. */
+static gboolean
+vte_terminal_blit_rows(VteTerminal *terminal, glong delta)
+{
+	GdkRectangle rect;
+	GdkRegion *region;
+	glong row;
+
+	if (terminal->pvt->scroll_background ||
+	    terminal->pvt->bg_transparent ||
+	    terminal->pvt->bg_pixbuf != NULL ||
+	    terminal->pvt->bg_file != NULL ||
+	    _vte_draw_requires_clear (terminal->pvt->draw) ||
+	    terminal->pvt->visibility_state != GDK_VISIBILITY_UNOBSCURED ||
+	    ABS (delta) >= terminal->row_count) {
+		return FALSE;
+	}
+
+	_vte_debug_print (VTE_DEBUG_UPDATES, "Blitting view by %ld.\n", delta);
+
+	vte_terminal_front_scroll(terminal, delta);
+
+	rect.x = 0;
+	rect.y = VTE_PAD_WIDTH;
+	rect.width = terminal->widget.allocation.width;
+	rect.height = terminal->row_count * terminal->char_height;
+	region = gdk_region_rectangle (&rect);
+	gdk_window_move_region (terminal->widget.window, region,
+				0, delta * terminal->char_height);
+	gdk_region_destroy (region);
+
+	vte_terminal_cells_to_rect (terminal, 0, terminal->column_count,
+				    0, 1, &rect);
+	gdk_window_invalidate_rect (terminal->widget.window, &rect, FALSE);
+	vte_terminal_cells_to_rect (terminal, 0, terminal->column_count,
+				    terminal->row_count - 1, 1, &rect);
+	gdk_window_invalidate_rect (terminal->widget.window, &rect, FALSE);
+
+	row = terminal->pvt->cursor_painted_row;
+	if (row >= 0) {
+		row += delta;
+		if (row >= 0 && row < terminal->row_count) {
+			vte_terminal_cells_to_rect (terminal,
+					0, terminal->column_count,
+					row, 1, &rect);
+			gdk_window_invalidate_rect (terminal->widget.window,
+					&rect, FALSE);
+		}
+	}
+	row = terminal->pvt->screen->cursor_current.row -
+		terminal->pvt->screen->scroll_delta;
+	if (row >= 0 && row < terminal->row_count) {
+		vte_terminal_cells_to_rect (terminal, 0, terminal->column_count,
+					    row, 1, &rect);
+		gdk_window_invalidate_rect (terminal->widget.window,
+					    &rect, FALSE);
+	}
+	return TRUE;
+}
+
+/* Record that the contents of the whole view moved down by @delta rows
+ * (up if negative).  Pending damage moves along with the contents, and the
+ * rows which scroll into view are dirty. */
+static void
+vte_terminal_damage_scroll(VteTerminal *terminal, glong delta)
+{
+	struct _vte_damage *damage = &terminal->pvt->damage;
+	glong i, rows;
+
+	/* Every row of the view holds different text now. */
+	terminal->pvt->text_damage_all = TRUE;
+
+	if (G_UNLIKELY (!GTK_WIDGET_DRAWABLE(terminal) ||
+				terminal->pvt->invalidated_all)) {
+		return;
+	}
+	rows = terminal->row_count;
+	if (ABS (delta) >= rows) {
+		_vte_invalidate_all(terminal);
+		return;
+	}
+	if (terminal->pvt->active == NULL) {
+		/* Nothing is pending, so what's on screen is current and can
+		 * be moved right away. */
+		if (!vte_terminal_blit_rows(terminal, delta)) {
+			_vte_invalidate_all(terminal);
+		}
+		return;
+	}
+
+	_vte_debug_print (VTE_DEBUG_UPDATES, "Scrolling view by %ld.\n", delta);
+
+	vte_terminal_damage_ensure_rows(terminal);
+	if (delta > 0) {
+		memmove(damage->rows + delta, damage->rows,
+			(rows - delta) * sizeof(*damage->rows));
+		i = 0;
+	} else {
+		memmove(damage->rows, damage->rows - delta,
+			(rows + delta) * sizeof(*damage->rows));
+		i = rows + delta;
+	}
+	for (rows = i + ABS (delta); i < rows; i++) {
+		damage->rows[i].start = 0;
+		damage->rows[i].end = terminal->column_count;
+	}
+	damage->scrolled += delta;
+	damage->pending = TRUE;
+	add_update_timeout (terminal);
+}
+
 /* Scroll a rectangular region up or down by a fixed number of lines,
  * negative = up, positive = down. */
 void
@@ -594,9 +972,12 @@ _vte_terminal_scroll_region (VteTerminal *terminal,
 		return;
 	}
 
-	if (terminal->pvt->scroll_background || count >= terminal->row_count) {
+	if (terminal->pvt->scroll_background) {
 		/* We have to repaint the entire window. */
 		_vte_invalidate_all(terminal);
+	} else if (count >= terminal->row_count) {
+		/* The whole view moves. */
+		vte_terminal_damage_scroll(terminal, delta);
 	} else {
 		/* We have to repaint the area which is to be
 		 * scrolled. */
@@ -1144,6 +1525,7 @@ vte_terminal_match_contents_clear(VteTerminal *terminal)
 		g_array_free(terminal->pvt->match_attributes, TRUE);
 		terminal->pvt->match_attributes = NULL;
 	}
+	terminal->pvt->match_lines_checked = FALSE;
 	vte_terminal_match_hilite_clear(terminal);
 }
 
@@ -1200,6 +1582,8 @@ regex_match_clear (struct vte_match_regex *regex)
         } else if (regex->mode == VTE_REGEX_VTE) {
                 _vte_regex_free(regex->regex.reg);
                 regex->regex.reg = NULL;
+                g_free(regex->pattern);
+                regex->pattern = NULL;
         }
 
         regex->tag = -1;
@@ -1258,6 +1642,7 @@ vte_terminal_match_clear_all(VteTerminal *terminal)
 		}
 	}
 	g_array_set_size(terminal->pvt->match_regexes, 0);
+	vte_terminal_match_lines_clear(terminal);
 	vte_terminal_match_hilite_clear(terminal);
 }
 
@@ -1288,6 +1673,7 @@ vte_terminal_match_remove(VteTerminal *terminal, int tag)
 		/* Remove this item and leave a hole in its place. */
                 regex_match_clear (regex);
 	}
+	vte_terminal_match_lines_clear(terminal);
 	vte_terminal_match_hilite_clear(terminal);
 }
 
@@ -1335,6 +1721,7 @@ vte_terminal_match_add(VteTerminal *terminal, const char *match)
 			  match);
 		return -1;
 	}
+	new_regex.pattern = g_strdup(match);
 
 	/* Search for a hole. */
 	for (ret = 0; ret < terminal->pvt->match_regexes->len; ret++) {
@@ -1358,6 +1745,7 @@ vte_terminal_match_add(VteTerminal *terminal, const char *match)
 		/* Append. */
 		g_array_append_val(terminal->pvt->match_regexes, new_regex);
 	}
+	vte_terminal_match_lines_clear(terminal);
 	return new_regex.tag;
 }
 
@@ -1416,6 +1804,7 @@ vte_terminal_match_add_gregex(VteTerminal *terminal, GRegex *regex, GRegexMatchF
 		/* Append. */
 		g_array_append_val(pvt->match_regexes, new_regex_match);
 	}
+	vte_terminal_match_lines_clear(terminal);
 
 	return new_regex_match.tag;
 }
@@ -1522,6 +1911,7 @@ vte_terminal_match_check_internal_vte(VteTerminal *terminal,
 	struct _VteCharAttributes *attr = NULL;
 	gssize sattr, eattr;
 	gchar *line, eol;
+	gboolean *found;
 
 	_vte_debug_print(VTE_DEBUG_EVENTS,
 			"Checking for match at (%ld,%ld).\n", row, column);
@@ -1623,13 +2013,21 @@ vte_terminal_match_check_internal_vte(VteTerminal *terminal,
 	start_blank = 0;
 	end_blank = eattr;
 
+	/* Scan the line once for every expression's literal. */
+	if (terminal->pvt->match_literals == NULL) {
+		vte_terminal_match_literals_build(terminal);
+	}
+	found = g_new0(gboolean, terminal->pvt->match_regexes->len);
+	_vte_search_literals_scan(terminal->pvt->match_literals,
+				  line, eattr, found);
+
 	/* Now iterate over each regex we need to match against. */
 	for (i = 0; i < terminal->pvt->match_regexes->len; i++) {
 		regex = &g_array_index(terminal->pvt->match_regexes,
 				       struct vte_match_regex,
 				       i);
-		/* Skip holes. */
-		if (regex->tag < 0) {
+		/* Skip holes, and expressions whose literal isn't here. */
+		if (regex->tag < 0 || (regex->prefiltered && !found[i])) {
 			continue;
 		}
 		/* We'll only match the first item in the buffer which
@@ -1691,6 +2089,7 @@ vte_terminal_match_check_internal_vte(VteTerminal *terminal,
 					result = g_strndup(line + k + matches[j].rm_so,
 							 matches[j].rm_eo - matches[j].rm_so);
 					line[eattr] = eol;
+					g_free(found);
 					return result;
 				}
 				if (ko > matches[j].rm_eo &&
@@ -1720,6 +2119,7 @@ vte_terminal_match_check_internal_vte(VteTerminal *terminal,
 					      matches);
 		}
 	}
+	g_free(found);
 	line[eattr] = eol;
 	if (start != NULL) {
 		*start = sattr + start_blank;
@@ -1730,223 +2130,458 @@ vte_terminal_match_check_internal_vte(VteTerminal *terminal,
 	return NULL;
 }
 
-/* Check if a given cell on the screen contains part of a matched string.  If
- * it does, return the string, and store the match tag in the optional tag
- * argument. */
-static char *
-vte_terminal_match_check_internal_gregex(VteTerminal *terminal,
-                                         long column, glong row,
-                                         int *tag, int *start, int *end)
+/* With GRegex expressions, matches are worked out a logical line at a time and
+ * kept until the line's text changes, so that moving the pointer around only
+ * costs a lookup. */
+struct vte_match_segment {
+	gint start, end;	/* bytes of the line covered */
+	gint so, eo;		/* the match which owns them */
+	guint regex;		/* index into match_regexes */
+};
+
+struct vte_match_line {
+	glong row, next_row;	/* rows the line covers */
+	gchar *text;
+	gsize length;
+	GArray *cells;		/* the cell each byte came from, plus one for
+				   the position just past the end */
+	GArray *segments;	/* sorted and disjoint */
+};
+
+static void
+vte_match_line_free(struct vte_match_line *line)
 {
-	gint start_blank, end_blank;
-        guint i;
-	int offset;
-	struct vte_match_regex *regex = NULL;
-	struct _VteCharAttributes *attr = NULL;
-	gssize sattr, eattr;
-	gchar *line, eol;
-        GMatchInfo *match_info;
+	g_free(line->text);
+	g_array_free(line->cells, TRUE);
+	g_array_free(line->segments, TRUE);
+	g_slice_free(struct vte_match_line, line);
+}
 
-	_vte_debug_print(VTE_DEBUG_EVENTS,
-			"Checking for match at (%ld,%ld).\n", row, column);
-	*tag = -1;
-	if (start != NULL) {
-		*start = 0;
+/* Forget the matches found so far, because the expressions have changed. */
+static void
+vte_terminal_match_lines_clear(VteTerminal *terminal)
+{
+	guint i;
+
+	if (terminal->pvt->match_lines != NULL) {
+		for (i = 0; i < terminal->pvt->match_lines->len; i++) {
+			vte_match_line_free(g_ptr_array_index(terminal->pvt->match_lines,
+							      i));
+		}
+		g_ptr_array_free(terminal->pvt->match_lines, TRUE);
+		terminal->pvt->match_lines = NULL;
 	}
-	if (end != NULL) {
-		*end = 0;
+	if (terminal->pvt->match_literals != NULL) {
+		_vte_search_literals_free(terminal->pvt->match_literals);
+		terminal->pvt->match_literals = NULL;
 	}
-	/* Map the pointer position to a portion of the string. */
-	eattr = terminal->pvt->match_attributes->len;
-	for (offset = eattr; offset--; ) {
-		attr = &g_array_index(terminal->pvt->match_attributes,
-				      struct _VteCharAttributes,
-				      offset);
-		if (row < attr->row) {
-			eattr = offset;
+	terminal->pvt->match_lines_checked = FALSE;
+}
+
+/* Collect the literal text each expression needs, so that a line can be
+ * checked for all of them in one pass before any expression is run. */
+static void
+vte_terminal_match_literals_build(VteTerminal *terminal)
+{
+	struct vte_match_regex *regex;
+	gunichar *literal;
+	gsize length;
+	guint i;
+
+	/* The extractor reads PCRE syntax, but for POSIX extended
+	 * expressions it only ever errs towards a shorter literal, and the
+	 * scan ignores case either way. */
+	terminal->pvt->match_literals = _vte_search_literals_new();
+	for (i = 0; i < terminal->pvt->match_regexes->len; i++) {
+		regex = &g_array_index(terminal->pvt->match_regexes,
+				       struct vte_match_regex,
+				       i);
+		if (regex->tag < 0) {
+			continue;
 		}
-		if (row == attr->row &&
-		    column == attr->column &&
-		    terminal->pvt->match_contents[offset] != ' ') {
-			break;
+		if (regex->mode == VTE_REGEX_GREGEX) {
+			literal = _vte_search_required_literal(
+				g_regex_get_pattern(regex->regex.gregex.regex),
+				g_regex_get_compile_flags(regex->regex.gregex.regex),
+				&length);
+		} else {
+			literal = _vte_search_required_literal(regex->pattern,
+							       0, &length);
+		}
+		regex->prefiltered = literal != NULL;
+		if (literal != NULL) {
+			_vte_search_literals_add(terminal->pvt->match_literals,
+						 literal, length, i);
+			g_free(literal);
 		}
 	}
+}
 
-	_VTE_DEBUG_IF(VTE_DEBUG_EVENTS) {
-		if (offset < 0)
-			g_printerr("Cursor is not on a character.\n");
-		else
-			g_printerr("Cursor is on character '%c' at %d.\n",
-					g_utf8_get_char (terminal->pvt->match_contents + offset),
-					offset);
+/* Read the logical line which starts at @row, giving up on it at @limit,
+ * noting which cell each byte of its text comes from.  Returns the row
+ * after the line. */
+static glong
+vte_terminal_match_line_text(VteTerminal *terminal, glong row, glong limit,
+			     GString *text, GArray *cells)
+{
+	VteRowData *row_data;
+	struct vte_charcell *cell;
+	struct vte_match_coords coords;
+	gchar utf8[8];
+	gint length, k;
+	gsize text_length, cells_length;
+
+	text_length = cells_length = 0;
+	do {
+		row_data = _vte_terminal_find_row_data(terminal, row);
+		coords.row = row++;
+		coords.column = 0;
+		if (row_data == NULL) {
+			break;
+		}
+		for (; coords.column < (long) row_data->cells->len;
+		     coords.column++) {
+			cell = &g_array_index(row_data->cells,
+					      struct vte_charcell,
+					      coords.column);
+			if (cell->attr.fragment) {
+				continue;
+			}
+			length = g_unichar_to_utf8(cell->c ? cell->c : ' ',
+						   utf8);
+			g_string_append_len(text, utf8, length);
+			for (k = 0; k < length; k++) {
+				g_array_append_val(cells, coords);
+			}
+			if (cell->c != 0 && cell->c != ' ') {
+				text_length = text->len;
+				cells_length = cells->len;
+			}
+		}
+	} while (row_data->soft_wrapped && row < limit);
+
+	/* Trailing blanks don't count. */
+	g_string_truncate(text, text_length);
+	if (cells_length < cells->len) {
+		g_array_set_size(cells, cells_length + 1);
+	} else {
+		g_array_append_val(cells, coords);
 	}
+	return row;
+}
 
-	/* If the pointer isn't on a matchable character, bug out. */
-	if (offset < 0) {
-		return NULL;
+/* Run the expressions over a line, skipping those which need some literal
+ * text the line doesn't have.  Where matches overlap, each byte goes to the
+ * expression which was added first, as that's the one a check would find. */
+static struct vte_match_line *
+vte_terminal_match_line_new(VteTerminal *terminal, glong row, glong next_row,
+			    GString *text, GArray *cells)
+{
+	struct vte_match_line *line;
+	struct vte_match_regex *regex;
+	struct vte_match_segment segment, *owners;
+	GMatchInfo *match_info;
+	gboolean *found;
+	gint so, eo, b;
+	guint i;
+
+	line = g_slice_new(struct vte_match_line);
+	line->row = row;
+	line->next_row = next_row;
+	line->text = g_strndup(text->str, text->len);
+	line->length = text->len;
+	line->cells = g_array_sized_new(FALSE, FALSE,
+					sizeof(struct vte_match_coords),
+					cells->len);
+	g_array_append_vals(line->cells, cells->data, cells->len);
+	line->segments = g_array_new(FALSE, FALSE,
+				     sizeof(struct vte_match_segment));
+	if (line->length == 0) {
+		return line;
 	}
 
-	/* If the pointer is on a newline, bug out. */
-	if ((g_ascii_isspace(terminal->pvt->match_contents[offset])) ||
-	    (terminal->pvt->match_contents[offset] == '\0')) {
-		_vte_debug_print(VTE_DEBUG_EVENTS,
-				"Cursor is on whitespace.\n");
-		return NULL;
+	if (terminal->pvt->match_literals == NULL) {
+		vte_terminal_match_literals_build(terminal);
 	}
+	found = g_new0(gboolean, terminal->pvt->match_regexes->len);
+	_vte_search_literals_scan(terminal->pvt->match_literals,
+				  line->text, line->length, found);
 
-	/* Snip off any final newlines. */
-	while (terminal->pvt->match_contents[eattr] == '\n' ||
-			terminal->pvt->match_contents[eattr] == '\0') {
-		eattr--;
+	owners = g_new0(struct vte_match_segment, line->length);
+	for (b = 0; b < (gint) line->length; b++) {
+		owners[b].so = -1;
 	}
-	/* and scan forwards to find the end of this line */
-	while (!(terminal->pvt->match_contents[eattr] == '\n' ||
-			terminal->pvt->match_contents[eattr] == '\0')) {
-		eattr++;
+	for (i = 0; i < terminal->pvt->match_regexes->len; i++) {
+		regex = &g_array_index(terminal->pvt->match_regexes,
+				       struct vte_match_regex,
+				       i);
+		/* Skip holes, and expressions whose literal isn't here. */
+		if (regex->tag < 0 || (regex->prefiltered && !found[i])) {
+			continue;
+		}
+		g_regex_match_full(regex->regex.gregex.regex,
+				   line->text, line->length, 0,
+				   regex->regex.gregex.flags,
+				   &match_info, NULL);
+		while (g_match_info_matches(match_info)) {
+			if (g_match_info_fetch_pos(match_info, 0, &so, &eo)) {
+				for (b = so; b < eo; b++) {
+					if (owners[b].so == -1) {
+						owners[b].so = so;
+						owners[b].eo = eo;
+						owners[b].regex = i;
+					}
+				}
+			}
+			g_match_info_next(match_info, NULL);
+		}
+		g_match_info_free(match_info);
 	}
 
-	/* find the start of row */
-	if (row == 0) {
-		sattr = 0;
-	} else {
-		for (sattr = offset; sattr > 0; sattr--) {
-			attr = &g_array_index(terminal->pvt->match_attributes,
-					      struct _VteCharAttributes,
-					      sattr);
-			if (row > attr->row) {
-				break;
-			}
+	/* Collapse runs of bytes owned by the same match into segments. */
+	for (b = 0; b < (gint) line->length; b++) {
+		if (owners[b].so == -1) {
+			continue;
 		}
+		segment = owners[b];
+		segment.start = b;
+		while (b + 1 < (gint) line->length &&
+		       owners[b + 1].so == segment.so &&
+		       owners[b + 1].regex == segment.regex) {
+			b++;
+		}
+		segment.end = b + 1;
+		g_array_append_val(line->segments, segment);
 	}
-	/* Scan backwards to find the start of this line */
-	while (sattr > 0 &&
-		! (terminal->pvt->match_contents[sattr] == '\n' ||
-		    terminal->pvt->match_contents[sattr] == '\0')) {
-		sattr--;
+	g_free(owners);
+	g_free(found);
+
+	_vte_debug_print(VTE_DEBUG_MISC,
+			"Matched line at row %ld, %u segments.\n",
+			row, line->segments->len);
+	return line;
+}
+
+/* Bring the cached lines in line with what's on the screen, reusing those
+ * whose text hasn't changed. */
+static void
+vte_terminal_match_lines_refresh(VteTerminal *terminal)
+{
+	VteScreen *screen = terminal->pvt->screen;
+	VteRowData *row_data;
+	GPtrArray *old, *lines;
+	struct vte_match_line *line;
+	GString *text;
+	GArray *cells;
+	glong row, next, last, limit, first;
+	guint o;
+
+	old = terminal->pvt->match_lines;
+	lines = g_ptr_array_new();
+	text = g_string_new(NULL);
+	cells = g_array_new(FALSE, FALSE, sizeof(struct vte_match_coords));
+
+	/* Lines which run off either edge of the screen are followed for at
+	 * most another screenful. */
+	row = screen->scroll_delta;
+	last = MIN(row + terminal->row_count,
+		   _vte_ring_next(screen->row_data));
+	limit = last + terminal->row_count;
+	first = MAX(row - terminal->row_count,
+		    _vte_ring_delta(screen->row_data));
+	while (row > first) {
+		row_data = _vte_terminal_find_row_data(terminal, row - 1);
+		if (row_data == NULL || !row_data->soft_wrapped) {
+			break;
+		}
+		row--;
+	}
+
+	o = 0;
+	for (; row < last; row = next) {
+		g_string_truncate(text, 0);
+		g_array_set_size(cells, 0);
+		next = vte_terminal_match_line_text(terminal, row, limit,
+						    text, cells);
+		line = NULL;
+		while (old != NULL && o < old->len &&
+		       ((struct vte_match_line *)
+			g_ptr_array_index(old, o))->row < row) {
+			o++;
+		}
+		if (old != NULL && o < old->len) {
+			line = g_ptr_array_index(old, o);
+			if (line->row == row && line->next_row == next &&
+			    line->length == text->len &&
+			    memcmp(line->text, text->str, text->len) == 0) {
+				g_ptr_array_index(old, o++) = NULL;
+			} else {
+				line = NULL;
+			}
+		}
+		if (line == NULL) {
+			line = vte_terminal_match_line_new(terminal, row, next,
+							   text, cells);
+		}
+		g_ptr_array_add(lines, line);
 	}
-	/* and skip any initial newlines. */
-	while (terminal->pvt->match_contents[sattr] == '\n' ||
-		terminal->pvt->match_contents[sattr] == '\0') {
-		sattr++;
+
+	g_array_free(cells, TRUE);
+	g_string_free(text, TRUE);
+	if (old != NULL) {
+		for (o = 0; o < old->len; o++) {
+			if (g_ptr_array_index(old, o) != NULL) {
+				vte_match_line_free(g_ptr_array_index(old, o));
+			}
+		}
+		g_ptr_array_free(old, TRUE);
 	}
-	if (eattr <= sattr) { /* blank line */
-		return NULL;
+	terminal->pvt->match_lines = lines;
+	terminal->pvt->match_lines_delta = screen->scroll_delta;
+	terminal->pvt->match_lines_checked = TRUE;
+}
+
+static inline gint
+vte_match_coords_compare(const struct vte_match_coords *a,
+			 glong row, glong column)
+{
+	if (a->row != row) {
+		return a->row < row ? -1 : 1;
 	}
-	if (eattr <= offset || sattr > offset) {
-		/* nothing to match on this line */
-		return NULL;
+	if (a->column != column) {
+		return a->column < column ? -1 : 1;
 	}
-	offset -= sattr;
-	eattr -= sattr;
-
-	/* temporarily shorten the contents to this row */
-	line = terminal->pvt->match_contents + sattr;
-	eol = line[eattr];
-	line[eattr] = '\0';
+	return 0;
+}
 
-	start_blank = 0;
-	end_blank = eattr;
+/* Check if a given cell on the screen contains part of a matched string.  If
+ * it does, return the string, and store the match tag in the optional tag
+ * argument.  If it doesn't, the extent of the text around it which doesn't
+ * match anything is stored instead. */
+static char *
+vte_terminal_match_check_internal_gregex(VteTerminal *terminal,
+                                         long column, glong row,
+                                         int *tag,
+					 struct vte_match_coords *start,
+					 struct vte_match_coords *end)
+{
+	struct vte_match_line *line;
+	struct vte_match_segment *segment;
+	struct vte_match_regex *regex;
+	guint lo, hi, mid;
+	gint offset, blank_start, blank_end;
 
-	/* Now iterate over each regex we need to match against. */
-	for (i = 0; i < terminal->pvt->match_regexes->len; i++) {
-		regex = &g_array_index(terminal->pvt->match_regexes,
-				       struct vte_match_regex,
-				       i);
-		/* Skip holes. */
-		if (regex->tag < 0) {
-			continue;
+	_vte_debug_print(VTE_DEBUG_EVENTS,
+			"Checking for match at (%ld,%ld).\n", row, column);
+	*tag = -1;
+	if (!terminal->pvt->match_lines_checked ||
+	    terminal->pvt->match_lines_delta !=
+	    terminal->pvt->screen->scroll_delta) {
+		vte_terminal_match_lines_refresh(terminal);
+	}
+
+	/* Find the line... */
+	lo = 0;
+	hi = terminal->pvt->match_lines->len;
+	line = NULL;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		line = g_ptr_array_index(terminal->pvt->match_lines, mid);
+		if (row < line->row) {
+			hi = mid;
+		} else if (row >= line->next_row) {
+			lo = mid + 1;
+		} else {
+			break;
 		}
-		/* We'll only match the first item in the buffer which
-		 * matches, so we'll have to skip each match until we
-		 * stop getting matches. */
-                if (!g_regex_match_full(regex->regex.gregex.regex,
-                                        line, -1, 0,
-                                        regex->regex.gregex.flags,
-                                        &match_info,
-                                        NULL)) {
-                        g_match_info_free(match_info);
-                        continue;
-                }
-
-                while (g_match_info_matches(match_info)) {
-			gint ko = offset;
-			gint sblank=G_MININT, eblank=G_MAXINT;
-                        gint rm_so, rm_eo;
-
-                        if (g_match_info_fetch_pos (match_info, 0, &rm_so, &rm_eo)) {
-				/* The offsets should be "sane". */
-				g_assert(rm_so < eattr);
-				g_assert(rm_eo <= eattr);
-				_VTE_DEBUG_IF(VTE_DEBUG_MISC) {
-					gchar *match;
-					struct _VteCharAttributes *_sattr, *_eattr;
-					match = g_strndup(line + rm_so, rm_eo - rm_so);
-					_sattr = &g_array_index(terminal->pvt->match_attributes,
-							struct _VteCharAttributes,
-							rm_so);
-					_eattr = &g_array_index(terminal->pvt->match_attributes,
-							struct _VteCharAttributes,
-							rm_eo - 1);
-					g_printerr("Match `%s' from %d(%ld,%ld) to %d(%ld,%ld) (%d).\n",
-							match,
-							rm_so,
-							_sattr->column,
-							_sattr->row,
-							rm_eo - 1,
-							_eattr->column,
-							_eattr->row,
-							offset);
-					g_free(match);
+	}
+	if (lo >= hi || line->length == 0) {
+		return NULL;
+	}
 
-				}
-				/* If the pointer is in this substring,
-				 * then we're done. */
-				if (ko >= rm_so &&
-				    ko < rm_eo) {
-					gchar *result;
-					if (tag != NULL) {
-						*tag = regex->tag;
-					}
-					if (start != NULL) {
-						*start = sattr + rm_so;
-					}
-					if (end != NULL) {
-						*end = sattr + rm_eo - 1;
-					}
-                                        vte_terminal_set_cursor_from_regex_match(terminal, regex);
-                                        result = g_match_info_fetch(match_info, 0);
-					line[eattr] = eol;
+	/* ...then the character... */
+	lo = 0;
+	hi = line->length;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (vte_match_coords_compare(&g_array_index(line->cells,
+							    struct vte_match_coords,
+							    mid),
+					     row, column) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	offset = lo;
+	if (offset >= (gint) line->length ||
+	    vte_match_coords_compare(&g_array_index(line->cells,
+						    struct vte_match_coords,
+						    offset),
+				     row, column) != 0) {
+		_vte_debug_print(VTE_DEBUG_EVENTS,
+				"Cursor is not on a character.\n");
+		return NULL;
+	}
+	if (g_ascii_isspace(line->text[offset])) {
+		_vte_debug_print(VTE_DEBUG_EVENTS,
+				"Cursor is on whitespace.\n");
+		return NULL;
+	}
 
-                                        g_match_info_free(match_info);
-					return result;
-				}
-				if (ko > rm_eo &&
-						rm_eo > sblank) {
-					sblank = rm_eo;
-				}
-				if (ko < rm_so &&
-						rm_so < eblank) {
-					eblank = rm_so;
-				}
-			}
-			if (sblank > start_blank) {
-				start_blank = sblank;
+	/* ...and the segment holding it, if there is one. */
+	lo = 0;
+	hi = line->segments->len;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		segment = &g_array_index(line->segments,
+					 struct vte_match_segment, mid);
+		if (offset < segment->start) {
+			hi = mid;
+		} else if (offset >= segment->end) {
+			lo = mid + 1;
+		} else {
+			regex = &g_array_index(terminal->pvt->match_regexes,
+					       struct vte_match_regex,
+					       segment->regex);
+			*tag = regex->tag;
+			if (start != NULL) {
+				*start = g_array_index(line->cells,
+						       struct vte_match_coords,
+						       segment->so);
 			}
-			if (eblank < end_blank) {
-				end_blank = eblank;
+			if (end != NULL) {
+				*end = g_array_index(line->cells,
+						     struct vte_match_coords,
+						     segment->eo - 1);
 			}
-
-                        g_match_info_next(match_info, NULL);
+			vte_terminal_set_cursor_from_regex_match(terminal,
+								 regex);
+			return g_strndup(line->text + segment->so,
+					 segment->eo - segment->so);
 		}
+	}
 
-                g_match_info_free(match_info);
+	/* The gap between the neighbouring segments doesn't match. */
+	blank_start = 0;
+	blank_end = line->length;
+	if (lo > 0) {
+		blank_start = g_array_index(line->segments,
+					    struct vte_match_segment,
+					    lo - 1).end;
+	}
+	if (lo < line->segments->len) {
+		blank_end = g_array_index(line->segments,
+					  struct vte_match_segment,
+					  lo).start;
 	}
-	line[eattr] = eol;
 	if (start != NULL) {
-		*start = sattr + start_blank;
+		*start = g_array_index(line->cells, struct vte_match_coords,
+				       blank_start);
 	}
 	if (end != NULL) {
-		*end = sattr + end_blank;
+		*end = g_array_index(line->cells, struct vte_match_coords,
+				     blank_end - 1);
 	}
 	return NULL;
 }
@@ -1954,17 +2589,49 @@ vte_terminal_match_check_internal_gregex(VteTerminal *terminal,
 static char *
 vte_terminal_match_check_internal(VteTerminal *terminal,
                                   long column, glong row,
-                                  int *tag, int *start, int *end)
+                                  int *tag,
+				  struct vte_match_coords *start,
+				  struct vte_match_coords *end)
 {
-	if (terminal->pvt->match_contents == NULL) {
-		vte_terminal_match_contents_refresh(terminal);
+	struct _VteCharAttributes *attr;
+	char *ret;
+	int s, e;
+
+	if (start != NULL) {
+		start->row = -1;
+		start->column = -1;
+	}
+	if (end != NULL) {
+		end->row = -2;
+		end->column = -2;
 	}
 
         if (terminal->pvt->match_regex_mode == VTE_REGEX_GREGEX)
                 return vte_terminal_match_check_internal_gregex(terminal, column, row, tag, start, end);
-        if (terminal->pvt->match_regex_mode == VTE_REGEX_VTE)
-                return vte_terminal_match_check_internal_vte(terminal, column, row, tag, start, end);
-        return NULL;
+        if (terminal->pvt->match_regex_mode != VTE_REGEX_VTE)
+                return NULL;
+
+	if (terminal->pvt->match_contents == NULL) {
+		vte_terminal_match_contents_refresh(terminal);
+	}
+	ret = vte_terminal_match_check_internal_vte(terminal, column, row,
+						    tag, &s, &e);
+	/* Map the offsets back to cells. */
+	if (start != NULL && end != NULL &&
+	    (guint) s < terminal->pvt->match_attributes->len &&
+	    (guint) e < terminal->pvt->match_attributes->len) {
+		attr = &g_array_index(terminal->pvt->match_attributes,
+				struct _VteCharAttributes,
+				s);
+		start->row = attr->row;
+		start->column = attr->column;
+		attr = &g_array_index(terminal->pvt->match_attributes,
+				struct _VteCharAttributes,
+				e);
+		end->row = attr->row;
+		end->column = attr->column;
+	}
+	return ret;
 }
 
 static gboolean
@@ -2401,7 +3068,7 @@ _vte_terminal_ensure_row (VteTerminal *terminal)
 		}
 		_vte_ring_set_cache (screen->row_data, v, row);
 	} else {
-		row = _vte_ring_get_cached_data (screen->row_data);
+		row = _vte_ring_get_cached_data (screen->row_data, v);
 	}
 	g_assert(row != NULL);
 
@@ -2427,6 +3094,25 @@ vte_terminal_ensure_cursor(VteTerminal *terminal)
 	return row;
 }
 
+/* Swap private copies in for any rows in the given range which snapshots
+ * are sharing, before the range becomes writable again. */
+static void
+vte_terminal_unshare_rows(VteScreen *screen, glong start, glong end)
+{
+	VteRowData *row;
+
+	start = MAX(start, _vte_ring_delta(screen->row_data));
+	end = MIN(end, _vte_ring_next(screen->row_data));
+	for (; start < end; start++) {
+		row = _vte_ring_index(screen->row_data, VteRowData *, start);
+		if (g_atomic_int_get(&row->ref_count) > 1) {
+			row = _vte_ring_replace(screen->row_data, start,
+						vte_row_data_copy(row));
+			_vte_free_row_data(row);
+		}
+	}
+}
+
 /* Update the insert delta so that the screen which includes it also
  * includes the end of the buffer. */
 void
@@ -2457,6 +3143,14 @@ _vte_terminal_update_insert_delta(VteTerminal *terminal)
 
 	/* Adjust the insert delta and scroll if needed. */
 	if (delta != screen->insert_delta) {
+		if (delta < screen->insert_delta) {
+			vte_terminal_unshare_rows(screen,
+						  delta, screen->insert_delta);
+			if (screen == &terminal->pvt->normal_screen) {
+				vte_terminal_search_index_invalidate(terminal,
+								     delta);
+			}
+		}
 		screen->insert_delta = delta;
 		_vte_terminal_adjust_adjustments(terminal);
 	}
@@ -3014,8 +3708,7 @@ _vte_terminal_cursor_down (VteTerminal *terminal)
 				/* If we're at the bottom of the scrolling
 				 * region, add a line at the top to scroll the
 				 * bottom off. */
-				vte_remove_line_internal(terminal, start);
-				vte_insert_line_internal(terminal, end);
+				_vte_terminal_rotate_line(terminal, start, end);
 				/* Update the display. */
 				_vte_terminal_scroll_region(terminal, start,
 							   end - start + 1, -1);
@@ -3677,9 +4370,12 @@ next_match:
 		/* Signal that the visible contents changed. */
 		_vte_terminal_queue_contents_changed(terminal);
 	}
+	if (modified) {
+		vte_terminal_search_index_update(terminal);
+	}
 
-	vte_terminal_emit_pending_signals (terminal);
-
+	/* Note the damage before the signals go out, so that the accessible
+	 * peer sees the new text when it handles them. */
 	if (invalidated_text) {
 		/* Clip off any part of the box which isn't already on-screen. */
 		bbox_topleft.x = MAX(bbox_topleft.x, 0);
@@ -3697,6 +4393,8 @@ next_match:
 				bbox_bottomright.y - bbox_topleft.y);
 	}
 
+	vte_terminal_emit_pending_signals (terminal);
+
 
 	if ((cursor.col != terminal->pvt->screen->cursor_current.col) ||
 	    (cursor.row != terminal->pvt->screen->cursor_current.row)) {
@@ -4829,6 +5527,48 @@ vte_cell_is_selected(VteTerminal *terminal, glong col, glong row, gpointer data)
 	return vte_cell_is_between(col, row, ss.col, ss.row, se.col, se.row, TRUE);
 }
 
+/* Find the columns [*start, *end) of a row which vte_cell_is_between() would
+ * say are between two points, inclusively. */
+static void
+vte_row_span_between(glong row,
+		     glong acol, glong arow, glong bcol, glong brow,
+		     glong *start, glong *end)
+{
+	*start = *end = 0;
+	if ((arow > brow) || ((arow == brow) && (acol > bcol))) {
+		return;
+	}
+	if ((row < arow) || (row > brow)) {
+		return;
+	}
+	*start = (row == arow) ? acol : 0;
+	*end = (row == brow) ? bcol + 1 : G_MAXLONG;
+}
+
+/* Find the columns [*start, *end) of a row for which vte_cell_is_selected()
+ * would be TRUE. */
+static void
+vte_row_selection_span(VteTerminal *terminal, glong row,
+		       glong *start, glong *end)
+{
+	struct selection_cell_coords ss, se;
+
+	*start = *end = 0;
+	if (!terminal->pvt->has_selection) {
+		return;
+	}
+	ss = terminal->pvt->selection_start;
+	se = terminal->pvt->selection_end;
+	if ((ss.row < 0) || (se.row < 0)) {
+		return;
+	}
+	vte_row_span_between(row, ss.col, ss.row, se.col, se.row, start, end);
+	if (terminal->pvt->selection_block_mode) {
+		*start = MAX(*start, ss.col);
+		*end = MIN(*end, se.col + 1);
+	}
+}
+
 /* Once we get text data, actually paste it in. */
 static void
 vte_terminal_paste_cb(GtkClipboard *clipboard, const gchar *text, gpointer data)
@@ -5105,9 +5845,9 @@ vte_terminal_match_hilite_hide(VteTerminal *terminal)
 static void
 vte_terminal_match_hilite_update(VteTerminal *terminal, long x, long y)
 {
-	int start, end, width, height;
+	int width, height;
 	char *match;
-	struct _VteCharAttributes *attr;
+	struct vte_match_coords start, end;
 	VteScreen *screen;
 	long delta;
 
@@ -5141,28 +5881,9 @@ vte_terminal_match_hilite_update(VteTerminal *terminal, long x, long y)
 	}
 
 	/* Read the new locations. */
-	attr = NULL;
-	if ((guint) start < terminal->pvt->match_attributes->len) {
-		attr = &g_array_index(terminal->pvt->match_attributes,
-				struct _VteCharAttributes,
-				start);
-		terminal->pvt->match_start.row = attr->row;
-		terminal->pvt->match_start.column = attr->column;
-
-		attr = NULL;
-		if ((guint) end < terminal->pvt->match_attributes->len) {
-			attr = &g_array_index(terminal->pvt->match_attributes,
-					struct _VteCharAttributes,
-					end);
-			terminal->pvt->match_end.row = attr->row;
-			terminal->pvt->match_end.column = attr->column;
-		}
-	}
-	if (attr == NULL) { /* i.e. if either endpoint is not found */
-		terminal->pvt->match_start.row = -1;
-		terminal->pvt->match_start.column = -1;
-		terminal->pvt->match_end.row = -2;
-		terminal->pvt->match_end.column = -2;
+	terminal->pvt->match_start = start;
+	terminal->pvt->match_end = end;
+	if (start.row < 0) { /* i.e. if either endpoint is not found */
 		g_assert (match == NULL);
 	}
 
@@ -5322,6 +6043,7 @@ vte_terminal_get_text_range_maybe_wrapped(VteTerminal *terminal,
 	GString *string;
 	struct _VteCharAttributes attr;
 	struct vte_palette_entry fore, back, *palette;
+	VteRingIter iter;
 
 	screen = terminal->pvt->screen;
 
@@ -5333,8 +6055,9 @@ vte_terminal_get_text_range_maybe_wrapped(VteTerminal *terminal,
 
 	palette = terminal->pvt->palette;
 	col = start_col;
+	_vte_ring_iter_init(&iter, screen->row_data, start_row);
 	for (row = start_row; row <= end_row; row++, col = 0) {
-		VteRowData *row_data = _vte_terminal_find_row_data (terminal, row);
+		VteRowData *row_data = _vte_ring_iter_next(&iter);
 		last_empty = last_nonempty = string->len;
 		last_emptycol = last_nonemptycol = -1;
 
@@ -5548,1572 +6271,3353 @@ vte_terminal_get_text_include_trailing_spaces(VteTerminal *terminal,
 						   TRUE);
 }
 
-/**
- * vte_terminal_get_cursor_position:
- * @terminal: a #VteTerminal
- * @column: long which will hold the column
- * @row : long which will hold the row
- *
- * Reads the location of the insertion cursor and returns it.  The row
- * coordinate is absolute.
- *
- */
-void
-vte_terminal_get_cursor_position(VteTerminal *terminal,
-				 glong *column, glong *row)
+/* Text being handed to a sink a chunk at a time. */
+struct vte_text_stream {
+	VteTextSink sink;
+	gpointer data;
+	const struct vte_palette_entry *palette;	/* or NULL for no runs */
+	GString *text;		/* the chunk being built */
+	GArray *runs;		/* VteTextRun */
+	gsize chunk;		/* size at which the text is passed on */
+	gboolean sgr;		/* mark attributes with escape sequences */
+	struct vte_charcell_attr sgr_attr;	/* the last ones marked */
+	gboolean stopped;	/* the sink wanted no more */
+};
+
+static void
+vte_text_stream_init(struct vte_text_stream *stream,
+		     const struct vte_palette_entry *palette,
+		     gsize chunk, VteTextSink sink, gpointer data)
 {
-	g_return_if_fail(VTE_IS_TERMINAL(terminal));
-	if (column) {
-		*column = terminal->pvt->screen->cursor_current.col;
-	}
-	if (row) {
-		*row = terminal->pvt->screen->cursor_current.row;
-	}
+	stream->sink = sink;
+	stream->data = data;
+	stream->palette = palette;
+	stream->text = g_string_sized_new(chunk + 256);
+	stream->runs = g_array_new(FALSE, FALSE, sizeof(VteTextRun));
+	stream->chunk = chunk;
+	stream->sgr = FALSE;
+	stream->stopped = FALSE;
 }
 
-static GtkClipboard *
-vte_terminal_clipboard_get(VteTerminal *terminal, GdkAtom board)
+/* Pass on whatever has been gathered. */
+static void
+vte_text_stream_flush(struct vte_text_stream *stream)
 {
-	GdkDisplay *display;
-	display = gtk_widget_get_display(&terminal->widget);
-	return gtk_clipboard_get_for_display(display, board);
+	if (stream->text->len > 0 && !stream->stopped) {
+		stream->stopped = !stream->sink(stream->text->str,
+						stream->text->len,
+						(const VteTextRun *) stream->runs->data,
+						stream->runs->len,
+						stream->data);
+	}
+	g_string_truncate(stream->text, 0);
+	g_array_set_size(stream->runs, 0);
 }
 
-/* Place the selected text onto the clipboard.  Do this asynchronously so that
- * we get notified when the selection we placed on the clipboard is replaced. */
 static void
-vte_terminal_copy(VteTerminal *terminal, GdkAtom board)
+vte_text_stream_finish(struct vte_text_stream *stream)
 {
-	GtkClipboard *clipboard;
-	static GtkTargetEntry *targets = NULL;
-	static gint n_targets = 0;
-
-	clipboard = vte_terminal_clipboard_get(terminal, board);
-
-	/* Chuck old selected text and retrieve the newly-selected text. */
-	g_free(terminal->pvt->selection);
-	terminal->pvt->selection =
-		vte_terminal_get_text_range(terminal,
-					    terminal->pvt->selection_start.row,
-					    0,
-					    terminal->pvt->selection_end.row,
-					    terminal->column_count,
-					    vte_cell_is_selected,
-					    NULL,
-					    NULL);
-	terminal->pvt->has_selection = TRUE;
-
-	/* Place the text on the clipboard. */
-	if (terminal->pvt->selection != NULL) {
-		_vte_debug_print(VTE_DEBUG_SELECTION,
-				"Assuming ownership of selection.\n");
-		if (!targets) {
-			GtkTargetList *list;
-			GList *l;
-			int i;
-
-			list = gtk_target_list_new (NULL, 0);
-			gtk_target_list_add_text_targets (list, 0);
+	vte_text_stream_flush(stream);
+	g_string_free(stream->text, TRUE);
+	g_array_free(stream->runs, TRUE);
+}
 
-			n_targets = g_list_length (list->list);
-			targets = g_new0 (GtkTargetEntry, n_targets);
-			for (l = list->list, i = 0; l; l = l->next, i++) {
-				GtkTargetPair *pair = (GtkTargetPair *)l->data;
-				targets[i].target = gdk_atom_name (pair->target);
-			}
-			gtk_target_list_unref (list);
+/* Extend the last run with a character, or start a new one if its
+ * attributes differ. */
+static void
+vte_text_stream_add_run(struct vte_text_stream *stream,
+			const struct vte_charcell *cell,
+			glong row, glong col, gsize offset)
+{
+	VteTextRun run, *last;
+	const struct vte_palette_entry *fore, *back;
+
+	fore = &stream->palette[cell->attr.fore];
+	back = &stream->palette[cell->attr.back];
+	if (stream->runs->len > 0) {
+		last = &g_array_index(stream->runs, VteTextRun,
+				      stream->runs->len - 1);
+		if (last->offset + last->length == offset &&
+		    last->attr.fore.red == fore->red &&
+		    last->attr.fore.green == fore->green &&
+		    last->attr.fore.blue == fore->blue &&
+		    last->attr.back.red == back->red &&
+		    last->attr.back.green == back->green &&
+		    last->attr.back.blue == back->blue &&
+		    last->attr.underline == cell->attr.underline &&
+		    last->attr.strikethrough == cell->attr.strikethrough) {
+			last->length = stream->text->len - last->offset;
+			return;
 		}
-
-		gtk_clipboard_set_with_owner(clipboard,
-					     targets,
-					     n_targets,
-					     vte_terminal_copy_cb,
-					     vte_terminal_clear_cb,
-					     G_OBJECT(terminal));
-		gtk_clipboard_set_can_store(clipboard, NULL, 0);
 	}
+	memset(&run, 0, sizeof(run));
+	run.offset = offset;
+	run.length = stream->text->len - offset;
+	run.attr.row = row;
+	run.attr.column = col;
+	run.attr.fore.red = fore->red;
+	run.attr.fore.green = fore->green;
+	run.attr.fore.blue = fore->blue;
+	run.attr.back.red = back->red;
+	run.attr.back.green = back->green;
+	run.attr.back.blue = back->blue;
+	run.attr.underline = cell->attr.underline;
+	run.attr.strikethrough = cell->attr.strikethrough;
+	g_array_append_val(stream->runs, run);
+}
+
+static inline gboolean
+vte_text_stream_same_sgr(const struct vte_charcell_attr *a,
+			 const struct vte_charcell_attr *b)
+{
+	return a->fore == b->fore && a->back == b->back &&
+	       a->bold == b->bold && a->half == b->half &&
+	       a->underline == b->underline && a->blink == b->blink &&
+	       a->reverse == b->reverse && a->standout == b->standout &&
+	       a->invisible == b->invisible &&
+	       a->strikethrough == b->strikethrough;
 }
 
-/* Paste from the given clipboard. */
 static void
-vte_terminal_paste(VteTerminal *terminal, GdkAtom board)
+vte_text_stream_sgr_color(GString *text, guint color, guint base, guint bright)
 {
-	GtkClipboard *clipboard;
-	clipboard = vte_terminal_clipboard_get(terminal, board);
-	if (clipboard != NULL) {
-		_vte_debug_print(VTE_DEBUG_SELECTION,
-				"Requesting clipboard contents.\n");
-		gtk_clipboard_request_text(clipboard,
-					   vte_terminal_paste_cb,
-					   terminal);
+	if (color < 8) {
+		g_string_append_printf(text, ";%u", base + color);
+	} else if (color < 16) {
+		g_string_append_printf(text, ";%u", bright + color - 8);
+	} else if (color < 256) {
+		g_string_append_printf(text, ";%u;5;%u", base + 8, color);
 	}
 }
 
-static glong
-find_start_column (VteTerminal *terminal, glong col, glong row)
+/* Switch to a cell's attributes, starting from a reset. */
+static void
+vte_text_stream_add_sgr(struct vte_text_stream *stream,
+			const struct vte_charcell_attr *attr)
 {
-	VteRowData *row_data = _vte_terminal_find_row_data (terminal, row);
-	if (G_UNLIKELY (col < 0))
-		return col;
-	if (row_data != NULL) {
-		struct vte_charcell *cell = _vte_row_data_find_charcell(row_data, col);
-		while (cell != NULL && cell->attr.fragment && col > 0) {
-			cell = _vte_row_data_find_charcell(row_data, --col);
-		}
+	GString *text = stream->text;
+
+	g_string_append(text, "\033[0");
+	if (attr->bold) {
+		g_string_append(text, ";1");
 	}
-	return MAX(col, 0);
+	if (attr->half) {
+		g_string_append(text, ";2");
+	}
+	if (attr->underline) {
+		g_string_append(text, ";4");
+	}
+	if (attr->blink) {
+		g_string_append(text, ";5");
+	}
+	if (attr->reverse || attr->standout) {
+		g_string_append(text, ";7");
+	}
+	if (attr->invisible) {
+		g_string_append(text, ";8");
+	}
+	if (attr->strikethrough) {
+		g_string_append(text, ";9");
+	}
+	vte_text_stream_sgr_color(text, attr->fore, 30, 90);
+	vte_text_stream_sgr_color(text, attr->back, 40, 100);
+	g_string_append_c(text, 'm');
+	stream->sgr_attr = *attr;
 }
-static glong
-find_end_column (VteTerminal *terminal, glong col, glong row)
-{
-	VteRowData *row_data = _vte_terminal_find_row_data (terminal, row);
-	gint columns = 0;
-	if (G_UNLIKELY (col < 0))
-		return col;
+
+/* Add columns @start_col to @end_col of a row, leaving off empty cells at
+ * the end unless something follows them further along the row. */
+static void
+vte_text_stream_add_row(struct vte_text_stream *stream,
+			const VteRowData *row_data, glong row,
+			glong start_col, glong end_col, gboolean newline)
+{
+	const struct vte_charcell *cell;
+	struct vte_charcell_attr plain;
+	gchar utf8[8];
+	gsize offset;
+	glong col, last;
+	gint length;
+
+	memset(&plain, 0, sizeof(plain));
+	plain.fore = VTE_DEF_FG;
+	plain.back = VTE_DEF_BG;
+	stream->sgr_attr = plain;
 	if (row_data != NULL) {
-		struct vte_charcell *cell = _vte_row_data_find_charcell(row_data, col);
-		while (cell != NULL && cell->attr.fragment && col > 0) {
-			cell = _vte_row_data_find_charcell(row_data, --col);
+		last = (glong) row_data->cells->len - 1;
+		while (last >= start_col &&
+		       g_array_index(row_data->cells,
+				     struct vte_charcell, last).c == 0) {
+			last--;
 		}
-		if (cell) {
-			columns = cell->attr.columns - 1;
+		last = MIN(last, end_col);
+		for (col = start_col; col <= last; col++) {
+			cell = &g_array_index(row_data->cells,
+					      struct vte_charcell, col);
+			if (cell->attr.fragment) {
+				continue;
+			}
+			if (stream->sgr &&
+			    !vte_text_stream_same_sgr(&cell->attr,
+						      &stream->sgr_attr)) {
+				vte_text_stream_add_sgr(stream, &cell->attr);
+			}
+			offset = stream->text->len;
+			length = g_unichar_to_utf8(cell->c ? cell->c : ' ',
+						   utf8);
+			g_string_append_len(stream->text, utf8, length);
+			if (stream->palette != NULL) {
+				vte_text_stream_add_run(stream, cell,
+							row, col, offset);
+			}
 		}
 	}
-	return MIN(col + columns, terminal->column_count);
+	if (stream->sgr &&
+	    !vte_text_stream_same_sgr(&plain, &stream->sgr_attr)) {
+		g_string_append(stream->text, "\033[0m");
+	}
+	if (newline) {
+		g_string_append_c(stream->text, '\n');
+	}
+	if (stream->text->len >= stream->chunk) {
+		vte_text_stream_flush(stream);
+	}
 }
 
-static void
-vte_terminal_invalidate_selection (VteTerminal *terminal)
-{
-	_vte_invalidate_region (terminal,
-				terminal->pvt->selection_start.col,
-				terminal->pvt->selection_end.col,
-				terminal->pvt->selection_start.row,
-				terminal->pvt->selection_end.row,
-				terminal->pvt->selection_block_mode);
-}
+/**
+ * vte_terminal_get_text_range_stream:
+ * @terminal: a #VteTerminal
+ * @start_row: first row to read
+ * @start_col: first column to read
+ * @end_row: last row to read
+ * @end_col: last column to read
+ * @mode: whether to read the range as a run of text or as a block
+ * @attributes: %TRUE to have the colors and styles of the text reported
+ * @sink: a function to receive the text
+ * @data: user data for @sink
+ *
+ * Extracts text the way vte_terminal_get_text_range() does, but hands it
+ * to @sink in chunks of a few kilobytes instead of building one string, so
+ * that any amount of the buffer can be read with little memory.  Each chunk
+ * holds whole rows.  If @attributes is set, the chunk comes with runs of
+ * text sharing the same attributes, given as byte offsets into the chunk;
+ * newlines aren't covered by any run.
+ *
+ * @sink may return %FALSE to stop early.  It is called while the buffer
+ * is being read, so it must not change the terminal: feeding it text,
+ * resetting it, resizing it or running the main loop (which may process
+ * the child's output) leaves the extraction reading freed rows.  Take a
+ * #VteSnapshot with vte_terminal_get_snapshot() to read the buffer while
+ * the terminal carries on.
+ *
+ * Returns: %FALSE if @sink stopped the extraction, %TRUE otherwise
+ */
+gboolean
+vte_terminal_get_text_range_stream(VteTerminal *terminal,
+				   glong start_row, glong start_col,
+				   glong end_row, glong end_col,
+				   VteTextRangeMode mode,
+				   gboolean attributes,
+				   VteTextSink sink, gpointer data)
+{
+	struct vte_text_stream stream;
+	VteRowData *row_data;
+	VteRingIter iter;
+	glong row, first, last;
+	gboolean newline;
 
+	g_return_val_if_fail(VTE_IS_TERMINAL(terminal), FALSE);
+	g_return_val_if_fail(sink != NULL, FALSE);
+
+	vte_text_stream_init(&stream,
+			     attributes ? terminal->pvt->palette : NULL,
+			     VTE_TEXT_CHUNK_SIZE, sink, data);
+	_vte_ring_iter_init(&iter, terminal->pvt->screen->row_data, start_row);
+	for (row = start_row; row <= end_row && !stream.stopped; row++) {
+		row_data = _vte_ring_iter_next(&iter);
+		if (mode == VTE_TEXT_RANGE_BLOCK) {
+			first = start_col;
+			last = end_col;
+			newline = TRUE;
+		} else {
+			first = (row == start_row) ? start_col : 0;
+			last = (row == end_row) ? end_col : G_MAXLONG;
+			newline = (row != end_row ||
+				   end_col >= terminal->column_count - 1) &&
+				  !(row_data != NULL && row_data->soft_wrapped);
+		}
+		vte_text_stream_add_row(&stream, row_data, row,
+					first, last, newline);
+	}
+	vte_text_stream_finish(&stream);
 
-/* Start selection at the location of the event. */
-static void
-vte_terminal_start_selection(VteTerminal *terminal, GdkEventButton *event,
-			     enum vte_selection_type selection_type)
+	return !stream.stopped;
+}
+
+/* The @i'th row of @snapshot, thawing its block first if it's still frozen.
+ * Readers on different threads may race to thaw the same block, hence the
+ * lock. */
+static VteRowData *
+vte_snapshot_row(VteSnapshot *snapshot, glong i)
 {
-	long delta;
+	VteRingBlock *block;
+	VteRowData *row;
+	gpointer items[VTE_RING_BLOCK_SIZE];
+	glong b, j, k;
 
-	if (terminal->pvt->selection_block_mode)
-		selection_type = selection_type_char;
+	row = g_atomic_pointer_get((gpointer *) &snapshot->rows[i]);
+	if (row != NULL) {
+		return row;
+	}
+	b = (snapshot->start_row + i) / VTE_RING_BLOCK_SIZE -
+	    snapshot->first_block;
+	if (b >= snapshot->n_blocks) {
+		return NULL;
+	}
 
-	/* Record that we have the selection, and where it started. */
-	delta = terminal->pvt->screen->scroll_delta;
-	terminal->pvt->has_selection = TRUE;
-	terminal->pvt->selection_last.x = event->x - VTE_PAD_WIDTH;
-	terminal->pvt->selection_last.y = event->y - VTE_PAD_WIDTH +
-					  (terminal->char_height * delta);
+	g_static_mutex_lock(&snapshot->thaw_lock);
+	block = snapshot->blocks[b];
+	if (block != NULL) {
+		if (_vte_ring_block_thaw(block, _vte_thaw_row_data, NULL,
+					 items)) {
+			for (j = 0; j < (glong) block->count; j++) {
+				k = block->start + j - snapshot->start_row;
+				if (k >= 0 && k < snapshot->n_rows) {
+					g_atomic_pointer_set(
+						(gpointer *) &snapshot->rows[k],
+						items[j]);
+				} else {
+					_vte_free_row_data(items[j]);
+				}
+			}
+		} else {
+			g_critical("Corrupt scrollback block %ld.\n",
+				   snapshot->first_block + b);
+		}
+		snapshot->blocks[b] = NULL;
+		_vte_ring_block_unref(block);
+	}
+	row = snapshot->rows[i];
+	g_static_mutex_unlock(&snapshot->thaw_lock);
 
-	/* Decide whether or not to restart on the next drag. */
-	switch (selection_type) {
-	case selection_type_char:
-		/* Restart selection once we register a drag. */
-		terminal->pvt->selecting_restart = TRUE;
-		terminal->pvt->has_selection = FALSE;
-		terminal->pvt->selecting_had_delta = FALSE;
+	return row;
+}
 
-		terminal->pvt->selection_origin = terminal->pvt->selection_last;
-		break;
-	case selection_type_word:
-	case selection_type_line:
-		/* Mark the newly-selected areas now. */
-		terminal->pvt->selecting_restart = FALSE;
-		terminal->pvt->has_selection = FALSE;
-		terminal->pvt->selecting_had_delta = FALSE;
-		break;
+/* Snapshot rows of @screen, which needn't be the one being shown.  Frozen
+ * history is taken a block at a time without thawing it, so this costs the
+ * same for any amount of it. */
+static VteSnapshot *
+vte_terminal_get_screen_snapshot(VteTerminal *terminal, VteScreen *screen,
+				 glong start_row, glong end_row)
+{
+	VteRing *ring = screen->row_data;
+	VteSnapshot *snapshot;
+	VteRowData *row;
+	VteRingIter iter;
+	glong i, frozen;
+
+	start_row = MAX(start_row, _vte_ring_delta(ring));
+	end_row = MIN(end_row, _vte_ring_next(ring) - 1);
+
+	snapshot = g_slice_new(VteSnapshot);
+	snapshot->ref_count = 1;
+	snapshot->start_row = start_row;
+	snapshot->n_rows = MAX(0, end_row - start_row + 1);
+	snapshot->column_count = terminal->column_count;
+	snapshot->rows = g_new0(VteRowData *, snapshot->n_rows);
+	snapshot->blocks = NULL;
+	snapshot->first_block = start_row / VTE_RING_BLOCK_SIZE;
+	snapshot->n_blocks = 0;
+	g_static_mutex_init(&snapshot->thaw_lock);
+
+	frozen = MIN(_vte_ring_frozen(ring), end_row + 1);
+	if (start_row < frozen) {
+		snapshot->n_blocks = (frozen - 1) / VTE_RING_BLOCK_SIZE -
+				     snapshot->first_block + 1;
+		snapshot->blocks = g_new(VteRingBlock *, snapshot->n_blocks);
+		for (i = 0; i < snapshot->n_blocks; i++) {
+			snapshot->blocks[i] = _vte_ring_ref_block(ring,
+				MAX((snapshot->first_block + i) *
+				    VTE_RING_BLOCK_SIZE, start_row));
+		}
 	}
 
-	/* Record the selection type. */
-	terminal->pvt->selection_type = selection_type;
-	terminal->pvt->selecting = TRUE;
+	_vte_ring_iter_init(&iter, ring, MAX(start_row, frozen));
+	for (i = MAX(start_row, frozen) - start_row;
+	     i < snapshot->n_rows;
+	     i++) {
+		row = _vte_ring_iter_next(&iter);
+		if (row == NULL) {
+			continue;
+		} else if (start_row + i < screen->insert_delta) {
+			g_atomic_int_inc(&row->ref_count);
+			snapshot->rows[i] = row;
+		} else {
+			snapshot->rows[i] = vte_row_data_copy(row);
+		}
+	}
 
-	_vte_debug_print(VTE_DEBUG_SELECTION,
-			"Selection started at (%ld,%ld).\n",
-			terminal->pvt->selection_start.col,
-			terminal->pvt->selection_start.row);
+	_vte_debug_print(VTE_DEBUG_MISC,
+			"Snapshot of rows %ld to %ld.\n", start_row, end_row);
+	return snapshot;
+}
 
-	/* Temporarily stop caring about input from the child. */
-	//_vte_terminal_disconnect_pty_read(terminal);
+/**
+ * vte_terminal_get_snapshot:
+ * @terminal: a #VteTerminal
+ * @start_row: first row to include
+ * @end_row: last row to include
+ *
+ * Takes a read-only snapshot of the given rows of the buffer.  Scrollback
+ * rows are shared with the terminal rather than copied, and compressed
+ * scrollback stays compressed until the snapshot is read, so this is cheap
+ * even for long ranges; only the rows which the terminal can still write to
+ * are copied.  The snapshot may then be handed to another thread and read there
+ * with vte_snapshot_get_text_range() while the terminal keeps processing
+ * output.
+ *
+ * Returns: a new #VteSnapshot, to be released with vte_snapshot_unref()
+ */
+VteSnapshot *
+vte_terminal_get_snapshot(VteTerminal *terminal,
+			  glong start_row, glong end_row)
+{
+	g_return_val_if_fail(VTE_IS_TERMINAL(terminal), NULL);
+
+	return vte_terminal_get_screen_snapshot(terminal, terminal->pvt->screen,
+						start_row, end_row);
 }
 
-static long
-math_div (long a, long b)
+/**
+ * vte_snapshot_ref:
+ * @snapshot: a #VteSnapshot
+ *
+ * Adds a reference to @snapshot.  This may be called from any thread.
+ *
+ * Returns: @snapshot
+ */
+VteSnapshot *
+vte_snapshot_ref(VteSnapshot *snapshot)
 {
-	if (G_LIKELY (a >= 0))
-		return a / b;
-	else
-		return (a / b) - 1;
+	g_return_val_if_fail(snapshot != NULL, NULL);
+	g_atomic_int_inc(&snapshot->ref_count);
+	return snapshot;
 }
 
-/* Helper */
-static void
-vte_terminal_extend_selection_expand (VteTerminal *terminal)
+/**
+ * vte_snapshot_unref:
+ * @snapshot: a #VteSnapshot
+ *
+ * Drops a reference to @snapshot, freeing it when the last one goes.  This
+ * may be called from any thread.
+ */
+void
+vte_snapshot_unref(VteSnapshot *snapshot)
 {
-	long i, j;
-	VteScreen *screen;
-	VteRowData *rowdata;
-	struct vte_charcell *cell;
-	struct selection_cell_coords *sc, *ec;
+	glong i;
 
-	if (terminal->pvt->selection_block_mode)
+	g_return_if_fail(snapshot != NULL);
+	if (!g_atomic_int_dec_and_test(&snapshot->ref_count)) {
 		return;
-
-	screen = terminal->pvt->screen;
-	sc = &terminal->pvt->selection_start;
-	ec = &terminal->pvt->selection_end;
-
-	/* Extend the selection to handle end-of-line cases, word, and line
-	 * selection.  We do this here because calculating it once is cheaper
-	 * than recalculating for each cell as we render it. */
-
-	/* Handle end-of-line at the start-cell. */
-	rowdata = _vte_terminal_find_row_data(terminal, sc->row);
-	if (rowdata != NULL) {
-		/* Find the last non-empty character on the first line. */
-		for (i = rowdata->cells->len; i > 0; i--) {
-			cell = &g_array_index(rowdata->cells,
-					struct vte_charcell, i - 1);
-			if (cell->attr.fragment || cell->c != 0)
-				break;
+	}
+	for (i = 0; i < snapshot->n_rows; i++) {
+		if (snapshot->rows[i] != NULL) {
+			_vte_free_row_data(snapshot->rows[i]);
 		}
-		/* If the start point is to its right, then move the
-		 * startpoint up to the beginning of the next line
-		 * unless that would move the startpoint after the end
-		 * point, or we're in select-by-line mode. */
-		if ((sc->col >= i) &&
-				(terminal->pvt->selection_type != selection_type_line)) {
-			if (sc->row < ec->row) {
-				sc->col = 0;
-				sc->row++;
-			} else {
-				sc->col = i;
-			}
+	}
+	for (i = 0; i < snapshot->n_blocks; i++) {
+		if (snapshot->blocks[i] != NULL) {
+			_vte_ring_block_unref(snapshot->blocks[i]);
 		}
-	} else {
-		/* Snap to the leftmost column. */
-		sc->col = 0;
 	}
-	sc->col = find_start_column (terminal, sc->col, sc->row);
+	g_free(snapshot->rows);
+	g_free(snapshot->blocks);
+	g_static_mutex_free(&snapshot->thaw_lock);
+	g_slice_free(VteSnapshot, snapshot);
+}
 
-	/* Handle end-of-line at the end-cell. */
-	rowdata = _vte_terminal_find_row_data(terminal, ec->row);
-	if (rowdata != NULL) {
-		/* Find the last non-empty character on the last line. */
-		for (i = rowdata->cells->len; i > 0; i--) {
-			cell = &g_array_index(rowdata->cells,
-					struct vte_charcell, i - 1);
-			if (cell->attr.fragment || cell->c != 0)
-				break;
-		}
-		/* If the end point is to its right, then extend the
-		 * endpoint as far right as we can expect. */
-		if (ec->col >= i) {
-			ec->col = MAX(ec->col,
-				    MAX(terminal->column_count - 1,
-					(long) rowdata->cells->len));
-		}
-	} else {
-		/* Snap to the rightmost column, only if selecting anything of
-		 * this row. */
-		if (ec->col >= 0)
-			ec->col = MAX(ec->col, terminal->column_count - 1);
+/**
+ * vte_snapshot_get_row_range:
+ * @snapshot: a #VteSnapshot
+ * @start_row: location for the first row, or %NULL
+ * @end_row: location for the last row, or %NULL
+ *
+ * Reports which rows @snapshot holds, which may be fewer than were asked for
+ * if the buffer didn't extend that far.  The range is empty if @end_row ends
+ * up before @start_row.
+ */
+void
+vte_snapshot_get_row_range(VteSnapshot *snapshot,
+			   glong *start_row, glong *end_row)
+{
+	g_return_if_fail(snapshot != NULL);
+	if (start_row) {
+		*start_row = snapshot->start_row;
 	}
-	ec->col = find_end_column (terminal, ec->col, ec->row);
+	if (end_row) {
+		*end_row = snapshot->start_row + snapshot->n_rows - 1;
+	}
+}
 
+/**
+ * vte_snapshot_get_text_range:
+ * @snapshot: a #VteSnapshot
+ * @start_row: first row to read
+ * @start_col: first column to read
+ * @end_row: last row to read
+ * @end_col: last column to read
+ *
+ * Extracts text from @snapshot the way vte_terminal_get_text_range() does
+ * from the live buffer: trailing blanks are trimmed, and lines which weren't
+ * soft-wrapped end in a newline.  This may be called from any thread.
+ *
+ * Returns: a text string which must be freed by the caller.
+ */
+char *
+vte_snapshot_get_text_range(VteSnapshot *snapshot,
+			    glong start_row, glong start_col,
+			    glong end_row, glong end_col)
+{
+	GString *string;
+	VteRowData *row;
+	struct vte_charcell *cell;
+	glong r, col, last, last_nonempty;
 
-	/* Now extend again based on selection type. */
-	switch (terminal->pvt->selection_type) {
-	case selection_type_char:
-		/* Nothing more to do. */
-		break;
-	case selection_type_word:
-		/* Keep selecting to the left as long as the next character we
-		 * look at is of the same class as the current start point. */
-		i = sc->col;
-		j = sc->row;
-		while (_vte_ring_contains(screen->row_data, j)) {
-			/* Get the data for the row we're looking at. */
-			rowdata = _vte_ring_index(screen->row_data,
-						  VteRowData *, j);
-			if (rowdata == NULL) {
-				break;
-			}
-			/* Back up. */
-			for (i = (j == sc->row) ?
-				 sc->col :
-				 terminal->column_count - 1;
-			     i > 0;
-			     i--) {
-				if (vte_same_class(terminal,
-						   i - 1,
-						   j,
-						   i,
-						   j)) {
-					sc->col = i - 1;
-					sc->row = j;
-				} else {
-					break;
-				}
-			}
-			if (i > 0) {
-				/* We hit a stopping point, so stop. */
-				break;
-			} else {
-				if (vte_line_is_wrappable(terminal, j - 1) &&
-				    vte_same_class(terminal,
-						   terminal->column_count - 1,
-						   j - 1,
-						   0,
-						   j)) {
-					/* Move on to the previous line. */
-					j--;
-					sc->col = terminal->column_count - 1;
-					sc->row = j;
-				} else {
-					break;
-				}
-			}
-		}
-		/* Keep selecting to the right as long as the next character we
-		 * look at is of the same class as the current end point. */
-		i = ec->col;
-		j = ec->row;
-		while (_vte_ring_contains(screen->row_data, j)) {
-			/* Get the data for the row we're looking at. */
-			rowdata = _vte_ring_index(screen->row_data,
-						  VteRowData *, j);
-			if (rowdata == NULL) {
-				break;
-			}
-			/* Move forward. */
-			for (i = (j == ec->row) ?
-				 ec->col :
-				 0;
-			     i < terminal->column_count - 1;
-			     i++) {
-				if (vte_same_class(terminal,
-						   i,
-						   j,
-						   i + 1,
-						   j)) {
-					ec->col = i + 1;
-					ec->row = j;
-				} else {
-					break;
+	g_return_val_if_fail(snapshot != NULL, NULL);
+
+	string = g_string_new(NULL);
+	start_row = MAX(start_row, snapshot->start_row);
+	end_row = MIN(end_row, snapshot->start_row + snapshot->n_rows - 1);
+	for (r = start_row; r <= end_row; r++) {
+		row = vte_snapshot_row(snapshot, r - snapshot->start_row);
+		last_nonempty = string->len;
+		col = (r == start_row) ? start_col : 0;
+		last = (r == end_row) ? end_col : snapshot->column_count - 1;
+		if (row != NULL) {
+			last = MIN(last, (glong) row->cells->len - 1);
+			for (; col <= last; col++) {
+				cell = &g_array_index(row->cells,
+						      struct vte_charcell, col);
+				if (cell->attr.fragment) {
+					continue;
 				}
-			}
-			if (i < terminal->column_count - 1) {
-				/* We hit a stopping point, so stop. */
-				break;
-			} else {
-				if (vte_line_is_wrappable(terminal, j) &&
-				    vte_same_class(terminal,
-						   terminal->column_count - 1,
-						   j,
-						   0,
-						   j + 1)) {
-					/* Move on to the next line. */
-					j++;
-					ec->col = 0;
-					ec->row = j;
-				} else {
-					break;
+				g_string_append_unichar(string,
+						cell->c ? cell->c : ' ');
+				if (cell->c != 0) {
+					last_nonempty = string->len;
 				}
 			}
 		}
-		break;
-	case selection_type_line:
-		/* Extend the selection to the beginning of the start line. */
-		sc->col = 0;
-		/* Now back up as far as we can go. */
-		j = sc->row;
-		while (_vte_ring_contains(screen->row_data, j - 1) &&
-		       vte_line_is_wrappable(terminal, j - 1)) {
-			j--;
-			sc->row = j;
-		}
-		/* And move forward as far as we can go. */
-		j = ec->row;
-		while (_vte_ring_contains(screen->row_data, j) &&
-		       vte_line_is_wrappable(terminal, j)) {
-			j++;
-			ec->row = j;
+		g_string_truncate(string, last_nonempty);
+		if ((r < end_row || end_col >= snapshot->column_count - 1) &&
+		    (row == NULL || !row->soft_wrapped)) {
+			g_string_append_c(string, '\n');
 		}
-		/* Make sure we include all of the last line. */
-		ec->col = terminal->column_count - 1;
-		if (_vte_ring_contains(screen->row_data, ec->row)) {
-			rowdata = _vte_ring_index(screen->row_data,
-						  VteRowData *, ec->row);
-			if (rowdata != NULL) {
-				ec->col = MAX(ec->col, (long) rowdata->cells->len);
+	}
+	return g_string_free(string, FALSE);
+}
+
+/* Writes chunks of text out to a descriptor. */
+struct vte_write_sink {
+	gint fd;
+	GError *error;
+};
+
+static gboolean
+vte_write_sink_write(const char *text, gsize length,
+		     const VteTextRun *runs, guint n_runs, gpointer data)
+{
+	struct vte_write_sink *sink = data;
+	gssize n;
+	int err;
+
+	while (length > 0) {
+		n = write(sink->fd, text, length);
+		if (n < 0) {
+			err = errno;
+			if (err == EINTR) {
+				continue;
 			}
+			g_set_error(&sink->error, G_FILE_ERROR,
+				    g_file_error_from_errno(err),
+				    "%s", g_strerror(err));
+			return FALSE;
 		}
-		break;
+		text += n;
+		length -= n;
 	}
+	return TRUE;
 }
 
-/* Extend selection to include the given event coordinates. */
 static void
-vte_terminal_extend_selection(VteTerminal *terminal, long x, long y,
-			      gboolean always_grow, gboolean force)
+vte_write_stream_init(struct vte_text_stream *stream,
+		      struct vte_write_sink *sink,
+		      VteTerminalWriteFlags flags)
 {
-	VteScreen *screen;
-	int width, height;
-	long delta, residual;
-	struct selection_event_coords *origin, *last, *start, *end;
-	struct selection_cell_coords old_start, old_end, *sc, *ec, *so, *eo;
-	gboolean invalidate_selected = FALSE;
-	gboolean had_selection;
+	vte_text_stream_init(stream, NULL, VTE_WRITE_CHUNK_SIZE,
+			     vte_write_sink_write, sink);
+	stream->sgr = (flags & VTE_TERMINAL_WRITE_ATTRIBUTES) != 0;
+}
 
-	height = terminal->char_height;
-	width = terminal->char_width;
+static void
+vte_write_stream_snapshot(struct vte_text_stream *stream,
+			  VteSnapshot *snapshot)
+{
+	VteRowData *row_data;
+	glong i;
 
-	/* Confine y into the visible area. (#563024) */
-	if (y < 0) {
-		y = 0;
-		if (!terminal->pvt->selection_block_mode)
-			x = 0;
-	} else if (y >= terminal->row_count * height) {
-		if (!terminal->pvt->selection_block_mode) {
-			y = terminal->row_count * height;
-			x = -1;
-		} else {
-			y = terminal->row_count * height - 1;
+	for (i = 0; i < snapshot->n_rows && !stream->stopped; i++) {
+		row_data = vte_snapshot_row(snapshot, i);
+		if (row_data == NULL) {
+			/* Not held by the ring when the snapshot was taken. */
+			continue;
 		}
+		vte_text_stream_add_row(stream, row_data,
+					snapshot->start_row + i,
+					0, G_MAXLONG,
+					!row_data->soft_wrapped);
 	}
+}
 
-	screen = terminal->pvt->screen;
-	old_start = terminal->pvt->selection_start;
-	old_end = terminal->pvt->selection_end;
-	so = &old_start;
-	eo = &old_end;
-
-	/* Convert the event coordinates to cell coordinates. */
-	delta = screen->scroll_delta;
+/* An export in the background.  The history is snapshotted a slice at a
+ * time by the main loop, one slice ahead of the writer, so that no more
+ * than two slices are ever expanded; the screen is snapshotted up front. */
+struct vte_write_job {
+	VteTerminal *terminal;
+	VteTerminalWriteFlags flags;
+	VteTerminalWriteCallback callback;
+	gpointer data;
+	VteScreen *source;		/* the screen being written */
+	glong next_row, history_end;	/* main loop only */
+	VteSnapshot *screen;
+	gboolean screen_queued;		/* main loop only */
+	GAsyncQueue *slices;
+	struct vte_write_sink sink;
+};
 
-	/* If we're restarting on a drag, then mark this as the start of
-	 * the selected block. */
-	if (terminal->pvt->selecting_restart) {
-		vte_terminal_deselect_all(terminal);
-		invalidate_selected = TRUE;
-		_vte_debug_print(VTE_DEBUG_SELECTION,
-				"Selection delayed start at (%ld,%ld).\n",
-				terminal->pvt->selection_origin.x / width,
-				terminal->pvt->selection_origin.y / height);
+/* Queue the next slice for the writer. */
+static gboolean
+vte_write_job_next_slice(gpointer data)
+{
+	struct vte_write_job *job = data;
+	VteSnapshot *slice;
+	glong end;
+
+	if (job->terminal->pvt->screen != job->source) {
+		/* The other screen's rows have nothing to do with ours. */
+		job->next_row = job->history_end;
+	}
+	/* Leave out whatever has fallen off the end of the scrollback. */
+	job->next_row = MAX(job->next_row,
+			    _vte_ring_delta(job->source->row_data));
+	if (job->next_row < job->history_end) {
+		end = MIN(job->next_row + VTE_WRITE_SLICE_ROWS,
+			  job->history_end);
+		slice = vte_terminal_get_snapshot(job->terminal,
+						  job->next_row, end - 1);
+		job->next_row = end;
+		g_async_queue_push(job->slices, slice);
+	} else if (!job->screen_queued) {
+		job->screen_queued = TRUE;
+		g_async_queue_push(job->slices, vte_snapshot_ref(job->screen));
 	}
+	return FALSE;
+}
 
-	/* Recognize that we've got a selected block. */
-	had_selection = terminal->pvt->has_selection;
-	terminal->pvt->has_selection = TRUE;
-	terminal->pvt->selecting_had_delta = TRUE;
-	terminal->pvt->selecting_restart = FALSE;
+static gboolean
+vte_write_job_done(gpointer data)
+{
+	struct vte_write_job *job = data;
+	VteSnapshot *slice;
 
-	/* If we're not in always-grow mode, update the last location of
-	 * the selection. */
-	last = &terminal->pvt->selection_last;
+	GDK_THREADS_ENTER ();
+	job->callback(job->terminal, job->sink.error == NULL,
+		      job->sink.error, job->data);
+	GDK_THREADS_LEAVE ();
 
-	/* Map the origin and last selected points to a start and end. */
-	origin = &terminal->pvt->selection_origin;
-	if (terminal->pvt->selection_block_mode) {
-		last->x = x;
-		last->y = y + height * delta;
+	while ((slice = g_async_queue_try_pop(job->slices)) != NULL) {
+		vte_snapshot_unref(slice);
+	}
+	g_async_queue_unref(job->slices);
+	vte_snapshot_unref(job->screen);
+	if (job->sink.error != NULL) {
+		g_error_free(job->sink.error);
+	}
+	g_object_unref(job->terminal);
+	g_slice_free(struct vte_write_job, job);
+	return FALSE;
+}
 
-		/* We don't support always_grow in block mode */
-		if (always_grow)
-			vte_terminal_invalidate_selection (terminal);
+/* Write out the slices as they are queued.  In the writer thread the main
+ * loop queues each next one; without a thread they are queued here. */
+static void
+vte_write_job_run(struct vte_write_job *job, gboolean threaded)
+{
+	struct vte_text_stream stream;
+	VteSnapshot *slice;
+	gboolean last;
 
-		if (origin->y <= last->y) {
-			/* The origin point is "before" the last point. */
-			start = origin;
-			end = last;
-		} else {
-			/* The last point is "before" the origin point. */
-			start = last;
-			end = origin;
-		}
-	} else {
-		if (!always_grow) {
-			last->x = x;
-			last->y = y + height * delta;
-		}
-
-		if ((origin->y / height < last->y / height) ||
-		    ((origin->y / height == last->y / height) &&
-		     (origin->x / width < last->x / width ))) {
-			/* The origin point is "before" the last point. */
-			start = origin;
-			end = last;
-		} else {
-			/* The last point is "before" the origin point. */
-			start = last;
-			end = origin;
-		}
-
-		/* Extend the selection by moving whichever end of the selection is
-		 * closer to the new point. */
-		if (always_grow) {
-			/* New endpoint is before existing selection. */
-			if ((y / height < ((start->y / height) - delta)) ||
-			    ((y / height == ((start->y / height) - delta)) &&
-			     (x / width < start->x / width))) {
-				start->x = x;
-				start->y = y + height * delta;
+	vte_write_stream_init(&stream, &job->sink, job->flags);
+	do {
+		slice = g_async_queue_pop(job->slices);
+		last = slice == job->screen;
+		if (!last) {
+			if (threaded) {
+				g_idle_add(vte_write_job_next_slice, job);
 			} else {
-				/* New endpoint is after existing selection. */
-				end->x = x;
-				end->y = y + height * delta;
+				vte_write_job_next_slice(job);
 			}
 		}
-	}
-
-#if 0
-	_vte_debug_print(VTE_DEBUG_SELECTION,
-			"Selection is (%ld,%ld) to (%ld,%ld).\n",
-			start->x, start->y, end->x, end->y);
-#endif
-
-	/* Recalculate the selection area in terms of cell positions. */
-
-	sc = &terminal->pvt->selection_start;
-	ec = &terminal->pvt->selection_end;
-
-	sc->row = MAX (0, start->y / height);
-	ec->row = MAX (0, end->y   / height);
-
-	/* Sort x using row cell coordinates */
-	if ((terminal->pvt->selection_block_mode || sc->row == ec->row) && (start->x > end->x)) {
-		struct selection_event_coords *tmp;
-		tmp = start;
-		start = end;
-		end = tmp;
-	}
-
-	/* We want to be more lenient on the user with their column selection.
-	 * We round to closest logical position (positions are located between
-	 * cells).  But we don't want to fully round.  So we divide the cell
-	 * width/height into three parts.  The side parts round to their nearest
-	 * position.  The middle part is always inclusive in the selection.
-	 *
-	 * math_div and no MAX, to allow selecting no cells in the line,
-	 * ie. ec->col = -1, which is essentially equal to copying the
-	 * newline from previous line but no chars from current line. */
-	residual = (width + 1) / 3;
-	sc->col = math_div (start->x + residual, width);
-	ec->col = math_div (end->x - residual, width);
-
-
-	vte_terminal_extend_selection_expand (terminal);
-
-	if (!invalidate_selected && !force &&
-	    0 == memcmp (sc, so, sizeof (*sc)) &&
-	    0 == memcmp (ec, eo, sizeof (*ec)))
-		/* No change */
-		return;
-
-	/* Invalidate */
+		vte_write_stream_snapshot(&stream, slice);
+		vte_snapshot_unref(slice);
+	} while (!last && !stream.stopped);
+	vte_text_stream_finish(&stream);
+}
 
-	if (had_selection) {
+static gpointer
+vte_write_job_thread(gpointer data)
+{
+	struct vte_write_job *job = data;
 
-		if (terminal->pvt->selection_block_mode) {
-			/* Update the selection area diff in block mode. */
+	vte_write_job_run(job, TRUE);
+	g_idle_add(vte_write_job_done, job);
+	return NULL;
+}
 
-			/* The top band */
-			_vte_invalidate_region (terminal,
-						MIN(sc->col, so->col),
-						MAX(ec->col, eo->col),
-						MIN(sc->row, so->row),
-						MAX(sc->row, so->row) - 1,
-						TRUE);
-			/* The bottom band */
-			_vte_invalidate_region (terminal,
-						MIN(sc->col, so->col),
-						MAX(ec->col, eo->col),
-						MIN(ec->row, eo->row) + 1,
-						MAX(ec->row, eo->row),
-						TRUE);
-			/* The left band */
-			_vte_invalidate_region (terminal,
-						MIN(sc->col, so->col),
-						MAX(sc->col, so->col) - 1,
-						MIN(sc->row, so->row),
-						MAX(ec->row, eo->row),
-						TRUE);
-			/* The right band */
-			_vte_invalidate_region (terminal,
-						MIN(ec->col, eo->col) + 1,
-						MAX(ec->col, eo->col),
-						MIN(sc->row, so->row),
-						MAX(ec->row, eo->row),
-						TRUE);
-		} else {
-			/* Update the selection area diff in non-block mode. */
+/**
+ * vte_terminal_write_contents:
+ * @terminal: a #VteTerminal
+ * @fd: a file descriptor open for writing
+ * @flags: a combination of #VteTerminalWriteFlags
+ * @callback: for %VTE_TERMINAL_WRITE_ASYNC, a function to call when done
+ * @data: user data for @callback
+ * @error: return location for a #GError, or %NULL
+ *
+ * Writes the whole of the scrollback and screen to @fd as text, a row at a
+ * time through a buffer of fixed size, so that exporting any amount of
+ * history takes little memory.  With %VTE_TERMINAL_WRITE_ATTRIBUTES, colors
+ * and styles are written as SGR escape sequences.
+ *
+ * With %VTE_TERMINAL_WRITE_ASYNC the writing happens in another thread,
+ * working from a snapshot, and this returns at once; @callback is then
+ * called from the main loop with the outcome, and @fd has to stay open until
+ * it has been.  History which falls off the end of the scrollback before
+ * the writer gets to it is left out, as are rows the ring no longer holds.
+ * Without thread support the same snapshots are written out before this
+ * returns, and @callback is called from the main loop as before.
+ *
+ * Returns: %TRUE on success, %FALSE with @error set if writing failed
+ */
+gboolean
+vte_terminal_write_contents(VteTerminal *terminal, gint fd,
+			    VteTerminalWriteFlags flags,
+			    VteTerminalWriteCallback callback, gpointer data,
+			    GError **error)
+{
+	struct vte_text_stream stream;
+	struct vte_write_sink sink;
+	struct vte_write_job *job;
+	VteScreen *screen;
+	VteRowData *row_data;
+	VteRingIter iter;
+	glong row, end;
 
-			/* The before band */
-			if (sc->row < so->row)
-				_vte_invalidate_region (terminal,
-							sc->col, so->col - 1,
-							sc->row, so->row,
-							FALSE);
-			else if (sc->row > so->row)
-				_vte_invalidate_region (terminal,
-							so->col, sc->col - 1,
-							so->row, sc->row,
-							FALSE);
-			else
-				_vte_invalidate_region (terminal,
-							MIN(sc->col, so->col), MAX(sc->col, so->col) - 1,
-							sc->row, sc->row,
-							TRUE);
+	g_return_val_if_fail(VTE_IS_TERMINAL(terminal), FALSE);
+	g_return_val_if_fail(fd >= 0, FALSE);
+	g_return_val_if_fail(!(flags & VTE_TERMINAL_WRITE_ASYNC) ||
+			     callback != NULL, FALSE);
 
-			/* The after band */
-			if (ec->row < eo->row)
-				_vte_invalidate_region (terminal,
-							ec->col + 1, eo->col,
-							ec->row, eo->row,
-							FALSE);
-			else if (ec->row > eo->row)
-				_vte_invalidate_region (terminal,
-							eo->col + 1, ec->col,
-							eo->row, ec->row,
-							FALSE);
-			else
-				_vte_invalidate_region (terminal,
-							MIN(ec->col, eo->col) + 1, MAX(ec->col, eo->col),
-							ec->row, ec->row,
-							TRUE);
+	screen = terminal->pvt->screen;
+	if (flags & VTE_TERMINAL_WRITE_ASYNC) {
+		job = g_slice_new0(struct vte_write_job);
+		job->terminal = g_object_ref(terminal);
+		job->flags = flags;
+		job->callback = callback;
+		job->data = data;
+		job->source = screen;
+		job->next_row = _vte_ring_delta(screen->row_data);
+		job->history_end = MAX(job->next_row, screen->insert_delta);
+		job->screen = vte_terminal_get_snapshot(terminal,
+				job->history_end,
+				_vte_ring_next(screen->row_data) - 1);
+		job->slices = g_async_queue_new();
+		job->sink.fd = fd;
+		vte_write_job_next_slice(job);
+		if (g_thread_supported() &&
+		    g_thread_create(vte_write_job_thread, job,
+				    FALSE, NULL) != NULL) {
+			return TRUE;
 		}
+		/* Fall back to writing it here, from the same snapshots. */
+		vte_write_job_run(job, FALSE);
+		g_idle_add(vte_write_job_done, job);
+		return TRUE;
 	}
 
-	if (invalidate_selected || !had_selection) {
-		_vte_debug_print(VTE_DEBUG_SELECTION, "Invalidating selection.");
-		vte_terminal_invalidate_selection (terminal);
+	sink.fd = fd;
+	sink.error = NULL;
+	vte_write_stream_init(&stream, &sink, flags);
+	end = _vte_ring_next(screen->row_data);
+	_vte_ring_iter_init(&iter, screen->row_data,
+			    _vte_ring_delta(screen->row_data));
+	for (row = _vte_ring_delta(screen->row_data);
+	     row < end && !stream.stopped;
+	     row++) {
+		row_data = _vte_ring_iter_next(&iter);
+		if (row_data == NULL) {
+			continue;
+		}
+		vte_text_stream_add_row(&stream, row_data, row, 0, G_MAXLONG,
+					!row_data->soft_wrapped);
 	}
+	vte_text_stream_finish(&stream);
 
-	_vte_debug_print(VTE_DEBUG_SELECTION,
-			"Selection changed to "
-			"(%ld,%ld) to (%ld,%ld).\n",
-			sc->col, sc->row, ec->col, ec->row);
-
-	vte_terminal_copy_primary(terminal);
-	vte_terminal_emit_selection_changed(terminal);
-}
-
-static void
-vte_terminal_set_selection_block_mode (VteTerminal *terminal,
-				       gboolean     selection_block_mode)
-{
-	if (G_LIKELY (!terminal->pvt->has_selection))
-		return;
-
-	if (G_LIKELY (terminal->pvt->mouse_last_button != 1))
-		return;
-
-	selection_block_mode = !!selection_block_mode;
-
-	if (terminal->pvt->selection_block_mode != selection_block_mode) {
-		vte_terminal_invalidate_selection (terminal);
-		terminal->pvt->selection_block_mode = selection_block_mode;
-		vte_terminal_extend_selection(terminal,
-					      terminal->pvt->mouse_last_x,
-					      terminal->pvt->mouse_last_y,
-					      FALSE, TRUE);
-		vte_terminal_invalidate_selection (terminal);
+	if (sink.error != NULL) {
+		g_propagate_error(error, sink.error);
+		return FALSE;
 	}
+	return TRUE;
 }
 
-
 /**
- * vte_terminal_select_all:
+ * vte_terminal_get_cursor_position:
  * @terminal: a #VteTerminal
+ * @column: long which will hold the column
+ * @row : long which will hold the row
  *
- * Selects all text within the terminal (including the scrollback buffer).
+ * Reads the location of the insertion cursor and returns it.  The row
+ * coordinate is absolute.
  *
- * Since: 0.16
  */
 void
-vte_terminal_select_all (VteTerminal *terminal)
+vte_terminal_get_cursor_position(VteTerminal *terminal,
+				 glong *column, glong *row)
 {
-	long delta;
+	g_return_if_fail(VTE_IS_TERMINAL(terminal));
+	if (column) {
+		*column = terminal->pvt->screen->cursor_current.col;
+	}
+	if (row) {
+		*row = terminal->pvt->screen->cursor_current.row;
+	}
+}
 
-	g_return_if_fail (VTE_IS_TERMINAL (terminal));
+static GtkClipboard *
+vte_terminal_clipboard_get(VteTerminal *terminal, GdkAtom board)
+{
+	GdkDisplay *display;
+	display = gtk_widget_get_display(&terminal->widget);
+	return gtk_clipboard_get_for_display(display, board);
+}
 
-	vte_terminal_deselect_all (terminal);
+/* Place the selected text onto the clipboard.  Do this asynchronously so that
+ * we get notified when the selection we placed on the clipboard is replaced. */
+static void
+vte_terminal_copy(VteTerminal *terminal, GdkAtom board)
+{
+	GtkClipboard *clipboard;
+	static GtkTargetEntry *targets = NULL;
+	static gint n_targets = 0;
 
-	delta = terminal->pvt->screen->scroll_delta;
+	clipboard = vte_terminal_clipboard_get(terminal, board);
 
+	/* Chuck old selected text and retrieve the newly-selected text. */
+	g_free(terminal->pvt->selection);
+	terminal->pvt->selection =
+		vte_terminal_get_text_range(terminal,
+					    terminal->pvt->selection_start.row,
+					    0,
+					    terminal->pvt->selection_end.row,
+					    terminal->column_count,
+					    vte_cell_is_selected,
+					    NULL,
+					    NULL);
 	terminal->pvt->has_selection = TRUE;
-	terminal->pvt->selecting_had_delta = TRUE;
-	terminal->pvt->selecting_restart = FALSE;
 
-	terminal->pvt->selection_start.col = 0;
-	terminal->pvt->selection_start.row = 0;
-	terminal->pvt->selection_end.col = terminal->column_count;
-	terminal->pvt->selection_end.row = delta + terminal->row_count;
+	/* Place the text on the clipboard. */
+	if (terminal->pvt->selection != NULL) {
+		_vte_debug_print(VTE_DEBUG_SELECTION,
+				"Assuming ownership of selection.\n");
+		if (!targets) {
+			GtkTargetList *list;
+			GList *l;
+			int i;
 
-	_vte_debug_print(VTE_DEBUG_SELECTION, "Selecting *all* text.\n");
+			list = gtk_target_list_new (NULL, 0);
+			gtk_target_list_add_text_targets (list, 0);
 
-	g_free (terminal->pvt->selection);
-	terminal->pvt->selection =
-		vte_terminal_get_text_range (terminal,
-				0, 0,
-				delta + terminal->row_count,
-				terminal->column_count,
-				vte_cell_is_selected,
-				NULL, NULL);
+			n_targets = g_list_length (list->list);
+			targets = g_new0 (GtkTargetEntry, n_targets);
+			for (l = list->list, i = 0; l; l = l->next, i++) {
+				GtkTargetPair *pair = (GtkTargetPair *)l->data;
+				targets[i].target = gdk_atom_name (pair->target);
+			}
+			gtk_target_list_unref (list);
+		}
 
-	vte_terminal_emit_selection_changed (terminal);
-	_vte_invalidate_all (terminal);
+		gtk_clipboard_set_with_owner(clipboard,
+					     targets,
+					     n_targets,
+					     vte_terminal_copy_cb,
+					     vte_terminal_clear_cb,
+					     G_OBJECT(terminal));
+		gtk_clipboard_set_can_store(clipboard, NULL, 0);
+	}
 }
 
-/**
- * vte_terminal_select_none:
- * @terminal: a #VteTerminal
- *
- * Clears the current selection.
- *
- * Since: 0.16
- */
-void
-vte_terminal_select_none (VteTerminal *terminal)
+/* Paste from the given clipboard. */
+static void
+vte_terminal_paste(VteTerminal *terminal, GdkAtom board)
 {
-	g_return_if_fail (VTE_IS_TERMINAL (terminal));
-
-	_vte_debug_print(VTE_DEBUG_SELECTION, "Clearing selection.\n");
-
-	vte_terminal_deselect_all (terminal);
+	GtkClipboard *clipboard;
+	clipboard = vte_terminal_clipboard_get(terminal, board);
+	if (clipboard != NULL) {
+		_vte_debug_print(VTE_DEBUG_SELECTION,
+				"Requesting clipboard contents.\n");
+		gtk_clipboard_request_text(clipboard,
+					   vte_terminal_paste_cb,
+					   terminal);
+	}
 }
 
-
-
-/* Autoscroll a bit. */
-static gboolean
-vte_terminal_autoscroll(VteTerminal *terminal)
+static glong
+find_start_column (VteTerminal *terminal, glong col, glong row)
 {
-	gboolean extend = FALSE;
-	long x, y, xmax, ymax;
-	glong adj;
-
-	/* Provide an immediate effect for mouse wigglers. */
-	if (terminal->pvt->mouse_last_y < 0) {
-		if (terminal->adjustment) {
-			/* Try to scroll up by one line. */
-			adj = CLAMP(terminal->pvt->screen->scroll_delta - 1,
-				    terminal->adjustment->lower,
-				    MAX (terminal->adjustment->lower,
-					    terminal->adjustment->upper -
-					    terminal->row_count));
-			vte_terminal_queue_adjustment_value_changed (terminal, adj);
-			extend = TRUE;
-		}
-		_vte_debug_print(VTE_DEBUG_EVENTS, "Autoscrolling down.\n");
-	}
-	if (terminal->pvt->mouse_last_y >=
-	    terminal->row_count * terminal->char_height) {
-		if (terminal->adjustment) {
-			/* Try to scroll up by one line. */
-			adj = CLAMP(terminal->pvt->screen->scroll_delta + 1,
-				    terminal->adjustment->lower,
-				    MAX (terminal->adjustment->lower,
-					    terminal->adjustment->upper -
-					    terminal->row_count));
-			vte_terminal_queue_adjustment_value_changed (terminal, adj);
-			extend = TRUE;
+	VteRowData *row_data = _vte_terminal_find_row_data (terminal, row);
+	if (G_UNLIKELY (col < 0))
+		return col;
+	if (row_data != NULL) {
+		struct vte_charcell *cell = _vte_row_data_find_charcell(row_data, col);
+		while (cell != NULL && cell->attr.fragment && col > 0) {
+			cell = _vte_row_data_find_charcell(row_data, --col);
 		}
-		_vte_debug_print(VTE_DEBUG_EVENTS, "Autoscrolling up.\n");
 	}
-	if (extend) {
-		/* Don't select off-screen areas.  That just confuses people. */
-		xmax = terminal->column_count * terminal->char_width;
-		ymax = terminal->row_count * terminal->char_height;
-
-		x = CLAMP(terminal->pvt->mouse_last_x, 0, xmax);
-		y = CLAMP(terminal->pvt->mouse_last_y, 0, ymax);
-		/* If we clamped the Y, mess with the X to get the entire
-		 * lines. */
-		if (terminal->pvt->mouse_last_y < 0 && !terminal->pvt->selection_block_mode) {
-			x = 0;
+	return MAX(col, 0);
+}
+static glong
+find_end_column (VteTerminal *terminal, glong col, glong row)
+{
+	VteRowData *row_data = _vte_terminal_find_row_data (terminal, row);
+	gint columns = 0;
+	if (G_UNLIKELY (col < 0))
+		return col;
+	if (row_data != NULL) {
+		struct vte_charcell *cell = _vte_row_data_find_charcell(row_data, col);
+		while (cell != NULL && cell->attr.fragment && col > 0) {
+			cell = _vte_row_data_find_charcell(row_data, --col);
 		}
-		if (terminal->pvt->mouse_last_y >= ymax && !terminal->pvt->selection_block_mode) {
-			x = terminal->column_count * terminal->char_width;
+		if (cell) {
+			columns = cell->attr.columns - 1;
 		}
-		/* Extend selection to cover the newly-scrolled area. */
-		vte_terminal_extend_selection(terminal, x, y, FALSE, TRUE);
-	} else {
-		/* Stop autoscrolling. */
-		terminal->pvt->mouse_autoscroll_tag = 0;
 	}
-	return (terminal->pvt->mouse_autoscroll_tag != 0);
+	return MIN(col + columns, terminal->column_count);
 }
 
-/* Start autoscroll. */
 static void
-vte_terminal_start_autoscroll(VteTerminal *terminal)
+vte_terminal_invalidate_selection (VteTerminal *terminal)
 {
-	if (terminal->pvt->mouse_autoscroll_tag == 0) {
-		terminal->pvt->mouse_autoscroll_tag =
-			g_timeout_add_full(G_PRIORITY_LOW,
-					   666 / terminal->row_count,
-					   (GSourceFunc)vte_terminal_autoscroll,
-					   terminal,
-					   NULL);
-	}
+	_vte_invalidate_region (terminal,
+				terminal->pvt->selection_start.col,
+				terminal->pvt->selection_end.col,
+				terminal->pvt->selection_start.row,
+				terminal->pvt->selection_end.row,
+				terminal->pvt->selection_block_mode);
 }
 
-/* Stop autoscroll. */
-static void
-vte_terminal_stop_autoscroll(VteTerminal *terminal)
-{
-	if (terminal->pvt->mouse_autoscroll_tag != 0) {
-		g_source_remove(terminal->pvt->mouse_autoscroll_tag);
-		terminal->pvt->mouse_autoscroll_tag = 0;
-	}
-}
 
-/* Read and handle a motion event. */
-static gboolean
-vte_terminal_motion_notify(GtkWidget *widget, GdkEventMotion *event)
+/* Start selection at the location of the event. */
+static void
+vte_terminal_start_selection(VteTerminal *terminal, GdkEventButton *event,
+			     enum vte_selection_type selection_type)
 {
-	VteTerminal *terminal;
-	int width, height;
-	long x, y;
-
-	/* check to see if it matters */
-	if (!GTK_WIDGET_DRAWABLE(widget)) {
-		return TRUE;
-	}
-
-	terminal = VTE_TERMINAL(widget);
-	x = event->x - VTE_PAD_WIDTH;
-	y = event->y - VTE_PAD_WIDTH;
-	width = terminal->char_width;
-	height = terminal->char_height;
+	long delta;
 
-	_vte_debug_print(VTE_DEBUG_EVENTS,
-			"Motion notify (%ld,%ld) [%ld, %ld].\n",
-			x, y,
-			x / width, y / height + terminal->pvt->screen->scroll_delta);
+	if (terminal->pvt->selection_block_mode)
+		selection_type = selection_type_char;
 
-	/* Read the modifiers. */
-	vte_terminal_read_modifiers (terminal, (GdkEvent*) event);
+	/* Record that we have the selection, and where it started. */
+	delta = terminal->pvt->screen->scroll_delta;
+	terminal->pvt->has_selection = TRUE;
+	terminal->pvt->selection_last.x = event->x - VTE_PAD_WIDTH;
+	terminal->pvt->selection_last.y = event->y - VTE_PAD_WIDTH +
+					  (terminal->char_height * delta);
 
-	if (terminal->pvt->mouse_last_button) {
-		vte_terminal_match_hilite_hide (terminal);
-	} else {
-		/* Hilite any matches. */
-		vte_terminal_match_hilite(terminal, x, y);
-		/* Show the cursor. */
-		_vte_terminal_set_pointer_visible(terminal, TRUE);
-	}
+	/* Decide whether or not to restart on the next drag. */
+	switch (selection_type) {
+	case selection_type_char:
+		/* Restart selection once we register a drag. */
+		terminal->pvt->selecting_restart = TRUE;
+		terminal->pvt->has_selection = FALSE;
+		terminal->pvt->selecting_had_delta = FALSE;
 
-	switch (event->type) {
-	case GDK_MOTION_NOTIFY:
-		switch (terminal->pvt->mouse_last_button) {
-		case 1:
-			_vte_debug_print(VTE_DEBUG_EVENTS, "Mousing drag 1.\n");
-			if ((terminal->pvt->modifiers & GDK_SHIFT_MASK) ||
-			    !terminal->pvt->mouse_tracking_mode) {
-				vte_terminal_extend_selection(terminal,
-							      x, y, FALSE, FALSE);
-			} else {
-				vte_terminal_maybe_send_mouse_drag(terminal,
-								   event);
-			}
-			break;
-		default:
-			vte_terminal_maybe_send_mouse_drag(terminal, event);
-			break;
-		}
+		terminal->pvt->selection_origin = terminal->pvt->selection_last;
 		break;
-	default:
+	case selection_type_word:
+	case selection_type_line:
+		/* Mark the newly-selected areas now. */
+		terminal->pvt->selecting_restart = FALSE;
+		terminal->pvt->has_selection = FALSE;
+		terminal->pvt->selecting_had_delta = FALSE;
 		break;
 	}
 
-	/* Start scrolling if we need to. */
-	if (event->y < VTE_PAD_WIDTH ||
-	    event->y >= terminal->row_count * height + VTE_PAD_WIDTH) {
-		switch (terminal->pvt->mouse_last_button) {
-		case 1:
-			if (!terminal->pvt->mouse_tracking_mode) {
-				/* Give mouse wigglers something. */
-				vte_terminal_autoscroll(terminal);
-				/* Start a timed autoscroll if we're not doing it
-				 * already. */
-				vte_terminal_start_autoscroll(terminal);
-			}
-			break;
-		case 2:
-		case 3:
-		default:
-			break;
-		}
-	}
+	/* Record the selection type. */
+	terminal->pvt->selection_type = selection_type;
+	terminal->pvt->selecting = TRUE;
 
-	/* Save the pointer coordinates for later use. */
-	terminal->pvt->mouse_last_x = x;
-	terminal->pvt->mouse_last_y = y;
+	_vte_debug_print(VTE_DEBUG_SELECTION,
+			"Selection started at (%ld,%ld).\n",
+			terminal->pvt->selection_start.col,
+			terminal->pvt->selection_start.row);
 
-	return TRUE;
+	/* Temporarily stop caring about input from the child. */
+	//_vte_terminal_disconnect_pty_read(terminal);
 }
 
-/* Read and handle a pointing device buttonpress event. */
-static gint
-vte_terminal_button_press(GtkWidget *widget, GdkEventButton *event)
+static long
+math_div (long a, long b)
 {
-	VteTerminal *terminal;
-	long height, width, delta;
-	gboolean handled = FALSE;
-	gboolean start_selecting = FALSE, extend_selecting = FALSE;
-	long cellx, celly;
-	long x,y;
+	if (G_LIKELY (a >= 0))
+		return a / b;
+	else
+		return (a / b) - 1;
+}
 
-	x = event->x - VTE_PAD_WIDTH;
-	y = event->y - VTE_PAD_WIDTH;
+/* Helper */
+static void
+vte_terminal_extend_selection_expand (VteTerminal *terminal)
+{
+	long i, j;
+	VteScreen *screen;
+	VteRowData *rowdata;
+	struct vte_charcell *cell;
+	struct selection_cell_coords *sc, *ec;
 
-	terminal = VTE_TERMINAL(widget);
-	height = terminal->char_height;
-	width = terminal->char_width;
-	delta = terminal->pvt->screen->scroll_delta;
+	if (terminal->pvt->selection_block_mode)
+		return;
 
-	/* Hilite any matches. */
-	vte_terminal_match_hilite(terminal, x, y);
+	screen = terminal->pvt->screen;
+	sc = &terminal->pvt->selection_start;
+	ec = &terminal->pvt->selection_end;
 
-	_vte_terminal_set_pointer_visible(terminal, TRUE);
+	/* Extend the selection to handle end-of-line cases, word, and line
+	 * selection.  We do this here because calculating it once is cheaper
+	 * than recalculating for each cell as we render it. */
 
-	/* Read the modifiers. */
-	vte_terminal_read_modifiers (terminal, (GdkEvent*) event);
+	/* Handle end-of-line at the start-cell. */
+	rowdata = _vte_terminal_find_row_data(terminal, sc->row);
+	if (rowdata != NULL) {
+		/* Find the last non-empty character on the first line. */
+		for (i = rowdata->cells->len; i > 0; i--) {
+			cell = &g_array_index(rowdata->cells,
+					struct vte_charcell, i - 1);
+			if (cell->attr.fragment || cell->c != 0)
+				break;
+		}
+		/* If the start point is to its right, then move the
+		 * startpoint up to the beginning of the next line
+		 * unless that would move the startpoint after the end
+		 * point, or we're in select-by-line mode. */
+		if ((sc->col >= i) &&
+				(terminal->pvt->selection_type != selection_type_line)) {
+			if (sc->row < ec->row) {
+				sc->col = 0;
+				sc->row++;
+			} else {
+				sc->col = i;
+			}
+		}
+	} else {
+		/* Snap to the leftmost column. */
+		sc->col = 0;
+	}
+	sc->col = find_start_column (terminal, sc->col, sc->row);
 
-	/* Convert the event coordinates to cell coordinates. */
-	cellx = x / width;
-	celly = y / height + delta;
+	/* Handle end-of-line at the end-cell. */
+	rowdata = _vte_terminal_find_row_data(terminal, ec->row);
+	if (rowdata != NULL) {
+		/* Find the last non-empty character on the last line. */
+		for (i = rowdata->cells->len; i > 0; i--) {
+			cell = &g_array_index(rowdata->cells,
+					struct vte_charcell, i - 1);
+			if (cell->attr.fragment || cell->c != 0)
+				break;
+		}
+		/* If the end point is to its right, then extend the
+		 * endpoint as far right as we can expect. */
+		if (ec->col >= i) {
+			ec->col = MAX(ec->col,
+				    MAX(terminal->column_count - 1,
+					(long) rowdata->cells->len));
+		}
+	} else {
+		/* Snap to the rightmost column, only if selecting anything of
+		 * this row. */
+		if (ec->col >= 0)
+			ec->col = MAX(ec->col, terminal->column_count - 1);
+	}
+	ec->col = find_end_column (terminal, ec->col, ec->row);
 
-	switch (event->type) {
-	case GDK_BUTTON_PRESS:
-		_vte_debug_print(VTE_DEBUG_EVENTS,
-				"Button %d single-click at (%ld,%ld)\n",
-				event->button,
-				x, y + terminal->char_height * delta);
-		/* Handle this event ourselves. */
-		switch (event->button) {
-		case 1:
-			_vte_debug_print(VTE_DEBUG_EVENTS,
-					"Handling click ourselves.\n");
-			/* Grab focus. */
-			if (!GTK_WIDGET_HAS_FOCUS(widget)) {
-				gtk_widget_grab_focus(widget);
-			}
 
-			/* If we're in event mode, and the user held down the
-			 * shift key, we start selecting. */
-			if (terminal->pvt->mouse_tracking_mode) {
-				if (terminal->pvt->modifiers & GDK_SHIFT_MASK) {
-					start_selecting = TRUE;
+	/* Now extend again based on selection type. */
+	switch (terminal->pvt->selection_type) {
+	case selection_type_char:
+		/* Nothing more to do. */
+		break;
+	case selection_type_word:
+		/* Keep selecting to the left as long as the next character we
+		 * look at is of the same class as the current start point. */
+		i = sc->col;
+		j = sc->row;
+		while (_vte_ring_contains(screen->row_data, j)) {
+			/* Get the data for the row we're looking at. */
+			rowdata = _vte_ring_index(screen->row_data,
+						  VteRowData *, j);
+			if (rowdata == NULL) {
+				break;
+			}
+			/* Back up. */
+			for (i = (j == sc->row) ?
+				 sc->col :
+				 terminal->column_count - 1;
+			     i > 0;
+			     i--) {
+				if (vte_same_class(terminal,
+						   i - 1,
+						   j,
+						   i,
+						   j)) {
+					sc->col = i - 1;
+					sc->row = j;
+				} else {
+					break;
 				}
+			}
+			if (i > 0) {
+				/* We hit a stopping point, so stop. */
+				break;
 			} else {
-				/* If the user hit shift, then extend the
-				 * selection instead. */
-				if ((terminal->pvt->modifiers & GDK_SHIFT_MASK) &&
-				    (terminal->pvt->has_selection ||
-				     terminal->pvt->selecting_restart) &&
-				    !vte_cell_is_selected(terminal,
-							  cellx,
-							  celly,
-							  NULL)) {
-					extend_selecting = TRUE;
+				if (vte_line_is_wrappable(terminal, j - 1) &&
+				    vte_same_class(terminal,
+						   terminal->column_count - 1,
+						   j - 1,
+						   0,
+						   j)) {
+					/* Move on to the previous line. */
+					j--;
+					sc->col = terminal->column_count - 1;
+					sc->row = j;
 				} else {
-					start_selecting = TRUE;
+					break;
 				}
 			}
-			if (start_selecting) {
-				vte_terminal_deselect_all(terminal);
-				vte_terminal_start_selection(terminal,
-							     event,
-							     selection_type_char);
-				handled = TRUE;
-			}
-			if (extend_selecting) {
-				vte_terminal_extend_selection(terminal,
-							      x, y,
-							      !terminal->pvt->selecting_restart, TRUE);
-				handled = TRUE;
+		}
+		/* Keep selecting to the right as long as the next character we
+		 * look at is of the same class as the current end point. */
+		i = ec->col;
+		j = ec->row;
+		while (_vte_ring_contains(screen->row_data, j)) {
+			/* Get the data for the row we're looking at. */
+			rowdata = _vte_ring_index(screen->row_data,
+						  VteRowData *, j);
+			if (rowdata == NULL) {
+				break;
 			}
-			break;
-		/* Paste if the user pressed shift or we're not sending events
-		 * to the app. */
-		case 2:
-			if ((terminal->pvt->modifiers & GDK_SHIFT_MASK) ||
-			    !terminal->pvt->mouse_tracking_mode) {
-				vte_terminal_paste_primary(terminal);
-				handled = TRUE;
+			/* Move forward. */
+			for (i = (j == ec->row) ?
+				 ec->col :
+				 0;
+			     i < terminal->column_count - 1;
+			     i++) {
+				if (vte_same_class(terminal,
+						   i,
+						   j,
+						   i + 1,
+						   j)) {
+					ec->col = i + 1;
+					ec->row = j;
+				} else {
+					break;
+				}
 			}
-			break;
-		case 3:
-		default:
-			break;
-		}
-		/* If we haven't done anything yet, try sending the mouse
-		 * event to the app. */
-		if (handled == FALSE) {
-			vte_terminal_maybe_send_mouse_button(terminal, event);
-			handled = TRUE;
-		}
-		break;
-	case GDK_2BUTTON_PRESS:
-		_vte_debug_print(VTE_DEBUG_EVENTS,
-				"Button %d double-click at (%ld,%ld)\n",
-				event->button,
-				x, y + (terminal->char_height * delta));
-		switch (event->button) {
-		case 1:
-			if ((terminal->pvt->modifiers & GDK_SHIFT_MASK) ||
-			    !terminal->pvt->mouse_tracking_mode) {
-				vte_terminal_start_selection(terminal,
-							     event,
-							     selection_type_word);
-				vte_terminal_extend_selection(terminal,
-							      x, y, FALSE, TRUE);
+			if (i < terminal->column_count - 1) {
+				/* We hit a stopping point, so stop. */
+				break;
+			} else {
+				if (vte_line_is_wrappable(terminal, j) &&
+				    vte_same_class(terminal,
+						   terminal->column_count - 1,
+						   j,
+						   0,
+						   j + 1)) {
+					/* Move on to the next line. */
+					j++;
+					ec->col = 0;
+					ec->row = j;
+				} else {
+					break;
+				}
 			}
-			break;
-		case 2:
-		case 3:
-		default:
-			break;
 		}
 		break;
-	case GDK_3BUTTON_PRESS:
-		_vte_debug_print(VTE_DEBUG_EVENTS,
-				"Button %d triple-click at (%ld,%ld).\n",
-				event->button,
-				x, y + (terminal->char_height * delta));
-		switch (event->button) {
-		case 1:
-			if ((terminal->pvt->modifiers & GDK_SHIFT_MASK) ||
-			    !terminal->pvt->mouse_tracking_mode) {
-				vte_terminal_start_selection(terminal,
-							     event,
-							     selection_type_line);
-				vte_terminal_extend_selection(terminal,
-							      x, y, FALSE, TRUE);
+	case selection_type_line:
+		/* Extend the selection to the beginning of the start line. */
+		sc->col = 0;
+		/* Now back up as far as we can go. */
+		j = sc->row;
+		while (_vte_ring_contains(screen->row_data, j - 1) &&
+		       vte_line_is_wrappable(terminal, j - 1)) {
+			j--;
+			sc->row = j;
+		}
+		/* And move forward as far as we can go. */
+		j = ec->row;
+		while (_vte_ring_contains(screen->row_data, j) &&
+		       vte_line_is_wrappable(terminal, j)) {
+			j++;
+			ec->row = j;
+		}
+		/* Make sure we include all of the last line. */
+		ec->col = terminal->column_count - 1;
+		if (_vte_ring_contains(screen->row_data, ec->row)) {
+			rowdata = _vte_ring_index(screen->row_data,
+						  VteRowData *, ec->row);
+			if (rowdata != NULL) {
+				ec->col = MAX(ec->col, (long) rowdata->cells->len);
 			}
-			break;
-		case 2:
-		case 3:
-		default:
-			break;
 		}
-	default:
 		break;
 	}
-
-	/* Save the pointer state for later use. */
-	terminal->pvt->mouse_last_button = event->button;
-	terminal->pvt->mouse_last_x = x;
-	terminal->pvt->mouse_last_y = y;
-
-	return TRUE;
 }
 
-/* Read and handle a pointing device buttonrelease event. */
-static gint
-vte_terminal_button_release(GtkWidget *widget, GdkEventButton *event)
+/* Extend selection to include the given event coordinates. */
+static void
+vte_terminal_extend_selection(VteTerminal *terminal, long x, long y,
+			      gboolean always_grow, gboolean force)
 {
-	VteTerminal *terminal;
-	gboolean handled = FALSE;
-	int x, y;
+	VteScreen *screen;
+	int width, height;
+	long delta, residual;
+	struct selection_event_coords *origin, *last, *start, *end;
+	struct selection_cell_coords old_start, old_end, *sc, *ec, *so, *eo;
+	gboolean invalidate_selected = FALSE;
+	gboolean had_selection;
 
-	x = event->x - VTE_PAD_WIDTH;
-	y = event->y - VTE_PAD_WIDTH;
+	height = terminal->char_height;
+	width = terminal->char_width;
 
-	terminal = VTE_TERMINAL(widget);
+	/* Confine y into the visible area. (#563024) */
+	if (y < 0) {
+		y = 0;
+		if (!terminal->pvt->selection_block_mode)
+			x = 0;
+	} else if (y >= terminal->row_count * height) {
+		if (!terminal->pvt->selection_block_mode) {
+			y = terminal->row_count * height;
+			x = -1;
+		} else {
+			y = terminal->row_count * height - 1;
+		}
+	}
 
-	/* Hilite any matches. */
-	vte_terminal_match_hilite(terminal, x, y);
+	screen = terminal->pvt->screen;
+	old_start = terminal->pvt->selection_start;
+	old_end = terminal->pvt->selection_end;
+	so = &old_start;
+	eo = &old_end;
 
-	_vte_terminal_set_pointer_visible(terminal, TRUE);
+	/* Convert the event coordinates to cell coordinates. */
+	delta = screen->scroll_delta;
 
-	/* Disconnect from autoscroll requests. */
-	vte_terminal_stop_autoscroll(terminal);
+	/* If we're restarting on a drag, then mark this as the start of
+	 * the selected block. */
+	if (terminal->pvt->selecting_restart) {
+		vte_terminal_deselect_all(terminal);
+		invalidate_selected = TRUE;
+		_vte_debug_print(VTE_DEBUG_SELECTION,
+				"Selection delayed start at (%ld,%ld).\n",
+				terminal->pvt->selection_origin.x / width,
+				terminal->pvt->selection_origin.y / height);
+	}
 
-	/* Read the modifiers. */
-	vte_terminal_read_modifiers (terminal, (GdkEvent*) event);
+	/* Recognize that we've got a selected block. */
+	had_selection = terminal->pvt->has_selection;
+	terminal->pvt->has_selection = TRUE;
+	terminal->pvt->selecting_had_delta = TRUE;
+	terminal->pvt->selecting_restart = FALSE;
 
-	switch (event->type) {
-	case GDK_BUTTON_RELEASE:
-		_vte_debug_print(VTE_DEBUG_EVENTS,
-				"Button %d released at (%d,%d).\n",
-				event->button, x, y);
-		switch (event->button) {
-		case 1:
-			/* If Shift is held down, or we're not in events mode,
-			 * copy the selected text. */
-			if (terminal->pvt->selecting || !terminal->pvt->mouse_tracking_mode) {
-				/* Copy only if something was selected. */
-				if (terminal->pvt->has_selection &&
-				    !terminal->pvt->selecting_restart &&
-				    terminal->pvt->selecting_had_delta) {
-					vte_terminal_copy_primary(terminal);
-				}
-				terminal->pvt->selecting = FALSE;
-				handled = TRUE;
-			}
-			/* Reconnect to input from the child if we paused it. */
-			//_vte_terminal_connect_pty_read(terminal);
-			break;
-		case 2:
-			if ((terminal->pvt->modifiers & GDK_SHIFT_MASK) ||
-			    !terminal->pvt->mouse_tracking_mode) {
-				handled = TRUE;
-			}
-			break;
-		case 3:
-		default:
-			break;
+	/* If we're not in always-grow mode, update the last location of
+	 * the selection. */
+	last = &terminal->pvt->selection_last;
+
+	/* Map the origin and last selected points to a start and end. */
+	origin = &terminal->pvt->selection_origin;
+	if (terminal->pvt->selection_block_mode) {
+		last->x = x;
+		last->y = y + height * delta;
+
+		/* We don't support always_grow in block mode */
+		if (always_grow)
+			vte_terminal_invalidate_selection (terminal);
+
+		if (origin->y <= last->y) {
+			/* The origin point is "before" the last point. */
+			start = origin;
+			end = last;
+		} else {
+			/* The last point is "before" the origin point. */
+			start = last;
+			end = origin;
 		}
-		if (handled == FALSE) {
-			vte_terminal_maybe_send_mouse_button(terminal, event);
-			handled = TRUE;
+	} else {
+		if (!always_grow) {
+			last->x = x;
+			last->y = y + height * delta;
 		}
-		break;
-	default:
-		break;
+
+		if ((origin->y / height < last->y / height) ||
+		    ((origin->y / height == last->y / height) &&
+		     (origin->x / width < last->x / width ))) {
+			/* The origin point is "before" the last point. */
+			start = origin;
+			end = last;
+		} else {
+			/* The last point is "before" the origin point. */
+			start = last;
+			end = origin;
+		}
+
+		/* Extend the selection by moving whichever end of the selection is
+		 * closer to the new point. */
+		if (always_grow) {
+			/* New endpoint is before existing selection. */
+			if ((y / height < ((start->y / height) - delta)) ||
+			    ((y / height == ((start->y / height) - delta)) &&
+			     (x / width < start->x / width))) {
+				start->x = x;
+				start->y = y + height * delta;
+			} else {
+				/* New endpoint is after existing selection. */
+				end->x = x;
+				end->y = y + height * delta;
+			}
+		}
+	}
+
+#if 0
+	_vte_debug_print(VTE_DEBUG_SELECTION,
+			"Selection is (%ld,%ld) to (%ld,%ld).\n",
+			start->x, start->y, end->x, end->y);
+#endif
+
+	/* Recalculate the selection area in terms of cell positions. */
+
+	sc = &terminal->pvt->selection_start;
+	ec = &terminal->pvt->selection_end;
+
+	sc->row = MAX (0, start->y / height);
+	ec->row = MAX (0, end->y   / height);
+
+	/* Sort x using row cell coordinates */
+	if ((terminal->pvt->selection_block_mode || sc->row == ec->row) && (start->x > end->x)) {
+		struct selection_event_coords *tmp;
+		tmp = start;
+		start = end;
+		end = tmp;
+	}
+
+	/* We want to be more lenient on the user with their column selection.
+	 * We round to closest logical position (positions are located between
+	 * cells).  But we don't want to fully round.  So we divide the cell
+	 * width/height into three parts.  The side parts round to their nearest
+	 * position.  The middle part is always inclusive in the selection.
+	 *
+	 * math_div and no MAX, to allow selecting no cells in the line,
+	 * ie. ec->col = -1, which is essentially equal to copying the
+	 * newline from previous line but no chars from current line. */
+	residual = (width + 1) / 3;
+	sc->col = math_div (start->x + residual, width);
+	ec->col = math_div (end->x - residual, width);
+
+
+	vte_terminal_extend_selection_expand (terminal);
+
+	if (!invalidate_selected && !force &&
+	    0 == memcmp (sc, so, sizeof (*sc)) &&
+	    0 == memcmp (ec, eo, sizeof (*ec)))
+		/* No change */
+		return;
+
+	/* Invalidate */
+
+	if (had_selection) {
+
+		if (terminal->pvt->selection_block_mode) {
+			/* Update the selection area diff in block mode. */
+
+			/* The top band */
+			_vte_invalidate_region (terminal,
+						MIN(sc->col, so->col),
+						MAX(ec->col, eo->col),
+						MIN(sc->row, so->row),
+						MAX(sc->row, so->row) - 1,
+						TRUE);
+			/* The bottom band */
+			_vte_invalidate_region (terminal,
+						MIN(sc->col, so->col),
+						MAX(ec->col, eo->col),
+						MIN(ec->row, eo->row) + 1,
+						MAX(ec->row, eo->row),
+						TRUE);
+			/* The left band */
+			_vte_invalidate_region (terminal,
+						MIN(sc->col, so->col),
+						MAX(sc->col, so->col) - 1,
+						MIN(sc->row, so->row),
+						MAX(ec->row, eo->row),
+						TRUE);
+			/* The right band */
+			_vte_invalidate_region (terminal,
+						MIN(ec->col, eo->col) + 1,
+						MAX(ec->col, eo->col),
+						MIN(sc->row, so->row),
+						MAX(ec->row, eo->row),
+						TRUE);
+		} else {
+			/* Update the selection area diff in non-block mode. */
+
+			/* The before band */
+			if (sc->row < so->row)
+				_vte_invalidate_region (terminal,
+							sc->col, so->col - 1,
+							sc->row, so->row,
+							FALSE);
+			else if (sc->row > so->row)
+				_vte_invalidate_region (terminal,
+							so->col, sc->col - 1,
+							so->row, sc->row,
+							FALSE);
+			else
+				_vte_invalidate_region (terminal,
+							MIN(sc->col, so->col), MAX(sc->col, so->col) - 1,
+							sc->row, sc->row,
+							TRUE);
+
+			/* The after band */
+			if (ec->row < eo->row)
+				_vte_invalidate_region (terminal,
+							ec->col + 1, eo->col,
+							ec->row, eo->row,
+							FALSE);
+			else if (ec->row > eo->row)
+				_vte_invalidate_region (terminal,
+							eo->col + 1, ec->col,
+							eo->row, ec->row,
+							FALSE);
+			else
+				_vte_invalidate_region (terminal,
+							MIN(ec->col, eo->col) + 1, MAX(ec->col, eo->col),
+							ec->row, ec->row,
+							TRUE);
+		}
+	}
+
+	if (invalidate_selected || !had_selection) {
+		_vte_debug_print(VTE_DEBUG_SELECTION, "Invalidating selection.");
+		vte_terminal_invalidate_selection (terminal);
+	}
+
+	_vte_debug_print(VTE_DEBUG_SELECTION,
+			"Selection changed to "
+			"(%ld,%ld) to (%ld,%ld).\n",
+			sc->col, sc->row, ec->col, ec->row);
+
+	vte_terminal_copy_primary(terminal);
+	vte_terminal_emit_selection_changed(terminal);
+}
+
+static void
+vte_terminal_set_selection_block_mode (VteTerminal *terminal,
+				       gboolean     selection_block_mode)
+{
+	if (G_LIKELY (!terminal->pvt->has_selection))
+		return;
+
+	if (G_LIKELY (terminal->pvt->mouse_last_button != 1))
+		return;
+
+	selection_block_mode = !!selection_block_mode;
+
+	if (terminal->pvt->selection_block_mode != selection_block_mode) {
+		vte_terminal_invalidate_selection (terminal);
+		terminal->pvt->selection_block_mode = selection_block_mode;
+		/* Block mode changes where lines end in the extracted text. */
+		terminal->pvt->text_damage_all = TRUE;
+		vte_terminal_extend_selection(terminal,
+					      terminal->pvt->mouse_last_x,
+					      terminal->pvt->mouse_last_y,
+					      FALSE, TRUE);
+		vte_terminal_invalidate_selection (terminal);
+	}
+}
+
+
+/**
+ * vte_terminal_select_all:
+ * @terminal: a #VteTerminal
+ *
+ * Selects all text within the terminal (including the scrollback buffer).
+ *
+ * Since: 0.16
+ */
+void
+vte_terminal_select_all (VteTerminal *terminal)
+{
+	long delta;
+
+	g_return_if_fail (VTE_IS_TERMINAL (terminal));
+
+	vte_terminal_deselect_all (terminal);
+
+	delta = terminal->pvt->screen->scroll_delta;
+
+	terminal->pvt->has_selection = TRUE;
+	terminal->pvt->selecting_had_delta = TRUE;
+	terminal->pvt->selecting_restart = FALSE;
+
+	terminal->pvt->selection_start.col = 0;
+	terminal->pvt->selection_start.row = 0;
+	terminal->pvt->selection_end.col = terminal->column_count;
+	terminal->pvt->selection_end.row = delta + terminal->row_count;
+
+	_vte_debug_print(VTE_DEBUG_SELECTION, "Selecting *all* text.\n");
+
+	g_free (terminal->pvt->selection);
+	terminal->pvt->selection =
+		vte_terminal_get_text_range (terminal,
+				0, 0,
+				delta + terminal->row_count,
+				terminal->column_count,
+				vte_cell_is_selected,
+				NULL, NULL);
+
+	vte_terminal_emit_selection_changed (terminal);
+	_vte_invalidate_all (terminal);
+}
+
+/**
+ * vte_terminal_select_none:
+ * @terminal: a #VteTerminal
+ *
+ * Clears the current selection.
+ *
+ * Since: 0.16
+ */
+void
+vte_terminal_select_none (VteTerminal *terminal)
+{
+	g_return_if_fail (VTE_IS_TERMINAL (terminal));
+
+	_vte_debug_print(VTE_DEBUG_SELECTION, "Clearing selection.\n");
+
+	vte_terminal_deselect_all (terminal);
+}
+
+
+
+/* Autoscroll a bit. */
+static gboolean
+vte_terminal_autoscroll(VteTerminal *terminal)
+{
+	gboolean extend = FALSE;
+	long x, y, xmax, ymax;
+	glong adj;
+
+	/* Provide an immediate effect for mouse wigglers. */
+	if (terminal->pvt->mouse_last_y < 0) {
+		if (terminal->adjustment) {
+			/* Try to scroll up by one line. */
+			adj = CLAMP(terminal->pvt->screen->scroll_delta - 1,
+				    terminal->adjustment->lower,
+				    MAX (terminal->adjustment->lower,
+					    terminal->adjustment->upper -
+					    terminal->row_count));
+			vte_terminal_queue_adjustment_value_changed (terminal, adj);
+			extend = TRUE;
+		}
+		_vte_debug_print(VTE_DEBUG_EVENTS, "Autoscrolling down.\n");
+	}
+	if (terminal->pvt->mouse_last_y >=
+	    terminal->row_count * terminal->char_height) {
+		if (terminal->adjustment) {
+			/* Try to scroll up by one line. */
+			adj = CLAMP(terminal->pvt->screen->scroll_delta + 1,
+				    terminal->adjustment->lower,
+				    MAX (terminal->adjustment->lower,
+					    terminal->adjustment->upper -
+					    terminal->row_count));
+			vte_terminal_queue_adjustment_value_changed (terminal, adj);
+			extend = TRUE;
+		}
+		_vte_debug_print(VTE_DEBUG_EVENTS, "Autoscrolling up.\n");
+	}
+	if (extend) {
+		/* Don't select off-screen areas.  That just confuses people. */
+		xmax = terminal->column_count * terminal->char_width;
+		ymax = terminal->row_count * terminal->char_height;
+
+		x = CLAMP(terminal->pvt->mouse_last_x, 0, xmax);
+		y = CLAMP(terminal->pvt->mouse_last_y, 0, ymax);
+		/* If we clamped the Y, mess with the X to get the entire
+		 * lines. */
+		if (terminal->pvt->mouse_last_y < 0 && !terminal->pvt->selection_block_mode) {
+			x = 0;
+		}
+		if (terminal->pvt->mouse_last_y >= ymax && !terminal->pvt->selection_block_mode) {
+			x = terminal->column_count * terminal->char_width;
+		}
+		/* Extend selection to cover the newly-scrolled area. */
+		vte_terminal_extend_selection(terminal, x, y, FALSE, TRUE);
+	} else {
+		/* Stop autoscrolling. */
+		terminal->pvt->mouse_autoscroll_tag = 0;
+	}
+	return (terminal->pvt->mouse_autoscroll_tag != 0);
+}
+
+/* Start autoscroll. */
+static void
+vte_terminal_start_autoscroll(VteTerminal *terminal)
+{
+	if (terminal->pvt->mouse_autoscroll_tag == 0) {
+		terminal->pvt->mouse_autoscroll_tag =
+			g_timeout_add_full(G_PRIORITY_LOW,
+					   666 / terminal->row_count,
+					   (GSourceFunc)vte_terminal_autoscroll,
+					   terminal,
+					   NULL);
+	}
+}
+
+/* Stop autoscroll. */
+static void
+vte_terminal_stop_autoscroll(VteTerminal *terminal)
+{
+	if (terminal->pvt->mouse_autoscroll_tag != 0) {
+		g_source_remove(terminal->pvt->mouse_autoscroll_tag);
+		terminal->pvt->mouse_autoscroll_tag = 0;
+	}
+}
+
+/* Read and handle a motion event. */
+static gboolean
+vte_terminal_motion_notify(GtkWidget *widget, GdkEventMotion *event)
+{
+	VteTerminal *terminal;
+	int width, height;
+	long x, y;
+
+	/* check to see if it matters */
+	if (!GTK_WIDGET_DRAWABLE(widget)) {
+		return TRUE;
+	}
+
+	terminal = VTE_TERMINAL(widget);
+	x = event->x - VTE_PAD_WIDTH;
+	y = event->y - VTE_PAD_WIDTH;
+	width = terminal->char_width;
+	height = terminal->char_height;
+
+	_vte_debug_print(VTE_DEBUG_EVENTS,
+			"Motion notify (%ld,%ld) [%ld, %ld].\n",
+			x, y,
+			x / width, y / height + terminal->pvt->screen->scroll_delta);
+
+	/* Read the modifiers. */
+	vte_terminal_read_modifiers (terminal, (GdkEvent*) event);
+
+	if (terminal->pvt->mouse_last_button) {
+		vte_terminal_match_hilite_hide (terminal);
+	} else {
+		/* Hilite any matches. */
+		vte_terminal_match_hilite(terminal, x, y);
+		/* Show the cursor. */
+		_vte_terminal_set_pointer_visible(terminal, TRUE);
+	}
+
+	switch (event->type) {
+	case GDK_MOTION_NOTIFY:
+		switch (terminal->pvt->mouse_last_button) {
+		case 1:
+			_vte_debug_print(VTE_DEBUG_EVENTS, "Mousing drag 1.\n");
+			if ((terminal->pvt->modifiers & GDK_SHIFT_MASK) ||
+			    !terminal->pvt->mouse_tracking_mode) {
+				vte_terminal_extend_selection(terminal,
+							      x, y, FALSE, FALSE);
+			} else {
+				vte_terminal_maybe_send_mouse_drag(terminal,
+								   event);
+			}
+			break;
+		default:
+			vte_terminal_maybe_send_mouse_drag(terminal, event);
+			break;
+		}
+		break;
+	default:
+		break;
+	}
+
+	/* Start scrolling if we need to. */
+	if (event->y < VTE_PAD_WIDTH ||
+	    event->y >= terminal->row_count * height + VTE_PAD_WIDTH) {
+		switch (terminal->pvt->mouse_last_button) {
+		case 1:
+			if (!terminal->pvt->mouse_tracking_mode) {
+				/* Give mouse wigglers something. */
+				vte_terminal_autoscroll(terminal);
+				/* Start a timed autoscroll if we're not doing it
+				 * already. */
+				vte_terminal_start_autoscroll(terminal);
+			}
+			break;
+		case 2:
+		case 3:
+		default:
+			break;
+		}
+	}
+
+	/* Save the pointer coordinates for later use. */
+	terminal->pvt->mouse_last_x = x;
+	terminal->pvt->mouse_last_y = y;
+
+	return TRUE;
+}
+
+/* Read and handle a pointing device buttonpress event. */
+static gint
+vte_terminal_button_press(GtkWidget *widget, GdkEventButton *event)
+{
+	VteTerminal *terminal;
+	long height, width, delta;
+	gboolean handled = FALSE;
+	gboolean start_selecting = FALSE, extend_selecting = FALSE;
+	long cellx, celly;
+	long x,y;
+
+	x = event->x - VTE_PAD_WIDTH;
+	y = event->y - VTE_PAD_WIDTH;
+
+	terminal = VTE_TERMINAL(widget);
+	height = terminal->char_height;
+	width = terminal->char_width;
+	delta = terminal->pvt->screen->scroll_delta;
+
+	/* Hilite any matches. */
+	vte_terminal_match_hilite(terminal, x, y);
+
+	_vte_terminal_set_pointer_visible(terminal, TRUE);
+
+	/* Read the modifiers. */
+	vte_terminal_read_modifiers (terminal, (GdkEvent*) event);
+
+	/* Convert the event coordinates to cell coordinates. */
+	cellx = x / width;
+	celly = y / height + delta;
+
+	switch (event->type) {
+	case GDK_BUTTON_PRESS:
+		_vte_debug_print(VTE_DEBUG_EVENTS,
+				"Button %d single-click at (%ld,%ld)\n",
+				event->button,
+				x, y + terminal->char_height * delta);
+		/* Handle this event ourselves. */
+		switch (event->button) {
+		case 1:
+			_vte_debug_print(VTE_DEBUG_EVENTS,
+					"Handling click ourselves.\n");
+			/* Grab focus. */
+			if (!GTK_WIDGET_HAS_FOCUS(widget)) {
+				gtk_widget_grab_focus(widget);
+			}
+
+			/* If we're in event mode, and the user held down the
+			 * shift key, we start selecting. */
+			if (terminal->pvt->mouse_tracking_mode) {
+				if (terminal->pvt->modifiers & GDK_SHIFT_MASK) {
+					start_selecting = TRUE;
+				}
+			} else {
+				/* If the user hit shift, then extend the
+				 * selection instead. */
+				if ((terminal->pvt->modifiers & GDK_SHIFT_MASK) &&
+				    (terminal->pvt->has_selection ||
+				     terminal->pvt->selecting_restart) &&
+				    !vte_cell_is_selected(terminal,
+							  cellx,
+							  celly,
+							  NULL)) {
+					extend_selecting = TRUE;
+				} else {
+					start_selecting = TRUE;
+				}
+			}
+			if (start_selecting) {
+				vte_terminal_deselect_all(terminal);
+				vte_terminal_start_selection(terminal,
+							     event,
+							     selection_type_char);
+				handled = TRUE;
+			}
+			if (extend_selecting) {
+				vte_terminal_extend_selection(terminal,
+							      x, y,
+							      !terminal->pvt->selecting_restart, TRUE);
+				handled = TRUE;
+			}
+			break;
+		/* Paste if the user pressed shift or we're not sending events
+		 * to the app. */
+		case 2:
+			if ((terminal->pvt->modifiers & GDK_SHIFT_MASK) ||
+			    !terminal->pvt->mouse_tracking_mode) {
+				vte_terminal_paste_primary(terminal);
+				handled = TRUE;
+			}
+			break;
+		case 3:
+		default:
+			break;
+		}
+		/* If we haven't done anything yet, try sending the mouse
+		 * event to the app. */
+		if (handled == FALSE) {
+			vte_terminal_maybe_send_mouse_button(terminal, event);
+			handled = TRUE;
+		}
+		break;
+	case GDK_2BUTTON_PRESS:
+		_vte_debug_print(VTE_DEBUG_EVENTS,
+				"Button %d double-click at (%ld,%ld)\n",
+				event->button,
+				x, y + (terminal->char_height * delta));
+		switch (event->button) {
+		case 1:
+			if ((terminal->pvt->modifiers & GDK_SHIFT_MASK) ||
+			    !terminal->pvt->mouse_tracking_mode) {
+				vte_terminal_start_selection(terminal,
+							     event,
+							     selection_type_word);
+				vte_terminal_extend_selection(terminal,
+							      x, y, FALSE, TRUE);
+			}
+			break;
+		case 2:
+		case 3:
+		default:
+			break;
+		}
+		break;
+	case GDK_3BUTTON_PRESS:
+		_vte_debug_print(VTE_DEBUG_EVENTS,
+				"Button %d triple-click at (%ld,%ld).\n",
+				event->button,
+				x, y + (terminal->char_height * delta));
+		switch (event->button) {
+		case 1:
+			if ((terminal->pvt->modifiers & GDK_SHIFT_MASK) ||
+			    !terminal->pvt->mouse_tracking_mode) {
+				vte_terminal_start_selection(terminal,
+							     event,
+							     selection_type_line);
+				vte_terminal_extend_selection(terminal,
+							      x, y, FALSE, TRUE);
+			}
+			break;
+		case 2:
+		case 3:
+		default:
+			break;
+		}
+	default:
+		break;
+	}
+
+	/* Save the pointer state for later use. */
+	terminal->pvt->mouse_last_button = event->button;
+	terminal->pvt->mouse_last_x = x;
+	terminal->pvt->mouse_last_y = y;
+
+	return TRUE;
+}
+
+/* Read and handle a pointing device buttonrelease event. */
+static gint
+vte_terminal_button_release(GtkWidget *widget, GdkEventButton *event)
+{
+	VteTerminal *terminal;
+	gboolean handled = FALSE;
+	int x, y;
+
+	x = event->x - VTE_PAD_WIDTH;
+	y = event->y - VTE_PAD_WIDTH;
+
+	terminal = VTE_TERMINAL(widget);
+
+	/* Hilite any matches. */
+	vte_terminal_match_hilite(terminal, x, y);
+
+	_vte_terminal_set_pointer_visible(terminal, TRUE);
+
+	/* Disconnect from autoscroll requests. */
+	vte_terminal_stop_autoscroll(terminal);
+
+	/* Read the modifiers. */
+	vte_terminal_read_modifiers (terminal, (GdkEvent*) event);
+
+	switch (event->type) {
+	case GDK_BUTTON_RELEASE:
+		_vte_debug_print(VTE_DEBUG_EVENTS,
+				"Button %d released at (%d,%d).\n",
+				event->button, x, y);
+		switch (event->button) {
+		case 1:
+			/* If Shift is held down, or we're not in events mode,
+			 * copy the selected text. */
+			if (terminal->pvt->selecting || !terminal->pvt->mouse_tracking_mode) {
+				/* Copy only if something was selected. */
+				if (terminal->pvt->has_selection &&
+				    !terminal->pvt->selecting_restart &&
+				    terminal->pvt->selecting_had_delta) {
+					vte_terminal_copy_primary(terminal);
+				}
+				terminal->pvt->selecting = FALSE;
+				handled = TRUE;
+			}
+			/* Reconnect to input from the child if we paused it. */
+			//_vte_terminal_connect_pty_read(terminal);
+			break;
+		case 2:
+			if ((terminal->pvt->modifiers & GDK_SHIFT_MASK) ||
+			    !terminal->pvt->mouse_tracking_mode) {
+				handled = TRUE;
+			}
+			break;
+		case 3:
+		default:
+			break;
+		}
+		if (handled == FALSE) {
+			vte_terminal_maybe_send_mouse_button(terminal, event);
+			handled = TRUE;
+		}
+		break;
+	default:
+		break;
+	}
+
+	/* Save the pointer state for later use. */
+	terminal->pvt->mouse_last_button = 0;
+	terminal->pvt->mouse_last_x = x;
+	terminal->pvt->mouse_last_y = y;
+
+	return TRUE;
+}
+
+/* Handle receiving or losing focus. */
+static gboolean
+vte_terminal_focus_in(GtkWidget *widget, GdkEventFocus *event)
+{
+	VteTerminal *terminal;
+
+	_vte_debug_print(VTE_DEBUG_EVENTS, "Focus in.\n");
+
+	terminal = VTE_TERMINAL(widget);
+	GTK_WIDGET_SET_FLAGS(widget, GTK_HAS_FOCUS);
+	/* Read the keyboard modifiers, though they're probably garbage. */
+	vte_terminal_read_modifiers (terminal, (GdkEvent*) event);
+
+	/* We only have an IM context when we're realized, and there's not much
+	 * point to painting the cursor if we don't have a window. */
+	if (GTK_WIDGET_REALIZED(widget)) {
+		terminal->pvt->cursor_blink_state = TRUE;
+
+		if (terminal->pvt->cursor_blinks &&
+		    terminal->pvt->cursor_blink_tag == 0)
+			add_cursor_timeout (terminal);
+
+		gtk_im_context_focus_in(terminal->pvt->im_context);
+		_vte_invalidate_cursor_once(terminal, FALSE);
+		_vte_terminal_set_pointer_visible(terminal, TRUE);
+	}
+
+	return FALSE;
+}
+
+static gboolean
+vte_terminal_focus_out(GtkWidget *widget, GdkEventFocus *event)
+{
+	VteTerminal *terminal;
+	_vte_debug_print(VTE_DEBUG_EVENTS, "Focus out.\n");
+	terminal = VTE_TERMINAL(widget);
+	GTK_WIDGET_UNSET_FLAGS(widget, GTK_HAS_FOCUS);
+	/* Read the keyboard modifiers, though they're probably garbage. */
+	vte_terminal_read_modifiers (terminal, (GdkEvent*) event);
+	/* We only have an IM context when we're realized, and there's not much
+	 * point to painting ourselves if we don't have a window. */
+	if (GTK_WIDGET_REALIZED(widget)) {
+		gtk_im_context_focus_out(terminal->pvt->im_context);
+		_vte_invalidate_cursor_once(terminal, FALSE);
+
+		/* XXX Do we want to hide the match just because the terminal
+		 * lost keyboard focus, but the pointer *is* still within our
+		 * area top? */
+		vte_terminal_match_hilite_hide (terminal);
+		/* Mark the cursor as invisible to disable hilite updating */
+		terminal->pvt->mouse_cursor_visible = FALSE;
+	}
+
+	if (terminal->pvt->cursor_blink_tag != 0)
+		remove_cursor_timeout (terminal);
+
+	return FALSE;
+}
+
+static gboolean
+vte_terminal_enter(GtkWidget *widget, GdkEventCrossing *event)
+{
+	gboolean ret = FALSE;
+	_vte_debug_print(VTE_DEBUG_EVENTS, "Enter.\n");
+	if (GTK_WIDGET_CLASS (vte_terminal_parent_class)->enter_notify_event) {
+		ret = GTK_WIDGET_CLASS (vte_terminal_parent_class)->enter_notify_event (widget, event);
+	}
+	if (GTK_WIDGET_REALIZED (widget)) {
+		VteTerminal *terminal = VTE_TERMINAL (widget);
+		/* Hilite any matches. */
+		vte_terminal_match_hilite_show(terminal,
+					       event->x - VTE_PAD_WIDTH,
+					       event->y - VTE_PAD_WIDTH);
+	}
+	return ret;
+}
+static gboolean
+vte_terminal_leave(GtkWidget *widget, GdkEventCrossing *event)
+{
+	gboolean ret = FALSE;
+	_vte_debug_print(VTE_DEBUG_EVENTS, "Leave.\n");
+	if (GTK_WIDGET_CLASS (vte_terminal_parent_class)->leave_notify_event) {
+		ret = GTK_WIDGET_CLASS (vte_terminal_parent_class)->leave_notify_event (widget, event);
+	}
+	if (GTK_WIDGET_REALIZED (widget)) {
+		VteTerminal *terminal = VTE_TERMINAL (widget);
+		vte_terminal_match_hilite_hide (terminal);
+		/* Mark the cursor as invisible to disable hilite updating,
+		 * whilst the cursor is absent (otherwise we copy the entire
+		 * buffer after each update for nothing...)
+		 */
+		terminal->pvt->mouse_cursor_visible = FALSE;
+	}
+	return ret;
+}
+
+static G_GNUC_UNUSED inline const char *
+visibility_state_str(GdkVisibilityState state)
+{
+	switch(state){
+		case GDK_VISIBILITY_FULLY_OBSCURED:
+			return "fully-obscured";
+		case GDK_VISIBILITY_UNOBSCURED:
+			return "unobscured";
+		default:
+			return "partial";
+	}
+}
+
+static void
+vte_terminal_set_visibility (VteTerminal *terminal, GdkVisibilityState state)
+{
+	_vte_debug_print(VTE_DEBUG_MISC, "change visibility: %s -> %s.\n",
+			visibility_state_str(terminal->pvt->visibility_state),
+			visibility_state_str(state));
+
+	if (state == terminal->pvt->visibility_state) {
+		return;
+	}
+
+	/* fully obscured to visible switch, force the fast path */
+	if (terminal->pvt->visibility_state == GDK_VISIBILITY_FULLY_OBSCURED) {
+		/* set invalidated_all false, since we didn't really mean it
+		 * when we set it to TRUE when becoming obscured */
+		terminal->pvt->invalidated_all = FALSE;
+
+		/* if all unobscured now, invalidate all, otherwise, wait
+		 * for the expose event */
+		if (state == GDK_VISIBILITY_UNOBSCURED) {
+			_vte_invalidate_all (terminal);
+		}
+	}
+
+	terminal->pvt->visibility_state = state;
+
+	/* no longer visible, stop processing display updates */
+	if (terminal->pvt->visibility_state == GDK_VISIBILITY_FULLY_OBSCURED) {
+		remove_update_timeout (terminal);
+		/* if fully obscured, just act like we have invalidated all,
+		 * so no updates are accumulated. */
+		terminal->pvt->invalidated_all = TRUE;
+	}
+}
+
+static gboolean
+vte_terminal_visibility_notify(GtkWidget *widget, GdkEventVisibility *event)
+{
+	VteTerminal *terminal;
+	terminal = VTE_TERMINAL(widget);
+
+	_vte_debug_print(VTE_DEBUG_EVENTS, "Visibility (%s -> %s).\n",
+			visibility_state_str(terminal->pvt->visibility_state),
+			visibility_state_str(event->state));
+	vte_terminal_set_visibility(terminal, event->state);
+
+	return FALSE;
+}
+
+/* Apply the changed metrics, and queue a resize if need be. */
+static void
+vte_terminal_apply_metrics(VteTerminal *terminal,
+			   gint width, gint height, gint ascent, gint descent)
+{
+	gboolean resize = FALSE, cresize = FALSE;
+	gint line_thickness;
+
+	/* Sanity check for broken font changes. */
+	width = MAX(width, 1);
+	height = MAX(height, 2);
+	ascent = MAX(ascent, 1);
+	descent = MAX(descent, 1);
+
+	/* Change settings, and keep track of when we've changed anything. */
+	if (width != terminal->char_width) {
+		resize = cresize = TRUE;
+		terminal->char_width = width;
+	}
+	if (height != terminal->char_height) {
+		resize = cresize = TRUE;
+		terminal->char_height = height;
+	}
+	if (ascent != terminal->char_ascent) {
+		resize = TRUE;
+		terminal->char_ascent = ascent;
+	}
+	if (descent != terminal->char_descent) {
+		resize = TRUE;
+		terminal->char_descent = descent;
+	}
+	terminal->pvt->line_thickness = line_thickness = MAX (MIN ((height - ascent) / 2, height / 14), 1);
+	terminal->pvt->underline_position = MIN (ascent + line_thickness, height - line_thickness);
+	terminal->pvt->strikethrough_position =  ascent - height / 4;
+
+	/* Queue a resize if anything's changed. */
+	if (resize) {
+		if (GTK_WIDGET_REALIZED(terminal)) {
+			gtk_widget_queue_resize_no_redraw(&terminal->widget);
+		}
+	}
+	/* Emit a signal that the font changed. */
+	if (cresize) {
+		vte_terminal_emit_char_size_changed(terminal,
+						    terminal->char_width,
+						    terminal->char_height);
+	}
+	/* Repaint. */
+	_vte_invalidate_all(terminal);
+}
+
+
+static void
+vte_terminal_ensure_font (VteTerminal *terminal)
+{
+	if (terminal->pvt->draw != NULL) {
+		/* Load default fonts, if no fonts have been loaded. */
+		if (!terminal->pvt->has_fonts) {
+			vte_terminal_set_font_full_internal(terminal,
+                                                            terminal->pvt->fontdesc,
+                                                            terminal->pvt->fontantialias);
+		}
+		if (terminal->pvt->fontdirty) {
+			gint width, height, ascent;
+			terminal->pvt->fontdirty = FALSE;
+			_vte_draw_set_text_font (terminal->pvt->draw,
+					terminal->pvt->fontdesc,
+					terminal->pvt->fontantialias);
+			_vte_draw_get_text_metrics (terminal->pvt->draw,
+						    &width, &height, &ascent);
+			vte_terminal_apply_metrics(terminal,
+						   width, height, ascent, height - ascent);
+		}
+	}
+}
+
+
+/**
+ * vte_terminal_set_font_full:
+ * @terminal: a #VteTerminal
+ * @font_desc: The #PangoFontDescription of the desired font.
+ * @antialias: Specify if anti aliasing of the fonts is to be used or not.
+ *
+ * Sets the font used for rendering all text displayed by the terminal,
+ * overriding any fonts set using gtk_widget_modify_font().  The terminal
+ * will immediately attempt to load the desired font, retrieve its
+ * metrics, and attempt to resize itself to keep the same number of rows
+ * and columns.
+ *
+ * Since: 0.11.11
+ * 
+ * Deprecated: 0.19.1
+ */
+void
+vte_terminal_set_font_full(VteTerminal *terminal,
+			   const PangoFontDescription *font_desc,
+			   VteTerminalAntiAlias antialias)
+{
+        vte_terminal_set_font_full_internal(terminal, font_desc, antialias);
+}
+
+static void
+vte_terminal_set_font_full_internal(VteTerminal *terminal,
+                                    const PangoFontDescription *font_desc,
+                                    VteTerminalAntiAlias antialias)
+{
+        VteTerminalPrivate *pvt;
+        GObject *object;
+	PangoFontDescription *desc;
+        gboolean same_desc;
+
+	g_return_if_fail(VTE_IS_TERMINAL(terminal));
+
+        object = G_OBJECT(terminal);
+        pvt = terminal->pvt;
+
+	/* Create an owned font description. */
+	gtk_widget_ensure_style (&terminal->widget);
+	desc = pango_font_description_copy (terminal->widget.style->font_desc);
+	pango_font_description_set_family_static (desc, "monospace");
+	if (font_desc != NULL) {
+		pango_font_description_merge (desc, font_desc, TRUE);
+		_VTE_DEBUG_IF(VTE_DEBUG_MISC) {
+			if (desc) {
+				char *tmp;
+				tmp = pango_font_description_to_string(desc);
+				g_printerr("Using pango font \"%s\".\n", tmp);
+				g_free (tmp);
+			}
+		}
+	} else {
+		_vte_debug_print(VTE_DEBUG_MISC,
+				"Using default monospace font.\n");
+	}
+
+        same_desc = pvt->fontdesc && pango_font_description_equal (pvt->fontdesc, desc);
+	
+	/* Note that we proceed to recreating the font even if the description
+	 * and antialias settings are the same.  This is because maybe screen
+	 * font options were changed, or new fonts installed.  Those will be
+	 * detected at font creation time and respected.
+	 */
+
+        g_object_freeze_notify(object);
+
+	/* Free the old font description and save the new one. */
+	if (terminal->pvt->fontdesc != NULL) {
+		pango_font_description_free(terminal->pvt->fontdesc);
+	}
+	pvt->fontdesc = desc;
+	pvt->fontantialias = antialias;
+	pvt->fontdirty = TRUE;
+	pvt->has_fonts = TRUE;
+	if (pvt->offscreen_draw != NULL) {
+		_vte_draw_free(pvt->offscreen_draw);
+		pvt->offscreen_draw = NULL;
 	}
 
-	/* Save the pointer state for later use. */
-	terminal->pvt->mouse_last_button = 0;
-	terminal->pvt->mouse_last_x = x;
-	terminal->pvt->mouse_last_y = y;
+        if (!same_desc)
+                g_object_notify(object, "font-desc");
 
-	return TRUE;
+	/* Set the drawing font. */
+	if (GTK_WIDGET_REALIZED(terminal)) {
+		vte_terminal_ensure_font (terminal);
+	}
+
+        g_object_thaw_notify(object);
 }
 
-/* Handle receiving or losing focus. */
-static gboolean
-vte_terminal_focus_in(GtkWidget *widget, GdkEventFocus *event)
+/**
+ * vte_terminal_set_font:
+ * @terminal: a #VteTerminal
+ * @font_desc: The #PangoFontDescription of the desired font.
+ *
+ * Sets the font used for rendering all text displayed by the terminal,
+ * overriding any fonts set using gtk_widget_modify_font().  The terminal
+ * will immediately attempt to load the desired font, retrieve its
+ * metrics, and attempt to resize itself to keep the same number of rows
+ * and columns.
+ *
+ */
+void
+vte_terminal_set_font(VteTerminal *terminal,
+		      const PangoFontDescription *font_desc)
 {
-	VteTerminal *terminal;
+	g_return_if_fail(VTE_IS_TERMINAL(terminal));
+	vte_terminal_set_font_full_internal(terminal, font_desc,
+                                            VTE_ANTI_ALIAS_USE_DEFAULT);
+}
 
-	_vte_debug_print(VTE_DEBUG_EVENTS, "Focus in.\n");
+static void
+vte_terminal_set_font_from_string_full_internal(VteTerminal *terminal,
+                                                const char *name,
+                                                VteTerminalAntiAlias antialias)
+{
+	PangoFontDescription *font_desc = NULL;
+	g_return_if_fail(VTE_IS_TERMINAL(terminal));
 
-	terminal = VTE_TERMINAL(widget);
-	GTK_WIDGET_SET_FLAGS(widget, GTK_HAS_FOCUS);
-	/* Read the keyboard modifiers, though they're probably garbage. */
-	vte_terminal_read_modifiers (terminal, (GdkEvent*) event);
+	if (name)
+	  font_desc = pango_font_description_from_string(name);
+	vte_terminal_set_font_full_internal(terminal, font_desc, antialias);
+	pango_font_description_free(font_desc);
+}
 
-	/* We only have an IM context when we're realized, and there's not much
-	 * point to painting the cursor if we don't have a window. */
-	if (GTK_WIDGET_REALIZED(widget)) {
-		terminal->pvt->cursor_blink_state = TRUE;
+/**
+ * vte_terminal_set_font_from_string_full:
+ * @terminal: a #VteTerminal
+ * @name: A string describing the font.
+ * @antialias: Whether or not to antialias the font (if possible).
+ *
+ * A convenience function which converts @name into a #PangoFontDescription and
+ * passes it to vte_terminal_set_font_full().
+ *
+ * Since: 0.11.11
+ *
+ * Deprecated: 0.19.1
+ */
+void
+vte_terminal_set_font_from_string_full(VteTerminal *terminal, const char *name,
+				       VteTerminalAntiAlias antialias)
+{
+        vte_terminal_set_font_from_string_full_internal(terminal, name, antialias);
+}
 
-		if (terminal->pvt->cursor_blinks &&
-		    terminal->pvt->cursor_blink_tag == 0)
-			add_cursor_timeout (terminal);
+/**
+ * vte_terminal_set_font_from_string:
+ * @terminal: a #VteTerminal
+ * @name: A string describing the font.
+ *
+ * A convenience function which converts @name into a #PangoFontDescription and
+ * passes it to vte_terminal_set_font().
+ *
+ */
+void
+vte_terminal_set_font_from_string(VteTerminal *terminal, const char *name)
+{
+	g_return_if_fail(VTE_IS_TERMINAL(terminal));
+	g_return_if_fail(name != NULL);
+	vte_terminal_set_font_from_string_full_internal(terminal, name,
+                                                        VTE_ANTI_ALIAS_USE_DEFAULT);
+}
 
-		gtk_im_context_focus_in(terminal->pvt->im_context);
-		_vte_invalidate_cursor_once(terminal, FALSE);
-		_vte_terminal_set_pointer_visible(terminal, TRUE);
-	}
+/**
+ * vte_terminal_get_font:
+ * @terminal: a #VteTerminal
+ *
+ * Queries the terminal for information about the fonts which will be
+ * used to draw text in the terminal.
+ *
+ * Returns: a #PangoFontDescription describing the font the terminal is
+ * currently using to render text.
+ */
+const PangoFontDescription *
+vte_terminal_get_font(VteTerminal *terminal)
+{
+	g_return_val_if_fail(VTE_IS_TERMINAL(terminal), NULL);
+	return terminal->pvt->fontdesc;
+}
 
-	return FALSE;
+/* Read and refresh our perception of the size of the PTY. */
+static void
+vte_terminal_refresh_size(VteTerminal *terminal)
+{
+	int rows, columns;
+	if (terminal->pvt->pty_master != -1) {
+		/* Use an ioctl to read the size of the terminal. */
+			terminal->row_count = rows;
+			terminal->column_count = columns;
+	}
 }
 
+/* Rewrapping.  When the width changes, the logical lines of the normal
+ * screen (runs of soft-wrapped rows) are reflowed to fit.  The rows from a
+ * screenful above the insertion delta down are rewrapped at once; older
+ * scrollback is rewrapped into a fresh ring from an idle handler, a chunk at
+ * a time, and swapped in when that's done or as soon as the user scrolls up
+ * into it.  Another resize restarts the background pass, so dragging the
+ * window only ever pays for the visible area. */
+
+/* Blanks at the end of a logical line are padding, not text. */
 static gboolean
-vte_terminal_focus_out(GtkWidget *widget, GdkEventFocus *event)
+vte_reflow_cell_is_blank(const struct vte_charcell *cell)
+{
+	return (cell->c == 0 || cell->c == ' ') &&
+		!cell->attr.fragment &&
+		cell->attr.back == VTE_DEF_BG &&
+		!cell->attr.reverse &&
+		!cell->attr.underline &&
+		!cell->attr.strikethrough;
+}
+
+/* Split the cells of one logical line into rows of @columns cells, never
+ * separating a character from its fragments, and append them to @ring.  If
+ * @cursor is non-negative it's an offset into @line, which is translated
+ * into a number of rows from the first new one and a column.  If @wrapped,
+ * the line carries on past @line, so its last row stays soft-wrapped.
+ * Returns the number of rows appended. */
+static glong
+vte_reflow_line(VteRing *ring, GArray *line, glong columns, gboolean wrapped,
+		glong cursor, glong *cursor_row, glong *cursor_col)
 {
-	VteTerminal *terminal;
-	_vte_debug_print(VTE_DEBUG_EVENTS, "Focus out.\n");
-	terminal = VTE_TERMINAL(widget);
-	GTK_WIDGET_UNSET_FLAGS(widget, GTK_HAS_FOCUS);
-	/* Read the keyboard modifiers, though they're probably garbage. */
-	vte_terminal_read_modifiers (terminal, (GdkEvent*) event);
-	/* We only have an IM context when we're realized, and there's not much
-	 * point to painting ourselves if we don't have a window. */
-	if (GTK_WIDGET_REALIZED(widget)) {
-		gtk_im_context_focus_out(terminal->pvt->im_context);
-		_vte_invalidate_cursor_once(terminal, FALSE);
+	struct vte_charcell *cells;
+	VteRowData *row;
+	guint start, end, next, len;
+	glong n_rows = 0;
 
-		/* XXX Do we want to hide the match just because the terminal
-		 * lost keyboard focus, but the pointer *is* still within our
-		 * area top? */
-		vte_terminal_match_hilite_hide (terminal);
-		/* Mark the cursor as invisible to disable hilite updating */
-		terminal->pvt->mouse_cursor_visible = FALSE;
+	cells = (struct vte_charcell *) line->data;
+	len = line->len;
+	while (!wrapped && len > 0 &&
+	       vte_reflow_cell_is_blank(&cells[len - 1])) {
+		len--;
 	}
 
-	if (terminal->pvt->cursor_blink_tag != 0)
-		remove_cursor_timeout (terminal);
+	start = 0;
+	do {
+		/* Take as many whole characters as will fit. */
+		end = start;
+		while (end < len) {
+			next = end + 1;
+			while (next < len && cells[next].attr.fragment) {
+				next++;
+			}
+			if (next - start > (guint) columns && end > start) {
+				break;
+			}
+			end = next;
+		}
 
-	return FALSE;
+		row = g_slice_new(VteRowData);
+		row->cells = g_array_sized_new(FALSE, TRUE,
+					       sizeof(struct vte_charcell),
+					       end - start);
+		g_array_append_vals(row->cells, cells + start, end - start);
+		row->soft_wrapped = end < len || wrapped;
+		row->ref_count = 1;
+		if (cursor >= (glong) start &&
+		    (cursor < (glong) end || end >= len)) {
+			*cursor_row = n_rows;
+			*cursor_col = MIN(cursor - start, columns);
+			cursor = -1;
+		}
+		row = _vte_ring_append(ring, row);
+		if (row != NULL) {
+			_vte_free_row_data(row);
+		}
+		n_rows++;
+		start = end;
+	} while (start < len);
+
+	return n_rows;
 }
 
-static gboolean
-vte_terminal_enter(GtkWidget *widget, GdkEventCrossing *event)
+/* Find the first row of the logical line which @position is part of.  At
+ * most VTE_REFLOW_CHUNK rows are walked back over, so that a huge wrapped
+ * line doesn't get rewrapped in one go; the rest of it is left to the
+ * background pass, as a line of its own. */
+static glong
+vte_reflow_line_start(VteRing *ring, glong position)
 {
-	gboolean ret = FALSE;
-	_vte_debug_print(VTE_DEBUG_EVENTS, "Enter.\n");
-	if (GTK_WIDGET_CLASS (vte_terminal_parent_class)->enter_notify_event) {
-		ret = GTK_WIDGET_CLASS (vte_terminal_parent_class)->enter_notify_event (widget, event);
-	}
-	if (GTK_WIDGET_REALIZED (widget)) {
-		VteTerminal *terminal = VTE_TERMINAL (widget);
-		/* Hilite any matches. */
-		vte_terminal_match_hilite_show(terminal,
-					       event->x - VTE_PAD_WIDTH,
-					       event->y - VTE_PAD_WIDTH);
+	VteRowData *row;
+	glong limit;
+
+	position = CLAMP(position, _vte_ring_delta(ring), _vte_ring_next(ring));
+	limit = MAX(position - VTE_REFLOW_CHUNK, _vte_ring_delta(ring));
+	while (position > limit) {
+		row = _vte_ring_index(ring, VteRowData *, position - 1);
+		if (!row->soft_wrapped) {
+			break;
+		}
+		position--;
 	}
-	return ret;
+	return position;
 }
+
+/* Copy the next @budget or so rows of the old scrollback into the new ring.
+ * Returns TRUE if there's more left to do. */
 static gboolean
-vte_terminal_leave(GtkWidget *widget, GdkEventCrossing *event)
+vte_terminal_reflow_step(VteTerminal *terminal, glong budget)
 {
-	gboolean ret = FALSE;
-	_vte_debug_print(VTE_DEBUG_EVENTS, "Leave.\n");
-	if (GTK_WIDGET_CLASS (vte_terminal_parent_class)->leave_notify_event) {
-		ret = GTK_WIDGET_CLASS (vte_terminal_parent_class)->leave_notify_event (widget, event);
-	}
-	if (GTK_WIDGET_REALIZED (widget)) {
-		VteTerminal *terminal = VTE_TERMINAL (widget);
-		vte_terminal_match_hilite_hide (terminal);
-		/* Mark the cursor as invisible to disable hilite updating,
-		 * whilst the cursor is absent (otherwise we copy the entire
-		 * buffer after each update for nothing...)
-		 */
-		terminal->pvt->mouse_cursor_visible = FALSE;
+	VteTerminalPrivate *pvt = terminal->pvt;
+	VteRing *ring = pvt->normal_screen.row_data;
+	VteRowData *row;
+	GArray *line;
+
+	line = g_array_new(FALSE, FALSE, sizeof(struct vte_charcell));
+	pvt->reflow_next = MAX(pvt->reflow_next, _vte_ring_delta(ring));
+	while (pvt->reflow_next < pvt->reflow_end && budget > 0) {
+		g_array_set_size(line, 0);
+		do {
+			row = _vte_ring_index(ring, VteRowData *,
+					      pvt->reflow_next++);
+			g_array_append_vals(line, row->cells->data,
+					    row->cells->len);
+			budget--;
+		} while (row->soft_wrapped &&
+			 pvt->reflow_next < pvt->reflow_end);
+		vte_reflow_line(pvt->reflow_ring, line, terminal->column_count,
+				row->soft_wrapped, -1, NULL, NULL);
 	}
-	return ret;
+	g_array_free(line, TRUE);
+
+	return pvt->reflow_next < pvt->reflow_end;
 }
 
-static G_GNUC_UNUSED inline const char *
-visibility_state_str(GdkVisibilityState state)
+static void
+vte_terminal_reflow_cancel(VteTerminal *terminal)
 {
-	switch(state){
-		case GDK_VISIBILITY_FULLY_OBSCURED:
-			return "fully-obscured";
-		case GDK_VISIBILITY_UNOBSCURED:
-			return "unobscured";
-		default:
-			return "partial";
+	if (terminal->pvt->reflow_tag != 0) {
+		g_source_remove(terminal->pvt->reflow_tag);
+		terminal->pvt->reflow_tag = 0;
+	}
+	if (terminal->pvt->reflow_ring != NULL) {
+		_vte_ring_free(terminal->pvt->reflow_ring, TRUE);
+		terminal->pvt->reflow_ring = NULL;
 	}
 }
 
+/* Rewrap whatever is left of the old scrollback and swap the new ring in,
+ * moving the rows which weren't part of the background pass over.  A view
+ * into the rewrapped history is kept at the same point of it, give or take
+ * the rows which the lines there gained or lost. */
 static void
-vte_terminal_set_visibility (VteTerminal *terminal, GdkVisibilityState state)
+vte_terminal_reflow_finish(VteTerminal *terminal)
 {
-	_vte_debug_print(VTE_DEBUG_MISC, "change visibility: %s -> %s.\n",
-			visibility_state_str(terminal->pvt->visibility_state),
-			visibility_state_str(state));
+	VteTerminalPrivate *pvt = terminal->pvt;
+	VteScreen *screen = &pvt->normal_screen;
+	VteRing *old, *ring;
+	VteRowData *row;
+	GPtrArray *rows;
+	glong low, end, shift, scroll;
+	guint i;
 
-	if (state == terminal->pvt->visibility_state) {
+	if (pvt->reflow_ring == NULL) {
 		return;
 	}
-
-	/* fully obscured to visible switch, force the fast path */
-	if (terminal->pvt->visibility_state == GDK_VISIBILITY_FULLY_OBSCURED) {
-		/* set invalidated_all false, since we didn't really mean it
-		 * when we set it to TRUE when becoming obscured */
-		terminal->pvt->invalidated_all = FALSE;
-
-		/* if all unobscured now, invalidate all, otherwise, wait
-		 * for the expose event */
-		if (state == GDK_VISIBILITY_UNOBSCURED) {
-			_vte_invalidate_all (terminal);
+	if (pvt->reflow_tag != 0) {
+		g_source_remove(pvt->reflow_tag);
+		pvt->reflow_tag = 0;
+	}
+	while (vte_terminal_reflow_step(terminal, G_MAXLONG)) ;
+
+	old = screen->row_data;
+	ring = pvt->reflow_ring;
+	pvt->reflow_ring = NULL;
+	_vte_ring_resize(ring, _vte_ring_max(old));
+
+	/* Rows are only cheap to take off the end of a ring. */
+	low = _vte_ring_delta(old);
+	end = MAX(pvt->reflow_end, low);
+	rows = g_ptr_array_sized_new(_vte_ring_next(old) - end);
+	while (_vte_ring_next(old) > end) {
+		g_ptr_array_add(rows, _vte_ring_remove(old,
+					_vte_ring_next(old) - 1, FALSE));
+	}
+	shift = _vte_ring_next(ring) - end;
+	for (i = rows->len; i > 0; i--) {
+		row = _vte_ring_append(ring, g_ptr_array_index(rows, i - 1));
+		if (row != NULL) {
+			_vte_free_row_data(row);
 		}
 	}
+	g_ptr_array_free(rows, TRUE);
+	_vte_ring_free(old, TRUE);
+	screen->row_data = ring;
+	_vte_ring_set_hot_length(ring,
+			terminal->row_count + VTE_SCROLLBACK_HOT_MARGIN);
 
-	terminal->pvt->visibility_state = state;
+	_vte_debug_print(VTE_DEBUG_MISC,
+			"Rewrapped scrollback, moving the screen by %ld.\n",
+			shift);
 
-	/* no longer visible, stop processing display updates */
-	if (terminal->pvt->visibility_state == GDK_VISIBILITY_FULLY_OBSCURED) {
-		remove_update_timeout (terminal);
-		/* if fully obscured, just act like we have invalidated all,
-		 * so no updates are accumulated. */
-		terminal->pvt->invalidated_all = TRUE;
+	vte_terminal_deselect_all(terminal);
+	vte_terminal_match_contents_clear(terminal);
+	screen->insert_delta += shift;
+	screen->cursor_current.row += shift;
+	scroll = screen->scroll_delta;
+	if (scroll >= end) {
+		scroll += shift;
+	} else if (scroll > low) {
+		scroll = _vte_ring_delta(ring) +
+			(gint64) (scroll - low) *
+			(end + shift - _vte_ring_delta(ring)) / (end - low);
+	}
+	scroll = CLAMP(scroll, _vte_ring_delta(ring), screen->insert_delta);
+	if (pvt->screen == screen) {
+		vte_terminal_queue_adjustment_value_changed(terminal, scroll);
+		_vte_terminal_adjust_adjustments(terminal);
+		_vte_invalidate_all(terminal);
+	} else {
+		screen->scroll_delta = scroll;
 	}
 }
 
 static gboolean
-vte_terminal_visibility_notify(GtkWidget *widget, GdkEventVisibility *event)
+vte_terminal_reflow_idle_cb(VteTerminal *terminal)
 {
-	VteTerminal *terminal;
-	terminal = VTE_TERMINAL(widget);
-
-	_vte_debug_print(VTE_DEBUG_EVENTS, "Visibility (%s -> %s).\n",
-			visibility_state_str(terminal->pvt->visibility_state),
-			visibility_state_str(event->state));
-	vte_terminal_set_visibility(terminal, event->state);
+	if (vte_terminal_reflow_step(terminal, VTE_REFLOW_CHUNK)) {
+		return TRUE;
+	}
+	terminal->pvt->reflow_tag = 0;
+	vte_terminal_reflow_finish(terminal);
+	return FALSE;
+}
 
+static gboolean
+vte_terminal_reflow_timeout_cb(VteTerminal *terminal)
+{
+	terminal->pvt->reflow_tag =
+		g_idle_add_full(G_PRIORITY_LOW,
+				(GSourceFunc) vte_terminal_reflow_idle_cb,
+				terminal, NULL);
 	return FALSE;
 }
 
-/* Apply the changed metrics, and queue a resize if need be. */
+/* Rewrap the normal screen to the current number of columns. */
 static void
-vte_terminal_apply_metrics(VteTerminal *terminal,
-			   gint width, gint height, gint ascent, gint descent)
+vte_terminal_reflow(VteTerminal *terminal)
 {
-	gboolean resize = FALSE, cresize = FALSE;
-	gint line_thickness;
+	VteTerminalPrivate *pvt = terminal->pvt;
+	VteScreen *screen = &pvt->normal_screen;
+	VteRing *ring = screen->row_data;
+	VteRowData *row;
+	GPtrArray *rows;
+	GArray *line;
+	gboolean wrapped, at_bottom;
+	glong start, old_next, first, position, offset, scroll;
+	glong cursor_row, cursor_col, new_row, new_col;
+	guint i;
 
-	/* Sanity check for broken font changes. */
-	width = MAX(width, 1);
-	height = MAX(height, 2);
-	ascent = MAX(ascent, 1);
-	descent = MAX(descent, 1);
+	/* Whatever the background pass had done is for the old width. */
+	vte_terminal_reflow_cancel(terminal);
+	/* So is the search index. */
+	vte_terminal_search_index_invalidate(terminal, G_MINLONG);
 
-	/* Change settings, and keep track of when we've changed anything. */
-	if (width != terminal->char_width) {
-		resize = cresize = TRUE;
-		terminal->char_width = width;
-	}
-	if (height != terminal->char_height) {
-		resize = cresize = TRUE;
-		terminal->char_height = height;
-	}
-	if (ascent != terminal->char_ascent) {
-		resize = TRUE;
-		terminal->char_ascent = ascent;
-	}
-	if (descent != terminal->char_descent) {
-		resize = TRUE;
-		terminal->char_descent = descent;
+	start = vte_reflow_line_start(ring,
+			MAX(screen->insert_delta - terminal->row_count,
+			    _vte_ring_delta(ring)));
+	old_next = _vte_ring_next(ring);
+	if (start >= old_next) {
+		return;
 	}
-	terminal->pvt->line_thickness = line_thickness = MAX (MIN ((height - ascent) / 2, height / 14), 1);
-	terminal->pvt->underline_position = MIN (ascent + line_thickness, height - line_thickness);
-	terminal->pvt->strikethrough_position =  ascent - height / 4;
 
-	/* Queue a resize if anything's changed. */
-	if (resize) {
-		if (GTK_WIDGET_REALIZED(terminal)) {
-			gtk_widget_queue_resize_no_redraw(&terminal->widget);
+	_vte_debug_print(VTE_DEBUG_MISC,
+			"Rewrapping rows %ld to %ld to %ld columns.\n",
+			start, old_next, terminal->column_count);
+
+	rows = g_ptr_array_sized_new(old_next - start);
+	while (_vte_ring_next(ring) > start) {
+		g_ptr_array_add(rows, _vte_ring_remove(ring,
+					_vte_ring_next(ring) - 1, FALSE));
+	}
+
+	cursor_row = screen->cursor_current.row;
+	cursor_col = screen->cursor_current.col;
+	new_row = cursor_row;
+	new_col = cursor_col;
+	line = g_array_new(FALSE, FALSE, sizeof(struct vte_charcell));
+	position = start;
+	i = rows->len;
+	while (i > 0) {
+		/* The rows were taken off the end, so they're backwards. */
+		g_array_set_size(line, 0);
+		offset = -1;
+		do {
+			row = g_ptr_array_index(rows, --i);
+			if (position == cursor_row) {
+				offset = line->len + cursor_col;
+			}
+			g_array_append_vals(line, row->cells->data,
+					    row->cells->len);
+			wrapped = row->soft_wrapped;
+			_vte_free_row_data(row);
+			position++;
+		} while (wrapped && i > 0);
+		first = _vte_ring_next(ring);
+		vte_reflow_line(ring, line, terminal->column_count, wrapped,
+				offset, &new_row, &new_col);
+		if (offset >= 0) {
+			new_row += first;
 		}
 	}
-	/* Emit a signal that the font changed. */
-	if (cresize) {
-		vte_terminal_emit_char_size_changed(terminal,
-						    terminal->char_width,
-						    terminal->char_height);
+	g_array_free(line, TRUE);
+	g_ptr_array_free(rows, TRUE);
+	if (cursor_row >= old_next) {
+		new_row = _vte_ring_next(ring) + cursor_row - old_next;
+	}
+
+	/* Keep the cursor on the same line of the screen if there's enough
+	 * history above it, and the view at the bottom if it was there. */
+	at_bottom = screen->scroll_delta >= screen->insert_delta;
+	screen->insert_delta = MAX(new_row -
+				   (cursor_row - screen->insert_delta),
+				   _vte_ring_delta(ring));
+	screen->insert_delta = MAX(screen->insert_delta,
+				   new_row - terminal->row_count + 1);
+	/* Rows above the rewrapped ones are replaced when the background
+	 * pass finishes, so they mustn't become writable. */
+	screen->insert_delta = MAX(screen->insert_delta, start);
+	screen->insert_delta = MIN(screen->insert_delta, new_row);
+	screen->cursor_current.row = new_row;
+	screen->cursor_current.col = new_col;
+	scroll = at_bottom ? screen->insert_delta :
+		MIN(screen->scroll_delta, screen->insert_delta);
+
+	vte_terminal_deselect_all(terminal);
+	vte_terminal_match_contents_clear(terminal);
+	if (pvt->screen == screen) {
+		vte_terminal_queue_adjustment_value_changed(terminal, scroll);
+		_vte_terminal_adjust_adjustments(terminal);
+	} else {
+		screen->scroll_delta = scroll;
 	}
-	/* Repaint. */
-	_vte_invalidate_all(terminal);
-}
 
+	/* Leave the rest of the history for later. */
+	if (start > _vte_ring_delta(ring)) {
+		pvt->reflow_ring = vte_row_ring_new(_vte_ring_max(ring),
+						    _vte_ring_delta(ring));
+		_vte_ring_set_hot_length(pvt->reflow_ring,
+				terminal->row_count + VTE_SCROLLBACK_HOT_MARGIN);
+		pvt->reflow_next = _vte_ring_delta(ring);
+		pvt->reflow_end = start;
+		pvt->reflow_tag = g_timeout_add(VTE_REFLOW_DELAY,
+				(GSourceFunc) vte_terminal_reflow_timeout_cb,
+				terminal);
+	}
+}
 
+/* Bring the search index up to date with the lines which have scrolled above
+ * the insertion area; those don't change any more, so each is indexed once. */
 static void
-vte_terminal_ensure_font (VteTerminal *terminal)
+vte_terminal_search_index_update(VteTerminal *terminal)
 {
-	if (terminal->pvt->draw != NULL) {
-		/* Load default fonts, if no fonts have been loaded. */
-		if (!terminal->pvt->has_fonts) {
-			vte_terminal_set_font_full_internal(terminal,
-                                                            terminal->pvt->fontdesc,
-                                                            terminal->pvt->fontantialias);
+	VteScreen *screen = &terminal->pvt->normal_screen;
+	VteSearchIndex *index = terminal->pvt->search_index;
+	VteRingIter iter;
+	VteRowData *row_data;
+	struct vte_charcell *cell;
+	GArray *line;
+	glong row, start, end;
+	gunichar c;
+	guint i;
+
+	if (index == NULL || terminal->pvt->reflow_ring != NULL) {
+		/* Row numbers aren't settled until rewrapping is done. */
+		return;
+	}
+	if (terminal->pvt->search_index_job != NULL) {
+		/* A search is still building it. */
+		return;
+	}
+	_vte_search_index_forget(index, _vte_ring_delta(screen->row_data));
+
+	start = _vte_search_index_next(index);
+	end = MIN(screen->insert_delta, _vte_ring_next(screen->row_data));
+	if (start >= end) {
+		return;
+	}
+	line = g_array_new(FALSE, FALSE, sizeof(gunichar));
+	_vte_ring_iter_init(&iter, screen->row_data, start);
+	for (row = start; row < end; row++) {
+		row_data = _vte_ring_iter_next(&iter);
+		if (row_data != NULL) {
+			for (i = 0; i < row_data->cells->len; i++) {
+				cell = &g_array_index(row_data->cells,
+						      struct vte_charcell, i);
+				if (cell->attr.fragment) {
+					continue;
+				}
+				c = cell->c ? cell->c : ' ';
+				g_array_append_val(line, c);
+			}
+			if (row_data->soft_wrapped) {
+				continue;
+			}
 		}
-		if (terminal->pvt->fontdirty) {
-			gint width, height, ascent;
-			terminal->pvt->fontdirty = FALSE;
-			_vte_draw_set_text_font (terminal->pvt->draw,
-					terminal->pvt->fontdesc,
-					terminal->pvt->fontantialias);
-			_vte_draw_get_text_metrics (terminal->pvt->draw,
-						    &width, &height, &ascent);
-			vte_terminal_apply_metrics(terminal,
-						   width, height, ascent, height - ascent);
+		_vte_search_index_add_line(index, start, row + 1,
+					   (const gunichar *) line->data,
+					   line->len);
+		g_array_set_size(line, 0);
+		start = row + 1;
+	}
+	g_array_free(line, TRUE);
+}
+
+/* The row on which the logical line containing @row ends, looking no further
+ * than @limit. */
+static glong
+vte_terminal_search_line_end(VteTerminal *terminal, glong row, glong limit)
+{
+	VteRing *ring = terminal->pvt->normal_screen.row_data;
+	VteRowData *row_data;
+
+	for (; row < limit; row++) {
+		row_data = _vte_ring_index(ring, VteRowData *, row);
+		if (row_data == NULL || !row_data->soft_wrapped) {
+			break;
 		}
 	}
+	return row;
 }
 
+/* A search in progress.  The snapshots are read by the worker, which may be
+ * another thread; matches are passed back to the main loop under the lock.
+ * Snapshots are queued by the main loop one at a time, one ahead of the
+ * worker, as with exports, and the history is taken a slice at a time, so
+ * the main loop never copies much of it at once.  The first search also
+ * builds the index: it adds each line of the history to the index as it
+ * checks it, and hands the index back to the terminal when done. */
+struct vte_search_job {
+	VteTerminal *terminal;	/* NULL once cancelled */
+	guint id;
+	GRegex *regex;
+	GRegexMatchFlags flags;
+	glong first_row;	/* lines starting before this aren't checked */
+	GAsyncQueue *snapshots;	/* each made of whole lines */
+	VteSnapshot *last;	/* queued after everything else */
+	GPtrArray *pending;	/* main loop only: taken but not queued */
+	guint next;		/* main loop only: next of those to queue */
+	glong next_row, history_end;	/* main loop only: history to slice */
+	VteSearchIndex *index;	/* being built, or NULL */
+	volatile gint index_stale;	/* the terminal has let go of it */
+	VteSearchCallback callback;
+	gpointer data;
+	GDestroyNotify destroy;
+	volatile gint cancelled;
+
+	GMutex *lock;		/* or NULL without thread support */
+	GArray *matches;	/* found but not yet delivered */
+	gboolean finished;
+	guint deliver_tag;
+};
 
-/**
- * vte_terminal_set_font_full:
- * @terminal: a #VteTerminal
- * @font_desc: The #PangoFontDescription of the desired font.
- * @antialias: Specify if anti aliasing of the fonts is to be used or not.
- *
- * Sets the font used for rendering all text displayed by the terminal,
- * overriding any fonts set using gtk_widget_modify_font().  The terminal
- * will immediately attempt to load the desired font, retrieve its
- * metrics, and attempt to resize itself to keep the same number of rows
- * and columns.
- *
- * Since: 0.11.11
- * 
- * Deprecated: 0.19.1
- */
-void
-vte_terminal_set_font_full(VteTerminal *terminal,
-			   const PangoFontDescription *font_desc,
-			   VteTerminalAntiAlias antialias)
-{
-        vte_terminal_set_font_full_internal(terminal, font_desc, antialias);
+/* Drop the search index if it covers @row or anything after it, because
+ * those rows can be written to again or no longer mean the same thing.  An
+ * index which a search is still building is left for the search to free.
+ * Searches stop slicing the history there too. */
+static void
+vte_terminal_search_index_invalidate(VteTerminal *terminal, glong row)
+{
+	VteTerminalPrivate *pvt = terminal->pvt;
+	struct vte_search_job *job;
+	GList *link;
+
+	if (pvt->search_index_job != NULL) {
+		if (row < pvt->search_index_job->history_end) {
+			g_atomic_int_set(&pvt->search_index_job->index_stale,
+					 1);
+			pvt->search_index_job = NULL;
+			pvt->search_index = NULL;
+		}
+	} else if (pvt->search_index != NULL &&
+		   row < _vte_search_index_next(pvt->search_index)) {
+		_vte_search_index_free(pvt->search_index);
+		pvt->search_index = NULL;
+	}
+
+	for (link = pvt->search_jobs; link != NULL; link = link->next) {
+		job = link->data;
+		if (row < job->history_end) {
+			job->history_end = MAX(row, job->next_row);
+		}
+	}
 }
 
 static void
-vte_terminal_set_font_full_internal(VteTerminal *terminal,
-                                    const PangoFontDescription *font_desc,
-                                    VteTerminalAntiAlias antialias)
+vte_search_job_free(struct vte_search_job *job)
 {
-        VteTerminalPrivate *pvt;
-        GObject *object;
-	PangoFontDescription *desc;
-        gboolean same_desc;
-
-	g_return_if_fail(VTE_IS_TERMINAL(terminal));
+	VteSnapshot *snapshot;
+	guint i;
 
-        object = G_OBJECT(terminal);
-        pvt = terminal->pvt;
+	if (job->destroy != NULL) {
+		job->destroy(job->data);
+	}
+	for (i = job->next; i < job->pending->len; i++) {
+		vte_snapshot_unref(g_ptr_array_index(job->pending, i));
+	}
+	g_ptr_array_free(job->pending, TRUE);
+	while ((snapshot = g_async_queue_try_pop(job->snapshots)) != NULL) {
+		vte_snapshot_unref(snapshot);
+	}
+	g_async_queue_unref(job->snapshots);
+	vte_snapshot_unref(job->last);
+	if (job->index != NULL) {
+		/* Only still ours if the terminal dropped it. */
+		_vte_search_index_free(job->index);
+	}
+	g_regex_unref(job->regex);
+	g_array_free(job->matches, TRUE);
+	if (job->lock != NULL) {
+		g_mutex_free(job->lock);
+	}
+	g_slice_free(struct vte_search_job, job);
+}
 
-	/* Create an owned font description. */
-	gtk_widget_ensure_style (&terminal->widget);
-	desc = pango_font_description_copy (terminal->widget.style->font_desc);
-	pango_font_description_set_family_static (desc, "monospace");
-	if (font_desc != NULL) {
-		pango_font_description_merge (desc, font_desc, TRUE);
-		_VTE_DEBUG_IF(VTE_DEBUG_MISC) {
-			if (desc) {
-				char *tmp;
-				tmp = pango_font_description_to_string(desc);
-				g_printerr("Using pango font \"%s\".\n", tmp);
-				g_free (tmp);
-			}
+/* Queue the next snapshot for the worker: one taken up front, else a slice
+ * of the history, else the last one.  Each call queues exactly
+ * one, so none is left pending once the worker has the last. */
+static gboolean
+vte_search_job_next_slice(gpointer data)
+{
+	struct vte_search_job *job = data;
+	VteTerminal *terminal = job->terminal;
+	VteSnapshot *slice;
+	glong end;
+
+	if (terminal == NULL) {
+		/* Cancelled; just let the worker finish. */
+		while (job->next < job->pending->len) {
+			vte_snapshot_unref(g_ptr_array_index(job->pending,
+							     job->next++));
 		}
+		job->next_row = job->history_end;
+	}
+	if (job->next < job->pending->len) {
+		slice = g_ptr_array_index(job->pending, job->next);
+		job->next++;
+	} else if (job->next_row < job->history_end) {
+		/* Whatever has been cut back, cleared or rewrapped since has
+		 * been taken off the end of the range already. */
+		job->next_row = MAX(job->next_row,
+			_vte_ring_delta(terminal->pvt->normal_screen.row_data));
+		end = MIN(job->next_row + VTE_SEARCH_SLICE_ROWS,
+			  job->history_end) - 1;
+		end = vte_terminal_search_line_end(terminal, end,
+						   job->history_end - 1);
+		slice = vte_terminal_get_screen_snapshot(terminal,
+				&terminal->pvt->normal_screen,
+				job->next_row, end);
+		job->next_row = end + 1;
 	} else {
-		_vte_debug_print(VTE_DEBUG_MISC,
-				"Using default monospace font.\n");
+		slice = vte_snapshot_ref(job->last);
 	}
+	g_async_queue_push(job->snapshots, slice);
+	return FALSE;
+}
 
-        same_desc = pvt->fontdesc && pango_font_description_equal (pvt->fontdesc, desc);
-	
-	/* Note that we proceed to recreating the font even if the description
-	 * and antialias settings are the same.  This is because maybe screen
-	 * font options were changed, or new fonts installed.  Those will be
-	 * detected at font creation time and respected.
-	 */
+/* Hand whatever has been found so far to the caller. */
+static gboolean
+vte_search_job_deliver(gpointer data)
+{
+	struct vte_search_job *job = data;
+	GArray *matches;
+	gboolean finished;
 
-        g_object_freeze_notify(object);
+	if (job->lock != NULL) {
+		g_mutex_lock(job->lock);
+	}
+	matches = job->matches;
+	job->matches = g_array_new(FALSE, FALSE, sizeof(VteSearchMatch));
+	finished = job->finished;
+	job->deliver_tag = 0;
+	if (job->lock != NULL) {
+		g_mutex_unlock(job->lock);
+	}
 
-	/* Free the old font description and save the new one. */
-	if (terminal->pvt->fontdesc != NULL) {
-		pango_font_description_free(terminal->pvt->fontdesc);
+	GDK_THREADS_ENTER ();
+	if (job->terminal != NULL && (matches->len > 0 || finished)) {
+		_vte_debug_print(VTE_DEBUG_MISC,
+				"Search %u found %u matches.\n",
+				job->id, matches->len);
+		job->callback(job->terminal,
+			      (const VteSearchMatch *) matches->data,
+			      matches->len, finished, job->data);
+	}
+	g_array_free(matches, TRUE);
+	if (finished) {
+		if (job->terminal != NULL) {
+			job->terminal->pvt->search_jobs =
+				g_list_remove(job->terminal->pvt->search_jobs,
+					      job);
+			if (job->terminal->pvt->search_index_job == job) {
+				/* The index is the terminal's again. */
+				job->terminal->pvt->search_index_job = NULL;
+				job->index = NULL;
+			}
+		}
+		vte_search_job_free(job);
 	}
-	pvt->fontdesc = desc;
-	pvt->fontantialias = antialias;
-	pvt->fontdirty = TRUE;
-	pvt->has_fonts = TRUE;
+	GDK_THREADS_LEAVE ();
 
-        if (!same_desc)
-                g_object_notify(object, "font-desc");
+	return FALSE;
+}
 
-	/* Set the drawing font. */
-	if (GTK_WIDGET_REALIZED(terminal)) {
-		vte_terminal_ensure_font (terminal);
+/* Queue matches for delivery, which happens on the main loop. */
+static void
+vte_search_job_post(struct vte_search_job *job, GArray *found,
+		    gboolean finished)
+{
+	if (job->lock != NULL) {
+		g_mutex_lock(job->lock);
+	}
+	g_array_append_vals(job->matches, found->data, found->len);
+	job->finished = finished;
+	if (job->deliver_tag == 0 && (job->matches->len > 0 || finished)) {
+		job->deliver_tag = g_idle_add(vte_search_job_deliver, job);
 	}
+	if (job->lock != NULL) {
+		g_mutex_unlock(job->lock);
+	}
+	g_array_set_size(found, 0);
+}
 
-        g_object_thaw_notify(object);
+/* Run the expression over one logical line, mapping byte offsets in its text
+ * back to cells. */
+static void
+vte_search_job_match_line(struct vte_search_job *job, GString *text,
+			  GArray *cells, GArray *found)
+{
+	GMatchInfo *info;
+	VteSearchMatch match;
+	struct selection_cell_coords *start, *end;
+	gint start_pos, end_pos;
+
+	g_regex_match_full(job->regex, text->str, text->len, 0,
+			   job->flags, &info, NULL);
+	while (g_match_info_matches(info)) {
+		if (g_match_info_fetch_pos(info, 0, &start_pos, &end_pos) &&
+		    end_pos > start_pos) {
+			start = &g_array_index(cells, struct selection_cell_coords,
+					       start_pos);
+			end = &g_array_index(cells, struct selection_cell_coords,
+					     end_pos);
+			match.start_row = start->row;
+			match.start_col = start->col;
+			match.end_row = end->row;
+			match.end_col = end->col;
+			g_array_append_val(found, match);
+		}
+		g_match_info_next(info, NULL);
+	}
+	g_match_info_free(info);
 }
 
-/**
- * vte_terminal_set_font:
- * @terminal: a #VteTerminal
- * @font_desc: The #PangoFontDescription of the desired font.
- *
- * Sets the font used for rendering all text displayed by the terminal,
- * overriding any fonts set using gtk_widget_modify_font().  The terminal
- * will immediately attempt to load the desired font, retrieve its
- * metrics, and attempt to resize itself to keep the same number of rows
- * and columns.
- *
- */
-void
-vte_terminal_set_font(VteTerminal *terminal,
-		      const PangoFontDescription *font_desc)
+/* Check every line of a snapshot, passing matches on a batch at a time, and
+ * index the lines of history slices if the job is building the index. */
+static void
+vte_search_job_check(struct vte_search_job *job, VteSnapshot *snapshot,
+		     GArray *found)
 {
-	g_return_if_fail(VTE_IS_TERMINAL(terminal));
-	vte_terminal_set_font_full_internal(terminal, font_desc,
-                                            VTE_ANTI_ALIAS_USE_DEFAULT);
+	GString *text;
+	GArray *cells, *chars;
+	struct selection_cell_coords attr;
+	VteRowData *row;
+	struct vte_charcell *cell;
+	gchar utf8[8];
+	gint length, k;
+	gsize text_length, cells_length;
+	glong i, col, line_row;
+	gboolean wrapped, indexing;
+	gunichar c;
+
+	indexing = job->index != NULL && snapshot != job->last;
+	text = g_string_new(NULL);
+	cells = g_array_new(FALSE, TRUE, sizeof(struct selection_cell_coords));
+	chars = g_array_new(FALSE, FALSE, sizeof(gunichar));
+	text_length = cells_length = 0;
+	line_row = snapshot->start_row;
+	for (i = 0; i < snapshot->n_rows; i++) {
+		row = vte_snapshot_row(snapshot, i);
+		attr.row = snapshot->start_row + i;
+		col = 0;
+		if (row != NULL) {
+			for (col = 0; col < (glong) row->cells->len; col++) {
+				cell = &g_array_index(row->cells,
+						      struct vte_charcell, col);
+				if (cell->attr.fragment) {
+					continue;
+				}
+				attr.col = col;
+				c = cell->c ? cell->c : ' ';
+				length = g_unichar_to_utf8(c, utf8);
+				g_string_append_len(text, utf8, length);
+				for (k = 0; k < length; k++) {
+					g_array_append_val(cells, attr);
+				}
+				if (indexing) {
+					g_array_append_val(chars, c);
+				}
+				if (cell->c != 0 && cell->c != ' ') {
+					text_length = text->len;
+					cells_length = cells->len;
+				}
+			}
+		}
+		wrapped = row != NULL && row->soft_wrapped &&
+			  i + 1 < snapshot->n_rows;
+		if (wrapped) {
+			continue;
+		}
+
+		/* Only whole lines go into the index; one which carries on
+		 * past the slice is left for the next update. */
+		if (indexing && !(row != NULL && row->soft_wrapped) &&
+		    !g_atomic_int_get(&job->index_stale)) {
+			_vte_search_index_add_line(job->index, line_row,
+						   attr.row + 1,
+						   (const gunichar *) chars->data,
+						   chars->len);
+		}
+
+		/* Trailing blanks aren't part of the line, but the position
+		 * just past its end is needed to finish matches off. */
+		g_string_truncate(text, text_length);
+		if (cells_length < cells->len) {
+			g_array_set_size(cells, cells_length + 1);
+		} else {
+			attr.col = col;
+			g_array_append_val(cells, attr);
+		}
+		if (line_row >= job->first_row) {
+			vte_search_job_match_line(job, text, cells, found);
+		}
+		if (found->len >= VTE_SEARCH_BATCH) {
+			vte_search_job_post(job, found, FALSE);
+		}
+		if (g_atomic_int_get(&job->cancelled)) {
+			break;
+		}
+		g_string_truncate(text, 0);
+		g_array_set_size(cells, 0);
+		g_array_set_size(chars, 0);
+		text_length = cells_length = 0;
+		line_row = attr.row + 1;
+	}
+	g_array_free(chars, TRUE);
+	g_array_free(cells, TRUE);
+	g_string_free(text, TRUE);
 }
 
-static void
-vte_terminal_set_font_from_string_full_internal(VteTerminal *terminal,
-                                                const char *name,
-                                                VteTerminalAntiAlias antialias)
-{
-	PangoFontDescription *font_desc = NULL;
-	g_return_if_fail(VTE_IS_TERMINAL(terminal));
+/* Check the next snapshot.  Returns FALSE once the job is over, at which
+ * point it belongs to the main loop and mustn't be touched again.  Even a
+ * cancelled job reads up to the last snapshot, so that the main loop isn't
+ * left with a slice to queue for a job which has gone. */
+static gboolean
+vte_search_job_step(gpointer data)
+{
+	struct vte_search_job *job = data;
+	VteSnapshot *snapshot;
+	GArray *found;
+	gboolean finished;
+
+	found = g_array_new(FALSE, FALSE, sizeof(VteSearchMatch));
+	snapshot = g_async_queue_pop(job->snapshots);
+	finished = snapshot == job->last;
+	if (!finished) {
+		if (job->lock != NULL) {
+			g_idle_add(vte_search_job_next_slice, job);
+		} else {
+			vte_search_job_next_slice(job);
+		}
+	}
+	if (!g_atomic_int_get(&job->cancelled)) {
+		vte_search_job_check(job, snapshot, found);
+	}
+	vte_snapshot_unref(snapshot);
+	vte_search_job_post(job, found, finished);
+	g_array_free(found, TRUE);
 
-	if (name)
-	  font_desc = pango_font_description_from_string(name);
-	vte_terminal_set_font_full_internal(terminal, font_desc, antialias);
-	pango_font_description_free(font_desc);
+	return !finished;
 }
 
-/**
- * vte_terminal_set_font_from_string_full:
- * @terminal: a #VteTerminal
- * @name: A string describing the font.
- * @antialias: Whether or not to antialias the font (if possible).
- *
- * A convenience function which converts @name into a #PangoFontDescription and
- * passes it to vte_terminal_set_font_full().
- *
- * Since: 0.11.11
- *
- * Deprecated: 0.19.1
- */
-void
-vte_terminal_set_font_from_string_full(VteTerminal *terminal, const char *name,
-				       VteTerminalAntiAlias antialias)
+static gpointer
+vte_search_job_thread(gpointer data)
 {
-        vte_terminal_set_font_from_string_full_internal(terminal, name, antialias);
+	while (vte_search_job_step(data)) ;
+	return NULL;
 }
 
 /**
- * vte_terminal_set_font_from_string:
+ * vte_terminal_search_gregex:
  * @terminal: a #VteTerminal
- * @name: A string describing the font.
+ * @regex: a #GRegex
+ * @flags: the #GRegexMatchFlags to use when matching the regex
+ * @start_row: the row from which to search
+ * @callback: a function to receive the matches
+ * @data: user data for @callback
+ * @destroy: a function to free @data when the search is over, or %NULL
  *
- * A convenience function which converts @name into a #PangoFontDescription and
- * passes it to vte_terminal_set_font().
+ * Searches the lines of the current screen's buffer which start at or after
+ * @start_row for matches of @regex.  The search runs in the background, in
+ * another thread if threads have been initialized, and @callback is called
+ * from the main loop with each batch of matches as they're found, ordered by
+ * position, and once more with @finished set when the search is done.
  *
+ * Lines which have scrolled into the history are kept in an index, built in
+ * the background by the first search made, so that later searches only
+ * examine lines which could contain a match.  The index can't help with
+ * expressions lacking a literal run of at least three characters which every
+ * match contains, nor with searches made while it is being built; those are
+ * checked against every line.
+ *
+ * Returns: an id which can be passed to vte_terminal_search_cancel()
  */
-void
-vte_terminal_set_font_from_string(VteTerminal *terminal, const char *name)
+guint
+vte_terminal_search_gregex(VteTerminal *terminal,
+			   GRegex *regex, GRegexMatchFlags flags,
+			   glong start_row,
+			   VteSearchCallback callback,
+			   gpointer data,
+			   GDestroyNotify destroy)
 {
-	g_return_if_fail(VTE_IS_TERMINAL(terminal));
-	g_return_if_fail(name != NULL);
-	vte_terminal_set_font_from_string_full_internal(terminal, name,
-                                                        VTE_ANTI_ALIAS_USE_DEFAULT);
+	VteTerminalPrivate *pvt;
+	VteRing *ring;
+	struct vte_search_job *job;
+	gunichar *literal;
+	GArray *lines;
+	glong first, tail, row;
+	gsize length;
+	guint i;
+
+	g_return_val_if_fail(VTE_IS_TERMINAL(terminal), 0);
+	g_return_val_if_fail(regex != NULL, 0);
+	g_return_val_if_fail(callback != NULL, 0);
+
+	pvt = terminal->pvt;
+	vte_terminal_reflow_finish(terminal);
+	ring = pvt->screen->row_data;
+
+	job = g_slice_new0(struct vte_search_job);
+	job->terminal = terminal;
+	job->id = ++pvt->search_last_id;
+	job->regex = g_regex_ref(regex);
+	job->flags = flags;
+	job->snapshots = g_async_queue_new();
+	job->pending = g_ptr_array_new();
+	job->callback = callback;
+	job->data = data;
+	job->destroy = destroy;
+	job->matches = g_array_new(FALSE, FALSE, sizeof(VteSearchMatch));
+
+	first = MAX(start_row, _vte_ring_delta(ring));
+	job->first_row = first;
+	job->next_row = job->history_end = first;
+	if (pvt->screen == &pvt->normal_screen) {
+		/* The history is sliced up to the line which the insertion
+		 * area starts in; that one is taken with the rest. */
+		job->history_end = vte_reflow_line_start(ring,
+				MIN(pvt->normal_screen.insert_delta,
+				    _vte_ring_next(ring)));
+	}
+	if (pvt->screen == &pvt->normal_screen &&
+	    pvt->search_index == NULL) {
+		/* Build the index while checking the history. */
+		pvt->search_index = _vte_search_index_new(_vte_ring_delta(ring));
+		pvt->search_index_job = job;
+		job->index = pvt->search_index;
+		job->next_row = _vte_ring_delta(ring);
+	} else if (pvt->screen == &pvt->normal_screen &&
+		   pvt->search_index_job == NULL) {
+		/* Lines past the index are always checked; before it, only
+		 * those the index says might match. */
+		vte_terminal_search_index_update(terminal);
+		tail = MIN(_vte_search_index_next(pvt->search_index),
+			   pvt->normal_screen.insert_delta);
+		literal = _vte_search_required_literal(
+				g_regex_get_pattern(regex),
+				g_regex_get_compile_flags(regex),
+				&length);
+		if (literal != NULL && first < tail) {
+			lines = _vte_search_index_lookup(pvt->search_index,
+							 literal, length,
+							 first);
+			for (i = 0; i < lines->len; i++) {
+				row = g_array_index(lines, glong, i);
+				if (row >= tail) {
+					break;
+				}
+				g_ptr_array_add(job->pending,
+					vte_terminal_get_snapshot(terminal, row,
+						vte_terminal_search_line_end(terminal,
+									     row,
+									     tail - 1)));
+			}
+			g_array_free(lines, TRUE);
+			job->next_row = tail;
+		}
+		g_free(literal);
+	}
+	job->history_end = MAX(job->history_end, job->next_row);
+	job->last = vte_terminal_get_snapshot(terminal,
+					      MAX(first, job->history_end),
+					      _vte_ring_next(ring) - 1);
+
+	_vte_debug_print(VTE_DEBUG_MISC,
+			"Search %u checking %u lines and rows %ld to %ld "
+			"from row %ld.\n",
+			job->id, job->pending->len,
+			job->next_row, job->history_end, start_row);
+	vte_search_job_next_slice(job);
+
+	pvt->search_jobs = g_list_prepend(pvt->search_jobs, job);
+	if (g_thread_supported()) {
+		job->lock = g_mutex_new();
+		if (g_thread_create(vte_search_job_thread, job,
+				    FALSE, NULL) != NULL) {
+			return job->id;
+		}
+		g_mutex_free(job->lock);
+		job->lock = NULL;
+	}
+	g_idle_add_full(G_PRIORITY_LOW, vte_search_job_step, job, NULL);
+	return job->id;
 }
 
 /**
- * vte_terminal_get_font:
+ * vte_terminal_search_cancel:
  * @terminal: a #VteTerminal
+ * @search_id: the id returned by vte_terminal_search_gregex()
  *
- * Queries the terminal for information about the fonts which will be
- * used to draw text in the terminal.
- *
- * Returns: a #PangoFontDescription describing the font the terminal is
- * currently using to render text.
+ * Stops a search.  Its callback won't be called again, and its destroy
+ * notifier is called once the search has wound down.
  */
-const PangoFontDescription *
-vte_terminal_get_font(VteTerminal *terminal)
+void
+vte_terminal_search_cancel(VteTerminal *terminal, guint search_id)
 {
-	g_return_val_if_fail(VTE_IS_TERMINAL(terminal), NULL);
-	return terminal->pvt->fontdesc;
-}
+	struct vte_search_job *job;
+	GList *link;
 
-/* Read and refresh our perception of the size of the PTY. */
-static void
-vte_terminal_refresh_size(VteTerminal *terminal)
-{
-	int rows, columns;
-	if (terminal->pvt->pty_master != -1) {
-		/* Use an ioctl to read the size of the terminal. */
-			terminal->row_count = rows;
-			terminal->column_count = columns;
+	g_return_if_fail(VTE_IS_TERMINAL(terminal));
+
+	for (link = terminal->pvt->search_jobs; link; link = link->next) {
+		job = link->data;
+		if (job->id == search_id) {
+			terminal->pvt->search_jobs =
+				g_list_delete_link(terminal->pvt->search_jobs,
+						   link);
+			if (terminal->pvt->search_index_job == job) {
+				/* An unfinished index is no use. */
+				vte_terminal_search_index_invalidate(terminal,
+								     G_MINLONG);
+			}
+			job->terminal = NULL;
+			g_atomic_int_set(&job->cancelled, 1);
+			return;
+		}
 	}
 }
 
@@ -7148,6 +9652,20 @@ vte_terminal_set_size(VteTerminal *terminal, glong columns, glong rows)
 		terminal->row_count = rows;
 		terminal->column_count = columns;
 	}
+	if (old_rows != terminal->row_count &&
+	    terminal->pvt->normal_screen.row_data != NULL) {
+		/* Keep the visible rows out of frozen blocks. */
+		_vte_ring_set_hot_length(terminal->pvt->normal_screen.row_data,
+				terminal->row_count + VTE_SCROLLBACK_HOT_MARGIN);
+		if (terminal->pvt->reflow_ring != NULL) {
+			_vte_ring_set_hot_length(terminal->pvt->reflow_ring,
+				terminal->row_count + VTE_SCROLLBACK_HOT_MARGIN);
+		}
+	}
+	if (old_columns != terminal->column_count &&
+	    terminal->pvt->normal_screen.row_data != NULL) {
+		vte_terminal_reflow(terminal);
+	}
 	if (old_rows != terminal->row_count ||
 			old_columns != terminal->column_count) {
 		gtk_widget_queue_resize (&terminal->widget);
@@ -7167,6 +9685,19 @@ vte_terminal_handle_scroll(VteTerminal *terminal)
 
 	/* Read the new adjustment value and save the difference. */
 	adj = floor (terminal->adjustment->value);
+	/* Looking at history which hasn't been rewrapped yet? */
+	if (terminal->pvt->reflow_ring != NULL &&
+	    screen == &terminal->pvt->normal_screen &&
+	    adj < terminal->pvt->reflow_end) {
+		/* Rewrapping renumbers the rows, so take the view there in
+		 * the old numbering and let finishing move it.  What was on
+		 * screen can't be reused. */
+		screen->scroll_delta = adj;
+		vte_terminal_reflow_finish(terminal);
+		vte_terminal_emit_text_modified(terminal);
+		_vte_terminal_queue_contents_changed(terminal);
+		return;
+	}
 	dy = adj - screen->scroll_delta;
 	screen->scroll_delta = adj;
 
@@ -7326,32 +9857,14 @@ _vte_terminal_inline_error_message(VteTerminal *terminal, const char *format, ..
 static void
 vte_terminal_reset_rowdata(VteRing **ring, glong lines)
 {
-	VteRing *new_ring;
-	VteRowData *row;
-	long i, next;
-
 	_vte_debug_print(VTE_DEBUG_MISC,
 			"Sizing scrollback buffer to %ld lines.\n",
 			lines);
-	if (*ring && (_vte_ring_max(*ring) == lines)) {
-		return;
-	}
-	new_ring = _vte_ring_new_with_delta(lines,
-					    *ring ? _vte_ring_delta(*ring) : 0,
-					    (GFunc) _vte_free_row_data,
-					    NULL);
 	if (*ring) {
-		next = _vte_ring_next(*ring);
-		for (i = _vte_ring_delta(*ring); i < next; i++) {
-			row = _vte_ring_index(*ring, VteRowData *, i);
-			row = _vte_ring_append(new_ring, row);
-			if (row) {
-				_vte_free_row_data (row);
-			}
-		}
-		_vte_ring_free(*ring, FALSE);
+		_vte_ring_resize(*ring, lines);
+	} else {
+		*ring = vte_row_ring_new(lines, 0);
 	}
-	*ring = new_ring;
 }
 
 static void
@@ -7444,7 +9957,7 @@ vte_terminal_init(VteTerminal *terminal)
 
 	/* Scrolling options. */
 	pvt->scroll_on_keystroke = TRUE;
-        pvt->scrollback_lines = -1; /* force update in vte_terminal_set_scrollback_lines */
+        pvt->scrollback_lines = -1; /* not set yet; force update in vte_terminal_set_scrollback_lines */
 	vte_terminal_set_scrollback_lines(terminal, VTE_SCROLLBACK_INIT);
 
 	/* Selection info. */
@@ -7465,6 +9978,7 @@ vte_terminal_init(VteTerminal *terminal)
 
 	/* Cursor blinking. */
 	pvt->cursor_visible = TRUE;
+	pvt->cursor_painted_row = -1;
 	pvt->cursor_blink_timeout = 500;
         pvt->cursor_blinks = FALSE;
         pvt->cursor_blink_mode = VTE_CURSOR_BLINK_SYSTEM;
@@ -7812,6 +10326,7 @@ vte_terminal_finalize(GObject *object)
 	GtkClipboard *clipboard;
         GtkSettings *settings;
 	struct vte_match_regex *regex;
+	struct vte_search_job *job;
 	guint i;
 
 	_vte_debug_print(VTE_DEBUG_LIFECYCLE, "vte_terminal_finalize()\n");
@@ -7825,6 +10340,16 @@ vte_terminal_finalize(GObject *object)
 	if (terminal->pvt->draw != NULL) {
 		_vte_draw_free(terminal->pvt->draw);
 	}
+	if (terminal->pvt->offscreen_draw != NULL) {
+		_vte_draw_free(terminal->pvt->offscreen_draw);
+	}
+	if (terminal->pvt->graphics != NULL) {
+		g_hash_table_destroy(terminal->pvt->graphics);
+	}
+	if (terminal->pvt->draw_runs != NULL) {
+		g_array_free(terminal->pvt->draw_runs, TRUE);
+		g_array_free(terminal->pvt->draw_row_runs, TRUE);
+	}
 
 	/* The NLS maps. */
 	_vte_iso2022_state_free(terminal->pvt->iso2022);
@@ -7842,6 +10367,7 @@ vte_terminal_finalize(GObject *object)
 	if (terminal->pvt->match_attributes != NULL) {
 		g_array_free(terminal->pvt->match_attributes, TRUE);
 	}
+	vte_terminal_match_lines_clear(terminal);
 	g_free(terminal->pvt->match_contents);
 	if (terminal->pvt->match_regexes != NULL) {
 		for (i = 0; i < terminal->pvt->match_regexes->len; i++) {
@@ -7893,7 +10419,14 @@ vte_terminal_finalize(GObject *object)
 		g_array_free(terminal->pvt->word_chars, TRUE);
 	}
 
+	/* Stop any searches; they finish off on their own. */
+	while (terminal->pvt->search_jobs != NULL) {
+		job = terminal->pvt->search_jobs->data;
+		vte_terminal_search_cancel(terminal, job->id);
+	}
 	/* Clear the output histories. */
+	vte_terminal_reflow_cancel(terminal);
+	vte_terminal_search_index_invalidate(terminal, G_MINLONG);
 	_vte_ring_free(terminal->pvt->normal_screen.row_data, TRUE);
 	_vte_ring_free(terminal->pvt->alternate_screen.row_data, TRUE);
 	if (terminal->pvt->free_row) {
@@ -7942,6 +10475,8 @@ vte_terminal_finalize(GObject *object)
 	}
 
 	remove_update_timeout (terminal);
+	g_free (terminal->pvt->damage.rows);
+	g_free (terminal->pvt->front.cells);
 
 	/* discard title updates */
 	g_free(terminal->pvt->window_title_changed);
@@ -7979,6 +10514,9 @@ vte_terminal_realize(GtkWidget *widget)
 	/* Create the draw structure if we don't already have one. */
 	if (terminal->pvt->draw == NULL) {
 		terminal->pvt->draw = _vte_draw_new(&terminal->widget);
+		/* The font may have been measured offscreen meanwhile, but
+		 * this draw still has to be given it. */
+		terminal->pvt->fontdirty = TRUE;
 	}
 
 	/* Create the stock cursors. */
@@ -8226,6 +10764,14 @@ vte_terminal_fill_rectangle_int(VteTerminal *terminal,
 	}
 }
 
+/* A rasterized line-drawing character, as a mask covering its cell.  It's
+ * both the key and the value in the terminal's table. */
+struct vte_graphic {
+	gunichar c;
+	gint width, height;
+	struct _vte_draw_mask *mask;
+};
+
 static void
 vte_terminal_fill_rectangle(VteTerminal *terminal,
 			    struct vte_palette_entry *entry,
@@ -8234,6 +10780,19 @@ vte_terminal_fill_rectangle(VteTerminal *terminal,
 			    gint width,
 			    gint height)
 {
+	struct _vte_draw_mask *mask = terminal->pvt->graphic_mask;
+	gint i, j;
+
+	if (mask != NULL) {
+		/* Rasterizing, so just cover the pixels, clipped to the
+		 * cell. */
+		for (j = MAX(y, 0); j < MIN(y + height, mask->height); j++) {
+			for (i = MAX(x, 0); i < MIN(x + width, mask->width); i++) {
+				mask->bytes[j * mask->width + i] = 0xff;
+			}
+		}
+		return;
+	}
 	vte_terminal_fill_rectangle_int(terminal, entry, x, y, width, height);
 }
 
@@ -8277,46 +10836,22 @@ vte_terminal_draw_point(VteTerminal *terminal,
 	vte_terminal_fill_rectangle(terminal, entry, x, y, 1, 1);
 }
 
-/* Draw the graphic representation of a line-drawing or special graphics
- * character. */
+/* Draw the shapes making up a line-drawing or special graphics character
+ * into a cell, one line or point at a time. */
 static gboolean
-vte_terminal_draw_graphic(VteTerminal *terminal, gunichar c,
-			  gint fore, gint back, gboolean draw_default_bg,
-			  gint x, gint y,
-			  gint column_width, gint columns, gint row_height,
-			  gboolean bold)
+vte_terminal_draw_graphic_shapes(VteTerminal *terminal, gunichar c,
+				 gint fore, gint x, gint y,
+				 gint column_width, gint columns,
+				 gint row_height)
 {
 	gboolean ret;
 	gint xcenter, xright, ycenter, ybottom, i, j, draw;
-	struct _vte_draw_text_request request;
-	GdkColor color;
-
-	request.c = c;
-	request.x = x + VTE_PAD_WIDTH;
-	request.y = y + VTE_PAD_WIDTH;
-	request.columns = columns;
 
-	color.red = terminal->pvt->palette[fore].red;
-	color.green = terminal->pvt->palette[fore].green;
-	color.blue = terminal->pvt->palette[fore].blue;
 	xright = x + column_width * columns;
 	ybottom = y + row_height;
 	xcenter = (x + xright) / 2;
 	ycenter = (y + ybottom) / 2;
 
-	if ((back != VTE_DEF_BG) || draw_default_bg) {
-		vte_terminal_fill_rectangle(terminal,
-					    &terminal->pvt->palette[back],
-					    x, y,
-					    column_width * columns, row_height);
-	}
-
-	if (_vte_draw_char(terminal->pvt->draw, &request,
-			   &color, VTE_DRAW_OPAQUE, bold)) {
-		/* We were able to draw with actual fonts. */
-		return TRUE;
-	}
-
 	ret = TRUE;
 
 	switch (c) {
@@ -9042,6 +11577,135 @@ vte_terminal_draw_graphic(VteTerminal *terminal, gunichar c,
 	return ret;
 }
 
+static guint
+vte_graphic_hash(gconstpointer p)
+{
+	const struct vte_graphic *graphic = p;
+
+	return graphic->c ^ (graphic->width << 21) ^ (graphic->height << 11);
+}
+
+static gboolean
+vte_graphic_equal(gconstpointer a, gconstpointer b)
+{
+	const struct vte_graphic *ga = a, *gb = b;
+
+	return (ga->c == gb->c) &&
+	       (ga->width == gb->width) &&
+	       (ga->height == gb->height);
+}
+
+static void
+vte_graphic_free(gpointer p)
+{
+	struct vte_graphic *graphic = p;
+
+	_vte_draw_mask_unref(graphic->mask);
+	g_slice_free(struct vte_graphic, graphic);
+}
+
+/* Rasterize a line-drawing character into a mask covering its cell.
+ * Returns NULL if we don't know how to draw the character. */
+static struct vte_graphic *
+vte_terminal_rasterize_graphic(VteTerminal *terminal, gunichar c,
+			       gint column_width, gint columns,
+			       gint row_height)
+{
+	struct _vte_draw_mask *mask;
+	struct vte_graphic *graphic;
+	gboolean known;
+
+	mask = _vte_draw_mask_new(column_width * columns, row_height);
+	terminal->pvt->graphic_mask = mask;
+	known = vte_terminal_draw_graphic_shapes(terminal, c, 0, 0, 0,
+						 column_width, columns,
+						 row_height);
+	terminal->pvt->graphic_mask = NULL;
+	if (!known) {
+		_vte_draw_mask_unref(mask);
+		return NULL;
+	}
+
+	graphic = g_slice_new(struct vte_graphic);
+	graphic->c = c;
+	graphic->width = mask->width;
+	graphic->height = mask->height;
+	graphic->mask = mask;
+	return graphic;
+}
+
+/* Draw the graphic representation of a line-drawing or special graphics
+ * character.  Each character is rasterized once for each cell size, and
+ * drawn from then on by painting its mask, much as a glyph would be.  If
+ * the backend can't, the shapes are drawn one at a time instead. */
+static gboolean
+vte_terminal_draw_graphic(VteTerminal *terminal, gunichar c,
+			  gint fore, gint back, gboolean draw_default_bg,
+			  gint x, gint y,
+			  gint column_width, gint columns, gint row_height,
+			  gboolean bold)
+{
+	struct _vte_draw_text_request request;
+	struct vte_graphic key, *graphic;
+	GdkColor color;
+
+	request.c = c;
+	request.x = x + VTE_PAD_WIDTH;
+	request.y = y + VTE_PAD_WIDTH;
+	request.columns = columns;
+
+	color.red = terminal->pvt->palette[fore].red;
+	color.green = terminal->pvt->palette[fore].green;
+	color.blue = terminal->pvt->palette[fore].blue;
+
+	if ((back != VTE_DEF_BG) || draw_default_bg) {
+		vte_terminal_fill_rectangle(terminal,
+					    &terminal->pvt->palette[back],
+					    x, y,
+					    column_width * columns, row_height);
+	}
+
+	if (_vte_draw_char(terminal->pvt->draw, &request,
+			   &color, VTE_DRAW_OPAQUE, bold)) {
+		/* We were able to draw with actual fonts. */
+		return TRUE;
+	}
+
+	if (terminal->pvt->graphics == NULL) {
+		terminal->pvt->graphics = g_hash_table_new_full(vte_graphic_hash,
+								vte_graphic_equal,
+								NULL,
+								vte_graphic_free);
+	}
+	key.c = c;
+	key.width = column_width * columns;
+	key.height = row_height;
+	graphic = g_hash_table_lookup(terminal->pvt->graphics, &key);
+	if (graphic == NULL) {
+		graphic = vte_terminal_rasterize_graphic(terminal, c,
+							 column_width, columns,
+							 row_height);
+		if (graphic == NULL) {
+			return FALSE;
+		}
+		/* Old cell sizes aren't coming back often enough to be
+		 * worth keeping around indefinitely. */
+		if (g_hash_table_size(terminal->pvt->graphics) >= VTE_GRAPHIC_CACHE_SIZE) {
+			g_hash_table_remove_all(terminal->pvt->graphics);
+		}
+		g_hash_table_insert(terminal->pvt->graphics, graphic, graphic);
+	}
+
+	if (!_vte_draw_mask(terminal->pvt->draw, graphic->mask,
+			    x + VTE_PAD_WIDTH, y + VTE_PAD_WIDTH,
+			    &color, VTE_DRAW_OPAQUE)) {
+		return vte_terminal_draw_graphic_shapes(terminal, c, fore,
+							x, y, column_width,
+							columns, row_height);
+	}
+	return TRUE;
+}
+
 /* Draw a string of characters with similar attributes. */
 static void
 vte_terminal_draw_cells(VteTerminal *terminal,
@@ -9404,31 +12068,181 @@ vte_terminal_draw_cells_with_attributes(VteTerminal *terminal,
 	for (i = 0, cell_count = 0; i < n; i++) {
 		cell_count += g_unichar_to_utf8(items[i].c, scratch_buf);
 	}
-	cells = g_new(struct vte_charcell, cell_count);
-	_vte_terminal_translate_pango_cells(terminal, attrs, cells, cell_count);
-	for (i = 0, j = 0; i < n; i++) {
-		vte_terminal_determine_colors(terminal, &cells[j],
-					      FALSE,
-					      FALSE,
-					      FALSE,
-					      &fore, &back);
-		vte_terminal_draw_cells(terminal, items + i, 1,
-					fore,
-					back,
-					TRUE, draw_default_bg,
-					cells[j].attr.bold,
-					cells[j].attr.underline,
-					cells[j].attr.strikethrough,
-					FALSE, FALSE, column_width, height);
-		j += g_unichar_to_utf8(items[i].c, scratch_buf);
+	cells = g_new(struct vte_charcell, cell_count);
+	_vte_terminal_translate_pango_cells(terminal, attrs, cells, cell_count);
+	for (i = 0, j = 0; i < n; i++) {
+		vte_terminal_determine_colors(terminal, &cells[j],
+					      FALSE,
+					      FALSE,
+					      FALSE,
+					      &fore, &back);
+		vte_terminal_draw_cells(terminal, items + i, 1,
+					fore,
+					back,
+					TRUE, draw_default_bg,
+					cells[j].attr.bold,
+					cells[j].attr.underline,
+					cells[j].attr.strikethrough,
+					FALSE, FALSE, column_width, height);
+		j += g_unichar_to_utf8(items[i].c, scratch_buf);
+	}
+	g_free(cells);
+}
+
+
+/* Paint the contents of a given row at the given location.  Take advantage
+ * of multiple-draw APIs by finding runs of characters with identical
+ * attributes and bundling them together. */
+/* A run of cells in a row which are drawn with the same colors. */
+struct vte_draw_run {
+	gint start, end;	/* columns */
+	gint fore, back;
+	gboolean bold;		/* the last character is, so it may spill
+				   over by a pixel */
+};
+
+/* Resolve the colors of each cell in the rows about to be drawn, selection
+ * included, into runs, so that neither pass has to work them out a cell at
+ * a time.  Row n's runs are draw_runs[draw_row_runs[n]] up to, but not
+ * including, draw_runs[draw_row_runs[n + 1]]. */
+static void
+vte_terminal_build_draw_runs(VteTerminal *terminal, VteScreen *screen,
+			     gint start_row, gint row_count,
+			     gint start_column, gint end_column,
+			     gboolean reverse)
+{
+	struct vte_draw_run run, *last;
+	struct vte_charcell *cell;
+	VteRowData *row_data;
+	VteRingIter iter;
+	GArray *runs, *row_runs;
+	glong sel_start, sel_end;
+	gboolean selected;
+	gint row, i, fore, back;
+	guint first;
+
+	if (terminal->pvt->draw_runs == NULL) {
+		terminal->pvt->draw_runs = g_array_new(FALSE, FALSE,
+						       sizeof(struct vte_draw_run));
+		terminal->pvt->draw_row_runs = g_array_new(FALSE, FALSE,
+							   sizeof(guint));
+	}
+	runs = terminal->pvt->draw_runs;
+	row_runs = terminal->pvt->draw_row_runs;
+	g_array_set_size(runs, 0);
+	g_array_set_size(row_runs, 0);
+
+	_vte_ring_iter_init(&iter, screen->row_data, start_row);
+	for (row = start_row; row < start_row + row_count; row++) {
+		first = runs->len;
+		g_array_append_val(row_runs, first);
+		vte_row_selection_span(terminal, row, &sel_start, &sel_end);
+		row_data = _vte_ring_iter_next(&iter);
+
+		/* Back up in case this is a multicolumn character,
+		 * making the drawing area a little wider. */
+		i = start_column;
+		if (row_data != NULL) {
+			cell = _vte_row_data_find_charcell(row_data, i);
+			if (cell != NULL) {
+				while (cell->attr.fragment && i > 0) {
+					cell = _vte_row_data_find_charcell(row_data, --i);
+				}
+			}
+		}
+
+		/* Walk the line. */
+		while (i < end_column) {
+			cell = row_data ?
+			       _vte_row_data_find_charcell(row_data, i) : NULL;
+			/* Fragments of multicolumn characters take the
+			 * colors of the initial portion. */
+			if (cell != NULL && cell->attr.fragment &&
+			    runs->len > first) {
+				last = &g_array_index(runs, struct vte_draw_run,
+						      runs->len - 1);
+				last->end = MAX(last->end, i + 1);
+				i++;
+				continue;
+			}
+			selected = (i >= sel_start) && (i < sel_end);
+			vte_terminal_determine_colors(terminal, cell,
+					reverse|selected,
+					selected,
+					FALSE,
+					&fore, &back);
+			run.start = i;
+			i += cell ? MAX(cell->attr.columns, 1) : 1;
+			run.end = i;
+			run.bold = cell && cell->attr.bold;
+			if (runs->len > first) {
+				last = &g_array_index(runs, struct vte_draw_run,
+						      runs->len - 1);
+				if ((last->fore == fore) &&
+				    (last->back == back) &&
+				    (last->end == run.start)) {
+					last->end = run.end;
+					last->bold = run.bold;
+					continue;
+				}
+			}
+			run.fore = fore;
+			run.back = back;
+			g_array_append_val(runs, run);
+		}
+	}
+	first = runs->len;
+	g_array_append_val(row_runs, first);
+}
+
+/* Get ready to look up colors for the cells of a row. */
+static inline void
+vte_terminal_draw_row_start(VteTerminal *terminal, gint row, gint start_row,
+			    const guint *row_runs, guint *k,
+			    glong *hilite_start, glong *hilite_end)
+{
+	*k = row_runs[row - start_row];
+	*hilite_start = *hilite_end = 0;
+	if (terminal->pvt->show_match) {
+		vte_row_span_between(row,
+				     terminal->pvt->match_start.column,
+				     terminal->pvt->match_start.row,
+				     terminal->pvt->match_end.column,
+				     terminal->pvt->match_end.row,
+				     hilite_start, hilite_end);
 	}
-	g_free(cells);
 }
 
+/* Look up the colors of a cell, moving through the row's runs as the
+ * columns asked about increase. */
+static inline void
+vte_terminal_draw_run_colors(VteTerminal *terminal,
+			     const struct vte_draw_run *runs,
+			     guint *k, guint end,
+			     gint col, gint row,
+			     const struct vte_charcell *cell,
+			     gboolean reverse,
+			     gint *fore, gint *back)
+{
+	gboolean selected;
+
+	while ((*k < end) && (runs[*k].end <= col)) {
+		(*k)++;
+	}
+	if ((*k < end) && (runs[*k].start <= col)) {
+		*fore = runs[*k].fore;
+		*back = runs[*k].back;
+		return;
+	}
+	/* Not something we walked over; work it out the long way. */
+	selected = vte_cell_is_selected(terminal, col, row, NULL);
+	vte_terminal_determine_colors(terminal, cell,
+				      reverse|selected,
+				      selected,
+				      FALSE,
+				      fore, back);
+}
 
-/* Paint the contents of a given row at the given location.  Take advantage
- * of multiple-draw APIs by finding runs of characters with identical
- * attributes and bundling them together. */
 static void
 vte_terminal_draw_rows(VteTerminal *terminal,
 		      VteScreen *screen,
@@ -9440,12 +12254,15 @@ vte_terminal_draw_rows(VteTerminal *terminal,
 	struct _vte_draw_text_request items[4*VTE_DRAW_MAX_LENGTH];
 	gint i, j, row, rows, x, y, end_column;
 	gint fore, nfore, back, nback;
-	glong delta;
+	glong hilite_start, hilite_end;
 	gboolean underline, nunderline, bold, nbold, hilite, nhilite, reverse,
-		 selected, nselected, strikethrough, nstrikethrough;
-	guint item_count;
+		 strikethrough, nstrikethrough;
+	guint item_count, k, m;
 	struct vte_charcell *cell;
+	struct vte_draw_run *runs;
+	guint *row_runs;
 	VteRowData *row_data;
+	VteRingIter iter;
 
 	reverse = terminal->pvt->screen->reverse_mode;
 
@@ -9453,118 +12270,44 @@ vte_terminal_draw_rows(VteTerminal *terminal,
 	start_x -= start_column * column_width;
 	end_column = start_column + column_count;
 
+	/* resolve the colors of every row once, for both passes */
+	vte_terminal_build_draw_runs(terminal, screen, start_row, row_count,
+				     start_column, end_column, reverse);
+	runs = (struct vte_draw_run *) terminal->pvt->draw_runs->data;
+	row_runs = (guint *) terminal->pvt->draw_row_runs->data;
+
 	/* clear the background */
-	delta = screen->scroll_delta;
 	x = start_x + VTE_PAD_WIDTH;
 	y = start_y + VTE_PAD_WIDTH;
-	row = start_row;
-	rows = row_count;
-	do {
-		row_data = _vte_terminal_find_row_data(terminal, row);
-		/* Back up in case this is a multicolumn character,
-		 * making the drawing area a little wider. */
-		i = start_column;
-		if (row_data != NULL) {
-			cell = _vte_row_data_find_charcell(row_data, i);
-			if (cell != NULL) {
-				while (cell->attr.fragment && i > 0) {
-					cell = _vte_row_data_find_charcell(row_data, --i);
-				}
+	for (row = 0; row < row_count; row++) {
+		/* Runs were split wherever the foreground changed, too, so
+		 * merge those with the same background. */
+		k = row_runs[row];
+		while (k < row_runs[row + 1]) {
+			back = runs[k].back;
+			m = k;
+			while ((m + 1 < row_runs[row + 1]) &&
+			       (runs[m + 1].back == back)) {
+				m++;
 			}
-			/* Walk the line. */
-			do {
-				/* Get the character cell's contents. */
-				cell = _vte_row_data_find_charcell(row_data, i);
-				/* Find the colors for this cell. */
-				selected = vte_cell_is_selected(terminal, i, row, NULL);
-				vte_terminal_determine_colors(terminal, cell,
-						reverse|selected,
-						selected,
-						FALSE,
-						&fore, &back);
-
-				bold = cell && cell->attr.bold;
-				j = i + (cell ? cell->attr.columns : 1);
-
-				while (j < end_column){
-					/* Retrieve the cell. */
-					cell = _vte_row_data_find_charcell(row_data, j);
-					/* Don't render fragments of multicolumn characters
-					 * which have the same attributes as the initial
-					 * portions. */
-					if (cell != NULL && cell->attr.fragment) {
-						j++;
-						continue;
-					}
-					/* Resolve attributes to colors where possible and
-					 * compare visual attributes to the first character
-					 * in this chunk. */
-					selected = vte_cell_is_selected(terminal, j, row, NULL);
-					vte_terminal_determine_colors(terminal, cell,
-							reverse|selected,
-							selected,
-							FALSE,
-							&nfore, &nback);
-					if (nback != back) {
-						break;
-					}
-					bold = cell && cell->attr.bold;
-					j += cell ? cell->attr.columns : 1;
-				}
-				if (back != VTE_DEF_BG) {
-					GdkColor color;
-					const struct vte_palette_entry *bg = &terminal->pvt->palette[back];
-					color.red = bg->red;
-					color.blue = bg->blue;
-					color.green = bg->green;
-					_vte_draw_fill_rectangle (
-							terminal->pvt->draw,
-							x + i * column_width,
-							y,
-							(j - i) * column_width + bold,
-							row_height,
-							&color, VTE_DRAW_OPAQUE);
-				}
-				/* We'll need to continue at the first cell which didn't
-				 * match the first one in this set. */
-				i = j;
-			} while (i < end_column);
-		} else {
-			do {
-				selected = vte_cell_is_selected(terminal, i, row, NULL);
-				j = i + 1;
-				while (j < end_column){
-					nselected = vte_cell_is_selected(terminal, j, row, NULL);
-					if (nselected != selected) {
-						break;
-					}
-					j++;
-				}
-				vte_terminal_determine_colors(terminal, NULL,
-						reverse|selected,
-						selected,
-						FALSE,
-						&fore, &back);
-				if (back != VTE_DEF_BG) {
-					GdkColor color;
-					const struct vte_palette_entry *bg = &terminal->pvt->palette[back];
-					color.red = bg->red;
-					color.blue = bg->blue;
-					color.green = bg->green;
-					_vte_draw_fill_rectangle (
-							terminal->pvt->draw,
-							x + i *column_width,
-							y,
-							(j - i)  * column_width,
-							row_height,
-							&color, VTE_DRAW_OPAQUE);
-				}
-				i = j;
-			} while (i < end_column);
+			if (back != VTE_DEF_BG) {
+				GdkColor color;
+				const struct vte_palette_entry *bg = &terminal->pvt->palette[back];
+				color.red = bg->red;
+				color.blue = bg->blue;
+				color.green = bg->green;
+				_vte_draw_fill_rectangle (
+						terminal->pvt->draw,
+						x + runs[k].start * column_width,
+						y,
+						(runs[m].end - runs[k].start) * column_width + runs[m].bold,
+						row_height,
+						&color, VTE_DRAW_OPAQUE);
+			}
+			k = m + 1;
 		}
-		row++;
 		y += row_height;
-	} while (--rows);
+	}
 
 
 	/* render the text */
@@ -9572,11 +12315,15 @@ vte_terminal_draw_rows(VteTerminal *terminal,
 	row = start_row;
 	rows = row_count;
 	item_count = 1;
+	_vte_ring_iter_init(&iter, screen->row_data, row);
 	do {
-		row_data = _vte_terminal_find_row_data(terminal, row);
+		row_data = _vte_ring_iter_next(&iter);
 		if (row_data == NULL) {
 			goto fg_skip_row;
 		}
+		vte_terminal_draw_row_start(terminal, row, start_row,
+					    row_runs, &k, &hilite_start,
+					    &hilite_end);
 		/* Back up in case this is a multicolumn character,
 		 * making the drawing area a little wider. */
 		i = start_column;
@@ -9609,25 +12356,14 @@ vte_terminal_draw_rows(VteTerminal *terminal,
 				}
 			}
 			/* Find the colors for this cell. */
-			selected = vte_cell_is_selected(terminal, i, row, NULL);
-			vte_terminal_determine_colors(terminal, cell,
-					reverse|selected,
-					selected,
-					FALSE,
+			vte_terminal_draw_run_colors(terminal, runs, &k,
+					row_runs[row - start_row + 1],
+					i, row, cell, reverse,
 					&fore, &back);
 			underline = cell->attr.underline;
 			strikethrough = cell->attr.strikethrough;
 			bold = cell->attr.bold;
-			if (terminal->pvt->show_match) {
-				hilite = vte_cell_is_between(i, row,
-						terminal->pvt->match_start.column,
-						terminal->pvt->match_start.row,
-						terminal->pvt->match_end.column,
-						terminal->pvt->match_end.row,
-						TRUE);
-			} else {
-				hilite = FALSE;
-			}
+			hilite = (i >= hilite_start) && (i < hilite_end);
 
 			items[0].c = cell->c;
 			items[0].columns = cell->attr.columns;
@@ -9682,11 +12418,10 @@ vte_terminal_draw_rows(VteTerminal *terminal,
 					/* Resolve attributes to colors where possible and
 					 * compare visual attributes to the first character
 					 * in this chunk. */
-					selected = vte_cell_is_selected(terminal, j, row, NULL);
-					vte_terminal_determine_colors(terminal, cell,
-							reverse|selected,
-							selected,
-							FALSE,
+					vte_terminal_draw_run_colors(terminal,
+							runs, &k,
+							row_runs[row - start_row + 1],
+							j, row, cell, reverse,
 							&nfore, &nback);
 					/* Graphic characters must be drawn individually. */
 					if (vte_terminal_unichar_is_local_graphic(terminal, cell->c, cell->attr.bold)) {
@@ -9722,15 +12457,8 @@ vte_terminal_draw_rows(VteTerminal *terminal,
 						break;
 					}
 					/* Break up matched/not-matched text. */
-					nhilite = FALSE;
-					if (terminal->pvt->show_match) {
-						nhilite = vte_cell_is_between(j, row,
-								terminal->pvt->match_start.column,
-								terminal->pvt->match_start.row,
-								terminal->pvt->match_end.column,
-								terminal->pvt->match_end.row,
-								TRUE);
-					}
+					nhilite = (j >= hilite_start) &&
+						  (j < hilite_end);
 					if (nhilite != hilite) {
 						break;
 					}
@@ -9757,8 +12485,13 @@ fg_next_row:
 						/* restart on the next row */
 						row++;
 						y += row_height;
-						row_data = _vte_terminal_find_row_data(terminal, row);
+						row_data = _vte_ring_iter_next(&iter);
 					} while (row_data == NULL);
+					vte_terminal_draw_row_start(terminal,
+							row, start_row,
+							row_runs, &k,
+							&hilite_start,
+							&hilite_end);
 
 					/* Back up in case this is a
 					 * multicolumn character, making the drawing
@@ -9795,6 +12528,134 @@ fg_out:
 	return;
 }
 
+/* Work out how a cell ends up on screen, for the front buffer: its
+ * attributes with the colors resolved, plus the selection, match and cursor
+ * state which draw_rows and paint_cursor overlay. */
+static void
+vte_terminal_front_resolve(VteTerminal *terminal, VteRowData *row_data,
+			   glong col, glong row, struct vte_front_cell *out)
+{
+	struct vte_charcell *cell;
+	VteScreen *screen = terminal->pvt->screen;
+	gboolean selected;
+	int fore, back;
+
+	cell = row_data ? _vte_row_data_find_charcell(row_data, col) : NULL;
+	selected = vte_cell_is_selected(terminal, col, row, NULL);
+	vte_terminal_determine_colors(terminal, cell,
+				      screen->reverse_mode|selected,
+				      selected, FALSE, &fore, &back);
+	if (cell != NULL) {
+		out->c = cell->c;
+		out->attr = cell->attr;
+	} else {
+		out->c = 0;
+		memset(&out->attr, 0, sizeof(out->attr));
+	}
+	out->attr.fore = fore;
+	out->attr.back = back;
+	out->state = selected ? VTE_FRONT_SELECTED : 0;
+	if (terminal->pvt->show_match &&
+	    vte_cell_is_between(col, row,
+				terminal->pvt->match_start.column,
+				terminal->pvt->match_start.row,
+				terminal->pvt->match_end.column,
+				terminal->pvt->match_end.row,
+				TRUE)) {
+		out->state |= VTE_FRONT_HILITE;
+	}
+	if (terminal->pvt->cursor_visible &&
+	    row == screen->cursor_current.row &&
+	    col == screen->cursor_current.col) {
+		if (GTK_WIDGET_HAS_FOCUS(terminal)) {
+			if (terminal->pvt->cursor_blink_state) {
+				out->state |= VTE_FRONT_CURSOR |
+					      VTE_FRONT_FOCUS;
+			}
+		} else {
+			out->state |= VTE_FRONT_CURSOR;
+		}
+		out->state |= terminal->pvt->cursor_shape <<
+			      VTE_FRONT_SHAPE_SHIFT;
+	}
+}
+
+/* Remember what was just painted over the given visible cells. */
+static void
+vte_terminal_front_store(VteTerminal *terminal,
+			 glong row, glong row_stop, glong col, glong col_stop)
+{
+	struct _vte_front *front = &terminal->pvt->front;
+	struct vte_front_cell *out;
+	VteRowData *row_data;
+	glong delta, i;
+
+	if (front->rows != terminal->row_count ||
+	    front->columns != terminal->column_count) {
+		front->rows = terminal->row_count;
+		front->columns = terminal->column_count;
+		front->cells = g_renew(struct vte_front_cell, front->cells,
+				       front->rows * front->columns);
+		memset(front->cells, 0xff,
+		       front->rows * front->columns * sizeof(*front->cells));
+	}
+
+	delta = terminal->pvt->screen->scroll_delta;
+	for (; row < row_stop; row++) {
+		row_data = _vte_terminal_find_row_data(terminal, row + delta);
+		out = front->cells + row * front->columns;
+		for (i = col; i < col_stop; i++) {
+			vte_terminal_front_resolve(terminal, row_data,
+						   i, row + delta, out + i);
+		}
+	}
+}
+
+/* Shrink a row's dirty span to the cells which differ from what's on
+ * screen, with a cell of slack either side for glyphs overhanging their
+ * neighbours. */
+static void
+vte_terminal_front_narrow(VteTerminal *terminal, glong row,
+			  struct vte_damage_span *span)
+{
+	struct _vte_front *front = &terminal->pvt->front;
+	struct vte_front_cell *painted, cell;
+	VteRowData *row_data;
+	glong delta, i, first, last;
+
+	if (front->rows != terminal->row_count ||
+	    front->columns != terminal->column_count) {
+		return;
+	}
+	delta = terminal->pvt->screen->scroll_delta;
+	if (terminal->pvt->im_preedit != NULL &&
+	    terminal->pvt->im_preedit[0] != '\0' &&
+	    row + delta == terminal->pvt->screen->cursor_current.row) {
+		/* The preedit string isn't in the grid at all. */
+		return;
+	}
+
+	row_data = _vte_terminal_find_row_data(terminal, row + delta);
+	painted = front->cells + row * front->columns;
+	first = last = -1;
+	for (i = span->start; i < span->end; i++) {
+		vte_terminal_front_resolve(terminal, row_data,
+					   i, row + delta, &cell);
+		if (memcmp(&cell, painted + i, sizeof(cell)) != 0) {
+			if (first < 0) {
+				first = i;
+			}
+			last = i;
+		}
+	}
+	if (first < 0) {
+		span->start = span->end = 0;
+		return;
+	}
+	span->start = MAX(0, first - 1);
+	span->end = MIN(terminal->column_count, last + 2);
+}
+
 static void
 vte_terminal_expand_region (VteTerminal *terminal, GdkRegion *region, const GdkRectangle *area)
 {
@@ -9916,6 +12777,7 @@ vte_terminal_paint_area (VteTerminal *terminal, const GdkRectangle *area)
 			      row * height,
 			      width,
 			      height);
+	vte_terminal_front_store(terminal, row, row_stop, col, col_stop);
 }
 
 static void
@@ -9930,6 +12792,7 @@ vte_terminal_paint_cursor(VteTerminal *terminal)
 	int fore, back, x, y;
 	gboolean blink, selected, focus, reverse;
 
+	terminal->pvt->cursor_painted_row = -1;
 	if (!terminal->pvt->cursor_visible)
 		return;
 
@@ -9951,6 +12814,7 @@ vte_terminal_paint_cursor(VteTerminal *terminal)
 
 	if (focus && !blink)
 		return;
+	terminal->pvt->cursor_painted_row = row;
 
 	/* Find the character "under" the cursor. */
 	cell = vte_terminal_find_charcell(terminal, col, drow);
@@ -10219,6 +13083,138 @@ vte_terminal_paint(GtkWidget *widget, GdkRegion *region)
 	_vte_draw_end(terminal->pvt->draw);
 }
 
+/* Get the offscreen draw ready, with the font loaded and the cell size
+ * worked out even if the widget has never been realized. */
+static struct _vte_draw *
+vte_terminal_ensure_offscreen_draw(VteTerminal *terminal)
+{
+	gint width, height, ascent;
+
+	if (!terminal->pvt->has_fonts) {
+		vte_terminal_set_font_full_internal(terminal,
+						    terminal->pvt->fontdesc,
+						    terminal->pvt->fontantialias);
+	}
+	vte_terminal_ensure_font(terminal);
+	if (terminal->pvt->offscreen_draw == NULL) {
+		terminal->pvt->offscreen_draw =
+			_vte_draw_new_offscreen(&terminal->widget);
+		_vte_draw_set_text_font(terminal->pvt->offscreen_draw,
+					terminal->pvt->fontdesc,
+					terminal->pvt->fontantialias);
+	}
+	/* With no on-screen draw to measure the font, go by this one, once
+	 * per font rather than on every frame. */
+	if (terminal->pvt->draw == NULL && terminal->pvt->fontdirty) {
+		terminal->pvt->fontdirty = FALSE;
+		_vte_draw_get_text_metrics(terminal->pvt->offscreen_draw,
+					   &width, &height, &ascent);
+		vte_terminal_apply_metrics(terminal,
+					   width, height, ascent, height - ascent);
+	}
+	return terminal->pvt->offscreen_draw;
+}
+
+/* Paint the visible rows into @buffer, which is cleared to the default
+ * background first, after parsing any input still pending.  Only as many
+ * whole cells as fit are drawn.  The cursor, preedit text and any background
+ * image or transparency are left out. */
+void
+_vte_terminal_render(VteTerminal *terminal, struct _vte_rgb_buffer *buffer)
+{
+	VteScreen *screen;
+	struct _vte_draw *draw, *saved;
+	GdkColor bgcolor;
+	glong rows, columns;
+
+	/* Nothing would otherwise parse what was fed since the last frame,
+	 * without a main loop and a window to run the update timers. */
+	if (need_processing(terminal)) {
+		vte_terminal_process_incoming(terminal);
+	}
+
+	draw = vte_terminal_ensure_offscreen_draw(terminal);
+
+	bgcolor.red = terminal->pvt->palette[VTE_DEF_BG].red;
+	bgcolor.green = terminal->pvt->palette[VTE_DEF_BG].green;
+	bgcolor.blue = terminal->pvt->palette[VTE_DEF_BG].blue;
+	bgcolor.pixel = 0;
+	_vte_draw_set_background_color(draw, &bgcolor);
+
+	screen = terminal->pvt->screen;
+	columns = MIN(terminal->column_count,
+		      (buffer->width - 2 * VTE_PAD_WIDTH) /
+		      terminal->char_width);
+	rows = MIN(terminal->row_count,
+		   (buffer->height - 2 * VTE_PAD_WIDTH) /
+		   terminal->char_height);
+
+	/* The row drawing code paints through pvt->draw. */
+	saved = terminal->pvt->draw;
+	terminal->pvt->draw = draw;
+	_vte_draw_set_target(draw, buffer);
+	_vte_draw_start(draw);
+	_vte_draw_clear(draw, 0, 0, buffer->width, buffer->height);
+	if (rows > 0 && columns > 0) {
+		vte_terminal_draw_rows(terminal, screen,
+				       screen->scroll_delta, rows,
+				       0, columns,
+				       0, 0,
+				       terminal->char_width,
+				       terminal->char_height);
+	}
+	_vte_draw_end(draw);
+	_vte_draw_set_target(draw, NULL);
+	terminal->pvt->draw = saved;
+}
+
+/**
+ * vte_terminal_render_pixbuf:
+ * @terminal: a #VteTerminal
+ *
+ * Paints the visible part of the terminal's contents into a new pixbuf, using
+ * the same code as is used to draw the widget but without needing a window:
+ * @terminal doesn't have to be realized, or even shown.  Text is always
+ * rendered client-side through FreeType, whichever backend the widget uses,
+ * so for a given font configuration the result is the same from one run to
+ * the next.  The pixbuf covers whole cells plus the widget's padding; the
+ * cursor, preedit text and any background image or transparency are not
+ * drawn.
+ *
+ * Returns: a new #GdkPixbuf, which the caller should unref
+ */
+GdkPixbuf *
+vte_terminal_render_pixbuf(VteTerminal *terminal)
+{
+	struct _vte_rgb_buffer *buffer;
+	GdkPixbuf *pixbuf;
+	guchar *pixels;
+	gint width, height, rowstride, y;
+
+	g_return_val_if_fail(VTE_IS_TERMINAL(terminal), NULL);
+
+	vte_terminal_ensure_offscreen_draw(terminal);
+	width = terminal->column_count * terminal->char_width +
+		2 * VTE_PAD_WIDTH;
+	height = terminal->row_count * terminal->char_height +
+		 2 * VTE_PAD_WIDTH;
+
+	buffer = _vte_rgb_buffer_new(width, height);
+	_vte_terminal_render(terminal, buffer);
+
+	pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+	pixels = gdk_pixbuf_get_pixels(pixbuf);
+	rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+	for (y = 0; y < height; y++) {
+		memcpy(pixels + y * rowstride,
+		       buffer->pixels + y * buffer->stride,
+		       width * 3);
+	}
+	_vte_rgb_buffer_free(buffer);
+
+	return pixbuf;
+}
+
 /* Handle an expose event by painting the exposed area. */
 static gint
 vte_terminal_expose(GtkWidget *widget, GdkEventExpose *event)
@@ -10236,7 +13232,7 @@ vte_terminal_expose(GtkWidget *widget, GdkEventExpose *event)
 		/* fix up a race condition where we schedule a delayed update
 		 * after an 'immediate' invalidate all */
 		if (terminal->pvt->invalidated_all &&
-				terminal->pvt->update_regions == NULL) {
+				!terminal->pvt->damage.pending) {
 			terminal->pvt->invalidated_all = FALSE;
 		}
 		/* if we expect to redraw the widget soon,
@@ -10246,9 +13242,13 @@ vte_terminal_expose(GtkWidget *widget, GdkEventExpose *event)
 					event->area.height >= widget->allocation.height) {
 				_vte_invalidate_all (terminal);
 			} else {
-				terminal->pvt->update_regions =
-					g_slist_prepend (terminal->pvt->update_regions,
-							gdk_region_copy (event->region));
+				if (terminal->pvt->damage.region == NULL) {
+					terminal->pvt->damage.region =
+						gdk_region_new ();
+				}
+				gdk_region_union (terminal->pvt->damage.region,
+						  event->region);
+				terminal->pvt->damage.pending = TRUE;
 			}
 		}
 	} else {
@@ -10437,7 +13437,8 @@ vte_terminal_get_property (GObject *object,
                         g_value_set_boolean (value, pvt->scroll_background);
                         break;
                 case PROP_SCROLLBACK_LINES:
-                        g_value_set_uint (value, pvt->scrollback_lines);
+                        g_value_set_uint (value, pvt->scrollback_lines == VTE_RING_UNLIMITED ?
+                                          G_MAXUINT : (guint) pvt->scrollback_lines);
                         break;
                 case PROP_SCROLL_ON_KEYSTROKE:
                         g_value_set_boolean (value, pvt->scroll_on_keystroke);
@@ -10527,7 +13528,9 @@ vte_terminal_set_property (GObject *object,
                         vte_terminal_set_scroll_background (terminal, g_value_get_boolean (value));
                         break;
                 case PROP_SCROLLBACK_LINES:
-                        vte_terminal_set_scrollback_lines (terminal, g_value_get_uint (value));
+                        vte_terminal_set_scrollback_lines (terminal,
+                                g_value_get_uint (value) == G_MAXUINT ? -1 :
+                                (glong) g_value_get_uint (value));
                         break;
                 case PROP_SCROLL_ON_KEYSTROKE:
                         vte_terminal_set_scroll_on_keystroke(terminal, g_value_get_boolean (value));
@@ -11279,7 +14282,8 @@ vte_terminal_class_init(VteTerminalClass *klass)
          * of visible rows the widget can display, so 0 can safely be used to disable
          * scrollback.  Note that this setting only affects the normal screen buffer.
          * For terminal types which have an alternate screen buffer, no scrollback is
-         * allowed on the alternate screen buffer.
+         * allowed on the alternate screen buffer.  %G_MAXUINT makes the scrollback
+         * unlimited, see vte_terminal_set_scrollback_lines().
          * 
          * Since: 0.19.1
          */
@@ -12221,6 +15225,10 @@ vte_terminal_get_cursor_shape(VteTerminal *terminal)
  * For terminal types which have an alternate screen buffer, no scrollback is
  * allowed on the alternate screen buffer.
  *
+ * If @lines is negative, the scrollback is unlimited: history older than the
+ * visible area is compressed and written to an anonymous temporary file, so
+ * its size is bounded by disk space rather than memory.
+ *
  */
 void
 vte_terminal_set_scrollback_lines(VteTerminal *terminal, glong lines)
@@ -12246,6 +15254,11 @@ vte_terminal_set_scrollback_lines(VteTerminal *terminal, glong lines)
 	_vte_debug_print (VTE_DEBUG_MISC,
 			"Setting scrollback lines to %ld\n", lines);
 
+	/* Unlimited is kept as VTE_RING_UNLIMITED, leaving negative values
+	 * free to mean "not set yet". */
+	if (lines < 0) {
+		lines = VTE_RING_UNLIMITED;
+	}
 	pvt->scrollback_lines = lines;
 	screen = pvt->screen;
 	scroll_delta = screen->scroll_delta;
@@ -12253,15 +15266,28 @@ vte_terminal_set_scrollback_lines(VteTerminal *terminal, glong lines)
 	/* The main screen gets the full scrollback buffer, but the
 	 * alternate screen isn't allowed to scroll at all. */
 	if (screen == &terminal->pvt->normal_screen) {
-		glong low, high, next;
+		glong low, high, next, old_insert;
+		gboolean unlimited = lines == VTE_RING_UNLIMITED;
 		/* We need at least as many lines as are visible */
-		lines = MAX (lines, terminal->row_count);
+		lines = unlimited ? VTE_RING_UNLIMITED :
+			MAX (lines, terminal->row_count);
 		next = MAX (screen->cursor_current.row + 1,
 				_vte_ring_next (screen->row_data));
 		vte_terminal_reset_rowdata (&screen->row_data, lines);
+		_vte_ring_set_hot_length (screen->row_data,
+				terminal->row_count + VTE_SCROLLBACK_HOT_MARGIN);
+		_vte_ring_set_spill (screen->row_data, unlimited);
 		low = _vte_ring_delta (screen->row_data);
-		high = low + lines - terminal->row_count + 1;
+		high = unlimited ? G_MAXLONG :
+			low + lines - terminal->row_count + 1;
+		old_insert = screen->insert_delta;
 		screen->insert_delta = CLAMP (screen->insert_delta, low, high);
+		if (screen->insert_delta < old_insert) {
+			vte_terminal_unshare_rows (screen, screen->insert_delta,
+						   old_insert);
+			vte_terminal_search_index_invalidate (terminal,
+					screen->insert_delta);
+		}
 		scroll_delta = CLAMP (scroll_delta, low, screen->insert_delta);
 		next = MIN (next, screen->insert_delta + terminal->row_count);
 		if (_vte_ring_next (screen->row_data) > next){
@@ -12550,14 +15576,16 @@ vte_terminal_reset(VteTerminal *terminal, gboolean full, gboolean clear_history)
 	terminal->pvt->alternate_screen.alternate_charset = FALSE;
 	/* Clear the scrollback buffers and reset the cursors. */
 	if (clear_history) {
+		vte_terminal_reflow_cancel(terminal);
+		vte_terminal_search_index_invalidate(terminal, G_MINLONG);
 		_vte_ring_free(terminal->pvt->normal_screen.row_data, TRUE);
 		terminal->pvt->normal_screen.row_data =
-			_vte_ring_new(terminal->pvt->scrollback_lines,
-				      (GFunc) _vte_free_row_data, NULL);
+			vte_row_ring_new(terminal->pvt->scrollback_lines, 0);
+		_vte_ring_set_hot_length(terminal->pvt->normal_screen.row_data,
+				terminal->row_count + VTE_SCROLLBACK_HOT_MARGIN);
 		_vte_ring_free(terminal->pvt->alternate_screen.row_data, TRUE);
 		terminal->pvt->alternate_screen.row_data =
-			_vte_ring_new(terminal->pvt->scrollback_lines,
-				      (GFunc) _vte_free_row_data, NULL);
+			vte_row_ring_new(terminal->row_count, 0);
 		terminal->pvt->normal_screen.cursor_saved.row = 0;
 		terminal->pvt->normal_screen.cursor_saved.col = 0;
 		terminal->pvt->normal_screen.cursor_current.row = 0;
@@ -13001,6 +16029,67 @@ _vte_terminal_remove_selection(VteTerminal *terminal)
 	vte_terminal_deselect_all (terminal);
 }
 
+/* Hand over the rows whose text may have changed since the last call, as a
+ * half-open range of absolute rows, and start over.  Returns FALSE if the
+ * whole view has to be assumed to have changed. */
+gboolean
+_vte_terminal_take_text_damage(VteTerminal *terminal, glong *start, glong *end)
+{
+	VteTerminalPrivate *pvt;
+	gboolean partial;
+
+	g_return_val_if_fail(VTE_IS_TERMINAL(terminal), FALSE);
+	pvt = terminal->pvt;
+
+	partial = !pvt->text_damage_all;
+	if (start) {
+		*start = pvt->text_damage_start;
+	}
+	if (end) {
+		*end = MAX(pvt->text_damage_start, pvt->text_damage_end);
+	}
+	pvt->text_damage_start = pvt->text_damage_end = 0;
+	pvt->text_damage_all = FALSE;
+	return partial;
+}
+
+glong
+_vte_terminal_get_view_start(VteTerminal *terminal)
+{
+	g_return_val_if_fail(VTE_IS_TERMINAL(terminal), 0);
+
+	return terminal->pvt->screen->scroll_delta;
+}
+
+/* Read rows [start_row, end_row) of the current screen the way
+ * vte_terminal_get_text_include_trailing_spaces() reads the whole view, so
+ * that the result can be spliced into a copy of it. */
+char *
+_vte_terminal_get_text_rows(VteTerminal *terminal,
+			    glong start_row, glong end_row,
+			    GArray *attributes)
+{
+	glong end_col;
+
+	g_return_val_if_fail(VTE_IS_TERMINAL(terminal), NULL);
+
+	/* Only the view's last row stops at the right margin; elsewhere the
+	 * column is never reached and whole rows are read. */
+	if (end_row == terminal->pvt->screen->scroll_delta + terminal->row_count) {
+		end_col = terminal->column_count - 1;
+	} else {
+		end_col = -1;
+	}
+	return vte_terminal_get_text_range_maybe_wrapped(terminal,
+							 start_row, 0,
+							 end_row - 1, end_col,
+							 TRUE,
+							 always_selected,
+							 NULL,
+							 attributes,
+							 TRUE);
+}
+
 static void
 add_update_timeout (VteTerminal *terminal)
 {
@@ -13031,11 +16120,19 @@ add_update_timeout (VteTerminal *terminal)
 static void
 reset_update_regions (VteTerminal *terminal)
 {
-	if (terminal->pvt->update_regions != NULL) {
-		g_slist_foreach (terminal->pvt->update_regions,
-				(GFunc)gdk_region_destroy, NULL);
-		g_slist_free (terminal->pvt->update_regions);
-		terminal->pvt->update_regions = NULL;
+	struct _vte_damage *damage = &terminal->pvt->damage;
+	glong i;
+
+	if (damage->pending) {
+		for (i = 0; i < damage->n_rows; i++) {
+			damage->rows[i].start = damage->rows[i].end = 0;
+		}
+		damage->scrolled = 0;
+		if (damage->region != NULL) {
+			gdk_region_destroy (damage->region);
+			damage->region = NULL;
+		}
+		damage->pending = FALSE;
 	}
 	/* the invalidated_all flag also marks whether to skip processing
 	 * due to the widget being invisible */
@@ -13047,7 +16144,7 @@ static void
 remove_from_active_list (VteTerminal *terminal)
 {
 	if (terminal->pvt->active != NULL
-			&& terminal->pvt->update_regions == NULL) {
+			&& !terminal->pvt->damage.pending) {
 		_vte_debug_print(VTE_DEBUG_TIMEOUT,
 			"Removing terminal from active list\n");
 		active_terminals = g_list_delete_link (active_terminals,
@@ -13243,7 +16340,7 @@ process_timeout (gpointer data)
 			terminal->pvt->input_bytes = 0;
 		} else
 			vte_terminal_emit_pending_signals (terminal);
-		if (!active && terminal->pvt->update_regions == NULL) {
+		if (!active && !terminal->pvt->damage.pending) {
 			if (terminal->pvt->active != NULL) {
 				_vte_debug_print(VTE_DEBUG_TIMEOUT,
 						"Removing terminal from active list [process]\n");
@@ -13284,10 +16381,71 @@ process_timeout (gpointer data)
 }
 
 
+/* Turn the accumulated damage into a region: one rectangle per run of rows
+ * sharing the same dirty columns. */
+static GdkRegion *
+vte_terminal_damage_region (VteTerminal *terminal)
+{
+	struct _vte_damage *damage = &terminal->pvt->damage;
+	GdkRegion *region, *moved;
+	GdkRectangle rect;
+	glong i, j, rows;
+
+	if (damage->region != NULL) {
+		region = damage->region;
+		damage->region = NULL;
+	} else {
+		region = gdk_region_new ();
+	}
+
+	if (!terminal->pvt->invalidated_all && damage->scrolled != 0 &&
+			vte_terminal_blit_rows (terminal, damage->scrolled)) {
+		/* Exposures still pending were in the old place. */
+		moved = gdk_region_copy (region);
+		gdk_region_offset (moved, 0,
+				damage->scrolled * terminal->char_height);
+		gdk_region_union (region, moved);
+		gdk_region_destroy (moved);
+	} else if (terminal->pvt->invalidated_all || damage->scrolled != 0) {
+		rect.x = rect.y = 0;
+		rect.width = terminal->widget.allocation.width;
+		rect.height = terminal->widget.allocation.height;
+		gdk_region_union_with_rect (region, &rect);
+		return region;
+	}
+
+	rows = MIN (damage->n_rows, terminal->row_count);
+	for (i = 0; i < rows; i++) {
+		if (damage->rows[i].start < damage->rows[i].end) {
+			vte_terminal_front_narrow (terminal, i,
+						   &damage->rows[i]);
+		}
+	}
+	for (i = 0; i < rows; i = j) {
+		j = i + 1;
+		if (damage->rows[i].start >= damage->rows[i].end) {
+			continue;
+		}
+		while (j < rows &&
+		       damage->rows[j].start == damage->rows[i].start &&
+		       damage->rows[j].end == damage->rows[i].end) {
+			j++;
+		}
+		vte_terminal_cells_to_rect (terminal,
+				damage->rows[i].start,
+				damage->rows[i].end - damage->rows[i].start,
+				i, j - i, &rect);
+		_vte_debug_print (VTE_DEBUG_UPDATES,
+				"Invalidating pixels at (%d,%d)x(%d,%d).\n",
+				rect.x, rect.y, rect.width, rect.height);
+		gdk_region_union_with_rect (region, &rect);
+	}
+	return region;
+}
+
 static gboolean
 update_regions (VteTerminal *terminal)
 {
-	GSList *l;
 	GdkRegion *region;
 
 	if (G_UNLIKELY (!GTK_WIDGET_DRAWABLE(terminal) ||
@@ -13296,23 +16454,11 @@ update_regions (VteTerminal *terminal)
 		return FALSE;
 	}
 
-	if (G_UNLIKELY (!terminal->pvt->update_regions))
+	if (G_UNLIKELY (!terminal->pvt->damage.pending))
 		return FALSE;
 
-
-	l = terminal->pvt->update_regions;
-	if (g_slist_next (l) != NULL) {
-		/* amalgamate into one super-region */
-		region = gdk_region_new ();
-		do {
-			gdk_region_union (region, l->data);
-			gdk_region_destroy (l->data);
-		} while ((l = g_slist_next (l)) != NULL);
-	} else {
-		region = l->data;
-	}
-	g_slist_free (terminal->pvt->update_regions);
-	terminal->pvt->update_regions = NULL;
+	region = vte_terminal_damage_region (terminal);
+	reset_update_regions (terminal);
 	terminal->pvt->invalidated_all = FALSE;
 
 	/* and perform the merge with the window visible area */
@@ -183,6 +183,49 @@ struct _VteCharAttributes {
 };
 typedef struct _VteCharAttributes VteCharAttributes;
 
+/* How a range of text is read: as a selection would be, from the start
+ * position to the end, or as the same columns of every row. */
+typedef enum {
+	VTE_TEXT_RANGE_LINEAR,
+	VTE_TEXT_RANGE_BLOCK
+} VteTextRangeMode;
+
+/* Attributes shared by a stretch of a chunk of text, in bytes. */
+struct _VteTextRun {
+	gsize offset, length;
+	VteCharAttributes attr;
+};
+typedef struct _VteTextRun VteTextRun;
+typedef gboolean (*VteTextSink)(const char *text, gsize length,
+				const VteTextRun *runs, guint n_runs,
+				gpointer data);
+
+/* Options for vte_terminal_write_contents(). */
+typedef enum {
+	VTE_TERMINAL_WRITE_DEFAULT = 0,
+	VTE_TERMINAL_WRITE_ATTRIBUTES = 1 << 0,
+	VTE_TERMINAL_WRITE_ASYNC = 1 << 1
+} VteTerminalWriteFlags;
+typedef void (*VteTerminalWriteCallback)(VteTerminal *terminal,
+					 gboolean success,
+					 const GError *error,
+					 gpointer data);
+
+/* A read-only copy of part of the buffer, safe to use from other threads. */
+typedef struct _VteSnapshot VteSnapshot;
+
+/* A stretch of the buffer found by a search; the end is exclusive. */
+struct _VteSearchMatch {
+	glong start_row, start_col;
+	glong end_row, end_col;
+};
+typedef struct _VteSearchMatch VteSearchMatch;
+typedef void (*VteSearchCallback)(VteTerminal *terminal,
+				  const VteSearchMatch *matches,
+				  guint n_matches,
+				  gboolean finished,
+				  gpointer data);
+
 /* The name of the same structure in the 0.10 series, for API compatibility. */
 struct vte_char_attributes {
 	long row, column;
@@ -281,7 +324,8 @@ void vte_terminal_set_cursor_shape(VteTerminal *terminal,
 				   VteTerminalCursorShape shape);
 VteTerminalCursorShape vte_terminal_get_cursor_shape(VteTerminal *terminal);
 
-/* Set the number of scrollback lines, above or at an internal minimum. */
+/* Set the number of scrollback lines, above or at an internal minimum, or
+ * negative for unlimited scrollback. */
 void vte_terminal_set_scrollback_lines(VteTerminal *terminal, glong lines);
 
 /* Append the input method menu items to a given shell. */
@@ -350,6 +394,33 @@ char *vte_terminal_get_text_range(VteTerminal *terminal,
 				  GArray *attributes);
 void vte_terminal_get_cursor_position(VteTerminal *terminal,
 				      glong *column, glong *row);
+/* Read a range of text a chunk at a time. */
+gboolean vte_terminal_get_text_range_stream(VteTerminal *terminal,
+					    glong start_row, glong start_col,
+					    glong end_row, glong end_col,
+					    VteTextRangeMode mode,
+					    gboolean attributes,
+					    VteTextSink sink, gpointer data);
+/* Write out the whole buffer. */
+gboolean vte_terminal_write_contents(VteTerminal *terminal, gint fd,
+				     VteTerminalWriteFlags flags,
+				     VteTerminalWriteCallback callback,
+				     gpointer data,
+				     GError **error);
+/* Paint the visible contents without a window. */
+GdkPixbuf *vte_terminal_render_pixbuf(VteTerminal *terminal);
+
+/* Take a cheap copy-on-write snapshot of a range of rows, which can then be
+ * read from any thread while the terminal carries on. */
+VteSnapshot *vte_terminal_get_snapshot(VteTerminal *terminal,
+				       glong start_row, glong end_row);
+VteSnapshot *vte_snapshot_ref(VteSnapshot *snapshot);
+void vte_snapshot_unref(VteSnapshot *snapshot);
+void vte_snapshot_get_row_range(VteSnapshot *snapshot,
+				glong *start_row, glong *end_row);
+char *vte_snapshot_get_text_range(VteSnapshot *snapshot,
+				  glong start_row, glong start_col,
+				  glong end_row, glong end_col);
 /* Display string matching:  clear all matching expressions. */
 void vte_terminal_match_clear_all(VteTerminal *terminal);
 
@@ -373,6 +444,16 @@ char *vte_terminal_match_check(VteTerminal *terminal,
 			       glong column, glong row,
 			       int *tag);
 
+/* Search the scrollback and screen in the background, handing matches to the
+ * callback in batches as they're found. */
+guint vte_terminal_search_gregex(VteTerminal *terminal,
+				 GRegex *regex, GRegexMatchFlags flags,
+				 glong start_row,
+				 VteSearchCallback callback,
+				 gpointer data,
+				 GDestroyNotify destroy);
+void vte_terminal_search_cancel(VteTerminal *terminal, guint search_id);
+
 /* Set the emulation type.  Most of the time you won't need this. */
 void vte_terminal_set_emulation(VteTerminal *terminal, const char *emulation);
 const char *vte_terminal_get_emulation(VteTerminal *terminal);
@@ -50,6 +50,8 @@ typedef struct _VteTerminalAccessiblePrivate {
 	GArray *snapshot_attributes;	/* Attributes, per byte. */
 	GArray *snapshot_linebreaks;	/* Offsets to line breaks. */
 	gint snapshot_caret;       /* Location of the cursor (in characters). */
+	glong snapshot_delta;		/* First row of the view it was read from. */
+	glong snapshot_rows, snapshot_columns;	/* Size of that view. */
 
 	char *action_descriptions[LAST_ACTION];
 } VteTerminalAccessiblePrivate;
@@ -187,44 +189,204 @@ emit_text_caret_moved(GObject *object, glong caret)
 	g_signal_emit_by_name(object, "text-caret-moved", caret);
 }
 
+/* Emit @signal for the @len bytes at @offset in @text, which begin at
+ * character @start. */
 static void
-emit_text_changed_insert(GObject *object,
-			 const char *text, glong offset, glong len)
+emit_text_changed(GObject *object, const char *signal,
+		  const char *text, glong offset, glong len, glong start)
 {
-	glong start, count;
+	glong count;
 	if (len == 0) {
 		return;
 	}
-	/* Convert the byte offsets to character offsets. */
-	start = g_utf8_pointer_to_offset (text, text + offset);
 	count = g_utf8_pointer_to_offset (text + offset, text + offset + len);
 	_vte_debug_print(VTE_DEBUG_SIGNALS|VTE_DEBUG_ALLY,
 			"Accessibility peer emitting "
-			"`text-changed::insert' (%ld, %ld) (%ld, %ld).\n"
-			"Inserted text was `%.*s'.\n",
-			offset, len, start, count,
+			"`%s' (%ld, %ld) (%ld, %ld).\n"
+			"Changed text was `%.*s'.\n",
+			signal, offset, len, start, count,
 			(int) len, text + offset);
-	g_signal_emit_by_name(object, "text-changed::insert", start, count);
+	g_signal_emit_by_name(object, signal, start, count);
+}
+
+static void
+emit_text_changed_insert(GObject *object,
+			 const char *text, glong offset, glong len)
+{
+	/* Convert the byte offsets to character offsets. */
+	emit_text_changed(object, "text-changed::insert", text, offset, len,
+			  g_utf8_pointer_to_offset (text, text + offset));
 }
 
 static void
 emit_text_changed_delete(GObject *object,
 			 const char *text, glong offset, glong len)
 {
-	glong start, count;
-	if (len == 0) {
-		return;
-	}
 	/* Convert the byte offsets to characters. */
-	start = g_utf8_pointer_to_offset (text, text + offset);
-	count = g_utf8_pointer_to_offset (text + offset, text + offset + len);
-	_vte_debug_print(VTE_DEBUG_SIGNALS|VTE_DEBUG_ALLY,
-			"Accessibility peer emitting "
-			"`text-changed::delete' (%ld, %ld) (%ld, %ld).\n"
-			"Deleted text was `%.*s'.\n",
-			offset, len, start, count,
-			(int) len, text + offset);
-	g_signal_emit_by_name(object, "text-changed::delete", start, count);
+	emit_text_changed(object, "text-changed::delete", text, offset, len,
+			  g_utf8_pointer_to_offset (text, text + offset));
+}
+
+/* Work out where the characters and lines of the snapshot text begin. */
+static void
+vte_terminal_accessible_index_snapshot(VteTerminalAccessiblePrivate *priv)
+{
+	struct _VteCharAttributes attrs;
+	char *next;
+	long row, offset;
+	guint i;
+
+	g_array_set_size(priv->snapshot_characters, 0);
+	g_array_set_size(priv->snapshot_linebreaks, 0);
+
+	/* Get the offsets to the beginnings of each character. */
+	i = 0;
+	next = priv->snapshot_text->str;
+	while (i < priv->snapshot_attributes->len) {
+		g_array_append_val(priv->snapshot_characters, i);
+		next = g_utf8_next_char(next);
+		if (next == NULL) {
+			break;
+		} else {
+			i = next - priv->snapshot_text->str;
+		}
+	}
+	/* Find offsets for the beginning of lines. */
+	for (i = 0, row = 0; i < priv->snapshot_characters->len; i++) {
+		/* Get the attributes for the current cell. */
+		offset = g_array_index(priv->snapshot_characters,
+				       int, i);
+		attrs = g_array_index(priv->snapshot_attributes,
+				      struct _VteCharAttributes,
+				      offset);
+		/* If this character is on a row different from the row
+		 * the character we looked at previously was on, then
+		 * it's a new line and we need to keep track of where
+		 * it is. */
+		if ((i == 0) || (attrs.row != row)) {
+			_vte_debug_print(VTE_DEBUG_ALLY,
+					"Row %d/%ld begins at %u.\n",
+					priv->snapshot_linebreaks->len,
+					attrs.row, i);
+			g_array_append_val(priv->snapshot_linebreaks, i);
+		}
+		row = attrs.row;
+	}
+	/* Add the final line break. */
+	g_array_append_val(priv->snapshot_linebreaks, i);
+}
+
+/* Find the first of an ascending array of offsets which is at least
+ * @value. */
+static guint
+vte_terminal_accessible_search_offsets(GArray *offsets, gint value)
+{
+	guint lo, hi, mid;
+
+	lo = 0;
+	hi = offsets->len;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (g_array_index(offsets, int, mid) < value) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* Patch up the character and line offsets after bytes [@start, @end) of the
+ * text, which were whole rows, have been replaced by @length bytes of other
+ * rows.  The text and attributes must have been spliced already.  Offsets
+ * past the change are only shifted. */
+static void
+vte_terminal_accessible_splice_index(VteTerminalAccessiblePrivate *priv,
+				     guint start, guint end, guint length)
+{
+	struct _VteCharAttributes *attrs;
+	GArray *added;
+	const char *p;
+	gint c0, c1, l0, l1, n, shift, i, offset;
+	glong row = 0;
+
+	c0 = vte_terminal_accessible_search_offsets(priv->snapshot_characters,
+						    start);
+	c1 = vte_terminal_accessible_search_offsets(priv->snapshot_characters,
+						    end);
+	l0 = vte_terminal_accessible_search_offsets(priv->snapshot_linebreaks,
+						    c0);
+	l1 = vte_terminal_accessible_search_offsets(priv->snapshot_linebreaks,
+						    c1);
+
+	/* Where the new characters begin. */
+	added = g_array_new(FALSE, FALSE, sizeof(int));
+	p = priv->snapshot_text->str + start;
+	while (p < priv->snapshot_text->str + start + length) {
+		offset = p - priv->snapshot_text->str;
+		g_array_append_val(added, offset);
+		p = g_utf8_next_char(p);
+	}
+	n = added->len;
+	if (c1 > c0) {
+		g_array_remove_range(priv->snapshot_characters, c0, c1 - c0);
+	}
+	g_array_insert_vals(priv->snapshot_characters, c0, added->data, n);
+	shift = length - (end - start);
+	for (i = c0 + n;
+	     i < (gint) priv->snapshot_characters->len;
+	     i++) {
+		g_array_index(priv->snapshot_characters, int, i) += shift;
+	}
+
+	/* Each new row begins a line, the first one included, since what
+	 * comes before it is from an earlier row. */
+	g_array_set_size(added, 0);
+	for (i = c0; i < c0 + n; i++) {
+		offset = g_array_index(priv->snapshot_characters, int, i);
+		attrs = &g_array_index(priv->snapshot_attributes,
+				       struct _VteCharAttributes, offset);
+		if (i == c0 || attrs->row != row) {
+			g_array_append_val(added, i);
+		}
+		row = attrs->row;
+	}
+	if (l1 > l0) {
+		g_array_remove_range(priv->snapshot_linebreaks, l0, l1 - l0);
+	}
+	g_array_insert_vals(priv->snapshot_linebreaks, l0,
+			    added->data, added->len);
+	shift = n - (c1 - c0);
+	for (i = l0 + added->len;
+	     i < (gint) priv->snapshot_linebreaks->len;
+	     i++) {
+		g_array_index(priv->snapshot_linebreaks, int, i) += shift;
+	}
+	g_array_free(added, TRUE);
+}
+
+/* Find the first byte of the snapshot which was read from @row or a later
+ * one. */
+static guint
+vte_terminal_accessible_row_offset(VteTerminalAccessiblePrivate *priv,
+				   glong row)
+{
+	struct _VteCharAttributes *attrs;
+	guint lo, hi, mid;
+
+	lo = 0;
+	hi = priv->snapshot_attributes->len;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		attrs = &g_array_index(priv->snapshot_attributes,
+				       struct _VteCharAttributes, mid);
+		if (attrs->row < row) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
 }
 
 static void
@@ -234,10 +396,10 @@ vte_terminal_accessible_update_private_data_if_needed(AtkObject *text,
 	VteTerminal *terminal;
 	VteTerminalAccessiblePrivate *priv;
 	struct _VteCharAttributes attrs;
-	char *next, *tmp;
-	long row, offset, caret;
+	char *tmp;
+	long offset, caret;
 	long ccol, crow;
-	guint i;
+	guint lo, hi, mid;
 
 	g_assert(VTE_IS_TERMINAL_ACCESSIBLE(text));
 
@@ -335,42 +497,14 @@ vte_terminal_accessible_update_private_data_if_needed(AtkObject *text,
 		priv->snapshot_text = g_string_new_len(tmp,
 						       priv->snapshot_attributes->len);
 		g_free(tmp);
-
-		/* Get the offsets to the beginnings of each character. */
-		i = 0;
-		next = priv->snapshot_text->str;
-		while (i < priv->snapshot_attributes->len) {
-			g_array_append_val(priv->snapshot_characters, i);
-			next = g_utf8_next_char(next);
-			if (next == NULL) {
-				break;
-			} else {
-				i = next - priv->snapshot_text->str;
-			}
-		}
-		/* Find offsets for the beginning of lines. */
-		for (i = 0, row = 0; i < priv->snapshot_characters->len; i++) {
-			/* Get the attributes for the current cell. */
-			offset = g_array_index(priv->snapshot_characters,
-					       int, i);
-			attrs = g_array_index(priv->snapshot_attributes,
-					      struct _VteCharAttributes,
-					      offset);
-			/* If this character is on a row different from the row
-			 * the character we looked at previously was on, then
-			 * it's a new line and we need to keep track of where
-			 * it is. */
-			if ((i == 0) || (attrs.row != row)) {
-				_vte_debug_print(VTE_DEBUG_ALLY,
-						"Row %d/%ld begins at %u.\n",
-						priv->snapshot_linebreaks->len,
-						attrs.row, i);
-				g_array_append_val(priv->snapshot_linebreaks, i);
-			}
-			row = attrs.row;
-		}
-		/* Add the final line break. */
-		g_array_append_val(priv->snapshot_linebreaks, i);
+		vte_terminal_accessible_index_snapshot(priv);
+
+		/* Remember which view this was, and forget about damage it
+		 * already covers. */
+		priv->snapshot_delta = _vte_terminal_get_view_start(terminal);
+		priv->snapshot_rows = terminal->row_count;
+		priv->snapshot_columns = terminal->column_count;
+		_vte_terminal_take_text_damage(terminal, NULL, NULL);
 		/* We're finished updating this. */
 		priv->snapshot_contents_invalid = FALSE;
 	}
@@ -380,26 +514,29 @@ vte_terminal_accessible_update_private_data_if_needed(AtkObject *text,
 	_vte_debug_print(VTE_DEBUG_ALLY,
 			"Cursor at (%ld, " "%ld).\n", ccol, crow);
 
-	/* Get the offsets to the beginnings of each line. */
-	caret = -1;
-	for (i = 0; i < priv->snapshot_characters->len; i++) {
-		/* Get the attributes for the current cell. */
+	/* The caret goes after the last cell "before" the cursor.  The cells
+	 * are in order, so find it by halves. */
+	lo = 0;
+	hi = priv->snapshot_characters->len;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
 		offset = g_array_index(priv->snapshot_characters,
-				       int, i);
+				       int, mid);
 		attrs = g_array_index(priv->snapshot_attributes,
 				      struct _VteCharAttributes,
 				      offset);
-		/* If this cell is "before" the cursor, move the
-		 * caret to be "here". */
 		if ((attrs.row < crow) ||
 		    ((attrs.row == crow) && (attrs.column < ccol))) {
-			caret = i + 1;
+			lo = mid + 1;
+		} else {
+			hi = mid;
 		}
 	}
+	caret = lo;
 
 	/* If no cells are before the caret, then the caret must be
 	 * at the end of the buffer. */
-	if (caret == -1) {
+	if (caret == 0) {
 		caret = priv->snapshot_characters->len;
 	}
 
@@ -419,6 +556,144 @@ vte_terminal_accessible_update_private_data_if_needed(AtkObject *text,
 			(long)priv->snapshot_characters->len);
 }
 
+/* Bring the snapshot up to date by re-reading only the rows the terminal
+ * reports as changed, and tell listeners what changed.  The rows are spliced
+ * into the text in place and only the changed part of it is compared, so
+ * this costs about as much as the change does.  Returns FALSE if the whole
+ * view has to be read again. */
+static gboolean
+vte_terminal_accessible_patch_private_data(AtkObject *text)
+{
+	VteTerminal *terminal;
+	VteTerminalAccessiblePrivate *priv;
+	GArray *attrs;
+	char *tmp, *old;
+	glong first, last, head, tail, offset, removed, added, caret_offset;
+	gint old_caret;
+	gsize saved;
+	guint ob, oe;
+
+	priv = g_object_get_data(G_OBJECT(text),
+				 VTE_TERMINAL_ACCESSIBLE_PRIVATE_DATA);
+	g_assert(priv != NULL);
+
+	terminal = VTE_TERMINAL((GTK_ACCESSIBLE(text))->widget);
+	if (!_vte_terminal_take_text_damage(terminal, &first, &last)) {
+		return FALSE;
+	}
+	/* If the view moved or changed size, the rows don't line up. */
+	if (priv->snapshot_contents_invalid ||
+	    priv->snapshot_text == NULL ||
+	    priv->snapshot_delta != _vte_terminal_get_view_start(terminal) ||
+	    priv->snapshot_rows != terminal->row_count ||
+	    priv->snapshot_columns != terminal->column_count) {
+		return FALSE;
+	}
+
+	/* Only rows in view matter. */
+	first = MAX(first, priv->snapshot_delta);
+	last = MIN(last, priv->snapshot_delta + priv->snapshot_rows);
+	if (first >= last) {
+		vte_terminal_accessible_update_private_data_if_needed(text,
+								      NULL,
+								      NULL);
+		return TRUE;
+	}
+
+	attrs = g_array_new(FALSE, FALSE, sizeof(struct _VteCharAttributes));
+	tmp = _vte_terminal_get_text_rows(terminal, first, last, attrs);
+	if (tmp == NULL) {
+		g_array_free(attrs, TRUE);
+		return FALSE;
+	}
+
+	_vte_debug_print(VTE_DEBUG_ALLY,
+			"Patching accessibility snapshot, rows %ld to %ld.\n",
+			first, last - 1);
+
+	/* Narrow the change down to what actually differs, in whole
+	 * characters. */
+	ob = vte_terminal_accessible_row_offset(priv, first);
+	oe = vte_terminal_accessible_row_offset(priv, last);
+	old = priv->snapshot_text->str;
+	head = 0;
+	while (head < (glong) (oe - ob) && head < (glong) attrs->len &&
+	       old[ob + head] == tmp[head]) {
+		head++;
+	}
+	while (head > 0 && (tmp[head] & 0xc0) == 0x80) {
+		head--;
+	}
+	tail = 0;
+	while (tail < (glong) (oe - ob) - head &&
+	       tail < (glong) attrs->len - head &&
+	       old[oe - 1 - tail] == tmp[attrs->len - 1 - tail]) {
+		tail++;
+	}
+	while (tail > 0 && (tmp[attrs->len - tail] & 0xc0) == 0x80) {
+		tail--;
+	}
+	offset = ob + head;
+	removed = oe - tail - offset;
+	added = attrs->len - tail - head;
+
+	/* Text that goes is announced while the snapshot still has it. */
+	if (removed > 0) {
+		saved = priv->snapshot_text->len;
+		priv->snapshot_text->len = offset + removed;
+		emit_text_changed(G_OBJECT(text), "text-changed::delete",
+				  old, offset, removed,
+				  vte_terminal_accessible_search_offsets(
+					priv->snapshot_characters, offset));
+		priv->snapshot_text->len = saved;
+	}
+
+	/* Splice the rows' text and attributes in place of the old ones. */
+	g_string_erase(priv->snapshot_text, ob, oe - ob);
+	g_string_insert_len(priv->snapshot_text, ob, tmp, attrs->len);
+	if (oe > ob) {
+		g_array_remove_range(priv->snapshot_attributes, ob, oe - ob);
+	}
+	g_array_insert_vals(priv->snapshot_attributes, ob,
+			    attrs->data, attrs->len);
+	vte_terminal_accessible_splice_index(priv, ob, oe, attrs->len);
+	g_free(tmp);
+	g_array_free(attrs, TRUE);
+
+	/* Where the caret is, in characters, may have changed too. */
+	old_caret = priv->snapshot_caret;
+	priv->snapshot_caret_invalid = TRUE;
+	vte_terminal_accessible_update_private_data_if_needed(text,
+							      NULL, NULL);
+
+	/* Check if we just backspaced over a space; outside of what was
+	 * added, the old text is the new one. */
+	if (removed == 0 && old_caret == priv->snapshot_caret + 1 &&
+	    (guint) priv->snapshot_caret < priv->snapshot_characters->len) {
+		caret_offset = g_array_index(priv->snapshot_characters,
+					     int, priv->snapshot_caret);
+		if (caret_offset >= offset) {
+			caret_offset += added;
+		}
+		if (caret_offset < (glong) priv->snapshot_text->len &&
+		    priv->snapshot_text->str[caret_offset] == ' ') {
+			emit_text_changed(G_OBJECT(text),
+					  "text-changed::delete",
+					  priv->snapshot_text->str,
+					  caret_offset, 1,
+					  priv->snapshot_caret);
+		}
+	}
+
+	if (added > 0) {
+		emit_text_changed(G_OBJECT(text), "text-changed::insert",
+				  priv->snapshot_text->str, offset, added,
+				  vte_terminal_accessible_search_offsets(
+					priv->snapshot_characters, offset));
+	}
+	return TRUE;
+}
+
 /* A signal handler to catch "text-inserted/deleted/modified" signals. */
 static void
 vte_terminal_accessible_text_modified(VteTerminal *terminal, gpointer data)
@@ -434,6 +709,10 @@ vte_terminal_accessible_text_modified(VteTerminal *terminal, gpointer data)
 				 VTE_TERMINAL_ACCESSIBLE_PRIVATE_DATA);
 	g_assert(priv != NULL);
 
+	if (vte_terminal_accessible_patch_private_data(ATK_OBJECT(data))) {
+		return;
+	}
+
 	old_snapshot_caret = priv->snapshot_caret;
 	priv->snapshot_contents_invalid = TRUE;
 	vte_terminal_accessible_update_private_data_if_needed(ATK_OBJECT(data),
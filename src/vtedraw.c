@@ -163,6 +163,31 @@ _vte_draw_new (GtkWidget *widget)
 	return draw;
 }
 
+/* Only the FT2 backend renders into memory, so that's what an offscreen
+ * draw uses regardless of the user's preference. */
+struct _vte_draw *
+_vte_draw_new_offscreen (GtkWidget *widget)
+{
+	struct _vte_draw *draw;
+
+	draw = g_slice_new0 (struct _vte_draw);
+	draw->widget = g_object_ref (widget);
+	draw->offscreen = TRUE;
+	draw->bg_type = VTE_BG_SOURCE_NONE;
+	draw->bg_opacity = 0xffff;
+	draw->impl = &_vte_draw_ft2;
+
+	_vte_draw_update_requires_clear (draw);
+
+	_vte_debug_print (VTE_DEBUG_DRAW,
+			"draw_new_offscreen (%s)\n", draw->impl->name);
+
+	if (draw->impl->create)
+		draw->impl->create (draw, draw->widget);
+
+	return draw;
+}
+
 void
 _vte_draw_free (struct _vte_draw *draw)
 {
@@ -213,11 +238,16 @@ _vte_draw_get_colormap (struct _vte_draw *draw, gboolean maybe_use_default)
 void
 _vte_draw_start (struct _vte_draw *draw)
 {
-	g_return_if_fail (GTK_WIDGET_REALIZED (draw->widget));
+	if (draw->offscreen) {
+		g_return_if_fail (draw->target != NULL);
+	} else {
+		g_return_if_fail (GTK_WIDGET_REALIZED (draw->widget));
+	}
 
 	_vte_debug_print (VTE_DEBUG_DRAW, "draw_start\n");
 
-	g_object_ref (draw->widget->window);
+	if (!draw->offscreen)
+		g_object_ref (draw->widget->window);
 
 	if (draw->impl->start)
 		draw->impl->start (draw);
@@ -233,13 +263,23 @@ _vte_draw_end (struct _vte_draw *draw)
 	if (draw->impl->end)
 		draw->impl->end (draw);
 
-	g_object_unref (draw->widget->window);
+	if (!draw->offscreen)
+		g_object_unref (draw->widget->window);
 
 	draw->started = FALSE;
 
 	_vte_debug_print (VTE_DEBUG_DRAW, "draw_end\n");
 }
 
+void
+_vte_draw_set_target (struct _vte_draw *draw, struct _vte_rgb_buffer *buffer)
+{
+	g_return_if_fail (draw->offscreen);
+	g_return_if_fail (draw->started == FALSE);
+
+	draw->target = buffer;
+}
+
 void
 _vte_draw_set_background_opacity (struct _vte_draw *draw,
 				  guint16 opacity)
@@ -461,6 +501,53 @@ _vte_draw_draw_rectangle (struct _vte_draw *draw,
 	}
 }
 
+struct _vte_draw_mask *
+_vte_draw_mask_new (gint width, gint height)
+{
+	struct _vte_draw_mask *mask;
+
+	mask = g_malloc0 (sizeof (struct _vte_draw_mask) + width * height);
+	mask->ref_count = 1;
+	mask->width = width;
+	mask->height = height;
+	return mask;
+}
+
+struct _vte_draw_mask *
+_vte_draw_mask_ref (struct _vte_draw_mask *mask)
+{
+	mask->ref_count++;
+	return mask;
+}
+
+void
+_vte_draw_mask_unref (struct _vte_draw_mask *mask)
+{
+	if (--mask->ref_count == 0) {
+		g_free (mask);
+	}
+}
+
+gboolean
+_vte_draw_mask (struct _vte_draw *draw, struct _vte_draw_mask *mask,
+		gint x, gint y, GdkColor *color, guchar alpha)
+{
+	g_return_val_if_fail (draw->started == TRUE, FALSE);
+
+	if (draw->impl->draw_mask == NULL) {
+		return FALSE;
+	}
+
+	_vte_debug_print (VTE_DEBUG_DRAW,
+			"draw_mask (%d, %d, %dx%d, color=(%d,%d,%d,%d))\n",
+			x, y, mask->width, mask->height,
+			color->red, color->green, color->blue,
+			alpha);
+
+	draw->impl->draw_mask (draw, mask, x, y, color, alpha);
+	return TRUE;
+}
+
 void
 _vte_draw_set_scroll (struct _vte_draw *draw, gint x, gint y)
 {
@@ -25,6 +25,7 @@
 #include <glib.h>
 #include <gtk/gtk.h>
 #include "vtebg.h"
+#include "vtergb.h"
 #include "vte.h"
 
 G_BEGIN_DECLS
@@ -58,6 +59,15 @@ struct _vte_draw_text_request {
 	gshort x, y, columns;
 };
 
+/* An alpha mask, one byte of coverage per pixel, which can be painted in any
+   color much as a glyph is.  Backends which put drawing off until the frame
+   ends keep a reference until then. */
+struct _vte_draw_mask {
+	gint ref_count;
+	gint width, height;
+	guchar bytes[1];
+};
+
 struct _vte_draw_impl {
 	const char *name;
 	gboolean (*check)(struct _vte_draw *draw, GtkWidget *widget);
@@ -93,6 +103,8 @@ struct _vte_draw_impl {
 	void (*fill_rectangle)(struct _vte_draw *,
 			       gint, gint, gint, gint,
 			       GdkColor *, guchar);
+	void (*draw_mask)(struct _vte_draw *, struct _vte_draw_mask *,
+			  gint, gint, GdkColor *, guchar);
 };
 
 struct _vte_draw {
@@ -100,6 +112,11 @@ struct _vte_draw {
 
 	gboolean started;
 
+	/* Offscreen draws paint into a client-supplied buffer instead of the
+	 * widget's window, which needn't be realized. */
+	gboolean offscreen;
+	struct _vte_rgb_buffer *target;
+
 	guint16 bg_opacity;
 	GdkColor bg_color;
 	enum VteBgSourceType bg_type;
@@ -116,6 +133,7 @@ struct _vte_draw {
 
 /* Create and destroy a draw structure. */
 struct _vte_draw *_vte_draw_new(GtkWidget *widget);
+struct _vte_draw *_vte_draw_new_offscreen(GtkWidget *widget);
 void _vte_draw_free(struct _vte_draw *draw);
 
 /* Get the visual and colormap the draw structure desires.  Certain draw
@@ -130,6 +148,11 @@ GdkColormap *_vte_draw_get_colormap(struct _vte_draw *draw,
 void _vte_draw_start(struct _vte_draw *draw);
 void _vte_draw_end(struct _vte_draw *draw);
 
+/* Set the buffer an offscreen draw paints into; it has to be set before the
+   drawing operation starts, and is left holding the finished frame. */
+void _vte_draw_set_target(struct _vte_draw *draw,
+			  struct _vte_rgb_buffer *buffer);
+
 /* Set the background color, a background pixbuf (if you want transparency,
    you'll have to do that yourself), and clear an area to the default. */
 void _vte_draw_set_background_opacity(struct _vte_draw *draw,
@@ -173,6 +196,15 @@ void _vte_draw_draw_rectangle(struct _vte_draw *draw,
 			      gint x, gint y, gint width, gint height,
 			      GdkColor *color, guchar alpha);
 
+/* Masks start out clear, with one reference.  Painting one returns FALSE,
+   having done nothing, if the backend can't composite; draw the shapes it
+   was made from instead. */
+struct _vte_draw_mask *_vte_draw_mask_new(gint width, gint height);
+struct _vte_draw_mask *_vte_draw_mask_ref(struct _vte_draw_mask *mask);
+void _vte_draw_mask_unref(struct _vte_draw_mask *mask);
+gboolean _vte_draw_mask(struct _vte_draw *draw, struct _vte_draw_mask *mask,
+			gint x, gint y, GdkColor *color, guchar alpha);
+
 /* Set the scrolling offset for painting in a pixbuf background. */
 void _vte_draw_set_scroll(struct _vte_draw *draw, gint x, gint y);
 
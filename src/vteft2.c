@@ -21,6 +21,7 @@
 
 #include <sys/param.h>
 #include <string.h>
+#include <unistd.h>
 #include <gtk/gtk.h>
 #include <glib.h>
 #include <fontconfig/fontconfig.h>
@@ -33,6 +34,45 @@
 
 #define FONT_INDEX_FUDGE 10
 #define CHAR_WIDTH_FUDGE 10
+#define CELL_CACHE_SIZE 256
+#define MAX_BANDS 8
+#define MIN_BAND_HEIGHT 64
+
+/* Drawing is recorded as it's asked for, and only carried out when the frame
+ * ends, split into bands of rows which are rendered in parallel. */
+enum _vte_ft2_op_type {
+	VTE_FT2_OP_CLEAR,
+	VTE_FT2_OP_FILL,
+	VTE_FT2_OP_TEXT,
+	VTE_FT2_OP_MASK
+};
+
+struct _vte_ft2_op {
+	enum _vte_ft2_op_type type;
+	gint x, y, width, height;	/* for clears, fills and masks */
+	gint scrollx, scrolly;		/* for clears */
+	GdkColor color;
+	guint first, count;		/* range of requests, for text */
+	struct _vte_draw_mask *mask;	/* a reference, for masks */
+};
+
+/* Cells already rendered by the draw_text call being replayed, which can be
+ * copied for repeats of the same character.  Entries are only valid if their
+ * stamp matches. */
+struct _vte_ft2_cells {
+	struct {
+		guint stamp;
+		gunichar c;
+		gint columns;
+		gint x, y;
+	} cells[CELL_CACHE_SIZE];
+	guint stamp;
+};
+
+struct _vte_ft2_band {
+	struct _vte_draw *draw;
+	gint top, bottom;
+};
 
 struct _vte_ft2_data
 {
@@ -40,13 +80,56 @@ struct _vte_ft2_data
 	struct _vte_rgb_buffer *rgb;
 	GdkPixbuf *pixbuf;
 	gint left, right, top, bottom;
+	GArray *ops;			/* _vte_ft2_op */
+	GArray *requests;		/* _vte_draw_text_request */
+	GArray *glyphs;			/* each request's glyph, or NULL */
+	GMutex *band_lock;
+	GCond *band_done;
+	gint bands_pending;
+	gboolean pinned;		/* holding a glyph cache pin */
 };
 
+/* Shared by all terminals; each frame waits for its own bands. */
+static GThreadPool *_vte_ft2_pool;
+static gint _vte_ft2_workers = -1;
+
 static void
 _vte_ft2_create(struct _vte_draw *draw, GtkWidget *widget)
 {
-	draw->impl_data = g_slice_new0(struct _vte_ft2_data);
-	gtk_widget_set_double_buffered (widget, FALSE);
+	struct _vte_ft2_data *data;
+
+	data = g_slice_new0(struct _vte_ft2_data);
+	data->ops = g_array_new(FALSE, FALSE, sizeof(struct _vte_ft2_op));
+	data->requests = g_array_new(FALSE, FALSE,
+				     sizeof(struct _vte_draw_text_request));
+	data->glyphs = g_array_new(FALSE, FALSE,
+				   sizeof(const struct _vte_glyph *));
+	draw->impl_data = data;
+	if (!draw->offscreen) {
+		gtk_widget_set_double_buffered (widget, FALSE);
+	}
+}
+
+/* Forget everything recorded this frame, and let go of what it used. */
+static void
+_vte_ft2_clear_ops(struct _vte_ft2_data *data)
+{
+	struct _vte_ft2_op *op;
+	guint i;
+
+	for (i = 0; i < data->ops->len; i++) {
+		op = &g_array_index(data->ops, struct _vte_ft2_op, i);
+		if (op->type == VTE_FT2_OP_MASK) {
+			_vte_draw_mask_unref(op->mask);
+		}
+	}
+	g_array_set_size(data->ops, 0);
+	g_array_set_size(data->requests, 0);
+	g_array_set_size(data->glyphs, 0);
+	if (data->pinned) {
+		_vte_glyph_cache_unpin();
+		data->pinned = FALSE;
+	}
 }
 
 static void
@@ -54,6 +137,8 @@ _vte_ft2_destroy(struct _vte_draw *draw)
 {
 	struct _vte_ft2_data *data = draw->impl_data;
 
+	_vte_ft2_clear_ops(data);
+
 	if (data->cache != NULL) {
 		_vte_glyph_cache_free(data->cache);
 	}
@@ -66,6 +151,14 @@ _vte_ft2_destroy(struct _vte_draw *draw)
 		g_object_unref(data->pixbuf);
 	}
 
+	if (data->band_lock != NULL) {
+		g_mutex_free(data->band_lock);
+		g_cond_free(data->band_done);
+	}
+	g_array_free(data->ops, TRUE);
+	g_array_free(data->requests, TRUE);
+	g_array_free(data->glyphs, TRUE);
+
 	g_slice_free(struct _vte_ft2_data, data);
 }
 
@@ -77,13 +170,253 @@ _vte_ft2_start(struct _vte_draw *draw)
 
 	width = draw->widget->allocation.width;
 	height = draw->widget->allocation.height;
-	if (data->rgb == NULL) {
+	if (draw->offscreen) {
+		data->rgb = draw->target;
+	} else if (data->rgb == NULL) {
 		data->rgb = _vte_rgb_buffer_new(width, height);
 	} else {
 		_vte_rgb_buffer_resize(data->rgb, width, height);
 	}
 	data->left = data->top = G_MAXINT;
 	data->right = data->bottom = -G_MAXINT;
+
+	/* Glyphs are looked up as text is recorded and drawn from when the
+	 * frame ends, maybe from other threads, so keep them until then.  A
+	 * frame which was never ended mustn't leave a second pin behind. */
+	if (!data->pinned) {
+		_vte_glyph_cache_pin();
+		data->pinned = TRUE;
+	}
+}
+
+/* Replay a draw_text call into a band. */
+static void
+_vte_ft2_replay_text(struct _vte_ft2_data *data,
+		     struct _vte_rgb_buffer *band, gint top,
+		     const struct _vte_draw_text_request *requests,
+		     const struct _vte_glyph **glyphs,
+		     gsize n_requests, GdkColor *color,
+		     struct _vte_ft2_cells *cells)
+{
+	gint width, height, y;
+	gboolean inside;
+	gunichar c;
+	guint hash;
+	gsize i;
+
+	/* Every cell in the call has the same colors, so a cell rendered
+	 * earlier can stand in for later ones with the same character.  That
+	 * doesn't hold across calls, so start with an empty cache.  Only
+	 * cells wholly within the band can be copied to or from. */
+	if (++cells->stamp == 0) {
+		memset(cells->cells, 0, sizeof(cells->cells));
+		cells->stamp = 1;
+	}
+
+	height = data->cache->height;
+	for (i = 0; i < n_requests; i++) {
+		c = requests[i].c;
+		if (glyphs[i] == NULL)
+			continue;
+		y = requests[i].y - top;
+		if (y + height <= 0 || y >= band->height)
+			continue;
+		width = data->cache->width * requests[i].columns;
+		inside = (y >= 0) && (y + height <= band->height);
+		hash = ((c ^ (c >> 8)) + requests[i].columns) &
+		       (CELL_CACHE_SIZE - 1);
+		if (inside &&
+		    cells->cells[hash].stamp == cells->stamp &&
+		    cells->cells[hash].c == c &&
+		    cells->cells[hash].columns == requests[i].columns) {
+			_vte_rgb_copy(band,
+				      cells->cells[hash].x, cells->cells[hash].y,
+				      width, height,
+				      requests[i].x, y);
+			continue;
+		}
+		_vte_glyph_draw_glyph(data->cache, glyphs[i], color,
+				      requests[i].x, y,
+				      requests[i].columns,
+				      0,
+				      band);
+		if (inside) {
+			cells->cells[hash].stamp = cells->stamp;
+			cells->cells[hash].c = c;
+			cells->cells[hash].columns = requests[i].columns;
+			cells->cells[hash].x = requests[i].x;
+			cells->cells[hash].y = y;
+		}
+	}
+}
+
+/* Carry out everything recorded this frame which touches rows [top,
+ * bottom).  Nothing outside of those rows is written to, so bands can be
+ * replayed at the same time. */
+static void
+_vte_ft2_replay(struct _vte_draw *draw, gint top, gint bottom)
+{
+	struct _vte_ft2_data *data = draw->impl_data;
+	struct _vte_rgb_buffer band;
+	struct _vte_ft2_cells cells;
+	struct _vte_ft2_op *op;
+	gint y0, y1;
+	guint i;
+
+	_vte_rgb_buffer_band(data->rgb, top, bottom - top, &band);
+	memset(&cells, 0, sizeof(cells));
+
+	for (i = 0; i < data->ops->len; i++) {
+		op = &g_array_index(data->ops, struct _vte_ft2_op, i);
+		if (op->type == VTE_FT2_OP_TEXT) {
+			_vte_ft2_replay_text(data, &band, top,
+					     &g_array_index(data->requests,
+						struct _vte_draw_text_request,
+						op->first),
+					     &g_array_index(data->glyphs,
+						const struct _vte_glyph *,
+						op->first),
+					     op->count, &op->color, &cells);
+			continue;
+		}
+		y0 = MAX(op->y, top);
+		y1 = MIN(op->y + op->height, bottom);
+		if (y1 <= y0) {
+			continue;
+		}
+		if (op->type == VTE_FT2_OP_MASK) {
+			_vte_rgb_draw_mask(&band, op->x, y0 - top,
+					   op->mask->bytes +
+					   (y0 - op->y) * op->mask->width,
+					   op->mask->width,
+					   op->width, y1 - y0,
+					   op->color.red >> 8,
+					   op->color.green >> 8,
+					   op->color.blue >> 8);
+		} else if (op->type == VTE_FT2_OP_CLEAR && data->pixbuf != NULL) {
+			/* Tile a pixbuf in. */
+			_vte_rgb_draw_pixbuf(&band, op->x, y0 - top,
+					     op->width, y1 - y0,
+					     data->pixbuf,
+					     op->scrollx + op->x,
+					     op->scrolly + y0);
+		} else {
+			_vte_rgb_draw_color(&band, op->x, y0 - top,
+					    op->width, y1 - y0, &op->color);
+		}
+	}
+}
+
+static void
+_vte_ft2_band_func(gpointer task, gpointer unused)
+{
+	struct _vte_ft2_band *band = task;
+	struct _vte_ft2_data *data = band->draw->impl_data;
+
+	_vte_ft2_replay(band->draw, band->top, band->bottom);
+
+	g_mutex_lock(data->band_lock);
+	if (--data->bands_pending == 0) {
+		g_cond_signal(data->band_done);
+	}
+	g_mutex_unlock(data->band_lock);
+}
+
+/* Start the worker threads, one fewer than there are processors, if we're
+ * allowed threads at all. */
+static gint
+_vte_ft2_get_workers(void)
+{
+	glong cpus;
+
+	if (_vte_ft2_workers >= 0) {
+		return _vte_ft2_workers;
+	}
+	_vte_ft2_workers = 0;
+	if (!g_thread_supported()) {
+		return 0;
+	}
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus <= 1) {
+		return 0;
+	}
+	_vte_ft2_pool = g_thread_pool_new(_vte_ft2_band_func, NULL,
+					  MIN(cpus, MAX_BANDS) - 1,
+					  FALSE, NULL);
+	if (_vte_ft2_pool != NULL) {
+		_vte_ft2_workers = MIN(cpus, MAX_BANDS) - 1;
+	}
+	_vte_debug_print(VTE_DEBUG_MISC,
+			"VteFT2 drawing with %d worker threads.\n",
+			_vte_ft2_workers);
+	return _vte_ft2_workers;
+}
+
+/* Render everything recorded this frame into the buffer, in parallel bands
+ * if the damaged area is tall enough to be worth it. */
+static void
+_vte_ft2_render(struct _vte_draw *draw)
+{
+	struct _vte_ft2_data *data = draw->impl_data;
+	struct _vte_ft2_band bands[MAX_BANDS];
+	gint top, bottom, n, i;
+
+	if (data->ops->len == 0) {
+		return;
+	}
+	top = MAX(data->top, 0);
+	bottom = MIN(data->bottom + 1, data->rgb->height);
+	if (bottom <= top) {
+		return;
+	}
+
+	n = MIN(_vte_ft2_get_workers() + 1, (bottom - top) / MIN_BAND_HEIGHT);
+	if (n <= 1) {
+		_vte_ft2_replay(draw, top, bottom);
+		return;
+	}
+
+	if (data->band_lock == NULL) {
+		data->band_lock = g_mutex_new();
+		data->band_done = g_cond_new();
+	}
+	for (i = 0; i < n; i++) {
+		bands[i].draw = draw;
+		bands[i].top = top + (bottom - top) * i / n;
+		bands[i].bottom = top + (bottom - top) * (i + 1) / n;
+	}
+
+	data->bands_pending = n - 1;
+	for (i = 1; i < n; i++) {
+		g_thread_pool_push(_vte_ft2_pool, &bands[i], NULL);
+	}
+	_vte_ft2_replay(draw, bands[0].top, bands[0].bottom);
+	g_mutex_lock(data->band_lock);
+	while (data->bands_pending > 0) {
+		g_cond_wait(data->band_done, data->band_lock);
+	}
+	g_mutex_unlock(data->band_lock);
+}
+
+/* Record a solid or background fill. */
+static void
+_vte_ft2_add_fill(struct _vte_draw *draw, enum _vte_ft2_op_type type,
+		  gint x, gint y, gint width, gint height,
+		  const GdkColor *color)
+{
+	struct _vte_ft2_data *data = draw->impl_data;
+	struct _vte_ft2_op op;
+
+	op.type = type;
+	op.x = x;
+	op.y = y;
+	op.width = width;
+	op.height = height;
+	op.scrollx = draw->scrollx;
+	op.scrolly = draw->scrolly;
+	op.color = *color;
+	op.first = op.count = 0;
+	g_array_append_val(data->ops, op);
 }
 
 static void
@@ -93,6 +426,15 @@ _vte_ft2_end(struct _vte_draw *draw)
 	GtkWidget *widget;
 	GtkStateType state;
 
+	_vte_ft2_render(draw);
+	_vte_ft2_clear_ops(data);
+
+	/* The frame is left in the target buffer, which isn't ours. */
+	if (draw->offscreen) {
+		data->rgb = NULL;
+		return;
+	}
+
 	widget = draw->widget;
 	state = GTK_WIDGET_STATE(widget);
 	if (data->right < data->left) {
@@ -142,6 +484,9 @@ _vte_ft2_set_background_image(struct _vte_draw *draw,
 static void
 _vte_ft2_clip(struct _vte_draw *draw, GdkRegion *region)
 {
+	if (draw->offscreen) {
+		return;
+	}
 	gdk_gc_set_clip_region(
 			draw->widget->style->fg_gc[GTK_WIDGET_STATE(draw->widget)],
 			region);
@@ -165,16 +510,8 @@ _vte_ft2_clear(struct _vte_draw *draw,
 {
 	struct _vte_ft2_data *data = draw->impl_data;
 
-	if (data->pixbuf != NULL) {
-		/* Tile a pixbuf in. */
-		_vte_rgb_draw_pixbuf(data->rgb, x, y, width, height,
-				     data->pixbuf,
-				     draw->scrollx + x, draw->scrolly + y);
-	} else {
-		/* The simple case is a solid color. */
-		_vte_rgb_draw_color(data->rgb, x, y, width, height,
-				    &draw->bg_color);
-	}
+	_vte_ft2_add_fill(draw, VTE_FT2_OP_CLEAR, x, y, width, height,
+			  &draw->bg_color);
 	update_bbox(data, x, y, width, height);
 }
 
@@ -235,32 +572,45 @@ _vte_ft2_draw_text(struct _vte_draw *draw,
 		   GdkColor *color, guchar alpha)
 {
 	struct _vte_ft2_data *data = draw->impl_data;
-	gsize i, j;
+	struct _vte_ft2_op op;
+	const struct _vte_glyph *glyph;
+	gint left, right, top, bottom, height;
+	gsize i;
+
+	op.type = VTE_FT2_OP_TEXT;
+	op.color = *color;
+	op.first = data->requests->len;
+	op.count = n_requests;
+	g_array_append_vals(data->requests, requests, n_requests);
+	g_array_append_val(data->ops, op);
+
+	/* Find the glyphs now, while the frame has the cache pinned, so
+	 * that the bands can draw them without taking its lock. */
+	for (i = 0; i < n_requests; i++) {
+		glyph = NULL;
+		if (requests[i].c != (gunichar)-1 &&
+		    requests[i].c != 32 /* space */) {
+			glyph = _vte_glyph_resolve(data->cache,
+						   requests[i].c, 0);
+		}
+		g_array_append_val(data->glyphs, glyph);
+	}
 
+	left = top = G_MAXINT;
+	right = bottom = -G_MAXINT;
+	height = data->cache->height;
 	for (i = 0; i < n_requests; i++) {
 		if (requests[i].c == (gunichar)-1 ||
-			       	requests[i].c == 32 /* space */)
+		    requests[i].c == 32 /* space */)
 			continue;
-		_vte_glyph_draw(data->cache, requests[i].c, color,
-				requests[i].x, requests[i].y,
-				requests[i].columns,
-				0,
-				data->rgb);
-		update_bbox(data, requests[i].x, requests[i].y,
-			    data->cache->width * requests[i].columns,
-			    data->cache->height);
-		for (j = i + 1; j < n_requests; j++) {
-			if (requests[j].c == requests[i].c) {
-				_vte_rgb_copy(data->rgb,
-						requests[i].x, requests[i].y,
-						requests[i].columns * data->cache->width, data->cache->height,
-						requests[j].x, requests[j].y);
-				update_bbox(data, requests[j].x, requests[j].y,
-						data->cache->width * requests[j].columns,
-						data->cache->height);
-				requests[j].c = -1;
-			}
-		}
+		left = MIN(left, requests[i].x);
+		top = MIN(top, requests[i].y);
+		right = MAX(right, requests[i].x +
+			    data->cache->width * requests[i].columns);
+		bottom = MAX(bottom, requests[i].y + height);
+	}
+	if (right > left) {
+		update_bbox(data, left, top, right - left, bottom - top);
 	}
 }
 
@@ -284,22 +634,22 @@ _vte_ft2_draw_rectangle(struct _vte_draw *draw,
 {
 	struct _vte_ft2_data *data = draw->impl_data;
 
-	_vte_rgb_draw_color(data->rgb,
-			    x, y,
-			    width, 1,
-			    color);
-	_vte_rgb_draw_color(data->rgb,
-			    x, y,
-			    1, height,
-			    color);
-	_vte_rgb_draw_color(data->rgb,
-			    x, y + height - 1,
-			    width, 1,
-			    color);
-	_vte_rgb_draw_color(data->rgb,
-			    x + width - 1, y,
-			    1, height,
-			    color);
+	_vte_ft2_add_fill(draw, VTE_FT2_OP_FILL,
+			  x, y,
+			  width, 1,
+			  color);
+	_vte_ft2_add_fill(draw, VTE_FT2_OP_FILL,
+			  x, y,
+			  1, height,
+			  color);
+	_vte_ft2_add_fill(draw, VTE_FT2_OP_FILL,
+			  x, y + height - 1,
+			  width, 1,
+			  color);
+	_vte_ft2_add_fill(draw, VTE_FT2_OP_FILL,
+			  x + width - 1, y,
+			  1, height,
+			  color);
 	update_bbox(data, x, y, width, height);
 }
 
@@ -310,10 +660,31 @@ _vte_ft2_fill_rectangle(struct _vte_draw *draw,
 {
 	struct _vte_ft2_data *data = draw->impl_data;
 
-	_vte_rgb_draw_color(data->rgb, x, y, width, height, color);
+	_vte_ft2_add_fill(draw, VTE_FT2_OP_FILL, x, y, width, height, color);
 	update_bbox(data, x, y, width, height);
 }
 
+/* Record a mask, which is painted like a glyph when the frame ends. */
+static void
+_vte_ft2_draw_mask(struct _vte_draw *draw, struct _vte_draw_mask *mask,
+		   gint x, gint y, GdkColor *color, guchar alpha)
+{
+	struct _vte_ft2_data *data = draw->impl_data;
+	struct _vte_ft2_op op;
+
+	op.type = VTE_FT2_OP_MASK;
+	op.x = x;
+	op.y = y;
+	op.width = mask->width;
+	op.height = mask->height;
+	op.scrollx = op.scrolly = 0;
+	op.color = *color;
+	op.first = op.count = 0;
+	op.mask = _vte_draw_mask_ref(mask);
+	g_array_append_val(data->ops, op);
+	update_bbox(data, x, y, mask->width, mask->height);
+}
+
 const struct _vte_draw_impl _vte_draw_ft2 = {
 	"ft2",
 	NULL, /* check */
@@ -334,5 +705,6 @@ const struct _vte_draw_impl _vte_draw_ft2 = {
 	_vte_ft2_draw_text,
 	_vte_ft2_draw_has_char,
 	_vte_ft2_draw_rectangle,
-	_vte_ft2_fill_rectangle
+	_vte_ft2_fill_rectangle,
+	_vte_ft2_draw_mask
 };
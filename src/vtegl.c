@@ -39,6 +39,26 @@
 #include "vtegl.h"
 #include "vteglyph.h"
 
+/* Glyphs are uploaded once into a single alpha texture, packed into shelves
+ * as they're first drawn, and everything drawn in a frame is queued as
+ * textured quads which are sent in as few calls as possible.  The first
+ * texels of the atlas are opaque, for untextured quads. */
+#define VTE_GL_ATLAS_SIZE	1024
+#define VTE_GL_ATLAS_SOLID	2
+
+struct _vte_gl_atlas_glyph {
+	gshort x, y;		/* in the atlas */
+	gshort width, height;	/* zero if there's nothing to draw */
+	gshort skip;
+};
+
+/* Laid out for glInterleavedArrays(GL_T2F_C4UB_V3F). */
+struct _vte_gl_vertex {
+	GLfloat s, t;
+	GLubyte r, g, b, a;
+	GLfloat x, y, z;
+};
+
 struct _vte_gl_data
 {
 	XVisualInfo *visual_info;
@@ -47,7 +67,14 @@ struct _vte_gl_data
 	GdkPixbuf *bgpixbuf;
 	GLXDrawable glwindow;
 	struct _vte_glyph_cache *cache;
-	struct _vte_buffer *buffer;
+	struct _vte_buffer *buffer;	/* staging for glyph uploads */
+
+	GLuint atlas;			/* or 0 until first started */
+	GHashTable *atlas_glyphs;	/* gunichar -> _vte_gl_atlas_glyph */
+	GHashTable *atlas_masks;	/* _vte_draw_mask (a reference) ->
+					   _vte_gl_atlas_glyph */
+	gint atlas_x, atlas_y, atlas_shelf;	/* where the next glyph goes */
+	GArray *vertices;		/* quads waiting to be drawn */
 };
 
 #define _vte_gl_attributes GLX_USE_GL, GLX_DOUBLEBUFFER, GLX_RGBA, None,
@@ -108,6 +135,213 @@ _vte_gl_check(struct _vte_draw *draw, GtkWidget *widget)
 	return (direct == True) ? TRUE : FALSE;
 }
 
+static void
+_vte_gl_atlas_glyph_free(gpointer glyph)
+{
+	g_slice_free(struct _vte_gl_atlas_glyph, glyph);
+}
+
+/* Draw the queued quads in one go. */
+static void
+_vte_gl_flush(struct _vte_gl_data *data)
+{
+	if (data->vertices->len == 0) {
+		return;
+	}
+
+	glBindTexture(GL_TEXTURE_2D, data->atlas);
+	glEnable(GL_TEXTURE_2D);
+	glInterleavedArrays(GL_T2F_C4UB_V3F, 0, data->vertices->data);
+	glDrawArrays(GL_QUADS, 0, data->vertices->len);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glDisableClientState(GL_COLOR_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisable(GL_TEXTURE_2D);
+
+	g_array_set_size(data->vertices, 0);
+}
+
+/* Queue a quad covering the given pixels, textured with the given part of
+ * the atlas. */
+static void
+_vte_gl_add_quad(struct _vte_gl_data *data,
+		 gint x, gint y, gint width, gint height,
+		 gint s, gint t, gint swidth, gint theight,
+		 const GdkColor *color, guchar alpha)
+{
+	struct _vte_gl_vertex *v;
+	guint i;
+
+	i = data->vertices->len;
+	g_array_set_size(data->vertices, i + 4);
+	v = &g_array_index(data->vertices, struct _vte_gl_vertex, i);
+
+	v[0].s = v[3].s = (GLfloat) s / VTE_GL_ATLAS_SIZE;
+	v[1].s = v[2].s = (GLfloat) (s + swidth) / VTE_GL_ATLAS_SIZE;
+	v[0].t = v[1].t = (GLfloat) t / VTE_GL_ATLAS_SIZE;
+	v[2].t = v[3].t = (GLfloat) (t + theight) / VTE_GL_ATLAS_SIZE;
+	v[0].x = v[3].x = x;
+	v[1].x = v[2].x = x + width;
+	v[0].y = v[1].y = y;
+	v[2].y = v[3].y = y + height;
+	for (i = 0; i < 4; i++) {
+		v[i].r = color->red >> 8;
+		v[i].g = color->green >> 8;
+		v[i].b = color->blue >> 8;
+		v[i].a = (alpha == VTE_DRAW_OPAQUE) ? 0xff : alpha;
+		v[i].z = 0;
+	}
+}
+
+/* Queue an untextured quad. */
+static void
+_vte_gl_add_solid_quad(struct _vte_gl_data *data,
+		       gint x, gint y, gint width, gint height,
+		       const GdkColor *color, guchar alpha)
+{
+	_vte_gl_add_quad(data, x, y, width, height,
+			 VTE_GL_ATLAS_SOLID / 2, VTE_GL_ATLAS_SOLID / 2, 0, 0,
+			 color, alpha);
+}
+
+/* Forget where glyphs are in the atlas, so that it can be refilled.  The
+ * opaque corner stays put. */
+static void
+_vte_gl_atlas_reset(struct _vte_gl_data *data)
+{
+	_vte_gl_flush(data);
+	g_hash_table_remove_all(data->atlas_glyphs);
+	g_hash_table_remove_all(data->atlas_masks);
+	data->atlas_x = VTE_GL_ATLAS_SOLID;
+	data->atlas_y = 0;
+	data->atlas_shelf = VTE_GL_ATLAS_SOLID;
+}
+
+static void
+_vte_gl_atlas_create(struct _vte_gl_data *data)
+{
+	guchar solid[VTE_GL_ATLAS_SOLID * VTE_GL_ATLAS_SOLID];
+
+	glGenTextures(1, &data->atlas);
+	glBindTexture(GL_TEXTURE_2D, data->atlas);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+	glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA,
+		     VTE_GL_ATLAS_SIZE, VTE_GL_ATLAS_SIZE, 0,
+		     GL_ALPHA, GL_UNSIGNED_BYTE, NULL);
+
+	memset(solid, 0xff, sizeof(solid));
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0,
+			VTE_GL_ATLAS_SOLID, VTE_GL_ATLAS_SOLID,
+			GL_ALPHA, GL_UNSIGNED_BYTE, solid);
+}
+
+/* Find room for @width by @height pixels of coverage in the atlas, starting
+ * over if it's full, and upload them there. */
+static void
+_vte_gl_atlas_place(struct _vte_gl_data *data,
+		    struct _vte_gl_atlas_glyph *entry,
+		    gint width, gint height, const guchar *pixels)
+{
+	/* Start a new shelf if this one is full, and start over if the atlas
+	 * is. */
+	if (data->atlas_x + width > VTE_GL_ATLAS_SIZE) {
+		data->atlas_x = 0;
+		data->atlas_y += data->atlas_shelf;
+		data->atlas_shelf = 0;
+	}
+	if (data->atlas_y + height > VTE_GL_ATLAS_SIZE) {
+		_vte_debug_print(VTE_DEBUG_MISC,
+				"Glyph atlas full, starting over.\n");
+		_vte_gl_atlas_reset(data);
+		if (data->atlas_x + width > VTE_GL_ATLAS_SIZE) {
+			data->atlas_x = 0;
+			data->atlas_y += data->atlas_shelf;
+			data->atlas_shelf = 0;
+		}
+	}
+	entry->x = data->atlas_x;
+	entry->y = data->atlas_y;
+	entry->width = width;
+	entry->height = height;
+	data->atlas_x += width;
+	data->atlas_shelf = MAX(data->atlas_shelf, height);
+
+	glBindTexture(GL_TEXTURE_2D, data->atlas);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, entry->x, entry->y,
+			entry->width, entry->height,
+			GL_ALPHA, GL_UNSIGNED_BYTE, pixels);
+}
+
+/* Whether something this size can go in the atlas at all. */
+static gboolean
+_vte_gl_atlas_fits(gint width, gint height)
+{
+	return (width > 0) && (height > 0) &&
+	       (width <= VTE_GL_ATLAS_SIZE) &&
+	       (height <= VTE_GL_ATLAS_SIZE - VTE_GL_ATLAS_SOLID);
+}
+
+/* Find a character's glyph in the atlas, uploading it on first use. */
+static const struct _vte_gl_atlas_glyph *
+_vte_gl_atlas_get(struct _vte_gl_data *data, gunichar c)
+{
+	struct _vte_gl_atlas_glyph *entry;
+	const struct _vte_glyph *glyph;
+	guchar *pixels;
+	glong i, n;
+
+	entry = g_hash_table_lookup(data->atlas_glyphs, GINT_TO_POINTER(c));
+	if (entry != NULL) {
+		return entry;
+	}
+
+	entry = g_slice_new0(struct _vte_gl_atlas_glyph);
+	glyph = _vte_glyph_get(data->cache, c);
+	if ((glyph != NULL) && _vte_gl_atlas_fits(glyph->width, glyph->height)) {
+		/* The glyph's coverage is the same in every channel. */
+		n = glyph->width * glyph->height;
+		_vte_buffer_set_minimum_size(data->buffer, n);
+		pixels = data->buffer->bytes;
+		for (i = 0; i < n; i++) {
+			pixels[i] = glyph->bytes[i * glyph->bytes_per_pixel];
+		}
+		_vte_gl_atlas_place(data, entry, glyph->width, glyph->height,
+				    pixels);
+		entry->skip = glyph->skip;
+	}
+	g_hash_table_insert(data->atlas_glyphs, GINT_TO_POINTER(c), entry);
+	return entry;
+}
+
+/* Find a mask in the atlas, uploading it on first use.  It's already in the
+ * atlas's format. */
+static const struct _vte_gl_atlas_glyph *
+_vte_gl_atlas_get_mask(struct _vte_gl_data *data, struct _vte_draw_mask *mask)
+{
+	struct _vte_gl_atlas_glyph *entry;
+
+	entry = g_hash_table_lookup(data->atlas_masks, mask);
+	if (entry != NULL) {
+		return entry;
+	}
+
+	entry = g_slice_new0(struct _vte_gl_atlas_glyph);
+	if (_vte_gl_atlas_fits(mask->width, mask->height)) {
+		_vte_gl_atlas_place(data, entry, mask->width, mask->height,
+				    mask->bytes);
+	}
+	/* Holding a reference keeps the address from being reused by another
+	 * mask while this entry's around. */
+	g_hash_table_insert(data->atlas_masks, _vte_draw_mask_ref(mask), entry);
+	return entry;
+}
+
 static void
 _vte_gl_create(struct _vte_draw *draw, GtkWidget *widget)
 {
@@ -144,6 +378,18 @@ _vte_gl_create(struct _vte_draw *draw, GtkWidget *widget)
 	data->cache = _vte_glyph_cache_new();
 	data->buffer = _vte_buffer_new();
 
+	data->atlas = 0;
+	data->atlas_glyphs = g_hash_table_new_full(NULL, NULL, NULL,
+						   _vte_gl_atlas_glyph_free);
+	data->atlas_masks = g_hash_table_new_full(NULL, NULL,
+						  (GDestroyNotify) _vte_draw_mask_unref,
+						  _vte_gl_atlas_glyph_free);
+	data->atlas_x = VTE_GL_ATLAS_SOLID;
+	data->atlas_y = 0;
+	data->atlas_shelf = VTE_GL_ATLAS_SOLID;
+	data->vertices = g_array_new(FALSE, FALSE,
+				     sizeof(struct _vte_gl_vertex));
+
 	gtk_widget_set_double_buffered(widget, FALSE);
 }
 
@@ -152,6 +398,11 @@ _vte_gl_destroy(struct _vte_draw *draw)
 {
 	struct _vte_gl_data *data = draw->impl_data;
 
+	/* The atlas texture goes away along with the context. */
+	g_array_free(data->vertices, TRUE);
+	g_hash_table_destroy(data->atlas_glyphs);
+	g_hash_table_destroy(data->atlas_masks);
+
 	_vte_buffer_free(data->buffer);
 
 	_vte_glyph_cache_free(data->cache);
@@ -205,6 +456,12 @@ _vte_gl_start(struct _vte_draw *draw)
 	glViewport(0, height, width, -height);
 	glEnable(GL_BLEND);
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	/* Background images are drawn top down, as text used to be. */
+	glPixelZoom(1, -1);
+
+	if (data->atlas == 0) {
+		_vte_gl_atlas_create(data);
+	}
 }
 
 static void
@@ -213,6 +470,7 @@ _vte_gl_end(struct _vte_draw *draw)
 	struct _vte_gl_data *data = draw->impl_data;
 
 	glXMakeCurrent(data->display, data->glwindow, data->context);
+	_vte_gl_flush(data);
 	glXSwapBuffers(data->display, data->glwindow);
 
 	data->glwindow = -1;
@@ -260,19 +518,14 @@ _vte_gl_clear(struct _vte_draw *draw, gint x, gint y, gint width, gint height)
 	}
 
 	if ((pixbufw == 0) || (pixbufh == 0)) {
-		glColor4us(draw->bg_color.red,
-			   draw->bg_color.green,
-			   draw->bg_color.blue,
-			   0xFFFF);
-		glBegin(GL_POLYGON);
-		glVertex2d(x, y);
-		glVertex2d(x + width, y);
-		glVertex2d(x + width, y + height - 1);
-		glVertex2d(x, y + height - 1);
-		glEnd();
+		_vte_gl_add_solid_quad(data, x, y, width, height,
+				       &draw->bg_color, VTE_DRAW_OPAQUE);
 		return;
 	}
 
+	/* Anything already queued has to go underneath. */
+	_vte_gl_flush(data);
+
 	/* Flood fill. */
 	xstop = x + width;
 	ystop = y + height;
@@ -340,6 +593,7 @@ _vte_gl_set_text_font(struct _vte_draw *draw,
 		data->cache = NULL;
 	}
 	data->cache = _vte_glyph_cache_new();
+	_vte_gl_atlas_reset(data);
 
 	_vte_glyph_cache_set_font_description(draw->widget,
 					      NULL, data->cache, fontdesc,
@@ -378,73 +632,27 @@ _vte_gl_draw_text(struct _vte_draw *draw,
 		  GdkColor *color, guchar alpha)
 {
 	struct _vte_gl_data *data = draw->impl_data;
-	const struct _vte_glyph *glyph;
-	guint16 a, r, g, b;
-	guint i, j;
-	int k, x, y, w, pad, rows, columns, src, dest;
-	guchar *pixels;
+	const struct _vte_gl_atlas_glyph *glyph;
+	gsize i;
+	gint w, pad;
 
 	glXMakeCurrent(data->display, data->glwindow, data->context);
 
-	r = color->red >> 8;
-	g = color->green >> 8;
-	b = color->blue >> 8;
-
-	rows = 0;
-	columns = 0;
 	for (i = 0; i < n_requests; i++) {
-		glyph = _vte_glyph_get(data->cache, requests[i].c);
-		columns += (requests[i].columns * data->cache->width);
-		if ((glyph == NULL) ||
-		    (glyph->width == 0) ||
-		    (glyph->height == 0)) {
+		glyph = _vte_gl_atlas_get(data, requests[i].c);
+		if (glyph->width == 0) {
 			continue;
 		}
-		rows = MAX(rows, glyph->skip + glyph->height);
-	}
-
-	_vte_buffer_set_minimum_size(data->buffer, rows * columns * 4);
-	pixels = data->buffer->bytes;
-	memset(pixels, 0, rows * columns * 4);
-	for (k = 0; k < rows * columns; k++) {
-		pixels[k * 4 + 0] = r;
-		pixels[k * 4 + 1] = g;
-		pixels[k * 4 + 2] = b;
-	}
-
-	for (i = j = 0; i < n_requests; i++) {
-		glyph = _vte_glyph_get(data->cache, requests[i].c);
 		w = requests[i].columns * data->cache->width;
-		if ((glyph == NULL) ||
-		    (glyph->width == 0) ||
-		    (glyph->height == 0)) {
-			j += w;
-			continue;
-		}
 		pad = (w - glyph->width) / 2;
-		for (y = 0; y < glyph->height; y++)
-		for (x = 0; x < glyph->width; x++) {
-			src = (y * glyph->width + x) * glyph->bytes_per_pixel;
-			a = glyph->bytes[src];
-			if (a == 0) {
-				continue;
-			}
-			if (alpha != VTE_DRAW_OPAQUE) {
-				a = (a * alpha) >> 8;
-			}
-			if (a == 0) {
-				continue;
-			}
-			dest = (y + glyph->skip) * columns * 4 +
-			       (j + pad + x) * 4 + 3;
-			pixels[dest] = a;
-		}
-		j += w;
+		_vte_gl_add_quad(data,
+				 requests[i].x + pad,
+				 requests[i].y + glyph->skip,
+				 glyph->width, glyph->height,
+				 glyph->x, glyph->y,
+				 glyph->width, glyph->height,
+				 color, alpha);
 	}
-
-	glRasterPos2i(requests[0].x, requests[0].y);
-	glPixelZoom(1, -1);
-	glDrawPixels(columns, rows, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
 }
 
 static gboolean
@@ -469,6 +677,7 @@ _vte_gl_rectangle(struct _vte_draw *draw,
 	struct _vte_gl_data *data = draw->impl_data;
 
 	glXMakeCurrent(data->display, data->glwindow, data->context);
+	_vte_gl_flush(data);
 
 	glColor4us(color->red, color->green, color->blue,
 		   (alpha == VTE_DRAW_OPAQUE) ? 0xffff : (alpha << 8));
@@ -494,8 +703,28 @@ _vte_gl_fill_rectangle(struct _vte_draw *draw,
 		       gint x, gint y, gint width, gint height,
 		       GdkColor *color, guchar alpha)
 {
-	_vte_gl_rectangle(draw, GL_POLYGON, x, y, width, height,
-			  color, alpha);
+	struct _vte_gl_data *data = draw->impl_data;
+
+	_vte_gl_add_solid_quad(data, x, y, width, height, color, alpha);
+}
+
+/* Draw a mask the same way as a glyph, from the atlas. */
+static void
+_vte_gl_draw_mask(struct _vte_draw *draw, struct _vte_draw_mask *mask,
+		  gint x, gint y, GdkColor *color, guchar alpha)
+{
+	struct _vte_gl_data *data = draw->impl_data;
+	const struct _vte_gl_atlas_glyph *glyph;
+
+	glXMakeCurrent(data->display, data->glwindow, data->context);
+
+	glyph = _vte_gl_atlas_get_mask(data, mask);
+	if (glyph->width == 0) {
+		return;
+	}
+	_vte_gl_add_quad(data, x, y, glyph->width, glyph->height,
+			 glyph->x, glyph->y, glyph->width, glyph->height,
+			 color, alpha);
 }
 
 const struct _vte_draw_impl _vte_draw_gl = {
@@ -518,7 +747,8 @@ const struct _vte_draw_impl _vte_draw_gl = {
 	_vte_gl_draw_text,
 	_vte_gl_draw_has_char,
 	_vte_gl_draw_rectangle,
-	_vte_gl_fill_rectangle
+	_vte_gl_fill_rectangle,
+	_vte_gl_draw_mask
 };
 
 #endif
@@ -23,6 +23,7 @@
 #include <math.h>
 #include <gdk/gdk.h>
 #include <glib.h>
+#include "debug.h"
 #include "iso2022.h"
 #include "vtedraw.h"
 #include "vtefc.h"
@@ -44,6 +45,9 @@ static FT_Face _vte_glyph_cache_face_for_char(struct _vte_glyph_cache *cache,
 void
 _vte_glyph_free(struct _vte_glyph *glyph)
 {
+	if (glyph->bold != NULL) {
+		_vte_glyph_free(glyph->bold);
+	}
 	g_free(glyph);
 }
 
@@ -54,6 +58,171 @@ _vte_cached_glyph_free(gpointer glyph)
 		_vte_glyph_free(glyph);
 }
 
+/* A glyph outside of the table, on the LRU list. */
+struct _vte_glyph_entry {
+	struct _vte_glyph_font *font;
+	gunichar c;
+	struct _vte_glyph *glyph;	/* or NULL if the font has none */
+	gsize size;
+	GList lru;			/* data points back to the entry */
+};
+
+struct _vte_glyph_font {
+	gchar *key;			/* patterns and flags it was made with */
+	guint ref_count;
+	gpointer table[VTE_GLYPH_TABLE_SIZE];	/* or NULL if not loaded */
+	GHashTable *glyphs;		/* gunichar -> _vte_glyph_entry */
+};
+
+/* Glyphs may be looked up from several threads at once while a frame is
+ * drawn in bands, so lookups are serialized, and eviction is put off while
+ * anyone has the cache pinned. */
+static GStaticMutex _vte_glyph_mutex = G_STATIC_MUTEX_INIT;
+static guint _vte_glyph_pins;
+
+static GHashTable *_vte_glyph_fonts;	/* key -> _vte_glyph_font */
+static GQueue _vte_glyph_lru = G_QUEUE_INIT;	/* most recent first */
+static struct _vte_glyph_cache_stats _vte_glyph_stats = {
+	0, 0, 0, 0, VTE_GLYPH_CACHE_BUDGET
+};
+
+static void
+_vte_glyph_entry_free(gpointer p)
+{
+	struct _vte_glyph_entry *entry = p;
+
+	g_queue_unlink(&_vte_glyph_lru, &entry->lru);
+	_vte_glyph_stats.bytes -= entry->size;
+	if (entry->glyph != NULL) {
+		_vte_glyph_free(entry->glyph);
+	}
+	g_slice_free(struct _vte_glyph_entry, entry);
+}
+
+/* Evict the least recently used glyphs until we're within budget, keeping
+ * @keep, which was just added. */
+static void
+_vte_glyph_cache_trim(struct _vte_glyph_entry *keep)
+{
+	struct _vte_glyph_entry *entry;
+
+	if (_vte_glyph_pins > 0) {
+		return;
+	}
+	while ((_vte_glyph_stats.bytes > _vte_glyph_stats.budget) &&
+	       (_vte_glyph_lru.tail != NULL)) {
+		entry = _vte_glyph_lru.tail->data;
+		if (entry == keep) {
+			break;
+		}
+		_vte_glyph_stats.evictions++;
+		g_hash_table_remove(entry->font->glyphs,
+				    GINT_TO_POINTER(entry->c));
+	}
+}
+
+static struct _vte_glyph_font *
+_vte_glyph_font_ref(const gchar *key)
+{
+	struct _vte_glyph_font *font;
+
+	if (_vte_glyph_fonts == NULL) {
+		_vte_glyph_fonts = g_hash_table_new(g_str_hash, g_str_equal);
+	}
+	font = g_hash_table_lookup(_vte_glyph_fonts, key);
+	if (font == NULL) {
+		font = g_slice_new0(struct _vte_glyph_font);
+		font->key = g_strdup(key);
+		font->glyphs = g_hash_table_new_full(NULL, NULL, NULL,
+						     _vte_glyph_entry_free);
+		g_hash_table_insert(_vte_glyph_fonts, font->key, font);
+	}
+	font->ref_count++;
+	return font;
+}
+
+static void
+_vte_glyph_font_unref(struct _vte_glyph_font *font)
+{
+	guint i;
+
+	if (--font->ref_count > 0) {
+		return;
+	}
+	g_hash_table_remove(_vte_glyph_fonts, font->key);
+	for (i = 0; i < G_N_ELEMENTS(font->table); i++) {
+		if (font->table[i] != NULL) {
+			_vte_cached_glyph_free(font->table[i]);
+		}
+	}
+	g_hash_table_destroy(font->glyphs);
+	g_free(font->key);
+	g_slice_free(struct _vte_glyph_font, font);
+}
+
+/* Describe everything which affects how glyphs are rendered, so that caches
+ * which would render them the same way can share them. */
+static gchar *
+_vte_glyph_cache_font_key(struct _vte_glyph_cache *cache)
+{
+	GString *key;
+#if defined(HAVE_FCSTRFREE) && defined(HAVE_FCNAMEUNPARSE)
+	FcChar8 *name;
+	guint i;
+
+	key = g_string_new(NULL);
+	for (i = 0; i < cache->patterns->len; i++) {
+		name = FcNameUnparse(g_ptr_array_index(cache->patterns, i));
+		if (name != NULL) {
+			g_string_append(key, (const char *) name);
+			FcStrFree(name);
+		}
+		g_string_append_c(key, '\n');
+	}
+#else
+	/* Without a way to describe the patterns, don't share. */
+	key = g_string_new(NULL);
+	g_string_append_printf(key, "%p\n", cache);
+#endif
+	g_string_append_printf(key, "%x %x",
+			       cache->ft_load_flags, cache->ft_render_flags);
+	return g_string_free(key, FALSE);
+}
+
+/* Change the number of bytes glyphs outside of the tables may take up. */
+void
+_vte_glyph_cache_set_budget(gsize budget)
+{
+	_vte_glyph_stats.budget = budget;
+	_vte_glyph_cache_trim(NULL);
+}
+
+void
+_vte_glyph_cache_get_stats(struct _vte_glyph_cache_stats *stats)
+{
+	*stats = _vte_glyph_stats;
+}
+
+/* Keep every glyph looked up from now on until the matching unpin, so that
+ * other threads can draw with them. */
+void
+_vte_glyph_cache_pin(void)
+{
+	g_static_mutex_lock(&_vte_glyph_mutex);
+	_vte_glyph_pins++;
+	g_static_mutex_unlock(&_vte_glyph_mutex);
+}
+
+void
+_vte_glyph_cache_unpin(void)
+{
+	g_static_mutex_lock(&_vte_glyph_mutex);
+	if (--_vte_glyph_pins == 0) {
+		_vte_glyph_cache_trim(NULL);
+	}
+	g_static_mutex_unlock(&_vte_glyph_mutex);
+}
+
 struct _vte_glyph_cache *
 _vte_glyph_cache_new(void)
 {
@@ -64,7 +233,7 @@ _vte_glyph_cache_new(void)
 
 	ret->patterns = g_ptr_array_new();
 	ret->faces = NULL;
-	ret->cache = g_hash_table_new_full(NULL, NULL, NULL, _vte_cached_glyph_free);
+	ret->font = NULL;
 	ret->ft_load_flags = 0;
 	ret->ft_render_flags = 0;
 	ret->width = 0;
@@ -97,8 +266,16 @@ _vte_glyph_cache_free(struct _vte_glyph_cache *cache)
 	g_list_foreach(cache->faces, (GFunc)FT_Done_Face, NULL);
 	g_list_free(cache->faces);
 
-	/* Free the glyph tree. */
-	g_hash_table_destroy(cache->cache);
+	/* Let go of the glyphs. */
+	if (cache->font != NULL) {
+		_vte_glyph_font_unref(cache->font);
+	}
+	_vte_debug_print(VTE_DEBUG_MISC,
+			"Glyph cache: %lu hits, %lu misses, %lu evictions, "
+			"%ld bytes.\n",
+			_vte_glyph_stats.hits, _vte_glyph_stats.misses,
+			_vte_glyph_stats.evictions,
+			(long) _vte_glyph_stats.bytes);
 
 	/* Close the FT library. */
 	if (cache->ft_library) {
@@ -126,6 +303,7 @@ _vte_glyph_cache_set_font_description(GtkWidget *widget,
 	FcPattern *pattern;
 	GPtrArray *patterns;
 	FT_Face face, prev_face;
+	gchar *key;
 	gunichar double_wide_characters[] = {VTE_DRAW_DOUBLE_WIDE_CHARACTERS};
 
 	g_return_if_fail(cache != NULL);
@@ -156,9 +334,11 @@ _vte_glyph_cache_set_font_description(GtkWidget *widget,
 	g_list_free(cache->faces);
 	cache->faces = NULL;
 
-	/* Clear the glyph tree. */
-	g_hash_table_destroy(cache->cache);
-	cache->cache = g_hash_table_new_full(NULL, NULL, NULL, _vte_cached_glyph_free);
+	/* Let go of the old font's glyphs. */
+	if (cache->font != NULL) {
+		_vte_glyph_font_unref(cache->font);
+		cache->font = NULL;
+	}
 
 	/* Clear the load and render flags. */
 	cache->ft_load_flags = 0;
@@ -281,6 +461,11 @@ _vte_glyph_cache_set_font_description(GtkWidget *widget,
 		}
 	}
 
+	/* Share glyphs with anyone else rendering the same way. */
+	key = _vte_glyph_cache_font_key(cache);
+	cache->font = _vte_glyph_font_ref(key);
+	g_free(key);
+
 	/* Calculate average cell size using the first face. */
 	cache->width = 0;
 	cache->height = 0;
@@ -383,21 +568,34 @@ gboolean
 _vte_glyph_cache_has_char(struct _vte_glyph_cache *cache, gunichar c)
 {
 	GList *iter;
-	gpointer p;
-
-	if ((p = g_hash_table_lookup(cache->cache, GINT_TO_POINTER(c))) != NULL) {
-		if (p == INVALID_GLYPH) {
-			return FALSE;
+	struct _vte_glyph_entry *entry;
+	gboolean ret = FALSE;
+
+	g_static_mutex_lock(&_vte_glyph_mutex);
+	if (cache->font != NULL) {
+		if (c < VTE_GLYPH_TABLE_SIZE) {
+			if (cache->font->table[c] == INVALID_GLYPH) {
+				goto out;
+			}
+		} else {
+			entry = g_hash_table_lookup(cache->font->glyphs,
+						    GINT_TO_POINTER(c));
+			if ((entry != NULL) && (entry->glyph == NULL)) {
+				goto out;
+			}
 		}
 	}
 
 	for (iter = cache->faces; iter != NULL; iter = g_list_next(iter)) {
 		if (FT_Get_Char_Index((FT_Face) iter->data, c) != 0) {
-			return TRUE;
+			ret = TRUE;
+			break;
 		}
 	}
+out:
+	g_static_mutex_unlock(&_vte_glyph_mutex);
 
-	return FALSE;
+	return ret;
 }
 
 static gunichar
@@ -481,8 +679,6 @@ _vte_glyph_get_uncached(struct _vte_glyph_cache *cache, gunichar c)
 
 	/* Bail if we weren't able to load the glyph. */
 	if (face == NULL) {
-		g_hash_table_insert(cache->cache, GINT_TO_POINTER(c),
-			      INVALID_GLYPH);
 		return NULL;
 	}
 
@@ -580,36 +776,199 @@ _vte_glyph_get_uncached(struct _vte_glyph_cache *cache, gunichar c)
 	return glyph;
 }
 
-const struct _vte_glyph *
-_vte_glyph_get(struct _vte_glyph_cache *cache, gunichar c)
+/* Build a glyph which looks like @glyph drawn twice, the second time one
+ * pixel further right: each channel's coverage is that of the union of the
+ * two. */
+static struct _vte_glyph *
+_vte_glyph_embolden(const struct _vte_glyph *glyph)
 {
-	struct _vte_glyph *glyph = NULL;
+	struct _vte_glyph *bold;
+	glong row, col, width, bpp, i, ioffset, ooffset;
+	guint a, b;
+
+	bpp = glyph->bytes_per_pixel;
+	width = glyph->width + 1;
+	bold = g_malloc0(sizeof(struct _vte_glyph) +
+			 width * glyph->height * bpp);
+	bold->width = width;
+	bold->height = glyph->height;
+	bold->skip = glyph->skip;
+	bold->bytes_per_pixel = bpp;
+
+	for (row = 0; row < glyph->height; row++) {
+		for (col = 0; col < width; col++) {
+			ooffset = (row * width + col) * bpp;
+			ioffset = (row * glyph->width + col) * bpp;
+			for (i = 0; i < bpp; i++) {
+				a = (col < glyph->width) ?
+				    glyph->bytes[ioffset + i] : 0;
+				b = (col > 0) ?
+				    glyph->bytes[ioffset - bpp + i] : 0;
+				bold->bytes[ooffset + i] = 255 -
+					((255 - a) * (255 - b) + 127) / 255;
+			}
+		}
+	}
+
+	return bold;
+}
+
+/* Return @glyph's bold copy, making it if need be.  Its size is charged to
+ * @entry, if the glyph is in the hash rather than the table. */
+static const struct _vte_glyph *
+_vte_glyph_get_bold_locked(struct _vte_glyph *glyph,
+			   struct _vte_glyph_entry *entry)
+{
+	gsize size;
+
+	if (glyph == NULL) {
+		return NULL;
+	}
+	if (glyph->bold == NULL) {
+		glyph->bold = _vte_glyph_embolden(glyph);
+		if (entry != NULL) {
+			size = sizeof(*glyph->bold) +
+			       glyph->bold->width * glyph->bold->height *
+			       glyph->bold->bytes_per_pixel;
+			entry->size += size;
+			_vte_glyph_stats.bytes += size;
+			_vte_glyph_cache_trim(entry);
+		}
+	}
+	return glyph->bold;
+}
+
+static const struct _vte_glyph *
+_vte_glyph_get_locked(struct _vte_glyph_cache *cache, gunichar c,
+		      gboolean bold)
+{
+	struct _vte_glyph_font *font;
+	struct _vte_glyph_entry *entry;
+	struct _vte_glyph *glyph;
 	gpointer p;
 
-	g_return_val_if_fail(cache != NULL, NULL);
+	font = cache->font;
+	if (font == NULL) {
+		return NULL;
+	}
 
-	/* See if we already have a glyph for this character. */
-	if ((p = g_hash_table_lookup(cache->cache, GINT_TO_POINTER(c))) != NULL) {
-		if (p == INVALID_GLYPH) {
-			return NULL;
+	/* Common characters are looked up directly. */
+	if (c < VTE_GLYPH_TABLE_SIZE) {
+		p = font->table[c];
+		if (p != NULL) {
+			_vte_glyph_stats.hits++;
+			glyph = (p == INVALID_GLYPH) ? NULL : p;
 		} else {
-			return p;
+			_vte_glyph_stats.misses++;
+			glyph = _vte_glyph_get_uncached(cache, c);
+			font->table[c] = (glyph != NULL) ? (gpointer) glyph :
+							   INVALID_GLYPH;
 		}
+		return bold ? _vte_glyph_get_bold_locked(glyph, NULL) : glyph;
 	}
 
-	/* Generate the glyph. */
+	/* See if we already have a glyph for this character, and if so,
+	 * note that it's been used. */
+	entry = g_hash_table_lookup(font->glyphs, GINT_TO_POINTER(c));
+	if (entry != NULL) {
+		_vte_glyph_stats.hits++;
+		g_queue_unlink(&_vte_glyph_lru, &entry->lru);
+		g_queue_push_head_link(&_vte_glyph_lru, &entry->lru);
+		return bold ? _vte_glyph_get_bold_locked(entry->glyph, entry) :
+			      entry->glyph;
+	}
+
+	/* Generate the glyph, and remember it even if there isn't one. */
+	_vte_glyph_stats.misses++;
 	glyph = _vte_glyph_get_uncached(cache, c);
+	entry = g_slice_new0(struct _vte_glyph_entry);
+	entry->font = font;
+	entry->c = c;
+	entry->glyph = glyph;
+	entry->size = sizeof(*entry);
+	if (glyph != NULL) {
+		entry->size += sizeof(*glyph) +
+			       glyph->width * glyph->height *
+			       glyph->bytes_per_pixel;
+	}
+	entry->lru.data = entry;
+	g_hash_table_insert(font->glyphs, GINT_TO_POINTER(c), entry);
+	g_queue_push_head_link(&_vte_glyph_lru, &entry->lru);
+	_vte_glyph_stats.bytes += entry->size;
+	_vte_glyph_cache_trim(entry);
 
-	/* Bail if we weren't able to load the glyph. */
-	if (glyph == NULL) {
-		g_hash_table_insert(cache->cache, GINT_TO_POINTER(c),
-			      INVALID_GLYPH);
-		return NULL;
+	return bold ? _vte_glyph_get_bold_locked(glyph, entry) : glyph;
+}
+
+const struct _vte_glyph *
+_vte_glyph_get(struct _vte_glyph_cache *cache, gunichar c)
+{
+	const struct _vte_glyph *glyph;
+
+	g_return_val_if_fail(cache != NULL, NULL);
+
+	g_static_mutex_lock(&_vte_glyph_mutex);
+	glyph = _vte_glyph_get_locked(cache, c, FALSE);
+	g_static_mutex_unlock(&_vte_glyph_mutex);
+	return glyph;
+}
+
+/* The emboldened copy of the glyph for @c, kept and accounted for along with
+ * the glyph itself. */
+const struct _vte_glyph *
+_vte_glyph_get_bold(struct _vte_glyph_cache *cache, gunichar c)
+{
+	const struct _vte_glyph *glyph;
+
+	g_return_val_if_fail(cache != NULL, NULL);
+
+	g_static_mutex_lock(&_vte_glyph_mutex);
+	glyph = _vte_glyph_get_locked(cache, c, TRUE);
+	g_static_mutex_unlock(&_vte_glyph_mutex);
+	return glyph;
+}
+
+/* Draw a one-pixel-high line, clipped to the buffer. */
+static void
+_vte_glyph_draw_line(struct _vte_rgb_buffer *buffer,
+		     gint x, gint y, gint width,
+		     guchar r, guchar g, guchar b)
+{
+	guchar *pixels;
+	gint col;
+
+	if ((y < 0) || (y >= buffer->height)) {
+		return;
 	}
+	width = MIN(width, buffer->width - x);
+	pixels = buffer->pixels + y * buffer->stride + x * 3;
+	for (col = 0; col < width; col++) {
+		pixels[col * 3 + 0] = r;
+		pixels[col * 3 + 1] = g;
+		pixels[col * 3 + 2] = b;
+	}
+}
 
-	/* Cache it. */
-	g_hash_table_insert(cache->cache, GINT_TO_POINTER(c), glyph);
+/* Find the glyph which _vte_glyph_draw() would draw for @c with @flags,
+ * falling back to a look-alike character if the font lacks @c. */
+const struct _vte_glyph *
+_vte_glyph_resolve(struct _vte_glyph_cache *cache, gunichar c,
+		   enum vte_glyph_flags flags)
+{
+	const struct _vte_glyph *(*get)(struct _vte_glyph_cache *, gunichar);
+	const struct _vte_glyph *glyph;
+	gunichar cc;
 
+	/* Bold text is drawn from a copy of the glyph smeared one pixel to
+	 * the right, which the cache keeps alongside the glyph. */
+	get = (flags & vte_glyph_bold) ? _vte_glyph_get_bold : _vte_glyph_get;
+	glyph = get(cache, c);
+	if (glyph == NULL) {
+		cc = _vte_glyph_remap_char(c);
+		if (cc != c) {
+			glyph = get(cache, cc);
+		}
+	}
 	return glyph;
 }
 
@@ -621,23 +980,37 @@ _vte_glyph_draw(struct _vte_glyph_cache *cache,
 		struct _vte_rgb_buffer *buffer)
 {
 	const struct _vte_glyph *glyph;
-	gint col, row, erow, ioffset, ooffset, icol, ocol, ecol;
-	gint strikethrough, underline, underline2;
-	gint32 r, g, b, ar, ag, ab;
-	guchar *pixels;
 
 	if (cache == NULL) {
 		return;
 	}
-	glyph = _vte_glyph_get(cache, c);
-	if (glyph == NULL) {
-		gunichar cc = _vte_glyph_remap_char(c);
-		if(cc != c)
-			glyph = _vte_glyph_get(cache, cc);
-		if (glyph == NULL) {
-			return;
-		}
+	_vte_glyph_cache_pin();
+	glyph = _vte_glyph_resolve(cache, c, flags);
+	if (glyph != NULL) {
+		_vte_glyph_draw_glyph(cache, glyph, color, x, y, columns,
+				      flags, buffer);
 	}
+	_vte_glyph_cache_unpin();
+}
+
+/* Draw a glyph already found with _vte_glyph_resolve() using the same
+ * @flags.  The cache isn't locked, so the caller must still hold the pin it
+ * took before looking the glyph up. */
+void
+_vte_glyph_draw_glyph(struct _vte_glyph_cache *cache,
+		      const struct _vte_glyph *glyph, GdkColor *color,
+		      gint x, gint y, gint columns,
+		      enum vte_glyph_flags flags,
+		      struct _vte_rgb_buffer *buffer)
+{
+	gint row, erow, ioffset, ooffset, icol, ocol, ecol, width;
+	gint strikethrough, underline, underline2;
+	gint32 r, g, b;
+	guchar *pixels;
+
+	/* Without a pin the glyph may already have been evicted and freed.
+	 * The count can't drop to zero under us while our caller holds one. */
+	g_return_if_fail(g_atomic_int_get((gint *) &_vte_glyph_pins) > 0);
 
 	if (x > buffer->width) {
 		return;
@@ -661,124 +1034,57 @@ _vte_glyph_draw(struct _vte_glyph_cache *cache,
 		underline2 = MAX(0, cache->height - 1);
 	}
 
-	icol = MAX(0, (glyph->width - (columns * cache->width)) >> 1);
-	ocol = MAX(0, ((columns * cache->width) - glyph->width) >> 1);
-
-_vte_glyph_draw_loop:
+	/* A bold copy goes where the plain glyph would have. */
+	width = glyph->width;
+	if (flags & vte_glyph_bold) {
+		width--;
+	}
+	icol = MAX(0, (width - (columns * cache->width)) >> 1);
+	ocol = MAX(0, ((columns * cache->width) - width) >> 1);
 
+	/* Glyph pixels are laid out the same way as the buffer's, so whole
+	 * rows can be blended at once. */
 	erow = MIN(cache->height, glyph->skip + glyph->height);
 	erow = MIN(erow, buffer->height - y);
-	for (row = glyph->skip;
-	     row < erow;
+	ecol = MIN(cache->width * columns, glyph->width - icol);
+	ecol = MIN(ecol, buffer->width - (x + ocol));
+	for (row = MAX(glyph->skip, -y);
+	     (row < erow) && (ecol > 0);
 	     row++) {
 		ooffset = (y + row) * buffer->stride +
 			  ((x + ocol) * 3);
 		ioffset = (((row - glyph->skip) * glyph->width) + icol) *
 			  DEFAULT_BYTES_PER_PIXEL;
-		ecol = MIN(cache->width * columns, glyph->width);
-		ecol = MIN(ecol, buffer->width - x);
-		for (col = 0; col < ecol; col++) {
-			ar = glyph->bytes[ioffset + 0];
-			ag = glyph->bytes[ioffset + 1];
-			ab = glyph->bytes[ioffset + 2];
-			ioffset += DEFAULT_BYTES_PER_PIXEL;
-
-			if (flags & vte_glyph_dim) {
-				ar = ar >> 1;
-				ag = ag >> 1;
-				ab = ab >> 1;
-			}
-
-			switch (ar) {
-			case 0:
-				break;
-			case 0xff:
-				pixels[ooffset + 0] = r;
-				break;
-			default:
-				pixels[ooffset + 0] +=
-					(((r - pixels[ooffset + 0]) * ar) >> 8);
-				break;
-			}
-
-			switch (ag) {
-			case 0:
-				break;
-			case 0xff:
-				pixels[ooffset + 1] = g;
-				break;
-			default:
-				pixels[ooffset + 1] +=
-					(((g - pixels[ooffset + 1]) * ag) >> 8);
-				break;
-			}
-
-			switch (ab) {
-			case 0:
-				break;
-			case 0xff:
-				pixels[ooffset + 2] = b;
-				break;
-			default:
-				pixels[ooffset + 2] +=
-					(((b - pixels[ooffset + 2]) * ab) >> 8);
-				break;
-			}
-
-			ooffset += 3;
-		}
+		_vte_rgb_blend_row(pixels + ooffset, glyph->bytes + ioffset,
+				   ecol, r, g, b,
+				   (flags & vte_glyph_dim) ? 1 : 0);
 	}
 
-	if (flags &
-	    (vte_glyph_underline | vte_glyph_underline2 |
-	     vte_glyph_strikethrough | vte_glyph_boxed)) {
-		for (col = 0; col < cache->width; col++) {
-			if ((flags & vte_glyph_strikethrough) &&
-			    (strikethrough >= 0) &&
-			    (strikethrough < cache->height)) {
-				ooffset = (y + strikethrough) * buffer->stride +
-					  (x + col) * 3;
-				pixels[ooffset + 0] = r;
-				pixels[ooffset + 1] = g;
-				pixels[ooffset + 2] = b;
-			}
-			if ((flags & vte_glyph_underline) &&
-			    (underline >= 0) &&
-			    (underline < cache->height)) {
-				ooffset = (y + underline) * buffer->stride +
-					  (x + col) * 3;
-				pixels[ooffset + 0] = r;
-				pixels[ooffset + 1] = g;
-				pixels[ooffset + 2] = b;
-			}
-			if ((flags & vte_glyph_underline2) &&
-			    (underline2 >= 0) &&
-			    (underline2 < cache->height)) {
-				ooffset = (y + underline2) * buffer->stride +
-					  (x + col) * 3;
-				pixels[ooffset + 0] = r;
-				pixels[ooffset + 1] = g;
-				pixels[ooffset + 2] = b;
-			}
-			if (flags & vte_glyph_boxed) {
-				ooffset = y * buffer->stride + (x + col) * 3;
-				pixels[ooffset + 0] = r;
-				pixels[ooffset + 1] = g;
-				pixels[ooffset + 2] = b;
-				ooffset = (y + cache->height - 1) * buffer->stride +
-					  (x + col) * 3;
-				pixels[ooffset + 0] = r;
-				pixels[ooffset + 1] = g;
-				pixels[ooffset + 2] = b;
-			}
-		}
+	if ((flags & vte_glyph_strikethrough) &&
+	    (strikethrough >= 0) &&
+	    (strikethrough < cache->height)) {
+		_vte_glyph_draw_line(buffer, x, y + strikethrough,
+				     cache->width, r, g, b);
 	}
-
-	if (flags & vte_glyph_bold) {
-		flags &= ~vte_glyph_bold;
-		pixels += 3;
-		goto _vte_glyph_draw_loop;
+	if ((flags & vte_glyph_underline) &&
+	    (underline >= 0) &&
+	    (underline < cache->height)) {
+		_vte_glyph_draw_line(buffer, x, y + underline,
+				     cache->width, r, g, b);
+	}
+	if ((flags & vte_glyph_underline2) &&
+	    (underline2 >= 0) &&
+	    (underline2 < cache->height)) {
+		_vte_glyph_draw_line(buffer, x, y + underline2,
+				     cache->width, r, g, b);
 	}
+	if (flags & vte_glyph_boxed) {
+		_vte_glyph_draw_line(buffer, x, y,
+				     cache->width, r, g, b);
+		_vte_glyph_draw_line(buffer, x, y + cache->height - 1,
+				     cache->width, r, g, b);
+	}
+
 }
 
 void
@@ -49,14 +49,34 @@ struct _vte_glyph {
 	glong width;
 	glong height;
 	glong skip;
+	struct _vte_glyph *bold;	/* emboldened copy, made by the cache
+					   on first use */
 	guchar bytes_per_pixel;
 	guchar bytes[1];
 };
 
+/* Rendered glyphs are shared by every cache using the same font, whichever
+ * terminal it belongs to.  Those for U+0000 to U+024F live in a table and
+ * are kept for as long as the font is in use; the rest are kept in a hash
+ * and, across all fonts, evicted least recently used first once they take
+ * up more than the budget.  A glyph returned by _vte_glyph_get() or
+ * _vte_glyph_resolve() may be evicted by any later lookup, from any thread,
+ * so callers must hold a pin (_vte_glyph_cache_pin()) from before the lookup
+ * until they are done with the glyph.  _vte_glyph_draw_glyph() checks. */
+#define VTE_GLYPH_TABLE_SIZE	0x250
+#define VTE_GLYPH_CACHE_BUDGET	(4 * 1024 * 1024)
+
+struct _vte_glyph_font;
+
+struct _vte_glyph_cache_stats {
+	gulong hits, misses, evictions;
+	gsize bytes, budget;
+};
+
 struct _vte_glyph_cache {
 	GPtrArray *patterns;
 	GList *faces;
-	GHashTable *cache;
+	struct _vte_glyph_font *font;
 	gint ft_load_flags;
 	gint ft_render_flags;
 	glong width, height, ascent;
@@ -65,6 +85,10 @@ struct _vte_glyph_cache {
 
 struct _vte_glyph_cache *_vte_glyph_cache_new(void);
 void _vte_glyph_cache_free(struct _vte_glyph_cache *cache);
+void _vte_glyph_cache_set_budget(gsize budget);
+void _vte_glyph_cache_get_stats(struct _vte_glyph_cache_stats *stats);
+void _vte_glyph_cache_pin(void);
+void _vte_glyph_cache_unpin(void);
 const FcPattern *_vte_glyph_cache_get_pattern(struct _vte_glyph_cache *cache);
 void _vte_glyph_cache_set_font_description(GtkWidget *widget, FcConfig *config,
 					   struct _vte_glyph_cache *cache,
@@ -75,14 +99,24 @@ void _vte_glyph_cache_set_font_description(GtkWidget *widget, FcConfig *config,
 gboolean _vte_glyph_cache_has_char(struct _vte_glyph_cache *cache, gunichar c);
 const struct _vte_glyph *_vte_glyph_get(struct _vte_glyph_cache *cache,
 					gunichar c);
+const struct _vte_glyph *_vte_glyph_get_bold(struct _vte_glyph_cache *cache,
+					     gunichar c);
 struct _vte_glyph *_vte_glyph_get_uncached(struct _vte_glyph_cache *cache,
 					   gunichar c);
 void _vte_glyph_free(struct _vte_glyph *glyph);
+const struct _vte_glyph *_vte_glyph_resolve(struct _vte_glyph_cache *cache,
+					    gunichar c,
+					    enum vte_glyph_flags flags);
 void _vte_glyph_draw(struct _vte_glyph_cache *cache,
 		     gunichar c, GdkColor *color,
 		     gint x, gint y, gint columns,
 		     enum vte_glyph_flags flags,
 		     struct _vte_rgb_buffer *buffer);
+void _vte_glyph_draw_glyph(struct _vte_glyph_cache *cache,
+			   const struct _vte_glyph *glyph, GdkColor *color,
+			   gint x, gint y, gint columns,
+			   enum vte_glyph_flags flags,
+			   struct _vte_rgb_buffer *buffer);
 void _vte_glyph_draw_string(struct _vte_glyph_cache *cache,
 			    const char *s, GdkColor *color,
 			    gint x, gint y,
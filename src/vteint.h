@@ -30,6 +30,9 @@ void _vte_terminal_get_start_selection(VteTerminal *terminal, long *x, long *y);
 void _vte_terminal_get_end_selection(VteTerminal *terminal, long *x, long *y);
 void _vte_terminal_select_text(VteTerminal *terminal, long start_x, long start_y, long end_x, long end_y, int start_offset, int end_offset);
 void _vte_terminal_remove_selection(VteTerminal *terminal);
+glong _vte_terminal_get_view_start(VteTerminal *terminal);
+gboolean _vte_terminal_take_text_damage(VteTerminal *terminal, glong *start, glong *end);
+char *_vte_terminal_get_text_rows(VteTerminal *terminal, glong start_row, glong end_row, GArray *attributes);
 
 G_END_DECLS
 
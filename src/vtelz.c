@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2009 Thiago Arrais
+ *
+ * This is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Library General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <config.h>
+#include <string.h>
+#include <glib.h>
+#include "vtelz.h"
+
+/* Each sequence is a token byte (literal count in the high nibble, match
+ * length minus VTE_LZ_MIN_MATCH in the low one), optional extra literal
+ * length bytes, the literals, a little-endian 16-bit offset and optional
+ * extra match length bytes.  The final sequence carries literals only. */
+#define VTE_LZ_MIN_MATCH	4
+#define VTE_LZ_HASH_LOG		12
+#define VTE_LZ_MAX_OFFSET	0xffff
+#define VTE_LZ_LAST_LITERALS	5
+#define VTE_LZ_MATCH_LIMIT	12
+
+static inline guint32
+_vte_lz_read32(const guchar *p)
+{
+	guint32 v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline guint
+_vte_lz_hash(guint32 v)
+{
+	return (v * 2654435761U) >> (32 - VTE_LZ_HASH_LOG);
+}
+
+static guchar *
+_vte_lz_put_length(guchar *op, gsize length)
+{
+	while (length >= 255) {
+		*op++ = 255;
+		length -= 255;
+	}
+	*op++ = length;
+	return op;
+}
+
+/**
+ * _vte_lz_compress_bound:
+ * @length: the size of the input
+ *
+ * Returns: the largest output _vte_lz_compress() can produce for @length
+ * bytes of input.
+ */
+gsize
+_vte_lz_compress_bound(gsize length)
+{
+	return length + length / 255 + 16;
+}
+
+/**
+ * _vte_lz_compress:
+ * @src: the data to compress
+ * @length: the number of bytes at @src
+ * @dst: a buffer of at least _vte_lz_compress_bound(@length) bytes
+ *
+ * Compresses @src into @dst using a single greedy pass with a small hash
+ * table of recently seen four byte sequences.
+ *
+ * Returns: the number of bytes written to @dst.
+ */
+gsize
+_vte_lz_compress(const guchar *src, gsize length, guchar *dst)
+{
+	guint32 table[1 << VTE_LZ_HASH_LOG];
+	const guchar *ip = src, *anchor = src, *end = src + length;
+	const guchar *limit, *ref, *start;
+	guchar *op = dst, *token;
+	gsize literals, match;
+	guint32 seq;
+	guint h;
+
+	memset(table, 0, sizeof(table));
+	limit = length > VTE_LZ_MATCH_LIMIT ? end - VTE_LZ_MATCH_LIMIT : src;
+
+	while (ip < limit) {
+		seq = _vte_lz_read32(ip);
+		h = _vte_lz_hash(seq);
+		ref = src + table[h];
+		table[h] = ip - src;
+		if (ref >= ip || ip - ref > VTE_LZ_MAX_OFFSET ||
+		    _vte_lz_read32(ref) != seq) {
+			ip++;
+			continue;
+		}
+
+		/* Extend the match as far as the tail allows. */
+		start = ip;
+		ip += VTE_LZ_MIN_MATCH;
+		ref += VTE_LZ_MIN_MATCH;
+		while (ip < end - VTE_LZ_LAST_LITERALS && *ip == *ref) {
+			ip++;
+			ref++;
+		}
+
+		literals = start - anchor;
+		match = ip - start - VTE_LZ_MIN_MATCH;
+		token = op++;
+		*token = (MIN(literals, 15) << 4) | MIN(match, 15);
+		if (literals >= 15) {
+			op = _vte_lz_put_length(op, literals - 15);
+		}
+		memcpy(op, anchor, literals);
+		op += literals;
+		*op++ = (ip - ref) & 0xff;
+		*op++ = (ip - ref) >> 8;
+		if (match >= 15) {
+			op = _vte_lz_put_length(op, match - 15);
+		}
+		anchor = ip;
+	}
+
+	literals = end - anchor;
+	token = op++;
+	*token = MIN(literals, 15) << 4;
+	if (literals >= 15) {
+		op = _vte_lz_put_length(op, literals - 15);
+	}
+	memcpy(op, anchor, literals);
+	op += literals;
+
+	return op - dst;
+}
+
+/**
+ * _vte_lz_decompress:
+ * @src: data produced by _vte_lz_compress()
+ * @length: the number of bytes at @src
+ * @dst: the output buffer
+ * @capacity: the size of @dst
+ *
+ * Expands @src into @dst, checking every length and offset against the
+ * buffers so that corrupt input can't write out of bounds.
+ *
+ * Returns: the number of bytes written, or -1 if @src is malformed.
+ */
+gssize
+_vte_lz_decompress(const guchar *src, gsize length,
+		   guchar *dst, gsize capacity)
+{
+	const guchar *ip = src, *iend = src + length, *ref;
+	guchar *op = dst, *oend = dst + capacity;
+	gsize literals, match, offset;
+	guint token, b;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		literals = token >> 4;
+		if (literals == 15) {
+			do {
+				if (ip >= iend) {
+					return -1;
+				}
+				b = *ip++;
+				literals += b;
+			} while (b == 255);
+		}
+		if (literals > (gsize) (iend - ip) ||
+		    literals > (gsize) (oend - op)) {
+			return -1;
+		}
+		memcpy(op, ip, literals);
+		op += literals;
+		ip += literals;
+
+		/* The last sequence has no match part. */
+		if (ip >= iend) {
+			break;
+		}
+
+		if (iend - ip < 2) {
+			return -1;
+		}
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (gsize) (op - dst)) {
+			return -1;
+		}
+
+		match = token & 15;
+		if (match == 15) {
+			do {
+				if (ip >= iend) {
+					return -1;
+				}
+				b = *ip++;
+				match += b;
+			} while (b == 255);
+		}
+		match += VTE_LZ_MIN_MATCH;
+		if (match > (gsize) (oend - op)) {
+			return -1;
+		}
+
+		/* Matches may overlap their own output, so copy bytewise. */
+		ref = op - offset;
+		while (match--) {
+			*op++ = *ref++;
+		}
+	}
+
+	return op - dst;
+}
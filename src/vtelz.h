@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2009 Thiago Arrais
+ *
+ * This is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Library General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* The interfaces in this file are subject to change at any time. */
+
+#ifndef vte_vtelz_h_included
+#define vte_vtelz_h_included
+
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* A small LZ77 block codec (LZ4 block layout) used to keep cold scrollback
+ * compressed in memory.  It trades ratio for speed: both directions run at
+ * memory bandwidth, so thawing a block of history on demand is cheap. */
+
+gsize _vte_lz_compress_bound(gsize length);
+gsize _vte_lz_compress(const guchar *src, gsize length, guchar *dst);
+gssize _vte_lz_decompress(const guchar *src, gsize length,
+			  guchar *dst, gsize capacity);
+
+G_END_DECLS
+
+#endif
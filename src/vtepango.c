@@ -35,6 +35,23 @@
 #define howmany(x, y) (((x) + ((y) - 1)) / (y))
 #endif
 
+/* The number of shaped runs we keep around. */
+#define VTE_PANGO_RUN_CACHE_SIZE 256
+
+/* A piece of a run which Pango shaped with a single font. */
+struct _vte_pango_segment {
+	PangoFont *font;
+	PangoGlyphString *glyphs;
+};
+
+/* A run of text, shaped and laid out on the cell grid, ready to be drawn
+ * at the position of its first cell. */
+struct _vte_pango_run {
+	gchar *key;			/* text and widths of its cells */
+	GArray *segments;		/* _vte_pango_segment */
+	GList lru;			/* data points back to the run */
+};
+
 struct _vte_pango_data
 {
 	GdkPixmap *pixmap;
@@ -44,8 +61,28 @@ struct _vte_pango_data
 	PangoLayout *layout;
 	GdkGC *gc;
 	gint width, height, ascent;
+	GHashTable *runs;		/* key -> _vte_pango_run */
+	GQueue runs_lru;		/* most recently drawn first */
 };
 
+static void
+_vte_pango_run_free(gpointer p)
+{
+	struct _vte_pango_run *run = p;
+	struct _vte_pango_segment *segment;
+	guint i;
+
+	for (i = 0; i < run->segments->len; i++) {
+		segment = &g_array_index(run->segments,
+					 struct _vte_pango_segment, i);
+		g_object_unref(segment->font);
+		pango_glyph_string_free(segment->glyphs);
+	}
+	g_array_free(run->segments, TRUE);
+	g_free(run->key);
+	g_slice_free(struct _vte_pango_run, run);
+}
+
 static void
 _vte_pango_create(struct _vte_draw *draw, GtkWidget *widget)
 {
@@ -59,6 +96,9 @@ _vte_pango_create(struct _vte_draw *draw, GtkWidget *widget)
 	data->font = NULL;
 	data->layout = NULL;
 	data->gc = NULL;
+	data->runs = g_hash_table_new_full(g_str_hash, g_str_equal,
+					   NULL, _vte_pango_run_free);
+	g_queue_init(&data->runs_lru);
 }
 
 static void
@@ -78,6 +118,7 @@ _vte_pango_destroy(struct _vte_draw *draw)
 	if (data->gc != NULL) {
 		g_object_unref(data->gc);
 	}
+	g_hash_table_destroy(data->runs);
 
 	g_slice_free (struct _vte_pango_data, draw->impl_data);
 }
@@ -226,6 +267,10 @@ _vte_pango_set_text_font(struct _vte_draw *draw,
 	data->font = pango_font_description_copy(fontdesc);
 	pango_layout_set_font_description(layout, data->font);
 
+	/* Runs shaped with the old font are no good any more. */
+	g_hash_table_remove_all(data->runs);
+	g_queue_init(&data->runs_lru);
+
 	/* Estimate for ASCII characters. */
 	pango_layout_set_text(layout,
 			      VTE_DRAW_SINGLE_WIDE_CHARACTERS,
@@ -284,15 +329,138 @@ _vte_pango_get_text_metrics(struct _vte_draw *draw,
 	*ascent = data->ascent;
 }
 
+/* Shape a run of text and lay its glyphs out on the cell grid: each cluster
+ * starts at the left edge of its cell, with any further glyphs in it keeping
+ * their shaped positions relative to the first.  Glyph widths are zeroed and
+ * the position folded into the offsets, which keeps this simple whichever
+ * direction the text runs in. */
+static struct _vte_pango_run *
+_vte_pango_shape_run(struct _vte_draw *draw,
+		     const gchar *text, gsize length, const gint *cells)
+{
+	struct _vte_pango_data *data = (struct _vte_pango_data*) draw->impl_data;
+	struct _vte_pango_run *run;
+	struct _vte_pango_segment segment;
+	PangoAttrList *attrs;
+	PangoAttribute *attr;
+	PangoItem *item;
+	PangoGlyphInfo *info;
+	GList *items, *iter;
+	gint g, cluster, pen, cluster_pen, cell;
+
+	attrs = pango_attr_list_new();
+	attr = pango_attr_font_desc_new(data->font);
+	attr->start_index = 0;
+	attr->end_index = length;
+	pango_attr_list_insert(attrs, attr);
+	items = pango_itemize(gtk_widget_get_pango_context(draw->widget),
+			      text, 0, length, attrs, NULL);
+	pango_attr_list_unref(attrs);
+
+	run = g_slice_new(struct _vte_pango_run);
+	run->segments = g_array_new(FALSE, FALSE,
+				    sizeof(struct _vte_pango_segment));
+	run->lru.prev = run->lru.next = NULL;
+	run->lru.data = run;
+
+	for (iter = items; iter != NULL; iter = g_list_next(iter)) {
+		item = iter->data;
+		segment.font = g_object_ref(item->analysis.font);
+		segment.glyphs = pango_glyph_string_new();
+		pango_shape(text + item->offset, item->length,
+			    &item->analysis, segment.glyphs);
+
+		pen = cluster_pen = cell = 0;
+		cluster = -1;
+		for (g = 0; g < segment.glyphs->num_glyphs; g++) {
+			info = &segment.glyphs->glyphs[g];
+			if (segment.glyphs->log_clusters[g] != cluster) {
+				cluster = segment.glyphs->log_clusters[g];
+				cluster_pen = pen;
+				cell = cells[item->offset + cluster];
+			}
+			pen += info->geometry.width;
+			info->geometry.x_offset += cell +
+				(pen - info->geometry.width - cluster_pen);
+			info->geometry.width = 0;
+		}
+		g_array_append_val(run->segments, segment);
+		pango_item_free(item);
+	}
+	g_list_free(items);
+
+	return run;
+}
+
+/* Draw a run of characters in consecutive cells, shaping it only if we
+ * haven't done so recently. */
+static void
+_vte_pango_draw_run(struct _vte_draw *draw,
+		    struct _vte_draw_text_request *requests, gsize n_requests)
+{
+	struct _vte_pango_data *data = (struct _vte_pango_data*) draw->impl_data;
+	struct _vte_pango_run *run, *evict;
+	struct _vte_pango_segment *segment;
+	GString *text;
+	GArray *cells;
+	gint x, i;
+	gsize j, start;
+	guint k;
+
+	text = g_string_sized_new(n_requests * 2 + 1);
+	cells = g_array_sized_new(FALSE, FALSE, sizeof(gint),
+				  n_requests * VTE_UTF8_BPC);
+	x = 0;
+	for (j = 0; j < n_requests; j++) {
+		start = text->len;
+		g_string_append_unichar(text, requests[j].c ? requests[j].c : ' ');
+		for (i = start; i < (gint) text->len; i++) {
+			g_array_append_val(cells, x);
+		}
+		x += requests[j].columns * data->width * PANGO_SCALE;
+	}
+	/* The key is the text, then a byte for the width of each cell. */
+	start = text->len;
+	g_string_append_c(text, '\1');
+	for (j = 0; j < n_requests; j++) {
+		g_string_append_c(text, '0' + CLAMP(requests[j].columns, 0, 9));
+	}
+
+	run = g_hash_table_lookup(data->runs, text->str);
+	if (run != NULL) {
+		g_queue_unlink(&data->runs_lru, &run->lru);
+	} else {
+		run = _vte_pango_shape_run(draw, text->str, start,
+					   (const gint *) cells->data);
+		run->key = g_strdup(text->str);
+		g_hash_table_insert(data->runs, run->key, run);
+		if (g_hash_table_size(data->runs) > VTE_PANGO_RUN_CACHE_SIZE) {
+			evict = data->runs_lru.tail->data;
+			g_queue_unlink(&data->runs_lru, &evict->lru);
+			g_hash_table_remove(data->runs, evict->key);
+		}
+	}
+	g_queue_push_head_link(&data->runs_lru, &run->lru);
+	g_string_free(text, TRUE);
+	g_array_free(cells, TRUE);
+
+	for (k = 0; k < run->segments->len; k++) {
+		segment = &g_array_index(run->segments,
+					 struct _vte_pango_segment, k);
+		gdk_draw_glyphs(draw->widget->window, data->gc,
+				segment->font,
+				requests[0].x, requests[0].y + data->ascent,
+				segment->glyphs);
+	}
+}
+
 static void
 _vte_pango_draw_text(struct _vte_draw *draw,
 		     struct _vte_draw_text_request *requests, gsize n_requests,
 		     GdkColor *color, guchar alpha)
 {
 	struct _vte_pango_data *data = (struct _vte_pango_data*) draw->impl_data;
-	char buf[VTE_UTF8_BPC];
-	guint i;
-	gsize length;
+	gsize i, start;
 	GdkColor wcolor;
 
 
@@ -301,12 +469,21 @@ _vte_pango_draw_text(struct _vte_draw *draw,
 			   &wcolor);
 	gdk_gc_set_foreground(data->gc, &wcolor);
 
-	for (i = 0; i < n_requests; i++) {
-		length = g_unichar_to_utf8(requests[i].c, buf);
-		pango_layout_set_text(data->layout, buf, length);
-		gdk_draw_layout(draw->widget->window, data->gc,
-				requests[i].x, requests[i].y,
-				data->layout);
+	/* Break the requests up into runs of adjacent cells. */
+	start = 0;
+	for (i = 1; i <= n_requests; i++) {
+		if ((i < n_requests) &&
+		    (requests[i].c != (gunichar)-1) &&
+		    (requests[i - 1].c != (gunichar)-1) &&
+		    (requests[i].y == requests[i - 1].y) &&
+		    (requests[i].x == requests[i - 1].x +
+		     requests[i - 1].columns * data->width)) {
+			continue;
+		}
+		if (requests[start].c != (gunichar)-1) {
+			_vte_pango_draw_run(draw, requests + start, i - start);
+		}
+		start = i;
 	}
 }
 
@@ -380,5 +557,6 @@ const struct _vte_draw_impl _vte_draw_pango = {
 	_vte_pango_draw_text,
 	_vte_pango_draw_has_char,
 	_vte_pango_draw_rectangle,
-	_vte_pango_fill_rectangle
+	_vte_pango_fill_rectangle,
+	NULL /* draw_mask */
 };
@@ -33,13 +33,21 @@ void _vte_rgb_buffer_free(struct _vte_rgb_buffer *buffer);
 void _vte_rgb_buffer_clear(struct _vte_rgb_buffer *buffer);
 void _vte_rgb_buffer_resize(struct _vte_rgb_buffer *buffer,
 			    gint minimum_width, gint minimum_height);
+void _vte_rgb_buffer_band(struct _vte_rgb_buffer *buffer, gint y, gint height,
+			  struct _vte_rgb_buffer *band);
 
+void _vte_rgb_blend_row(guchar *pixels, const guchar *coverage, gint width,
+			guchar r, guchar g, guchar b, gint shift);
 void _vte_rgb_draw_color_rgb(struct _vte_rgb_buffer *buffer,
 			     gint x, gint y, gint width, gint height,
 			     guchar r, guchar g, guchar b);
 void _vte_rgb_draw_color(struct _vte_rgb_buffer *buffer,
 			 gint x, gint y, gint width, gint height,
 			 GdkColor *color);
+void _vte_rgb_draw_mask(struct _vte_rgb_buffer *buffer, gint x, gint y,
+			const guchar *mask, gint mask_stride,
+			gint width, gint height,
+			guchar r, guchar g, guchar b);
 void _vte_rgb_draw_pixbuf(struct _vte_rgb_buffer *buffer,
 			  gint x, gint y, gint width, gint height,
 			  GdkPixbuf *pixbuf, gint xbias, gint ybias);
@@ -0,0 +1,966 @@
+/*
+ * Copyright (C) 2009 Thiago Arrais
+ *
+ * This is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Library General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <config.h>
+#include <string.h>
+#include <glib.h>
+#include "vtesearch.h"
+
+/* Postings for rows which scrolled off are dropped in batches. */
+#define VTE_SEARCH_PRUNE_INTERVAL	4096
+/* Rows in each block of a posting list. */
+#define VTE_SEARCH_BLOCK_ROWS		128
+
+struct _VteSearchIndex {
+	GHashTable *postings;	/* trigram -> _vte_search_posting */
+	glong next;		/* first row not yet indexed */
+	glong delta;		/* rows before this are gone */
+	glong pruned;		/* delta when the postings were last pruned */
+};
+
+/* The line start rows which have a trigram, in order.  Each is stored as a
+ * varint of its distance from the one before, and every block of them also
+ * notes the rows it starts and ends with, so that a lookup can step over a
+ * block without decoding it and pruning can drop whole blocks. */
+struct _vte_search_block {
+	glong first, last;
+	guint offset;		/* of the distances after the first row */
+	guint count;
+};
+
+struct _vte_search_posting {
+	GArray *blocks;		/* _vte_search_block */
+	GByteArray *bytes;
+	guint len;
+};
+
+/* A position in a posting list. */
+struct _vte_search_cursor {
+	struct _vte_search_posting *posting;
+	guint block;
+	guint offset;		/* of the next distance in the block */
+	guint left;		/* rows after this one in the block */
+	glong row;
+};
+
+/* Trigrams are hashed rather than stored; a collision only adds a false
+ * candidate, which the caller weeds out anyway. */
+static inline guint
+_vte_search_trigram(gunichar a, gunichar b, gunichar c)
+{
+	return (g_unichar_tolower(a) * 0x9e3779b1U) ^
+	       (g_unichar_tolower(b) * 0x85ebca6bU) ^
+	       (g_unichar_tolower(c) * 0xc2b2ae35U);
+}
+
+static struct _vte_search_posting *
+_vte_search_posting_new(void)
+{
+	struct _vte_search_posting *posting;
+	posting = g_slice_new(struct _vte_search_posting);
+	posting->blocks = g_array_new(FALSE, FALSE,
+				      sizeof(struct _vte_search_block));
+	posting->bytes = g_byte_array_new();
+	posting->len = 0;
+	return posting;
+}
+
+static void
+_vte_search_posting_free(gpointer data)
+{
+	struct _vte_search_posting *posting = data;
+	g_array_free(posting->blocks, TRUE);
+	g_byte_array_free(posting->bytes, TRUE);
+	g_slice_free(struct _vte_search_posting, posting);
+}
+
+/* Add @row, which mustn't come before any row already there. */
+static void
+_vte_search_posting_append(struct _vte_search_posting *posting, glong row)
+{
+	struct _vte_search_block *block, new_block;
+	gulong distance;
+	guint8 byte;
+
+	block = NULL;
+	if (posting->blocks->len > 0) {
+		block = &g_array_index(posting->blocks,
+				       struct _vte_search_block,
+				       posting->blocks->len - 1);
+		if (block->last == row) {
+			return;
+		}
+	}
+	if (block == NULL || block->count >= VTE_SEARCH_BLOCK_ROWS) {
+		new_block.first = new_block.last = row;
+		new_block.offset = posting->bytes->len;
+		new_block.count = 1;
+		g_array_append_val(posting->blocks, new_block);
+		posting->len++;
+		return;
+	}
+	distance = row - block->last;
+	while (distance >= 0x80) {
+		byte = (distance & 0x7f) | 0x80;
+		g_byte_array_append(posting->bytes, &byte, 1);
+		distance >>= 7;
+	}
+	byte = distance;
+	g_byte_array_append(posting->bytes, &byte, 1);
+	block->last = row;
+	block->count++;
+	posting->len++;
+}
+
+/* Drop the blocks which only hold rows before @row.  Returns TRUE if that
+ * leaves nothing. */
+static gboolean
+_vte_search_posting_prune(struct _vte_search_posting *posting, glong row)
+{
+	struct _vte_search_block *block;
+	guint n, offset, i;
+
+	for (n = 0; n < posting->blocks->len; n++) {
+		block = &g_array_index(posting->blocks,
+				       struct _vte_search_block, n);
+		if (block->last >= row) {
+			break;
+		}
+		posting->len -= block->count;
+	}
+	if (n == 0) {
+		return FALSE;
+	}
+	g_array_remove_range(posting->blocks, 0, n);
+	if (posting->blocks->len == 0) {
+		return TRUE;
+	}
+	offset = g_array_index(posting->blocks,
+			       struct _vte_search_block, 0).offset;
+	g_byte_array_remove_range(posting->bytes, 0, offset);
+	for (i = 0; i < posting->blocks->len; i++) {
+		g_array_index(posting->blocks,
+			      struct _vte_search_block, i).offset -= offset;
+	}
+	return FALSE;
+}
+
+static void
+_vte_search_cursor_enter(struct _vte_search_cursor *cursor, guint block)
+{
+	struct _vte_search_block *b;
+	b = &g_array_index(cursor->posting->blocks,
+			   struct _vte_search_block, block);
+	cursor->block = block;
+	cursor->offset = b->offset;
+	cursor->left = b->count - 1;
+	cursor->row = b->first;
+}
+
+/* Move to the first row at or after @row, never backwards.  Returns FALSE
+ * if there isn't one. */
+static gboolean
+_vte_search_cursor_seek(struct _vte_search_cursor *cursor, glong row)
+{
+	GArray *blocks = cursor->posting->blocks;
+	const guint8 *bytes = cursor->posting->bytes->data;
+	guint low, high, mid, shift;
+	gulong distance;
+
+	if (cursor->row >= row) {
+		return TRUE;
+	}
+	if (g_array_index(blocks, struct _vte_search_block,
+			  cursor->block).last < row) {
+		/* Find the first later block which gets that far. */
+		low = cursor->block + 1;
+		high = blocks->len;
+		while (low < high) {
+			mid = low + (high - low) / 2;
+			if (g_array_index(blocks, struct _vte_search_block,
+					  mid).last < row) {
+				low = mid + 1;
+			} else {
+				high = mid;
+			}
+		}
+		if (low >= blocks->len) {
+			return FALSE;
+		}
+		_vte_search_cursor_enter(cursor, low);
+	}
+	while (cursor->row < row) {
+		/* The block's last row is at or after @row, so this
+		 * doesn't run off its end. */
+		distance = 0;
+		shift = 0;
+		do {
+			distance |= (gulong) (bytes[cursor->offset] & 0x7f) <<
+				    shift;
+			shift += 7;
+		} while (bytes[cursor->offset++] & 0x80);
+		cursor->row += distance;
+		cursor->left--;
+	}
+	return TRUE;
+}
+
+/* Start at the first row at or after @row.  Returns FALSE if there isn't
+ * one. */
+static gboolean
+_vte_search_cursor_init(struct _vte_search_cursor *cursor,
+			struct _vte_search_posting *posting, glong row)
+{
+	cursor->posting = posting;
+	if (posting->blocks->len == 0) {
+		return FALSE;
+	}
+	_vte_search_cursor_enter(cursor, 0);
+	return _vte_search_cursor_seek(cursor, row);
+}
+
+/* Step to the next row.  Returns FALSE at the end of the list. */
+static gboolean
+_vte_search_cursor_next(struct _vte_search_cursor *cursor)
+{
+	if (cursor->left == 0) {
+		if (cursor->block + 1 >= cursor->posting->blocks->len) {
+			return FALSE;
+		}
+		_vte_search_cursor_enter(cursor, cursor->block + 1);
+		return TRUE;
+	}
+	return _vte_search_cursor_seek(cursor, cursor->row + 1);
+}
+
+VteSearchIndex *
+_vte_search_index_new(glong start)
+{
+	VteSearchIndex *index;
+	index = g_slice_new(VteSearchIndex);
+	index->postings = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+						NULL, _vte_search_posting_free);
+	index->next = index->delta = index->pruned = start;
+	return index;
+}
+
+void
+_vte_search_index_free(VteSearchIndex *index)
+{
+	g_hash_table_destroy(index->postings);
+	g_slice_free(VteSearchIndex, index);
+}
+
+/* The row the next line to be added has to start on. */
+glong
+_vte_search_index_next(VteSearchIndex *index)
+{
+	return index->next;
+}
+
+/* Record the logical line which starts on @row and ends just before
+ * @next_row. */
+void
+_vte_search_index_add_line(VteSearchIndex *index,
+			   glong row, glong next_row,
+			   const gunichar *text, gsize length)
+{
+	struct _vte_search_posting *posting;
+	gpointer key;
+	gsize i;
+
+	g_return_if_fail(row >= index->next);
+
+	for (i = 0; i + 2 < length; i++) {
+		key = GUINT_TO_POINTER(_vte_search_trigram(text[i],
+							   text[i + 1],
+							   text[i + 2]));
+		posting = g_hash_table_lookup(index->postings, key);
+		if (posting == NULL) {
+			posting = _vte_search_posting_new();
+			g_hash_table_insert(index->postings, key, posting);
+		}
+		_vte_search_posting_append(posting, row);
+	}
+	index->next = next_row;
+}
+
+static gboolean
+_vte_search_prune_posting(gpointer key, gpointer value, gpointer data)
+{
+	return _vte_search_posting_prune(value, *(glong *) data);
+}
+
+/* Note that rows before @delta have been discarded. */
+void
+_vte_search_index_forget(VteSearchIndex *index, glong delta)
+{
+	if (delta <= index->delta) {
+		return;
+	}
+	index->delta = delta;
+	index->next = MAX(index->next, delta);
+	if (delta - index->pruned >= VTE_SEARCH_PRUNE_INTERVAL) {
+		g_hash_table_foreach_remove(index->postings,
+					    _vte_search_prune_posting, &delta);
+		index->pruned = delta;
+	}
+}
+
+/* List the lines at or after @from which contain every trigram of
+ * @literal, in order, or return NULL if @literal is too short to tell. */
+GArray *
+_vte_search_index_lookup(VteSearchIndex *index,
+			 const gunichar *literal, gsize length,
+			 glong from)
+{
+	struct _vte_search_posting *posting;
+	struct _vte_search_cursor *cursors, *shortest;
+	GArray *result;
+	gpointer key;
+	glong row;
+	guint n, i;
+	gsize k;
+
+	if (length < 3) {
+		return NULL;
+	}
+	from = MAX(from, index->delta);
+	result = g_array_new(FALSE, FALSE, sizeof(glong));
+
+	n = length - 2;
+	cursors = g_new(struct _vte_search_cursor, n);
+	shortest = NULL;
+	for (k = 0; k < n; k++) {
+		key = GUINT_TO_POINTER(_vte_search_trigram(literal[k],
+							   literal[k + 1],
+							   literal[k + 2]));
+		posting = g_hash_table_lookup(index->postings, key);
+		if (posting == NULL ||
+		    !_vte_search_cursor_init(&cursors[k], posting, from)) {
+			/* Nothing has this trigram, so nothing matches. */
+			g_free(cursors);
+			return result;
+		}
+		if (shortest == NULL || posting->len < shortest->posting->len) {
+			shortest = &cursors[k];
+		}
+	}
+
+	/* Walk the rarest trigram's lines and check the others for each;
+	 * the rows only go up, so every list is read at most once. */
+	do {
+		row = shortest->row;
+		for (i = 0; i < n; i++) {
+			if (&cursors[i] == shortest) {
+				continue;
+			}
+			if (!_vte_search_cursor_seek(&cursors[i], row)) {
+				g_free(cursors);
+				return result;
+			}
+			if (cursors[i].row != row) {
+				break;
+			}
+		}
+		if (i == n) {
+			g_array_append_val(result, row);
+		}
+	} while (_vte_search_cursor_next(shortest));
+	g_free(cursors);
+	return result;
+}
+
+/* End the current run of literal characters, keeping it if it's the
+ * longest so far. */
+static void
+_vte_search_flush_run(GArray *run, GArray *best)
+{
+	if (run->len > best->len) {
+		g_array_set_size(best, 0);
+		g_array_append_vals(best, run->data, run->len);
+	}
+	g_array_set_size(run, 0);
+}
+
+/* Return the first @close at or after @p, or the string's last byte. */
+static const char *
+_vte_search_skip_to(const char *p, char close)
+{
+	while (*p != close) {
+		if (p[0] == '\0' || p[1] == '\0') {
+			return p;
+		}
+		p++;
+	}
+	return p;
+}
+
+/* Skip the escape sequence starting at the backslash at @p, with whatever
+ * arguments it takes, returning its last character. */
+static const char *
+_vte_search_skip_escape(const char *p)
+{
+	const char *q;
+
+	q = p + 1;
+	switch (*q) {
+	case '\0':
+		return p;
+	case 'x':
+		if (q[1] == '{') {
+			return _vte_search_skip_to(q, '}');
+		}
+		while (g_ascii_isxdigit(q[1]) && q < p + 3) {
+			q++;
+		}
+		return q;
+	case 'o':
+		if (q[1] == '{') {
+			return _vte_search_skip_to(q, '}');
+		}
+		return q;
+	case 'c':
+		return q[1] != '\0' ? q + 1 : q;
+	case 'k':
+	case 'g':
+		switch (q[1]) {
+		case '<':
+			return _vte_search_skip_to(q, '>');
+		case '{':
+			return _vte_search_skip_to(q, '}');
+		case '\'':
+			if (q[2] == '\0') {
+				return q + 1;
+			}
+			return _vte_search_skip_to(q + 2, '\'');
+		}
+		if (q[1] == '-' || q[1] == '+') {
+			q++;
+		}
+		while (g_ascii_isdigit(q[1])) {
+			q++;
+		}
+		return q;
+	case 'p':
+	case 'P':
+		if (q[1] == '{') {
+			return _vte_search_skip_to(q, '}');
+		}
+		return q[1] != '\0' ? q + 1 : q;
+	case 'Q':
+		/* Quoted text, up to \E. */
+		for (q++; *q != '\0'; q++) {
+			if (q[0] == '\\' && q[1] == 'E') {
+				return q + 1;
+			}
+		}
+		return q - 1;
+	default:
+		if (g_ascii_isdigit(*q)) {
+			/* An octal character or a back reference. */
+			while (g_ascii_isdigit(q[1])) {
+				q++;
+			}
+		}
+		return q;
+	}
+}
+
+/* Skip the bracketed class starting at @p, returning its closing bracket.
+ * A bracket first in the class is a member, as are POSIX classes, collating
+ * elements and equivalence classes inside it. */
+static const char *
+_vte_search_skip_class(const char *p)
+{
+	const char *q;
+
+	p++;
+	if (*p == '^') {
+		p++;
+	}
+	if (*p == ']') {
+		p++;
+	}
+	while (*p != '\0' && *p != ']') {
+		if (p[0] == '[' &&
+		    (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+			for (q = p + 2; *q != '\0'; q++) {
+				if (q[0] == p[1] && q[1] == ']') {
+					break;
+				}
+			}
+			if (*q != '\0') {
+				p = q + 2;
+				continue;
+			}
+		} else if (p[0] == '\\') {
+			p = _vte_search_skip_escape(p);
+		}
+		p = g_utf8_next_char(p);
+	}
+	if (*p == '\0') {
+		p--;
+	}
+	return p;
+}
+
+/* Only characters outside any group or class count, none do if there's an
+ * alternation at the top level, and a character followed by a quantifier
+ * which allows zero repetitions is dropped.  Whatever isn't understood just
+ * ends the current run, so the result can be shorter than it might be but is
+ * never wrong. */
+gunichar *
+_vte_search_required_literal(const char *pattern,
+			     GRegexCompileFlags flags,
+			     gsize *length)
+{
+	GArray *run, *best;
+	const char *p, *q;
+	gunichar c;
+	gint depth = 0;
+
+	*length = 0;
+	if (flags & G_REGEX_EXTENDED) {
+		return NULL;
+	}
+
+	run = g_array_new(TRUE, FALSE, sizeof(gunichar));
+	best = g_array_new(TRUE, FALSE, sizeof(gunichar));
+	for (p = pattern; *p != '\0'; p = g_utf8_next_char(p)) {
+		c = g_utf8_get_char(p);
+		switch (c) {
+		case '\\':
+			/* Escapes can stand for classes, assertions, back
+			 * references or characters given by number; none of
+			 * them is kept, not even an escaped punctuation mark. */
+			_vte_search_flush_run(run, best);
+			p = _vte_search_skip_escape(p);
+			break;
+		case '(':
+			_vte_search_flush_run(run, best);
+			if (p[1] == '?') {
+				/* Inline options; extended mode changes what
+				 * every character means. */
+				for (q = p + 2; g_ascii_isalpha(*q) || *q == '-'; q++) {
+					if (*q == 'x') {
+						g_array_free(run, TRUE);
+						g_array_free(best, TRUE);
+						return NULL;
+					}
+				}
+			}
+			depth++;
+			break;
+		case ')':
+			_vte_search_flush_run(run, best);
+			depth = MAX(depth - 1, 0);
+			break;
+		case '[':
+			_vte_search_flush_run(run, best);
+			p = _vte_search_skip_class(p);
+			break;
+		case '*':
+		case '?':
+		case '{':
+			/* The preceding character may not be there at all. */
+			if (run->len > 0) {
+				g_array_set_size(run, run->len - 1);
+			}
+			_vte_search_flush_run(run, best);
+			if (c == '{') {
+				while (p[1] != '\0' && *p != '}') {
+					p++;
+				}
+			}
+			break;
+		case '|':
+			if (depth == 0) {
+				/* Nothing is common to every branch. */
+				g_array_free(run, TRUE);
+				g_array_free(best, TRUE);
+				return NULL;
+			}
+			break;
+		case '+':
+		case '.':
+		case '^':
+		case '$':
+			_vte_search_flush_run(run, best);
+			break;
+		default:
+			if (depth == 0) {
+				c = g_unichar_tolower(c);
+				g_array_append_val(run, c);
+			}
+			break;
+		}
+	}
+	_vte_search_flush_run(run, best);
+	g_array_free(run, TRUE);
+
+	if (best->len < 3) {
+		g_array_free(best, TRUE);
+		return NULL;
+	}
+	*length = best->len;
+	return (gunichar *) g_array_free(best, FALSE);
+}
+
+/* An Aho-Corasick automaton: a trie of the literals in which each node also
+ * knows the longest proper suffix of its string that's in the trie, so that
+ * a text can be checked for all of them in a single pass. */
+#define VTE_SEARCH_NO_NODE	G_MAXUINT
+
+struct _vte_search_edge {
+	gunichar c;
+	guint node;
+};
+
+struct _vte_search_node {
+	GArray *edges;		/* struct _vte_search_edge, few enough to scan */
+	guint fail;		/* the longest suffix's node */
+	GArray *ids;		/* literals ending here, or NULL */
+};
+
+struct _VteSearchLiterals {
+	GArray *nodes;		/* struct _vte_search_node, the root first */
+	gboolean built;		/* failure links have been worked out */
+};
+
+#define _vte_search_node(__set, __n) \
+	(&g_array_index((__set)->nodes, struct _vte_search_node, (__n)))
+
+static guint
+_vte_search_literals_goto(VteSearchLiterals *set, guint node, gunichar c)
+{
+	struct _vte_search_node *n = _vte_search_node(set, node);
+	guint i;
+	for (i = 0; i < n->edges->len; i++) {
+		if (g_array_index(n->edges, struct _vte_search_edge, i).c == c) {
+			return g_array_index(n->edges,
+					     struct _vte_search_edge, i).node;
+		}
+	}
+	return VTE_SEARCH_NO_NODE;
+}
+
+static guint
+_vte_search_literals_add_node(VteSearchLiterals *set)
+{
+	struct _vte_search_node node;
+	node.edges = g_array_new(FALSE, FALSE, sizeof(struct _vte_search_edge));
+	node.fail = 0;
+	node.ids = NULL;
+	g_array_append_val(set->nodes, node);
+	return set->nodes->len - 1;
+}
+
+VteSearchLiterals *
+_vte_search_literals_new(void)
+{
+	VteSearchLiterals *set;
+	set = g_slice_new(VteSearchLiterals);
+	set->nodes = g_array_new(FALSE, FALSE, sizeof(struct _vte_search_node));
+	set->built = FALSE;
+	_vte_search_literals_add_node(set);
+	return set;
+}
+
+void
+_vte_search_literals_free(VteSearchLiterals *set)
+{
+	struct _vte_search_node *node;
+	guint i;
+	for (i = 0; i < set->nodes->len; i++) {
+		node = _vte_search_node(set, i);
+		g_array_free(node->edges, TRUE);
+		if (node->ids != NULL) {
+			g_array_free(node->ids, TRUE);
+		}
+	}
+	g_array_free(set->nodes, TRUE);
+	g_slice_free(VteSearchLiterals, set);
+}
+
+/* Add a case-folded literal, to be reported as @id.  Everything has to be
+ * added before the first scan. */
+void
+_vte_search_literals_add(VteSearchLiterals *set,
+			 const gunichar *literal, gsize length, guint id)
+{
+	struct _vte_search_edge edge;
+	struct _vte_search_node *node;
+	guint n, next;
+	gsize i;
+
+	g_return_if_fail(!set->built);
+
+	n = 0;
+	for (i = 0; i < length; i++) {
+		next = _vte_search_literals_goto(set, n, literal[i]);
+		if (next == VTE_SEARCH_NO_NODE) {
+			next = _vte_search_literals_add_node(set);
+			edge.c = literal[i];
+			edge.node = next;
+			g_array_append_val(_vte_search_node(set, n)->edges,
+					   edge);
+		}
+		n = next;
+	}
+	node = _vte_search_node(set, n);
+	if (node->ids == NULL) {
+		node->ids = g_array_new(FALSE, FALSE, sizeof(guint));
+	}
+	g_array_append_val(node->ids, id);
+}
+
+/* Work out the failure links breadth first, so that a node's suffix has
+ * always been done before it, and fold each suffix's literals into its
+ * node's. */
+static void
+_vte_search_literals_build(VteSearchLiterals *set)
+{
+	struct _vte_search_node *node, *fail;
+	struct _vte_search_edge edge;
+	GArray *queue;
+	guint head, i, f, n;
+
+	queue = g_array_new(FALSE, FALSE, sizeof(guint));
+	n = 0;
+	g_array_append_val(queue, n);
+	for (head = 0; head < queue->len; head++) {
+		n = g_array_index(queue, guint, head);
+		for (i = 0; i < _vte_search_node(set, n)->edges->len; i++) {
+			edge = g_array_index(_vte_search_node(set, n)->edges,
+					     struct _vte_search_edge, i);
+			f = _vte_search_node(set, n)->fail;
+			while (f != 0 &&
+			       _vte_search_literals_goto(set, f, edge.c) ==
+			       VTE_SEARCH_NO_NODE) {
+				f = _vte_search_node(set, f)->fail;
+			}
+			f = _vte_search_literals_goto(set, f, edge.c);
+			if (f == VTE_SEARCH_NO_NODE || f == edge.node) {
+				f = 0;
+			}
+			node = _vte_search_node(set, edge.node);
+			node->fail = f;
+			fail = _vte_search_node(set, f);
+			if (fail->ids != NULL) {
+				if (node->ids == NULL) {
+					node->ids = g_array_new(FALSE, FALSE,
+								sizeof(guint));
+				}
+				g_array_append_vals(node->ids, fail->ids->data,
+						    fail->ids->len);
+			}
+			g_array_append_val(queue, edge.node);
+		}
+	}
+	g_array_free(queue, TRUE);
+	set->built = TRUE;
+}
+
+/* Set @found[id] for each literal which occurs in @text; @found has to have
+ * room for every id which was added. */
+void
+_vte_search_literals_scan(VteSearchLiterals *set,
+			  const gchar *text, gssize length,
+			  gboolean *found)
+{
+	struct _vte_search_node *node;
+	const gchar *p, *end;
+	gunichar c;
+	guint n, next, i;
+
+	if (!set->built) {
+		_vte_search_literals_build(set);
+	}
+	if (set->nodes->len == 1) {
+		return;
+	}
+	if (length < 0) {
+		length = strlen(text);
+	}
+
+	n = 0;
+	end = text + length;
+	for (p = text; p < end; p = g_utf8_next_char(p)) {
+		c = g_unichar_tolower(g_utf8_get_char(p));
+		while ((next = _vte_search_literals_goto(set, n, c)) ==
+		       VTE_SEARCH_NO_NODE && n != 0) {
+			n = _vte_search_node(set, n)->fail;
+		}
+		n = (next == VTE_SEARCH_NO_NODE) ? 0 : next;
+		node = _vte_search_node(set, n);
+		if (node->ids != NULL) {
+			for (i = 0; i < node->ids->len; i++) {
+				found[g_array_index(node->ids, guint, i)] = TRUE;
+			}
+		}
+	}
+}
+
+#ifdef VTESEARCH_MAIN
+static void
+add_line(VteSearchIndex *index, glong row, glong next_row, const char *text)
+{
+	gunichar *ucs;
+	glong length;
+	ucs = g_utf8_to_ucs4_fast(text, -1, &length);
+	_vte_search_index_add_line(index, row, next_row, ucs, length);
+	g_free(ucs);
+}
+
+static GArray *
+lookup(VteSearchIndex *index, const char *text, glong from)
+{
+	gunichar *ucs;
+	glong length;
+	GArray *rows;
+	ucs = g_utf8_to_ucs4_fast(text, -1, &length);
+	rows = _vte_search_index_lookup(index, ucs, length, from);
+	g_free(ucs);
+	return rows;
+}
+
+static gboolean
+literal_is(const char *pattern, const char *expected)
+{
+	gunichar *literal;
+	gsize length;
+	char *utf8;
+	gboolean ret;
+
+	literal = _vte_search_required_literal(pattern, 0, &length);
+	if (literal == NULL) {
+		return expected == NULL;
+	}
+	utf8 = g_ucs4_to_utf8(literal, length, NULL, NULL, NULL);
+	ret = expected != NULL && strcmp(utf8, expected) == 0;
+	if (!ret) {
+		g_printerr("\"%s\" gave \"%s\".\n", pattern, utf8);
+	}
+	g_free(utf8);
+	g_free(literal);
+	return ret;
+}
+
+static void
+add_literal(VteSearchLiterals *literals, const char *text, guint id)
+{
+	gunichar *ucs;
+	glong length;
+	ucs = g_utf8_to_ucs4_fast(text, -1, &length);
+	_vte_search_literals_add(literals, ucs, length, id);
+	g_free(ucs);
+}
+
+int
+main(int argc, char **argv)
+{
+	VteSearchIndex *index;
+	VteSearchLiterals *literals;
+	gboolean found[4];
+	GArray *rows;
+	glong i;
+
+	index = _vte_search_index_new(0);
+	add_line(index, 0, 1, "make: *** [all] Error 1");
+	add_line(index, 1, 3, "a line which wraps onto a second row");
+	add_line(index, 3, 4, "ERROR: disk full");
+	g_assert(_vte_search_index_next(index) == 4);
+
+	rows = lookup(index, "error", 0);
+	g_assert(rows->len == 2);
+	g_assert(g_array_index(rows, glong, 0) == 0);
+	g_assert(g_array_index(rows, glong, 1) == 3);
+	g_array_free(rows, TRUE);
+
+	rows = lookup(index, "error", 1);
+	g_assert(rows->len == 1 && g_array_index(rows, glong, 0) == 3);
+	g_array_free(rows, TRUE);
+
+	rows = lookup(index, "second", 0);
+	g_assert(rows->len == 1 && g_array_index(rows, glong, 0) == 1);
+	g_array_free(rows, TRUE);
+
+	rows = lookup(index, "nowhere", 0);
+	g_assert(rows->len == 0);
+	g_array_free(rows, TRUE);
+
+	g_assert(lookup(index, "er", 0) == NULL);
+
+	/* Forgetting rows drops their lines once enough have gone. */
+	for (i = 4; i < VTE_SEARCH_PRUNE_INTERVAL + 8; i++) {
+		add_line(index, i, i + 1, "error again");
+	}
+	_vte_search_index_forget(index, VTE_SEARCH_PRUNE_INTERVAL + 4);
+	rows = lookup(index, "error", 0);
+	g_assert(rows->len == 4);
+	g_assert(g_array_index(rows, glong, 0) ==
+		 VTE_SEARCH_PRUNE_INTERVAL + 4);
+	g_array_free(rows, TRUE);
+	rows = lookup(index, "disk", 0);
+	g_assert(rows->len == 0);
+	g_array_free(rows, TRUE);
+	_vte_search_index_free(index);
+	g_printerr("Index OK.\n");
+
+	g_assert(literal_is("Error", "error"));
+	g_assert(literal_is("foo.*barbaz", "barbaz"));
+	g_assert(literal_is("colou?r", "colo"));
+	g_assert(literal_is("ab+cdef", "cdef"));
+	g_assert(literal_is("x(abcdef)?y", NULL));
+	g_assert(literal_is("[abc]+defg\\d", "defg"));
+	g_assert(literal_is("a\\.b\\.c", NULL));
+	g_assert(literal_is("abc\\.defg", "defg"));
+	g_assert(literal_is("[[:alnum:]]xyz", "xyz"));
+	g_assert(literal_is("[]a]bcd", "bcd"));
+	g_assert(literal_is("[^]]bcd", "bcd"));
+	g_assert(literal_is("\\x41bcd", "bcd"));
+	g_assert(literal_is("\\x{41}bcd", "bcd"));
+	g_assert(literal_is("\\101bcd", "bcd"));
+	g_assert(literal_is("\\cAbcd", "bcd"));
+	g_assert(literal_is("(?<name>a)\\k<name>bcd", "bcd"));
+	g_assert(literal_is("[-[:alnum:]_.]+://[^ ]+", "://"));
+	g_assert(literal_is("one|two", NULL));
+	g_assert(literal_is("(https?|ftp)://", "://"));
+	g_assert(literal_is("(?x) a b c d", NULL));
+	g_assert(literal_is("ab", NULL));
+	g_printerr("Literals OK.\n");
+
+	literals = _vte_search_literals_new();
+	add_literal(literals, "://", 0);
+	add_literal(literals, "error", 1);
+	add_literal(literals, "rro", 2);
+	add_literal(literals, "warning", 3);
+	memset(found, 0, sizeof(found));
+	_vte_search_literals_scan(literals, "See HTTP://x for ERRORS", -1,
+				  found);
+	g_assert(found[0] && found[1] && found[2] && !found[3]);
+	memset(found, 0, sizeof(found));
+	_vte_search_literals_scan(literals, "warnwarning: errr", -1, found);
+	g_assert(!found[0] && !found[1] && !found[2] && found[3]);
+	_vte_search_literals_free(literals);
+	g_printerr("Scanning OK.\n");
+
+	return 0;
+}
+#endif
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2009 Thiago Arrais
+ *
+ * This is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Library General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* The interfaces in this file are subject to change at any time. */
+
+#ifndef vte_vtesearch_h_included
+#define vte_vtesearch_h_included
+
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* A trigram index over the logical lines of the scrollback.  Each line is
+ * recorded under the row it starts on, once all of its rows are final, and
+ * characters are case-folded so one index serves both kinds of search.  A
+ * lookup only narrows things down: candidates still have to be checked
+ * against the real text. */
+typedef struct _VteSearchIndex VteSearchIndex;
+
+VteSearchIndex *_vte_search_index_new(glong start);
+void _vte_search_index_free(VteSearchIndex *index);
+glong _vte_search_index_next(VteSearchIndex *index);
+void _vte_search_index_add_line(VteSearchIndex *index,
+				glong row, glong next_row,
+				const gunichar *text, gsize length);
+void _vte_search_index_forget(VteSearchIndex *index, glong delta);
+GArray *_vte_search_index_lookup(VteSearchIndex *index,
+				 const gunichar *literal, gsize length,
+				 glong from);
+
+/* Find the longest run of characters which every match of a regular
+ * expression has to contain, case-folded, or NULL if there isn't one long
+ * enough to look up. */
+gunichar *_vte_search_required_literal(const char *pattern,
+				       GRegexCompileFlags flags,
+				       gsize *length);
+
+/* A set of case-folded literals, all of which can be looked for in a text
+ * at once. */
+typedef struct _VteSearchLiterals VteSearchLiterals;
+
+VteSearchLiterals *_vte_search_literals_new(void);
+void _vte_search_literals_free(VteSearchLiterals *set);
+void _vte_search_literals_add(VteSearchLiterals *set,
+			      const gunichar *literal, gsize length,
+			      guint id);
+void _vte_search_literals_scan(VteSearchLiterals *set,
+			       const gchar *text, gssize length,
+			       gboolean *found);
+
+G_END_DECLS
+
+#endif
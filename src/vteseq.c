@@ -113,51 +113,6 @@ vte_g_array_fill(GArray *array, gpointer item, guint final_size)
 	} while (--final_size);
 }
 
-/* Insert a blank line at an arbitrary position. */
-static void
-vte_insert_line_internal(VteTerminal *terminal, glong position)
-{
-	VteRowData *row, *old_row;
-	old_row = terminal->pvt->free_row;
-	/* Pad out the line data to the insertion point. */
-	while (_vte_ring_next(terminal->pvt->screen->row_data) < position) {
-		if (old_row) {
-			row = _vte_reset_row_data (terminal, old_row, TRUE);
-		} else {
-			row = _vte_new_row_data_sized(terminal, TRUE);
-		}
-		old_row = _vte_ring_append(terminal->pvt->screen->row_data, row);
-	}
-	/* If we haven't inserted a line yet, insert a new one. */
-	if (old_row) {
-		row = _vte_reset_row_data (terminal, old_row, TRUE);
-	} else {
-		row = _vte_new_row_data_sized(terminal, TRUE);
-	}
-	if (_vte_ring_next(terminal->pvt->screen->row_data) >= position) {
-		old_row = _vte_ring_insert(terminal->pvt->screen->row_data,
-				 position, row);
-	} else {
-		old_row =_vte_ring_append(terminal->pvt->screen->row_data, row);
-	}
-	terminal->pvt->free_row = old_row;
-}
-
-/* Remove a line at an arbitrary position. */
-static void
-vte_remove_line_internal(VteTerminal *terminal, glong position)
-{
-	if (_vte_ring_next(terminal->pvt->screen->row_data) > position) {
-		if (terminal->pvt->free_row)
-			_vte_free_row_data (terminal->pvt->free_row);
-
-		terminal->pvt->free_row = _vte_ring_remove(
-				terminal->pvt->screen->row_data,
-				position,
-				FALSE);
-	}
-}
-
 /* Check how long a string of unichars is.  Slow version. */
 static gssize
 vte_unichar_strlen(gunichar *c)
@@ -357,8 +312,10 @@ _vte_terminal_clear_screen (VteTerminal *terminal)
 	screen->insert_delta = initial;
 	screen->cursor_current.row = row + screen->insert_delta;
 	_vte_terminal_adjust_adjustments(terminal);
-	/* Redraw everything. */
-	_vte_invalidate_all(terminal);
+	/* Redraw everything, or rather whatever really changed. */
+	_vte_invalidate_cells(terminal,
+			      0, terminal->column_count,
+			      screen->scroll_delta, terminal->row_count);
 	/* We've modified the display.  Make a note of it. */
 	terminal->pvt->text_deleted_flag = TRUE;
 }
@@ -465,13 +422,11 @@ _vte_terminal_scroll_text (VteTerminal *terminal, int scroll_amount)
 	terminal->pvt->free_row = old_row;
 	if (scroll_amount > 0) {
 		for (i = 0; i < scroll_amount; i++) {
-			vte_remove_line_internal(terminal, end);
-			vte_insert_line_internal(terminal, start);
+			_vte_terminal_rotate_line(terminal, end, start);
 		}
 	} else {
 		for (i = 0; i < -scroll_amount; i++) {
-			vte_remove_line_internal(terminal, start);
-			vte_insert_line_internal(terminal, end);
+			_vte_terminal_rotate_line(terminal, start, end);
 		}
 	}
 
@@ -994,8 +949,7 @@ vte_sequence_handler_al (VteTerminal *terminal, GValueArray *params)
 	for (i = 0; i < param; i++) {
 		/* Clear a line off the end of the region and add one to the
 		 * top of the region. */
-		vte_remove_line_internal(terminal, end);
-		vte_insert_line_internal(terminal, start);
+		_vte_terminal_rotate_line(terminal, end, start);
 		/* Get the data for the new row. */
 		rowdata = _vte_ring_index(screen->row_data,
 					  VteRowData *, start);
@@ -1518,8 +1472,7 @@ vte_sequence_handler_dl (VteTerminal *terminal, GValueArray *params)
 	for (i = 0; i < param; i++) {
 		/* Clear a line off the end of the region and add one to the
 		 * top of the region. */
-		vte_remove_line_internal(terminal, start);
-		vte_insert_line_internal(terminal, end);
+		_vte_terminal_rotate_line(terminal, start, end);
 		/* Adjust the scrollbars if necessary. */
 		_vte_terminal_adjust_adjustments(terminal);
 	}
@@ -2073,8 +2026,7 @@ vte_sequence_handler_sr (VteTerminal *terminal, GValueArray *params)
 	if (screen->cursor_current.row == start) {
 		/* If we're at the top of the scrolling region, add a
 		 * line at the top to scroll the bottom off. */
-		vte_remove_line_internal(terminal, end);
-		vte_insert_line_internal(terminal, start);
+		_vte_terminal_rotate_line(terminal, end, start);
 		/* Update the display. */
 		_vte_terminal_scroll_region(terminal, start, end - start + 1, 1);
 		_vte_invalidate_cells(terminal,
@@ -2866,8 +2818,7 @@ vte_sequence_handler_insert_lines (VteTerminal *terminal, GValueArray *params)
 	for (i = 0; i < param; i++) {
 		/* Clear a line off the end of the region and add one to the
 		 * top of the region. */
-		vte_remove_line_internal(terminal, end);
-		vte_insert_line_internal(terminal, row);
+		_vte_terminal_rotate_line(terminal, end, row);
 		/* Get the data for the new row. */
 		rowdata = _vte_ring_index(screen->row_data, VteRowData *, row);
 		g_assert(rowdata != NULL);
@@ -2915,8 +2866,7 @@ vte_sequence_handler_delete_lines (VteTerminal *terminal, GValueArray *params)
 	for (i = 0; i < param; i++) {
 		/* Insert a line at the end of the region and remove one from
 		 * the top of the region. */
-		vte_remove_line_internal(terminal, row);
-		vte_insert_line_internal(terminal, end);
+		_vte_terminal_rotate_line(terminal, row, end);
 		/* Get the data for the new row. */
 		rowdata = _vte_ring_index(screen->row_data, VteRowData *, end);
 		g_assert(rowdata != NULL);
@@ -80,5 +80,6 @@ const struct _vte_draw_impl _vte_draw_skel = {
 	_vte_skel_draw_text,
 	NULL, /* draw_has_char */
 	NULL, /* draw_rectangle */
-	_vte_skel_fill_rectangle
+	_vte_skel_fill_rectangle,
+	NULL /* draw_mask */
 };
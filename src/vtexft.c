@@ -20,6 +20,7 @@
 #include "../config.h"
 
 #include <sys/param.h>
+#include <stdlib.h>
 #include <string.h>
 #include <gtk/gtk.h>
 #include <gdk/gdkx.h>
@@ -54,7 +55,15 @@ struct _vte_xft_font {
 	GPtrArray *fonts;
 	VteTree *fontmap;
 	VteTree *widths;
-	guint last_pattern;
+	gint *pattern_fonts;	/* index into fonts for each pattern, 0 if
+				   not opened yet, or -1 if it can't be */
+
+	/* Which pattern covers each character we've looked up, kept across
+	 * sessions in coverage_file, if there is one. */
+	GHashTable *coverage;	/* codepoint -> pattern + 1, or -1 if none
+				   (which isn't saved) */
+	gchar *coverage_file;
+	gboolean coverage_dirty;
 
 	gint width, height, ascent;
 	gboolean have_metrics;
@@ -130,6 +139,119 @@ _vte_xft_font_equal (struct _vte_xft_font *a, struct _vte_xft_font *b)
 	return TRUE;
 }
 
+/* Work out where to keep the coverage of a set of patterns, unless the user
+ * asked us not to. */
+static gchar *
+_vte_xft_font_coverage_file (struct _vte_xft_font *font)
+{
+#if defined(HAVE_FCSTRFREE) && defined(HAVE_FCNAMEUNPARSE)
+	GChecksum *checksum;
+	FcChar8 *name;
+	const gchar *env;
+	gchar *file;
+	guint i;
+
+	env = g_getenv ("VTE_XFT_COVERAGE_CACHE");
+	if (env != NULL && strcmp (env, "0") == 0) {
+		return NULL;
+	}
+
+	checksum = g_checksum_new (G_CHECKSUM_MD5);
+	for (i = 0; i < font->patterns->len; i++) {
+		name = FcNameUnparse (g_ptr_array_index (font->patterns, i));
+		if (name != NULL) {
+			g_checksum_update (checksum, name, -1);
+			FcStrFree (name);
+		}
+		g_checksum_update (checksum, (const guchar *) "\n", 1);
+	}
+	file = g_build_filename (g_get_user_cache_dir (), GETTEXT_PACKAGE,
+			"xft-coverage", g_checksum_get_string (checksum),
+			NULL);
+	g_checksum_free (checksum);
+	return file;
+#else
+	/* There's no way to name the patterns, so nothing to key a file on. */
+	return NULL;
+#endif
+}
+
+/* Each line of a coverage file holds a codepoint and the index of the first
+ * pattern which covers it.  Characters which none of them covered aren't
+ * kept across sessions, as a font installed since might; files written
+ * before that was so may still list them with -1, and those are skipped. */
+static void
+_vte_xft_font_load_coverage (struct _vte_xft_font *font)
+{
+	gchar *contents, *p, *end;
+	gunichar c;
+	glong j;
+
+	if (font->coverage_file == NULL ||
+	    !g_file_get_contents (font->coverage_file, &contents, NULL, NULL)) {
+		return;
+	}
+	p = contents;
+	while (*p != '\0') {
+		c = strtoul (p, &end, 16);
+		if (end == p) {
+			break;
+		}
+		p = end;
+		j = strtol (p, &end, 10);
+		if (end == p) {
+			break;
+		}
+		p = end;
+		if (j >= 0 && j < (glong) font->patterns->len) {
+			g_hash_table_insert (font->coverage,
+					GINT_TO_POINTER (c),
+					GINT_TO_POINTER (j + 1));
+		}
+		while (*p == '\n' || *p == ' ') {
+			p++;
+		}
+	}
+	g_free (contents);
+	_vte_debug_print (VTE_DEBUG_MISC,
+			"Loaded coverage of %u characters from %s.\n",
+			g_hash_table_size (font->coverage), font->coverage_file);
+}
+
+static void
+_vte_xft_font_save_coverage (struct _vte_xft_font *font)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	GString *contents;
+	gchar *dir;
+
+	if (font->coverage_file == NULL || !font->coverage_dirty) {
+		return;
+	}
+	contents = g_string_new (NULL);
+	g_hash_table_iter_init (&iter, font->coverage);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		if (GPOINTER_TO_INT (value) < 0) {
+			continue;
+		}
+		g_string_append_printf (contents, "%x %d\n",
+				GPOINTER_TO_INT (key),
+				GPOINTER_TO_INT (value) - 1);
+	}
+	dir = g_path_get_dirname (font->coverage_file);
+	if (g_mkdir_with_parents (dir, 0700) != 0 ||
+	    !g_file_set_contents (font->coverage_file,
+				  contents->str, contents->len, NULL)) {
+		_vte_debug_print (VTE_DEBUG_MISC,
+				"Could not save font coverage to %s.\n",
+				font->coverage_file);
+	}
+	g_free (dir);
+	g_string_free (contents, TRUE);
+	font->coverage_dirty = FALSE;
+}
+
 static struct _vte_xft_font *
 _vte_xft_font_open (GtkWidget *widget, const PangoFontDescription *fontdesc,
 		   VteTerminalAntiAlias antialias)
@@ -158,7 +280,6 @@ _vte_xft_font_open (GtkWidget *widget, const PangoFontDescription *fontdesc,
 	font->ref = 1;
 	font->display = dpy;
 	font->patterns = patterns;
-	font->last_pattern = 0;
 	font->have_metrics = FALSE;
 
 	if (font_cache == NULL) {
@@ -182,6 +303,11 @@ _vte_xft_font_open (GtkWidget *widget, const PangoFontDescription *fontdesc,
 		g_ptr_array_add (font->fonts, NULL); /* 1 indexed array */
 		font->fontmap = _vte_tree_new (_vte_xft_direct_compare);
 		font->widths = _vte_tree_new (_vte_xft_direct_compare);
+		font->pattern_fonts = g_new0 (gint, font->patterns->len);
+		font->coverage = g_hash_table_new (NULL, NULL);
+		font->coverage_file = _vte_xft_font_coverage_file (font);
+		font->coverage_dirty = FALSE;
+		_vte_xft_font_load_coverage (font);
 	}
 
 	return font;
@@ -198,6 +324,11 @@ _vte_xft_font_close (struct _vte_xft_font *font)
 	}
 	g_hash_table_remove (font_cache, font);
 
+	_vte_xft_font_save_coverage (font);
+	g_hash_table_destroy (font->coverage);
+	g_free (font->coverage_file);
+	g_free (font->pattern_fonts);
+
 	for (i = 0; i < font->patterns->len; i++) {
 		FcPatternDestroy (g_ptr_array_index (font->patterns, i));
 	}
@@ -222,51 +353,87 @@ _vte_xft_font_close (struct _vte_xft_font *font)
 	}
 }
 
-static XftFont *
-_vte_xft_open_font_for_char (struct _vte_xft_font *font, gunichar c, GPtrArray *locked_fonts)
+/* Open the font for a pattern if we haven't yet, returning its index in the
+ * font list, or -1 if it can't be opened. */
+static gint
+_vte_xft_font_open_pattern (struct _vte_xft_font *font, guint j)
 {
-	gpointer p = GINT_TO_POINTER (c);
-	guint i, j;
+	FcPattern *pattern;
 	XftFont *ftfont;
 
-	/* Look the character up in the fonts we have. */
-	for (i = 1; i < font->fonts->len; i++) {
-		ftfont = g_ptr_array_index (font->fonts, i);
-		if (_vte_xft_char_exists (font, ftfont, c)) {
-			if (g_ptr_array_index (locked_fonts, i) == NULL) {
-				XftLockFace (ftfont);
-				g_ptr_array_index (locked_fonts, i) = ftfont;
-			}
-			_vte_tree_insert (font->fontmap,
-					p, GINT_TO_POINTER (i));
-			return ftfont;
-		}
-	}
-
-	/* Look the character up in other fonts. */
-	for (j = font->last_pattern; j < font->patterns->len; j++) {
-		FcPattern *pattern = g_ptr_array_index (font->patterns, j);
+	if (font->pattern_fonts[j] == 0) {
+		pattern = g_ptr_array_index (font->patterns, j);
 		FcPatternReference (pattern);
 		ftfont = XftFontOpenPattern (font->display, pattern);
 		/* If the font was opened, it takes a ref to the pattern. */
 		if (ftfont != NULL) {
 			g_ptr_array_add (font->fonts, ftfont);
-			if (_vte_xft_char_exists (font, ftfont, c)) {
-				XftLockFace (ftfont);
-				g_ptr_array_index (locked_fonts, i) = ftfont;
-				_vte_tree_insert (font->fontmap,
-						p, GINT_TO_POINTER (i));
-				font->last_pattern = j;
-				return ftfont;
-			}
-			i++;
+			font->pattern_fonts[j] = font->fonts->len - 1;
 		} else {
 			FcPatternDestroy (pattern);
+			font->pattern_fonts[j] = -1;
+		}
+	}
+	return font->pattern_fonts[j];
+}
+
+/* Use the @i'th font for @c from now on. */
+static XftFont *
+_vte_xft_font_map_char (struct _vte_xft_font *font, gunichar c, gint i,
+		       GPtrArray *locked_fonts)
+{
+	XftFont *ftfont;
+
+	ftfont = g_ptr_array_index (font->fonts, i);
+	if (g_ptr_array_index (locked_fonts, i) == NULL) {
+		XftLockFace (ftfont);
+		g_ptr_array_index (locked_fonts, i) = ftfont;
+	}
+	_vte_tree_insert (font->fontmap,
+			GINT_TO_POINTER (c), GINT_TO_POINTER (i));
+	return ftfont;
+}
+
+static XftFont *
+_vte_xft_open_font_for_char (struct _vte_xft_font *font, gunichar c, GPtrArray *locked_fonts)
+{
+	gpointer p = GINT_TO_POINTER (c);
+	gint hint, i;
+	guint j;
+
+	/* If we've seen this character before, in this session or an
+	 * earlier one, go straight to the pattern which covered it. */
+	hint = GPOINTER_TO_INT (g_hash_table_lookup (font->coverage, p));
+	if (hint < 0) {
+		_vte_tree_insert (font->fontmap,
+				p, GINT_TO_POINTER (-FONT_INDEX_FUDGE));
+		return NULL;
+	}
+	if (hint > 0) {
+		i = _vte_xft_font_open_pattern (font, hint - 1);
+		if (i > 0 && _vte_xft_char_exists (font,
+					g_ptr_array_index (font->fonts, i), c)) {
+			return _vte_xft_font_map_char (font, c, i,
+					locked_fonts);
+		}
+	}
+
+	/* Look the character up in each pattern in turn, opening fonts as
+	 * we go. */
+	for (j = 0; j < font->patterns->len; j++) {
+		i = _vte_xft_font_open_pattern (font, j);
+		if (i > 0 && _vte_xft_char_exists (font,
+					g_ptr_array_index (font->fonts, i), c)) {
+			g_hash_table_insert (font->coverage,
+					p, GINT_TO_POINTER (j + 1));
+			font->coverage_dirty = TRUE;
+			return _vte_xft_font_map_char (font, c, i,
+					locked_fonts);
 		}
 	}
-	font->last_pattern = j;
 
-	/* No match? */
+	/* No match?  Remember that for this session only. */
+	g_hash_table_insert (font->coverage, p, GINT_TO_POINTER (-1));
 	_vte_tree_insert (font->fontmap,
 			p, GINT_TO_POINTER (-FONT_INDEX_FUDGE));
 	_vte_debug_print (VTE_DEBUG_MISC,
@@ -949,5 +1116,6 @@ const struct _vte_draw_impl _vte_draw_xft = {
 	_vte_xft_draw_text,
 	_vte_xft_draw_has_char,
 	_vte_xft_draw_rectangle,
-	_vte_xft_fill_rectangle
+	_vte_xft_fill_rectangle,
+	NULL /* draw_mask */
 };